@@ -0,0 +1,16 @@
+#version 330 core
+
+// For textures that are texture array layers (e.g. the ones from loadGltf)
+uniform sampler2DArray albedo;
+uniform vec4 color;
+
+in vec2 texCoords;
+// The layer of albedo, passed on by the vertex shader from textureLayers (see womf.glsl)
+flat in int textureLayer;
+
+out vec4 fragColor;
+
+void main()
+{
+    fragColor = color * texture(albedo, vec3(texCoords, float(textureLayer)));
+}
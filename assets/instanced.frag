@@ -0,0 +1,13 @@
+#version 330 core
+
+uniform sampler2D texture;
+
+in vec2 texCoords;
+in vec4 instanceColor;
+
+out vec4 fragColor;
+
+void main()
+{
+    fragColor = instanceColor * texture2D(texture, texCoords);
+}
@@ -0,0 +1,19 @@
+#version 330 core
+
+#include <womf.glsl>
+
+layout(location = 0) in vec3 attrPosition;
+layout(location = 3) in vec2 attrTexCoords;
+layout(location = 8) in mat4 attrInstanceModel; // takes 8 - 11
+layout(location = 12) in vec4 attrInstanceColor;
+
+out vec2 texCoords;
+out vec4 instanceColor;
+
+void main()
+{
+    texCoords = attrTexCoords;
+    instanceColor = attrInstanceColor;
+    gl_Position = viewProjectionMatrix * modelMatrix * attrInstanceModel * vertexTransform
+        * vec4(attrPosition, 1.0);
+}
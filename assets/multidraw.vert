@@ -0,0 +1,18 @@
+#version 430 core
+
+// Like default.vert, but a multi-draw shader, so it can only draw geometry from a GeometryPool
+#define WOMF_MULTI_DRAW
+#include <womf.glsl>
+
+layout(location = 0) in vec3 attrPosition;
+layout(location = 3) in vec2 attrTexCoords;
+
+out vec2 texCoords;
+flat out int textureLayer; // for array.frag
+
+void main()
+{
+    texCoords = attrTexCoords;
+    textureLayer = textureLayers.x;
+    gl_Position = viewProjectionMatrix * modelMatrix * vec4(attrPosition, 1.0);
+}
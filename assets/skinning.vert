@@ -2,10 +2,8 @@
 
 const int MAX_JOINTS = 64;
 
-uniform mat4 modelMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 projectionMatrix;
-uniform mat3 normalMatrix;
+#include <womf.glsl>
+
 uniform mat4 jointMatrices[MAX_JOINTS];
 
 layout(location = 0) in vec3 attrPosition;
@@ -19,6 +17,7 @@ layout(location = 7) in vec4 attrJointWeights;
 
 out vec2 texCoords;
 out vec3 normal; // view space
+flat out int textureLayer; // for array.frag
 
 void main()
 {
@@ -27,6 +26,7 @@ void main()
         + attrJointWeights.z * jointMatrices[int(attrJoints.z)]
         + attrJointWeights.w * jointMatrices[int(attrJoints.w)];
     texCoords = attrTexCoords0;
+    textureLayer = textureLayers.x;
     normal = normalMatrix * attrNormal;
     gl_Position
         = projectionMatrix * viewMatrix * modelMatrix * skinMatrix * vec4(attrPosition, 1.0);
@@ -1,3 +1,6 @@
 return {
-    title = "Test"
+    title = "Test",
+    -- Record the files read during startup and prefetch them on the next launch
+    -- prefetchManifest = "prefetch.txt",
+    -- prefetchRecordTime = 5.0,
 }
@@ -1,4 +1,4 @@
-local shader = womf.Shader("assets/skinning.vert", "assets/default.frag")
+local shader = womf.Shader("assets/skinning.vert", "assets/array.frag")
 
 local scene = womf.loadGltf("assets/Mike.gltf")
 
@@ -0,0 +1,112 @@
+-- Draws 10k small meshes in three ways and prints the frame times, switch with 1, 2 and 3:
+--  1. separate: every mesh has its own buffers and vertex array
+--  2. pooled: the meshes are in a GeometryPool, so they share a vertex array
+--  3. multidraw: pooled with a multi-draw shader, so the draws are merged
+local tex = womf.Texture("assets/test.png")
+
+local shader = womf.Shader("assets/default.vert", "assets/default.frag")
+local multiDrawShader = womf.isMultiDrawSupported()
+    and womf.Shader("assets/multidraw.vert", "assets/default.frag")
+
+local fmt = womf.VertexFormat {
+    { "position", womf.attrType.f32, 3 },
+    { "texcoord0", womf.attrType.f32, 2 },
+}
+
+-- A disc with `segments` segments, so the meshes are not all the same
+local function makeDisc(segments)
+    local vertices = {0, 0, 0, 0.5, 0.5}
+    local indices = {}
+    for i = 0, segments - 1 do
+        local angle = i / segments * 2 * math.pi
+        local x, y = math.cos(angle), math.sin(angle)
+        for _, v in ipairs({x, y, 0, x * 0.5 + 0.5, y * 0.5 + 0.5}) do
+            table.insert(vertices, v)
+        end
+        for _, v in ipairs({0, i + 1, (i + 1) % segments + 1}) do
+            table.insert(indices, v)
+        end
+    end
+    return womf.Buffer("f32", vertices), womf.Buffer("u16", indices)
+end
+
+local gridSize = 100
+local spacing = 2.5
+local pool = womf.GeometryPool(fmt, womf.attrType.u16)
+local meshes = {}
+for y = 0, gridSize - 1 do
+    for x = 0, gridSize - 1 do
+        local vertices, indices = makeDisc(3 + (x + y) % 10)
+
+        local separate = womf.Geometry(womf.drawMode.triangles)
+        separate:addVertexBuffer(fmt,
+            womf.GraphicsBuffer(womf.bufferTarget.attributes, womf.bufferUsage.static, vertices))
+        separate:setIndexBuffer(womf.attrType.u16,
+            womf.GraphicsBuffer(womf.bufferTarget.indices, womf.bufferUsage.static, indices))
+
+        local trafo = womf.Transform()
+        trafo:setPosition((x - gridSize / 2) * spacing, (y - gridSize / 2) * spacing, 0)
+        table.insert(meshes, {
+            separate = separate,
+            pooled = pool:add(womf.drawMode.triangles, vertices, indices),
+            trafo = trafo,
+        })
+    end
+end
+print(inspect(pool:getStats()))
+
+local modes = {"separate", "pooled", "multidraw"}
+local mode = "separate"
+
+local xRes, yRes = womf.getWindowSize()
+womf.setProjectionMatrix(45, xRes/yRes, 0.1, 1000.0)
+
+local camTrafo = womf.Transform()
+camTrafo:setPosition(0, 0, -250)
+camTrafo:lookAt(0, 0, 0)
+
+local function main()
+    local time = womf.getTime()
+    local frames, reportTime = 0, time
+    while true do
+        for event in womf.pollEvent() do
+            if event.type == "quit" then
+                return
+            elseif event.type == "keydown" and event.symbol == "escape" then
+                return
+            elseif event.type == "keydown" and modes[tonumber(event.symbol)] then
+                mode = modes[tonumber(event.symbol)]
+                if mode == "multidraw" and not multiDrawShader then
+                    print("Multi-draw is not supported, using pooled instead")
+                    mode = "pooled"
+                end
+                frames, reportTime = 0, womf.getTime()
+            end
+        end
+
+        local now = womf.getTime()
+        camTrafo:rotate(quat.from_angle_axis((now - time) * 0.2, 0, 0, 1):unpack())
+        time = now
+        womf.setViewMatrix(camTrafo)
+
+        womf.clear(0, 0, 0, 0, 1)
+        local drawShader = mode == "multidraw" and multiDrawShader or shader
+        local uniforms = {texture = tex, color = {1, 1, 1, 1}}
+        for _, mesh in ipairs(meshes) do
+            womf.setModelMatrix(mesh.trafo)
+            womf.draw(drawShader, mode == "separate" and mesh.separate or mesh.pooled, uniforms)
+        end
+        womf.present()
+
+        frames = frames + 1
+        if now - reportTime > 2 then
+            local stats = womf.getDrawStats()
+            print(("%s: %.2f ms/frame, %d draw calls, %d multi-draws of %d draws"):format(mode,
+                (now - reportTime) / frames * 1000, stats.drawCalls, stats.multiDrawCalls,
+                stats.multiDrawCommands))
+            frames, reportTime = 0, now
+        end
+    end
+end
+
+return main
@@ -1,4 +1,4 @@
-local shader = womf.Shader("assets/default.vert", "assets/default.frag")
+local shader = womf.Shader("assets/default.vert", "assets/array.frag")
 
 local scene = womf.loadGltf("assets/Avocado.gltf")
 
@@ -0,0 +1,39 @@
+-- Compares the JSON parsing in gltf.lua against the native loader (womf.readGltf), with and
+-- without the scene cache. "native" does the same work as the Lua loader, "optimized" adds the
+-- mesh optimization and levels of detail.
+local files = { "assets/Mike.gltf", "assets/Avocado.gltf" }
+local runs = 20
+
+local function bench(filename, loader)
+    -- The first load uploads the buffers, later ones share them (see GraphicsBuffer.getShared)
+    womf.loadGltfModelUncached(filename, loader)
+    local start = womf.getTime()
+    for _ = 1, runs do
+        womf.loadGltfModelUncached(filename, loader)
+    end
+    return (womf.getTime() - start) / runs
+end
+
+for _, filename in ipairs(files) do
+    local lua = bench(filename, "lua")
+    local native = bench(filename, "native")
+    local optimized = bench(filename, "optimized")
+    -- The first run writes the cache if it's missing or stale
+    local cached = bench(filename, "cached")
+    print(("%s: lua %.2f ms, native %.2f ms, optimized %.2f ms, cached %.2f ms"):format(
+        filename, lua * 1000, native * 1000, optimized * 1000, cached * 1000))
+    local opt = womf.loadGltfModel(filename).meshOptimization
+    if opt then
+        print(("  %d triangles, vertex shader invocations per triangle %.2f -> %.2f"):format(
+            opt.triangles, opt.vertexShaderInvocationsBefore / opt.triangles,
+            opt.vertexShaderInvocationsAfter / opt.triangles))
+        print(("  bytes per vertex %.1f -> %.1f, index bytes %d -> %d"):format(
+            opt.vertexBytesBefore / opt.verticesBefore, opt.vertexBytesAfter / opt.verticesAfter,
+            opt.indexBytesBefore, opt.indexBytesAfter))
+        print(("  %d levels of detail with %d triangles in %d index bytes"):format(opt.lods,
+            opt.lodTriangles, opt.lodIndexBytes))
+    end
+end
+womf.finishTextureUploads()
+
+return function() end
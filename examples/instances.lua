@@ -0,0 +1,81 @@
+local shader = womf.Shader("assets/skinning.vert", "assets/array.frag")
+
+local start = womf.getTime()
+local model = womf.loadGltfModel("assets/Mike.gltf")
+print(("Model loaded in %.2f ms"):format((womf.getTime() - start) * 1000))
+
+-- Instances only allocate their node transforms, joint matrices and animation state
+local count = 200
+collectgarbage()
+local luaMemBefore = collectgarbage("count")
+start = womf.getTime()
+local instances = {}
+for i = 1, count do
+    instances[i] = model:instantiate()
+end
+local instantiateTime = womf.getTime() - start
+collectgarbage()
+local luaBytes = (collectgarbage("count") - luaMemBefore) * 1024
+local usage = instances[1]:getMemoryUsage()
+print(("%d instances in %.2f ms"):format(count, instantiateTime * 1000))
+print(("Per instance: %d nodes (%d bytes), joint matrices %d bytes, Lua %d bytes"):format(
+    usage.nodes, usage.nodeBytes, usage.paletteBytes, luaBytes / count))
+
+local animationNames = { "Dance", "Hello", "Jump", "Run" }
+local trafos = {}
+local columns = math.ceil(math.sqrt(count))
+for i, instance in ipairs(instances) do
+    local trafo = womf.Transform()
+    trafo:setPosition(((i - 1) % columns - columns / 2) * 2, -2.5, math.floor((i - 1) / columns) * 2)
+    trafo:rotateLocal(quat.from_angle_axis(math.pi, 0, 1, 0):unpack())
+    trafos[i] = trafo
+    local animation = instance.animations[animationNames[(i - 1) % #animationNames + 1]]
+    animation:seek(i * 0.1)
+end
+
+local xRes, yRes = womf.getWindowSize()
+womf.setProjectionMatrix(45, xRes/yRes, 0.1, 200.0)
+
+local camTrafo = womf.Transform()
+camTrafo:setPosition(0, 8, -15)
+camTrafo:lookAt(0, 0, columns)
+womf.setViewMatrix(camTrafo)
+
+local function main()
+    local time = womf.getTime()
+    local frames, frameTime = 0, 0
+    while true do
+        for event in womf.pollEvent() do
+            if event.type == "quit" then
+                return
+            elseif event.type == "keydown" and event.symbol == "escape" then
+                return
+            end
+        end
+
+        local now = womf.getTime()
+        local dt = now - time
+        time = now
+
+        for i, instance in ipairs(instances) do
+            local animation = instance.animations[animationNames[(i - 1) % #animationNames + 1]]
+            instance.skins[1]:pose(animation:update(dt))
+        end
+
+        womf.clear(0, 0, 0, 0, 1)
+        for i, instance in ipairs(instances) do
+            instance:draw(shader, trafos[i])
+        end
+        womf.present()
+
+        frames, frameTime = frames + 1, frameTime + dt
+        if frameTime > 1.0 then
+            local stats = model.graph:getStats()
+            print(("%.2f ms/frame, %d nodes updated"):format(frameTime / frames * 1000,
+                stats.lastNodesUpdated))
+            frames, frameTime = 0, 0
+        end
+    end
+end
+
+return main
@@ -0,0 +1,71 @@
+local tex = womf.Texture("assets/test.png")
+
+local shader = womf.Shader("assets/instanced.vert", "assets/instanced.frag")
+
+local attr = womf.GraphicsBuffer(womf.bufferTarget.attributes, womf.bufferUsage.static, "assets/quad.attributes.bin")
+local idx = womf.GraphicsBuffer(womf.bufferTarget.indices, womf.bufferUsage.static, "assets/quad.indices.bin")
+
+local quad = womf.Geometry(womf.drawMode.triangles)
+quad:addVertexBuffer(womf.VertexFormat {
+    { "position", womf.attrType.f32, 3 },
+    { "texcoord0", womf.attrType.f32, 2 },
+}, attr)
+quad:setIndexBuffer(womf.attrType.u16, idx)
+quad:setInstanceFormat(womf.VertexFormat {
+    { "instanceModel", womf.attrType.f32, 16 },
+    { "instanceColor", womf.attrType.f32, 4 },
+})
+
+local gridSize = 100
+local spacing = 2.5
+local instanceData = {}
+for y = 0, gridSize - 1 do
+    for x = 0, gridSize - 1 do
+        local tx = (x - gridSize / 2) * spacing
+        local ty = (y - gridSize / 2) * spacing
+        -- column-major model matrix (translation only)
+        for _, v in ipairs({1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  tx, ty, 0, 1}) do
+            table.insert(instanceData, v)
+        end
+        for _, v in ipairs({x / gridSize, y / gridSize, 1, 1}) do
+            table.insert(instanceData, v)
+        end
+    end
+end
+local instanceCount = gridSize * gridSize
+local instances = womf.GraphicsBuffer(womf.bufferTarget.attributes, womf.bufferUsage.static,
+    womf.Buffer("f32", instanceData))
+
+local xRes, yRes = womf.getWindowSize()
+womf.setProjectionMatrix(45, xRes/yRes, 0.1, 1000.0)
+
+local camTrafo = womf.Transform()
+camTrafo:setPosition(0, 0, -250)
+camTrafo:lookAt(0, 0, 0)
+womf.setViewMatrix(camTrafo)
+
+local trafo = womf.Transform()
+
+local function main()
+    local time = womf.getTime()
+    while true do
+        for event in womf.pollEvent() do
+            if event.type == "quit" then
+                return
+            elseif event.type == "keydown" and event.symbol == "escape" then
+                return
+            end
+        end
+
+        local now = womf.getTime()
+        trafo:rotate(quat.from_angle_axis((now - time) * 0.2, 0, 0, 1):unpack())
+        time = now
+
+        womf.clear(0, 0, 0, 0, 1)
+        womf.setModelMatrix(trafo)
+        womf.drawInstanced(shader, quad, instances, instanceCount, {texture = tex})
+        womf.present()
+    end
+end
+
+return main
@@ -0,0 +1,176 @@
+#include "bcn.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace {
+using Block = std::array<uint8_t, 16 * 4>; // RGBA of 4x4 pixels
+
+uint16_t toRgb565(int r, int g, int b)
+{
+    return static_cast<uint16_t>((r >> 3) << 11 | (g >> 2) << 5 | (b >> 3));
+}
+
+std::array<int, 3> fromRgb565(uint16_t c)
+{
+    const auto r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return { (r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2) };
+}
+
+void write16(uint8_t*& out, uint16_t v)
+{
+    *out++ = static_cast<uint8_t>(v & 0xff);
+    *out++ = static_cast<uint8_t>(v >> 8);
+}
+
+// BC1 color block, always in 4 color mode
+void encodeColor(const Block& block, uint8_t*& out)
+{
+    std::array<int, 3> lo = { 255, 255, 255 }, hi = { 0, 0, 0 };
+    for (size_t i = 0; i < 16; ++i) {
+        for (size_t c = 0; c < 3; ++c) {
+            lo[c] = std::min<int>(lo[c], block[i * 4 + c]);
+            hi[c] = std::max<int>(hi[c], block[i * 4 + c]);
+        }
+    }
+    // Inset the bounding box a little, which reduces the error for most blocks
+    for (size_t c = 0; c < 3; ++c) {
+        const auto inset = (hi[c] - lo[c]) / 16;
+        lo[c] += inset;
+        hi[c] -= inset;
+    }
+
+    auto c0 = toRgb565(hi[0], hi[1], hi[2]);
+    auto c1 = toRgb565(lo[0], lo[1], lo[2]);
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+    write16(out, c0);
+    write16(out, c1);
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        const auto p0 = fromRgb565(c0), p1 = fromRgb565(c1);
+        std::array<std::array<int, 3>, 4> palette;
+        palette[0] = p0;
+        palette[1] = p1;
+        for (size_t c = 0; c < 3; ++c) {
+            palette[2][c] = (2 * p0[c] + p1[c]) / 3;
+            palette[3][c] = (p0[c] + 2 * p1[c]) / 3;
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            int best = 0, bestDist = std::numeric_limits<int>::max();
+            for (int p = 0; p < 4; ++p) {
+                int dist = 0;
+                for (size_t c = 0; c < 3; ++c) {
+                    const auto d = block[i * 4 + c] - palette[p][c];
+                    dist += d * d;
+                }
+                if (dist < bestDist) {
+                    best = p;
+                    bestDist = dist;
+                }
+            }
+            indices |= static_cast<uint32_t>(best) << (i * 2);
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        *out++ = static_cast<uint8_t>(indices >> (i * 8));
+    }
+}
+
+// BC4 block of a single channel, always in 8 value mode
+void encodeChannel(const Block& block, size_t channel, uint8_t*& out)
+{
+    int lo = 255, hi = 0;
+    for (size_t i = 0; i < 16; ++i) {
+        lo = std::min<int>(lo, block[i * 4 + channel]);
+        hi = std::max<int>(hi, block[i * 4 + channel]);
+    }
+    *out++ = static_cast<uint8_t>(hi);
+    *out++ = static_cast<uint8_t>(lo);
+
+    uint64_t indices = 0;
+    if (hi != lo) {
+        std::array<int, 8> palette;
+        palette[0] = hi;
+        palette[1] = lo;
+        for (int p = 1; p < 7; ++p) {
+            palette[p + 1] = ((7 - p) * hi + p * lo) / 7;
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            const int value = block[i * 4 + channel];
+            uint64_t best = 0;
+            int bestDist = 256;
+            for (size_t p = 0; p < 8; ++p) {
+                const auto dist = std::abs(value - palette[p]);
+                if (dist < bestDist) {
+                    best = p;
+                    bestDist = dist;
+                }
+            }
+            indices |= best << (i * 3);
+        }
+    }
+    for (size_t i = 0; i < 6; ++i) {
+        *out++ = static_cast<uint8_t>(indices >> (i * 8));
+    }
+}
+
+Block getBlock(const Image& image, size_t bx, size_t by)
+{
+    Block block;
+    for (size_t y = 0; y < 4; ++y) {
+        const auto sy = std::min(by * 4 + y, image.height - 1);
+        for (size_t x = 0; x < 4; ++x) {
+            const auto sx = std::min(bx * 4 + x, image.width - 1);
+            std::memcpy(block.data() + (y * 4 + x) * 4,
+                image.pixels.data() + (sy * image.width + sx) * 4, 4);
+        }
+    }
+    return block;
+}
+
+size_t getBlockSize(TextureFormat format)
+{
+    return format == TextureFormat::Bc1 ? 8 : 16;
+}
+}
+
+size_t getCompressedSize(size_t width, size_t height, TextureFormat format)
+{
+    return (width + 3) / 4 * ((height + 3) / 4) * getBlockSize(format);
+}
+
+std::vector<uint8_t> compressImage(const Image& image, TextureFormat format)
+{
+    assert(format != TextureFormat::Rgba8);
+    std::vector<uint8_t> data(getCompressedSize(image.width, image.height, format));
+    auto out = data.data();
+    for (size_t by = 0; by < (image.height + 3) / 4; ++by) {
+        for (size_t bx = 0; bx < (image.width + 3) / 4; ++bx) {
+            const auto block = getBlock(image, bx, by);
+            switch (format) {
+            case TextureFormat::Bc1:
+                encodeColor(block, out);
+                break;
+            case TextureFormat::Bc3:
+                encodeChannel(block, 3, out);
+                encodeColor(block, out);
+                break;
+            case TextureFormat::Bc5:
+                encodeChannel(block, 0, out);
+                encodeChannel(block, 1, out);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    assert(out == data.data() + data.size());
+    return data;
+}
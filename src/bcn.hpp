@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "image.hpp"
+#include "wtex.hpp"
+
+// Simple CPU block compression (bounding box endpoints, nearest palette entry). The quality is
+// below that of dedicated encoders, but it is fast enough to run as part of the build.
+// Sizes that are not a multiple of 4 are padded by repeating the edge pixels.
+std::vector<uint8_t> compressImage(const Image& image, TextureFormat format);
+
+size_t getCompressedSize(size_t width, size_t height, TextureFormat format);
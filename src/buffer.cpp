@@ -3,14 +3,33 @@
 #include "die.hpp"
 #include "util.hpp"
 
+Buffer::Ptr Buffer::map(const std::string& filename)
+{
+    auto mapping = MappedFile::open(filename);
+    if (!mapping) {
+        return nullptr;
+    }
+    return std::shared_ptr<Buffer>(new Buffer(filename, std::move(*mapping)));
+}
+
 std::span<const uint8_t> Buffer::data() const
 {
+    if (mapping_) {
+        return mapping_->data();
+    }
     return std::span<const uint8_t>(data_);
 }
 
+std::span<uint8_t> Buffer::getWritableData()
+{
+    // Data from files may be read again later (see Residency)
+    dieAssert(!mapping_ && !fileRange_, "'{}' is not writable", name());
+    return std::span<uint8_t>(data_);
+}
+
 size_t Buffer::size() const
 {
-    return data_.size();
+    return data().size();
 }
 
 std::string Buffer::path() const
@@ -19,12 +38,46 @@ std::string Buffer::path() const
 }
 std::string Buffer::name() const
 {
+    if (fileRange_ && (fileRange_->offset > 0 || fileRange_->size != size())) {
+        return filename_ + fmt::format("[{}:{}]", fileRange_->offset, fileRange_->size);
+    }
     return filename_;
 }
 
+std::optional<FileRange> Buffer::getFileRange() const
+{
+    return fileRange_;
+}
+
 Buffer::Buffer(std::string filename)
     : filename_(std::move(filename))
     , data_(readFile<std::vector<uint8_t>>(filename_))
+    , fileRange_(FileRange { filename_, 0, data_.size() })
+    , memory_(MemoryCategory::Buffers, static_cast<int64_t>(data_.size()))
+{
+}
+
+Buffer::Buffer(FileRange range)
+    : filename_(range.path)
+    , data_(readFile<std::vector<uint8_t>>(range.path, range.offset, range.size))
+    , fileRange_(std::move(range))
+    , memory_(MemoryCategory::Buffers, static_cast<int64_t>(data_.size()))
+{
+}
+
+Buffer::Buffer(std::string name, std::vector<uint8_t> data)
+    : filename_(std::move(name))
+    , data_(std::move(data))
+    , memory_(MemoryCategory::Buffers, static_cast<int64_t>(data_.size()))
+{
+}
+
+// The mapping tracks its own memory
+Buffer::Buffer(std::string filename, MappedFile mapping)
+    : filename_(std::move(filename))
+    , mapping_(std::move(mapping))
+    , fileRange_(FileRange { filename_, 0, mapping_->data().size() })
+    , memory_(MemoryCategory::Buffers)
 {
 }
 
@@ -60,6 +113,16 @@ std::string BufferView::name() const
     return buffer_->name() + fmt::format("[{}:{}]", offset_, size_);
 }
 
+std::optional<FileRange> BufferView::getFileRange() const
+{
+    auto range = buffer_->getFileRange();
+    if (range) {
+        range->offset += offset_;
+        range->size = size_;
+    }
+    return range;
+}
+
 BufferView::BufferView(BufferBase::Ptr buffer, size_t offset, size_t size)
     : buffer_(std::move(buffer))
     , offset_(offset)
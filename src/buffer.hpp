@@ -1,10 +1,20 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 #include <span>
 #include <string>
 #include <vector>
 
+#include "mappedfile.hpp"
+#include "memory.hpp"
+
+struct FileRange {
+    std::string path;
+    size_t offset;
+    size_t size;
+};
+
 class BufferBase {
 public:
     using Ptr = std::shared_ptr<BufferBase>;
@@ -14,6 +24,8 @@ public:
     virtual size_t size() const = 0;
     virtual std::string path() const = 0;
     virtual std::string name() const = 0;
+    // Where the data was read from, so it can be read again later (see Residency)
+    virtual std::optional<FileRange> getFileRange() const = 0;
 };
 
 class Buffer final
@@ -28,18 +40,34 @@ public:
         return std::shared_ptr<Buffer>(new Buffer(std::forward<Args>(args)...));
     }
 
+    // Maps the file instead of reading it, so views into it (e.g. the BIN chunk of a .glb) don't
+    // copy anything. Returns nullptr if the file can't be opened.
+    [[nodiscard]] static Ptr map(const std::string& filename);
+
     std::span<const uint8_t> data() const override;
+    // Only for buffers created from data, e.g. to decode into a buffer that views were already
+    // created for. Nothing may read the buffer while it is written.
+    std::span<uint8_t> getWritableData();
 
     size_t size() const override;
 
     std::string path() const override;
     std::string name() const override;
+    std::optional<FileRange> getFileRange() const override;
 
 private:
     Buffer(std::string filename);
+    // Reads only part of the file
+    Buffer(FileRange range);
+    // For data that does not come from a file. The name is just used for messages.
+    Buffer(std::string name, std::vector<uint8_t> data);
+    Buffer(std::string filename, MappedFile mapping);
 
     std::string filename_;
     std::vector<uint8_t> data_;
+    std::optional<MappedFile> mapping_; // data_ is empty if this is set
+    std::optional<FileRange> fileRange_;
+    TrackedMemory memory_;
 };
 
 class BufferView final
@@ -59,6 +87,8 @@ public:
 
     std::string name() const override;
 
+    std::optional<FileRange> getFileRange() const override;
+
 private:
     BufferView(BufferBase::Ptr buffer, size_t offset = 0, size_t size = -1);
 
@@ -0,0 +1,125 @@
+// womf-cook: converts source images into cooked .wtex textures, which womf loads instead of the
+// source image if they are up to date.
+//   womf-cook [--format auto|rgba8|bc1|bc3|bc5] [--force] <image>...
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "image.hpp"
+#include "wtex.hpp"
+
+namespace {
+std::optional<std::vector<uint8_t>> readFile(const std::string& path)
+{
+    auto file = std::unique_ptr<FILE, decltype(&std::fclose)>(
+        std::fopen(path.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        return std::nullopt;
+    }
+    std::fseek(file.get(), 0, SEEK_END);
+    std::vector<uint8_t> data(std::ftell(file.get()));
+    std::fseek(file.get(), 0, SEEK_SET);
+    std::fread(data.data(), 1, data.size(), file.get());
+    return data;
+}
+
+std::optional<TextureFormat> parseFormat(std::string_view str)
+{
+    if (str == "rgba8") {
+        return TextureFormat::Rgba8;
+    } else if (str == "bc1") {
+        return TextureFormat::Bc1;
+    } else if (str == "bc3") {
+        return TextureFormat::Bc3;
+    } else if (str == "bc5") {
+        return TextureFormat::Bc5;
+    }
+    return std::nullopt;
+}
+
+bool hasAlpha(const Image& image)
+{
+    for (size_t i = 3; i < image.pixels.size(); i += 4) {
+        if (image.pixels[i] != 255) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool isUpToDate(const std::string& source, const std::string& cooked)
+{
+    std::error_code ec;
+    const auto cookedTime = std::filesystem::last_write_time(cooked, ec);
+    if (ec) {
+        return false;
+    }
+    return cookedTime >= std::filesystem::last_write_time(source, ec) && !ec;
+}
+
+void printUsage()
+{
+    std::fprintf(
+        stderr, "Usage: womf-cook [--format auto|rgba8|bc1|bc3|bc5] [--force] <image>...\n");
+}
+}
+
+int main(int argc, char** argv)
+{
+    std::optional<TextureFormat> format; // nullopt = auto
+    bool force = false;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--format" && i + 1 < argc) {
+            const std::string_view value = argv[++i];
+            format = parseFormat(value);
+            if (!format && value != "auto") {
+                std::fprintf(stderr, "Invalid format '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--force") {
+            force = true;
+        } else if (arg.starts_with("--")) {
+            printUsage();
+            return 1;
+        } else {
+            inputs.emplace_back(arg);
+        }
+    }
+    if (inputs.empty()) {
+        printUsage();
+        return 1;
+    }
+
+    int ret = 0;
+    for (const auto& input : inputs) {
+        const auto output = getCookedPath(input);
+        if (!force && isUpToDate(input, output)) {
+            std::printf("%s is up to date\n", output.c_str());
+            continue;
+        }
+
+        const auto data = readFile(input);
+        auto image = data ? Image::decode(*data) : std::nullopt;
+        if (!image) {
+            std::fprintf(stderr, "Could not load '%s'\n", input.c_str());
+            ret = 1;
+            continue;
+        }
+        const auto fmt
+            = format.value_or(hasAlpha(*image) ? TextureFormat::Bc3 : TextureFormat::Bc1);
+        if (!writeWtex(output, buildMipChain(std::move(*image)), fmt)) {
+            std::fprintf(stderr, "Could not write '%s'\n", output.c_str());
+            ret = 1;
+            continue;
+        }
+        std::printf("%s -> %s\n", input.c_str(), output.c_str());
+    }
+    return ret;
+}
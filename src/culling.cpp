@@ -0,0 +1,124 @@
+#include "culling.hpp"
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WOMF_CULLING_SSE2
+#endif
+
+CenterExtent transformAabb(const Aabb& box, const glm::mat4& transform)
+{
+    // Arvo: The extent of the transformed box is the extent multiplied with the absolute matrix
+    const auto center = glm::vec3(transform * glm::vec4((box.min + box.max) * 0.5f, 1.0f));
+    const auto halfSize = (box.max - box.min) * 0.5f;
+    const auto basis = glm::mat3(transform);
+    const auto extent = glm::mat3(glm::abs(basis[0]), glm::abs(basis[1]), glm::abs(basis[2]))
+        * halfSize;
+    return CenterExtent { center, extent };
+}
+
+void CullBoxes::push(const Aabb& box, const glm::mat4& transform)
+{
+    const auto [center, extent] = transformAabb(box, transform);
+    centerX.push_back(center.x);
+    centerY.push_back(center.y);
+    centerZ.push_back(center.z);
+    extentX.push_back(extent.x);
+    extentY.push_back(extent.y);
+    extentZ.push_back(extent.z);
+}
+
+size_t CullBoxes::size() const
+{
+    return centerX.size();
+}
+
+void CullBoxes::clear()
+{
+    centerX.clear();
+    centerY.clear();
+    centerZ.clear();
+    extentX.clear();
+    extentY.clear();
+    extentZ.clear();
+}
+
+Frustum::Frustum(const glm::mat4& viewProjection)
+{
+    // Gribb/Hartmann: Rows of the matrix combined
+    const auto row = [&viewProjection](int i) {
+        return glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i],
+            viewProjection[3][i]);
+    };
+    planes_ = {
+        row(3) + row(0), // left
+        row(3) - row(0), // right
+        row(3) + row(1), // bottom
+        row(3) - row(1), // top
+        row(3) + row(2), // near
+        row(3) - row(2), // far
+    };
+    for (auto& plane : planes_) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+}
+
+bool Frustum::isVisible(const glm::vec3& center, const glm::vec3& extent) const
+{
+    for (const auto& plane : planes_) {
+        const auto normal = glm::vec3(plane);
+        const auto distance = glm::dot(normal, center) + plane.w;
+        const auto radius = glm::dot(glm::abs(normal), extent);
+        if (distance + radius < 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t Frustum::test(const CullBoxes& boxes, size_t first, size_t count, uint8_t* visible) const
+{
+    size_t numVisible = 0;
+    size_t i = 0;
+#ifdef WOMF_CULLING_SSE2
+    // Four boxes against one plane at a time
+    for (; i + 4 <= count; i += 4) {
+        const auto b = first + i;
+        const auto cx = _mm_loadu_ps(boxes.centerX.data() + b);
+        const auto cy = _mm_loadu_ps(boxes.centerY.data() + b);
+        const auto cz = _mm_loadu_ps(boxes.centerZ.data() + b);
+        const auto ex = _mm_loadu_ps(boxes.extentX.data() + b);
+        const auto ey = _mm_loadu_ps(boxes.extentY.data() + b);
+        const auto ez = _mm_loadu_ps(boxes.extentZ.data() + b);
+        auto outside = _mm_setzero_ps();
+        for (const auto& plane : planes_) {
+            const auto nx = _mm_set1_ps(plane.x);
+            const auto ny = _mm_set1_ps(plane.y);
+            const auto nz = _mm_set1_ps(plane.z);
+            const auto distance = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(plane.w)));
+            const auto radius = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane.x)), ex),
+                    _mm_mul_ps(_mm_set1_ps(std::abs(plane.y)), ey)),
+                _mm_mul_ps(_mm_set1_ps(std::abs(plane.z)), ez));
+            outside = _mm_or_ps(
+                outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+        }
+        const auto mask = _mm_movemask_ps(outside);
+        for (size_t j = 0; j < 4; ++j) {
+            visible[i + j] = (mask & (1 << j)) ? 0 : 1;
+            numVisible += visible[i + j];
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        const auto b = first + i;
+        const auto center = glm::vec3(boxes.centerX[b], boxes.centerY[b], boxes.centerZ[b]);
+        const auto extent = glm::vec3(boxes.extentX[b], boxes.extentY[b], boxes.extentZ[b]);
+        visible[i] = isVisible(center, extent) ? 1 : 0;
+        numVisible += visible[i];
+    }
+    return numVisible;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+struct Aabb {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+struct CenterExtent {
+    glm::vec3 center;
+    glm::vec3 extent; // half size
+};
+
+// The box around `box` transformed by `transform`
+CenterExtent transformAabb(const Aabb& box, const glm::mat4& transform);
+
+// Boxes as center and half extent in SoA layout, so the frustum test can do four at once
+struct CullBoxes {
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+
+    // Adds the box around `box` transformed by `transform`
+    void push(const Aabb& box, const glm::mat4& transform);
+    size_t size() const;
+    void clear();
+};
+
+class Frustum {
+public:
+    // The planes of the clip volume of `viewProjection` (pointing inwards)
+    explicit Frustum(const glm::mat4& viewProjection);
+
+    bool isVisible(const glm::vec3& center, const glm::vec3& extent) const;
+
+    // Writes 1 (visible) or 0 into visible[i] for the boxes [first, first + count).
+    // Returns the number of visible boxes.
+    size_t test(const CullBoxes& boxes, size_t first, size_t count, uint8_t* visible) const;
+
+private:
+    std::array<glm::vec4, 6> planes_;
+};
@@ -0,0 +1,71 @@
+#ifndef WOMF_GLSL
+#define WOMF_GLSL
+
+// Built-in uniforms, include with #include <womf.glsl>
+// These have to match FrameUniforms and ObjectUniforms in graphics.cpp
+
+// Updated once per frame (or whenever the view or projection matrix changes)
+layout(std140) uniform WomfFrame {
+    mat4 viewMatrix;
+    mat4 invViewMatrix;
+    mat4 projectionMatrix;
+    mat4 invProjectionMatrix;
+    mat4 viewProjectionMatrix;
+    mat4 invViewProjectionMatrix;
+};
+
+#if defined(WOMF_MULTI_DRAW) && !defined(FRAGMENT_SHADER)
+// Define WOMF_MULTI_DRAW before including this in the vertex shader (needs #version 430) to make
+// it a multi-draw shader. It can only draw geometry from a GeometryPool, but consecutive draws are
+// merged and every draw reads its uniforms from this array. The object uniforms are not available
+// in the fragment shader, pass what you need from the vertex shader.
+struct WomfObjectData {
+    mat4 modelMatrix;
+    mat4 invModelMatrix;
+    mat3 normalMatrix;
+    mat4 modelViewMatrix;
+    mat4 invModelViewMatrix;
+    mat4 modelViewProjectionMatrix;
+    mat4 invModelViewProjectionMatrix;
+    mat4 vertexTransform;
+    ivec4 textureLayers;
+};
+
+layout(std430) readonly buffer WomfObjects {
+    WomfObjectData womfObjects[];
+};
+
+// The index of the draw in the multi-draw, see drawIndexAttributeLocation in graphics.cpp
+layout(location = 15) in uint womfDrawIndex;
+
+#define modelMatrix (womfObjects[womfDrawIndex].modelMatrix)
+#define invModelMatrix (womfObjects[womfDrawIndex].invModelMatrix)
+#define normalMatrix (womfObjects[womfDrawIndex].normalMatrix)
+#define modelViewMatrix (womfObjects[womfDrawIndex].modelViewMatrix)
+#define invModelViewMatrix (womfObjects[womfDrawIndex].invModelViewMatrix)
+#define modelViewProjectionMatrix (womfObjects[womfDrawIndex].modelViewProjectionMatrix)
+#define invModelViewProjectionMatrix (womfObjects[womfDrawIndex].invModelViewProjectionMatrix)
+#define vertexTransform (womfObjects[womfDrawIndex].vertexTransform)
+#define textureLayers (womfObjects[womfDrawIndex].textureLayers)
+#else
+// Updated for every draw
+layout(std140) uniform WomfObject {
+    mat4 modelMatrix;
+    mat4 invModelMatrix;
+    mat3 normalMatrix; // inv normal is just transpose
+    mat4 modelViewMatrix;
+    mat4 invModelViewMatrix;
+    mat4 modelViewProjectionMatrix;
+    mat4 invModelViewProjectionMatrix;
+    // The part of Geometry::setVertexTransform that is not in the matrices above. That is all of
+    // it for instanced draws, where it has to be applied before the instance matrix, and the
+    // identity otherwise.
+    mat4 vertexTransform;
+    // The layers of the textures bound to sampler2DArray uniforms that have no int uniform
+    // "<name>Layer", in the order of the sampler names. Unlike such a uniform, this does not
+    // prevent draws with different layers from being merged.
+    ivec4 textureLayers;
+};
+#endif
+
+#endif
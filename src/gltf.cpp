@@ -0,0 +1,977 @@
+#include "gltf.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <map>
+#include <string_view>
+
+#include <simdjson.h>
+
+#include "meshoptdecode.hpp"
+#include "meshoptimize.hpp"
+#include "meshsimplify.hpp"
+#include "scenecache.hpp"
+#include "threadpool.hpp"
+#include "util.hpp"
+
+namespace {
+using simdjson::dom::element;
+
+enum class ComponentType : uint64_t {
+    I8 = 5120,
+    U8 = 5121,
+    I16 = 5122,
+    U16 = 5123,
+    U32 = 5125,
+    F32 = 5126,
+};
+
+struct Accessor {
+    std::optional<size_t> bufferView;
+    size_t byteOffset;
+    ComponentType componentType;
+    size_t components;
+    size_t count;
+    bool normalized;
+    std::optional<std::array<double, 3>> min;
+    std::optional<std::array<double, 3>> max;
+};
+
+struct BufferViewInfo {
+    BufferView::Ptr view;
+    std::optional<size_t> byteStride;
+};
+
+std::optional<element> getField(element obj, std::string_view key)
+{
+    element value;
+    if (obj[key].get(value) != simdjson::SUCCESS) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+uint64_t getUint(element obj, std::string_view key, std::optional<uint64_t> def = std::nullopt)
+{
+    const auto field = getField(obj, key);
+    if (!field) {
+        dieAssert(def.has_value(), "Missing field '{}'", key);
+        return def.value_or(0);
+    }
+    uint64_t value = 0;
+    dieAssert(field->get(value) == simdjson::SUCCESS, "'{}' must be an unsigned integer", key);
+    return value;
+}
+
+std::optional<element> getExtension(element obj, std::string_view name)
+{
+    const auto extensions = getField(obj, "extensions");
+    return extensions ? getField(*extensions, name) : std::nullopt;
+}
+
+std::optional<uint64_t> getIndex(element obj, std::string_view key)
+{
+    if (!getField(obj, key)) {
+        return std::nullopt;
+    }
+    return getUint(obj, key);
+}
+
+double getNumber(element obj, std::string_view key, double def)
+{
+    const auto field = getField(obj, key);
+    if (!field) {
+        return def;
+    }
+    double value = 0.0;
+    dieAssert(field->get(value) == simdjson::SUCCESS, "'{}' must be a number", key);
+    return value;
+}
+
+std::string_view getString(element obj, std::string_view key, std::string_view def = "")
+{
+    const auto field = getField(obj, key);
+    if (!field) {
+        return def;
+    }
+    std::string_view value;
+    dieAssert(field->get(value) == simdjson::SUCCESS, "'{}' must be a string", key);
+    return value;
+}
+
+// Empty if the field is missing
+std::vector<element> getArray(element obj, std::string_view key)
+{
+    const auto field = getField(obj, key);
+    if (!field) {
+        return {};
+    }
+    simdjson::dom::array array;
+    dieAssert(field->get(array) == simdjson::SUCCESS, "'{}' must be an array", key);
+    return std::vector<element>(array.begin(), array.end());
+}
+
+template <size_t N>
+std::optional<std::array<double, N>> getNumbers(element obj, std::string_view key)
+{
+    const auto values = getArray(obj, key);
+    if (values.empty()) {
+        return std::nullopt;
+    }
+    dieAssert(values.size() == N, "'{}' must have {} elements", key, N);
+    std::array<double, N> ret;
+    for (size_t i = 0; i < N; ++i) {
+        dieAssert(values[i].get(ret[i]) == simdjson::SUCCESS, "'{}' must be numbers", key);
+    }
+    return ret;
+}
+
+size_t getComponentSize(ComponentType type)
+{
+    switch (type) {
+    case ComponentType::I8:
+    case ComponentType::U8:
+        return 1;
+    case ComponentType::I16:
+    case ComponentType::U16:
+        return 2;
+    case ComponentType::U32:
+    case ComponentType::F32:
+        return 4;
+    default:
+        die("Invalid component type {}", static_cast<uint64_t>(type));
+        return 0;
+    }
+}
+
+glw::AttributeType getAttributeType(ComponentType type)
+{
+    switch (type) {
+    case ComponentType::I8:
+        return glw::AttributeType::I8;
+    case ComponentType::U8:
+        return glw::AttributeType::U8;
+    case ComponentType::I16:
+        return glw::AttributeType::I16;
+    case ComponentType::U16:
+        return glw::AttributeType::U16;
+    case ComponentType::U32:
+        return glw::AttributeType::U32;
+    case ComponentType::F32:
+        return glw::AttributeType::F32;
+    default:
+        die("Invalid component type {}", static_cast<uint64_t>(type));
+        return glw::AttributeType::F32;
+    }
+}
+
+size_t getComponentCount(std::string_view type)
+{
+    if (type == "SCALAR") {
+        return 1;
+    } else if (type == "VEC2") {
+        return 2;
+    } else if (type == "VEC3") {
+        return 3;
+    } else if (type == "VEC4" || type == "MAT2") {
+        return 4;
+    } else if (type == "MAT3") {
+        return 9;
+    } else if (type == "MAT4") {
+        return 16;
+    }
+    die("Invalid accessor type '{}'", type);
+    return 0;
+}
+
+// glTF maps -1 and the minimum of signed types to -1
+template <typename T>
+float normalize(std::span<const uint8_t> data, size_t index)
+{
+    T value;
+    std::memcpy(&value, data.data() + index * sizeof(T), sizeof(T));
+    return std::max(
+        static_cast<float>(value) / static_cast<float>(std::numeric_limits<T>::max()), -1.0f);
+}
+
+float readNormalized(std::span<const uint8_t> data, ComponentType type, size_t index)
+{
+    switch (type) {
+    case ComponentType::I8:
+        return normalize<int8_t>(data, index);
+    case ComponentType::U8:
+        return normalize<uint8_t>(data, index);
+    case ComponentType::I16:
+        return normalize<int16_t>(data, index);
+    case ComponentType::U16:
+        return normalize<uint16_t>(data, index);
+    default:
+        die("Component type {} can't be normalized", static_cast<uint64_t>(type));
+        return 0.0f;
+    }
+}
+
+uint32_t getMaxIndex(std::span<const uint8_t> data, ComponentType type, size_t count)
+{
+    const auto size = getComponentSize(type);
+    uint32_t maxIndex = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t index = 0;
+        // Little-endian only, like the rest of the loader
+        std::memcpy(&index, data.data() + i * size, size);
+        maxIndex = std::max(maxIndex, index);
+    }
+    return maxIndex;
+}
+
+MeshoptMode getMeshoptMode(std::string_view mode)
+{
+    if (mode == "ATTRIBUTES") {
+        return MeshoptMode::Attributes;
+    } else if (mode == "TRIANGLES") {
+        return MeshoptMode::Triangles;
+    } else if (mode == "INDICES") {
+        return MeshoptMode::Indices;
+    }
+    die("Invalid EXT_meshopt_compression mode '{}'", mode);
+    return MeshoptMode::Attributes;
+}
+
+MeshoptFilter getMeshoptFilter(std::string_view filter)
+{
+    if (filter == "NONE") {
+        return MeshoptFilter::None;
+    } else if (filter == "OCTAHEDRAL") {
+        return MeshoptFilter::Octahedral;
+    } else if (filter == "QUATERNION") {
+        return MeshoptFilter::Quaternion;
+    } else if (filter == "EXPONENTIAL") {
+        return MeshoptFilter::Exponential;
+    }
+    die("Invalid EXT_meshopt_compression filter '{}'", filter);
+    return MeshoptFilter::None;
+}
+
+std::optional<std::string> getAttributeName(std::string_view name)
+{
+    static const std::array<std::pair<std::string_view, std::string_view>, 9> names { {
+        { "POSITION", "position" },
+        { "NORMAL", "normal" },
+        { "TANGENT", "tangent" },
+        { "TEXCOORD_0", "texcoord0" },
+        { "TEXCOORD_1", "texcoord1" },
+        { "COLOR_0", "color0" },
+        { "COLOR_1", "color1" },
+        { "JOINTS_0", "joints0" },
+        { "WEIGHTS_0", "weights0" },
+    } };
+    for (const auto& [gltfName, womfName] : names) {
+        if (gltfName == name) {
+            return std::string(womfName);
+        }
+    }
+    return std::nullopt;
+}
+
+uint8_t decodeBase64Char(char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return static_cast<uint8_t>(c - 'A');
+    } else if (c >= 'a' && c <= 'z') {
+        return static_cast<uint8_t>(c - 'a' + 26);
+    } else if (c >= '0' && c <= '9') {
+        return static_cast<uint8_t>(c - '0' + 52);
+    } else if (c == '+') {
+        return 62;
+    } else if (c == '/') {
+        return 63;
+    }
+    die("Invalid base64 character '{}'", c);
+    return 0;
+}
+
+std::vector<uint8_t> decodeBase64(std::string_view str)
+{
+    while (!str.empty() && str.back() == '=') {
+        str.remove_suffix(1);
+    }
+    std::vector<uint8_t> data;
+    data.reserve(str.size() * 3 / 4);
+    uint32_t bits = 0;
+    size_t numBits = 0;
+    for (const auto c : str) {
+        bits = (bits << 6) | decodeBase64Char(c);
+        numBits += 6;
+        if (numBits >= 8) {
+            numBits -= 8;
+            data.push_back(static_cast<uint8_t>(bits >> numBits));
+        }
+    }
+    return data;
+}
+
+// Files relative to the .gltf or embedded data URIs
+Buffer::Ptr loadUri(const std::string& dir, std::string_view uri)
+{
+    if (uri.starts_with("data:")) {
+        const auto comma = uri.find(',');
+        dieAssert(comma != std::string_view::npos && uri.substr(0, comma).ends_with(";base64"),
+            "Only base64 data URIs are supported");
+        return Buffer::create(std::string(uri.substr(0, std::min<size_t>(comma, 64))),
+            decodeBase64(uri.substr(comma + 1)));
+    }
+    // Percent-encoding is not handled, none of our assets need it
+    return Buffer::create(dir + std::string(uri));
+}
+
+class Loader {
+public:
+    // binChunk is the BIN chunk of a .glb, if there is one
+    Loader(const std::string& path, BufferView::Ptr binChunk = nullptr)
+        : path_(path)
+        , dir_(path.substr(0, path.find_last_of("/\\") + 1))
+        , binChunk_(std::move(binChunk))
+    {
+    }
+
+    GltfAsset::Ptr load(element doc)
+    {
+        doc_ = doc;
+        const auto assetInfo = getField(doc, "asset");
+        dieAssert(assetInfo && getString(*assetInfo, "version").starts_with("2."),
+            "'{}' is not glTF 2.0", path_);
+        for (const auto& ext : getArray(doc, "extensionsRequired")) {
+            std::string_view name;
+            static_cast<void>(ext.get(name));
+            dieAssert(name == "EXT_meshopt_compression",
+                "'{}' requires unsupported extension '{}'", path_, name);
+        }
+
+        auto asset = std::make_shared<GltfAsset>();
+        asset->files.push_back(path_);
+        loadBuffers(*asset);
+        loadAccessors();
+        loadTextures(*asset);
+        loadMaterials(*asset);
+        loadMeshes(*asset);
+        loadNodes(*asset);
+        loadSkins(*asset);
+        // Nothing before reads the data of the bufferViews
+        waitForDecodes();
+        validateIndices();
+        loadAnimations(*asset);
+        return asset;
+    }
+
+private:
+    void loadBuffers(GltfAsset& asset)
+    {
+        std::vector<BufferView::Ptr> buffers;
+        for (const auto& buffer : getArray(doc_, "buffers")) {
+            // Only compressed bufferViews refer to it and they are decoded instead, so it's not
+            // loaded at all (it may have no uri or the uncompressed data)
+            bool fallback = false;
+            if (const auto meshopt = getExtension(buffer, "EXT_meshopt_compression")) {
+                if (const auto field = getField(*meshopt, "fallback")) {
+                    static_cast<void>(field->get(fallback));
+                }
+            }
+            if (fallback) {
+                buffers.push_back(nullptr);
+                continue;
+            }
+            const auto uri = getString(buffer, "uri");
+            if (uri.empty()) {
+                // Only the first buffer may refer to the BIN chunk
+                dieAssert(binChunk_ && buffers.empty(),
+                    "Buffers without uri are only supported in .glb files");
+                buffers.push_back(binChunk_);
+            } else {
+                const auto data = loadUri(dir_, uri);
+                buffers.push_back(BufferView::create(data, 0, data->size()));
+                if (!uri.starts_with("data:")) {
+                    asset.files.push_back(data->path());
+                }
+            }
+            dieAssert(buffers.back()->size() >= getUint(buffer, "byteLength"),
+                "Buffer {} is smaller than its byteLength", buffers.size() - 1);
+        }
+
+        for (const auto& bv : getArray(doc_, "bufferViews")) {
+            const auto bufferIdx = getUint(bv, "buffer");
+            dieAssert(bufferIdx < buffers.size(), "Invalid buffer index {}", bufferIdx);
+            const auto offset = getUint(bv, "byteOffset", 0);
+            const auto size = getUint(bv, "byteLength");
+            const auto stride = getIndex(bv, "byteStride");
+            dieAssert(!stride || (*stride >= 4 && *stride <= 252 && *stride % 4 == 0),
+                "Invalid byteStride {}", stride.value_or(0));
+            BufferView::Ptr view;
+            if (const auto meshopt = getExtension(bv, "EXT_meshopt_compression")) {
+                view = decodeMeshoptView(*meshopt, buffers, size, stride);
+            } else {
+                dieAssert(buffers[bufferIdx] != nullptr,
+                    "BufferView {} refers to a fallback buffer", bufferViews_.size());
+                const auto bufferSize = buffers[bufferIdx]->size();
+                dieAssert(offset <= bufferSize && size <= bufferSize - offset,
+                    "BufferView exceeds its buffer");
+                view = BufferView::create(buffers[bufferIdx], offset, size);
+            }
+            bufferViews_.push_back(BufferViewInfo {
+                std::move(view),
+                stride ? std::optional<size_t>(*stride) : std::nullopt,
+            });
+        }
+    }
+
+    // EXT_meshopt_compression: the bufferView is decoded on the thread pool into a new buffer,
+    // while the rest of the file is loaded. The view of the new buffer is returned right away,
+    // but it may only be read after waitForDecodes.
+    BufferView::Ptr decodeMeshoptView(element ext, const std::vector<BufferView::Ptr>& buffers,
+        size_t size, std::optional<uint64_t> viewStride)
+    {
+        const auto index = bufferViews_.size();
+        const auto bufferIdx = getUint(ext, "buffer");
+        dieAssert(bufferIdx < buffers.size() && buffers[bufferIdx] != nullptr,
+            "Invalid buffer index {} in compressed bufferView {}", bufferIdx, index);
+        const auto offset = getUint(ext, "byteOffset", 0);
+        const auto length = getUint(ext, "byteLength");
+        const auto bufferSize = buffers[bufferIdx]->size();
+        dieAssert(offset <= bufferSize && length <= bufferSize - offset,
+            "Compressed bufferView {} exceeds its buffer", index);
+        const auto count = getUint(ext, "count");
+        const auto stride = getUint(ext, "byteStride");
+        // The division first, so a huge count can't overflow
+        dieAssert(stride > 0 && count <= size / stride && count * stride == size,
+            "Compressed bufferView {} has the wrong size", index);
+        const auto mode = getMeshoptMode(getString(ext, "mode"));
+        // The decoded vertices are used with the stride of the bufferView
+        dieAssert(mode != MeshoptMode::Attributes || viewStride == stride,
+            "Compressed bufferView {} has a different byteStride than its vertices", index);
+        const auto filter = getMeshoptFilter(getString(ext, "filter", "NONE"));
+
+        const auto src = BufferView::create(buffers[bufferIdx], offset, length);
+        const auto dest = Buffer::create(
+            fmt::format("{}[bufferView {}]", path_, index), std::vector<uint8_t>(size));
+        decodes_.emplace_back(index,
+            getThreadPool().submit(
+                [src, dest, out = dest->getWritableData(), count, stride, mode, filter]() {
+                    return decodeMeshopt(out, count, stride, mode, filter, src->data());
+                }));
+        return BufferView::create(dest, 0, size);
+    }
+
+    void waitForDecodes()
+    {
+        for (auto& [index, decoded] : decodes_) {
+            dieAssert(decoded.get(), "Could not decode compressed bufferView {} in '{}'", index,
+                path_);
+        }
+        decodes_.clear();
+    }
+
+    // The accessors only check that the index data is in bounds, so an index past the vertices
+    // would make the GPU read outside of the vertex buffers
+    void validateIndices()
+    {
+        for (const auto& [index, vertexCount] : indexChecks_) {
+            const auto& acc = accessors_[index];
+            const auto data = bufferViews_[*acc.bufferView].view->data().subspan(acc.byteOffset);
+            const auto maxIndex = getMaxIndex(data, acc.componentType, acc.count);
+            dieAssert(maxIndex < vertexCount, "Index {} of accessor {} exceeds the {} vertices",
+                maxIndex, index, vertexCount);
+        }
+        indexChecks_.clear();
+    }
+
+    void loadAccessors()
+    {
+        for (const auto& acc : getArray(doc_, "accessors")) {
+            dieAssert(!getField(acc, "sparse"), "Sparse accessors are not supported");
+            Accessor accessor {
+                .bufferView = getIndex(acc, "bufferView"),
+                .byteOffset = getUint(acc, "byteOffset", 0),
+                .componentType = static_cast<ComponentType>(getUint(acc, "componentType")),
+                .components = getComponentCount(getString(acc, "type")),
+                .count = getUint(acc, "count"),
+                .normalized = false,
+                .min = std::nullopt,
+                .max = std::nullopt,
+            };
+            if (const auto normalized = getField(acc, "normalized")) {
+                static_cast<void>(normalized->get(accessor.normalized));
+            }
+            if (accessor.components == 3) {
+                accessor.min = getNumbers<3>(acc, "min");
+                accessor.max = getNumbers<3>(acc, "max");
+            }
+            validate(accessor);
+            accessors_.push_back(accessor);
+        }
+    }
+
+    // Every element of the accessor has to be inside of its bufferView
+    void validate(const Accessor& acc) const
+    {
+        // All zeros, which is only useful with sparse accessors
+        dieAssert(acc.bufferView.has_value(), "Accessors without bufferView are not supported");
+        dieAssert(*acc.bufferView < bufferViews_.size(), "Invalid bufferView {}", *acc.bufferView);
+        const auto& bv = bufferViews_[*acc.bufferView];
+        const auto componentSize = getComponentSize(acc.componentType);
+        const auto elementSize = componentSize * acc.components;
+        const auto stride = bv.byteStride.value_or(elementSize);
+        dieAssert(acc.byteOffset % componentSize == 0, "Accessor offset is not aligned");
+        dieAssert(stride >= elementSize, "Accessor elements overlap (stride {} < size {})",
+            stride, elementSize);
+        dieAssert(acc.count > 0, "Accessor is empty");
+        // Subtracted and divided, so a huge count or offset can't overflow
+        const auto size = bv.view->size();
+        dieAssert(acc.byteOffset <= size && elementSize <= size - acc.byteOffset
+                && acc.count - 1 <= (size - acc.byteOffset - elementSize) / stride,
+            "Accessor exceeds its bufferView");
+    }
+
+    const Accessor& getAccessor(uint64_t index) const
+    {
+        dieAssert(index < accessors_.size(), "Invalid accessor index {}", index);
+        return accessors_[index];
+    }
+
+    // For data that is read on the CPU, which has to be tightly packed
+    BufferView::Ptr getPackedData(uint64_t index, ComponentType type, size_t components) const
+    {
+        const auto& acc = getAccessor(index);
+        dieAssert(acc.componentType == type && acc.components == components,
+            "Accessor {} has the wrong type", index);
+        const auto& bv = bufferViews_[*acc.bufferView];
+        const auto size = getComponentSize(type) * components * acc.count;
+        dieAssert(!bv.byteStride || *bv.byteStride == getComponentSize(type) * components,
+            "Accessor {} must be tightly packed", index);
+        return BufferView::create(bv.view, acc.byteOffset, size);
+    }
+
+    // Like getPackedData with floats, but normalized integers (e.g. rotations compressed with the
+    // quaternion filter of EXT_meshopt_compression) are converted
+    BufferView::Ptr getFloatData(uint64_t index, size_t components) const
+    {
+        const auto& acc = getAccessor(index);
+        if (acc.componentType == ComponentType::F32) {
+            return getPackedData(index, ComponentType::F32, components);
+        }
+        dieAssert(acc.normalized, "Accessor {} must be float or normalized", index);
+        const auto packed = getPackedData(index, acc.componentType, components);
+        std::vector<uint8_t> data(acc.count * components * sizeof(float));
+        for (size_t i = 0; i < acc.count * components; ++i) {
+            const auto value = readNormalized(packed->data(), acc.componentType, i);
+            std::memcpy(data.data() + i * sizeof(float), &value, sizeof(float));
+        }
+        const auto buffer
+            = Buffer::create(fmt::format("{}[accessor {}]", path_, index), std::move(data));
+        return BufferView::create(buffer, 0, buffer->size());
+    }
+
+    void loadTextures(GltfAsset& asset)
+    {
+        for (const auto& image : getArray(doc_, "images")) {
+            if (const auto uri = getString(image, "uri"); !uri.empty()) {
+                if (uri.starts_with("data:")) {
+                    const auto data = loadUri(dir_, uri);
+                    asset.images.push_back({ "", BufferView::create(data, 0, data->size()) });
+                } else {
+                    asset.images.push_back({ dir_ + std::string(uri), nullptr });
+                    asset.files.push_back(asset.images.back().path);
+                }
+            } else {
+                const auto bv = getIndex(image, "bufferView");
+                dieAssert(bv && *bv < bufferViews_.size(), "Image needs a uri or a bufferView");
+                asset.images.push_back({ "", bufferViews_[*bv].view });
+            }
+        }
+
+        for (const auto& texture : getArray(doc_, "textures")) {
+            const auto source = getUint(texture, "source");
+            dieAssert(source < asset.images.size(), "Invalid image index {}", source);
+            asset.textureImages.push_back(source);
+        }
+    }
+
+    void loadMaterials(GltfAsset& asset)
+    {
+        const auto getTexture
+            = [&asset](element obj, std::string_view key) -> std::optional<size_t> {
+            const auto info = getField(obj, key);
+            if (!info) {
+                return std::nullopt;
+            }
+            const auto index = getUint(*info, "index");
+            dieAssert(index < asset.textureImages.size(), "Invalid texture index {}", index);
+            return index;
+        };
+
+        for (const auto& mat : getArray(doc_, "materials")) {
+            GltfAsset::Material material;
+            material.name = getString(mat, "name");
+            material.normal = getTexture(mat, "normalTexture");
+            material.occlusion = getTexture(mat, "occlusionTexture");
+            if (const auto pbr = getField(mat, "pbrMetallicRoughness")) {
+                material.albedo = getTexture(*pbr, "baseColorTexture");
+                material.metallicRoughness = getTexture(*pbr, "metallicRoughnessTexture");
+                material.metallicFactor
+                    = static_cast<float>(getNumber(*pbr, "metallicFactor", 1.0));
+                material.roughnessFactor
+                    = static_cast<float>(getNumber(*pbr, "roughnessFactor", 1.0));
+                if (const auto color = getNumbers<4>(*pbr, "baseColorFactor")) {
+                    material.color = glm::vec4((*color)[0], (*color)[1], (*color)[2], (*color)[3]);
+                }
+            }
+            asset.materials.push_back(std::move(material));
+        }
+    }
+
+    GltfAsset::Primitive loadPrimitive(element prim)
+    {
+        const auto mode = getUint(prim, "mode", 4);
+        dieAssert(mode == 4, "Only triangle lists are supported (mode {})", mode);
+        GltfAsset::Primitive primitive;
+
+        // Attributes in the same bufferView with the same stride are one vertex buffer binding,
+        // so interleaved attributes are a single binding with different offsets. Every bufferView
+        // is uploaded once, no matter how many primitives use it (see createGpuObjects).
+        const auto attributes = getField(prim, "attributes");
+        dieAssert(attributes.has_value(), "Primitive has no attributes");
+        simdjson::dom::object attributeObject;
+        dieAssert(attributes->get(attributeObject) == simdjson::SUCCESS,
+            "'attributes' must be an object");
+        auto vertexCount = std::numeric_limits<size_t>::max();
+        for (const auto [name, value] : attributeObject) {
+            const auto attrName = getAttributeName(name);
+            if (!attrName) {
+                fmt::print(stderr, "Ignoring unsupported attribute '{}' in '{}'\n", name, path_);
+                continue;
+            }
+            uint64_t index = 0;
+            dieAssert(value.get(index) == simdjson::SUCCESS, "Invalid accessor for '{}'", name);
+            const auto& acc = getAccessor(index);
+            vertexCount = std::min(vertexCount, acc.count);
+            const auto elementSize = getComponentSize(acc.componentType) * acc.components;
+            const auto& bv = bufferViews_[*acc.bufferView];
+            const auto stride = bv.byteStride.value_or(elementSize);
+            auto& buffers = primitive.vertexBuffers;
+            auto buffer = std::find_if(buffers.begin(), buffers.end(), [&](const auto& b) {
+                return b.data == bv.view && b.format.getStride() == stride;
+            });
+            if (buffer == buffers.end()) {
+                buffers.push_back(GltfAsset::VertexBuffer { bv.view, VertexFormat {} });
+                buffer = buffers.end() - 1;
+                buffer->format.setStride(stride);
+            }
+            buffer->format.add(getAttributeLocation(*attrName), acc.components,
+                getAttributeType(acc.componentType), acc.normalized, acc.byteOffset);
+
+            if (name == "POSITION" && acc.min && acc.max) {
+                const auto& min = *acc.min;
+                const auto& max = *acc.max;
+                primitive.bounds = Aabb { glm::vec3(min[0], min[1], min[2]),
+                    glm::vec3(max[0], max[1], max[2]) };
+            }
+        }
+
+        const auto indices = getIndex(prim, "indices");
+        dieAssert(indices.has_value(), "Only indexed primitives are supported");
+        const auto& acc = getAccessor(*indices);
+        dieAssert(acc.components == 1
+                && (acc.componentType == ComponentType::U8
+                    || acc.componentType == ComponentType::U16
+                    || acc.componentType == ComponentType::U32),
+            "Invalid index accessor");
+        dieAssert(!bufferViews_[*acc.bufferView].byteStride
+                || *bufferViews_[*acc.bufferView].byteStride
+                    == getComponentSize(acc.componentType),
+            "Indices must be tightly packed");
+        primitive.indexData = bufferViews_[*acc.bufferView].view;
+        primitive.indexType = getAttributeType(acc.componentType);
+        primitive.indexOffset = acc.byteOffset;
+        primitive.indexCount = acc.count;
+        dieAssert(vertexCount != std::numeric_limits<size_t>::max(),
+            "Primitive has no supported attributes");
+        indexChecks_.emplace_back(*indices, vertexCount);
+        return primitive;
+    }
+
+    void loadMeshes(GltfAsset& asset)
+    {
+        for (const auto& mesh : getArray(doc_, "meshes")) {
+            GltfAsset::Mesh& m = asset.meshes.emplace_back();
+            m.name = getString(mesh, "name");
+            for (const auto& prim : getArray(mesh, "primitives")) {
+                const auto material = getIndex(prim, "material");
+                dieAssert(material && *material < asset.materials.size(),
+                    "Primitives need a valid material");
+                m.primitives.push_back(loadPrimitive(prim));
+                m.primitives.back().material = *material;
+            }
+        }
+    }
+
+    void loadNodes(GltfAsset& asset)
+    {
+        for (const auto& node : getArray(doc_, "nodes")) {
+            GltfAsset::Node& n = asset.nodes.emplace_back();
+            n.name = getString(node, "name");
+            n.mesh = getIndex(node, "mesh");
+            n.skin = getIndex(node, "skin");
+            dieAssert(!n.mesh || *n.mesh < asset.meshes.size(), "Invalid mesh index");
+            for (const auto& child : getArray(node, "children")) {
+                uint64_t index = 0;
+                dieAssert(child.get(index) == simdjson::SUCCESS, "Invalid child index");
+                n.children.push_back(index);
+            }
+            dieAssert(!getField(node, "matrix"), "Node matrices are not supported, only TRS");
+            if (const auto t = getNumbers<3>(node, "translation")) {
+                n.translation = glm::vec3((*t)[0], (*t)[1], (*t)[2]);
+            }
+            if (const auto r = getNumbers<4>(node, "rotation")) {
+                n.rotation = glm::quat(static_cast<float>((*r)[3]), static_cast<float>((*r)[0]),
+                    static_cast<float>((*r)[1]), static_cast<float>((*r)[2]));
+            }
+            if (const auto s = getNumbers<3>(node, "scale")) {
+                n.scale = glm::vec3((*s)[0], (*s)[1], (*s)[2]);
+            }
+        }
+        for (const auto& node : asset.nodes) {
+            for (const auto child : node.children) {
+                dieAssert(child < asset.nodes.size(), "Invalid child index {}", child);
+            }
+        }
+
+        const auto scenes = getArray(doc_, "scenes");
+        dieAssert(scenes.size() == 1, "Only files with a single scene are supported");
+        for (const auto& node : getArray(scenes[0], "nodes")) {
+            uint64_t index = 0;
+            dieAssert(node.get(index) == simdjson::SUCCESS && index < asset.nodes.size(),
+                "Invalid scene node");
+            asset.scene.push_back(index);
+        }
+    }
+
+    void loadSkins(GltfAsset& asset)
+    {
+        for (const auto& skin : getArray(doc_, "skins")) {
+            GltfAsset::Skin& s = asset.skins.emplace_back();
+            for (const auto& joint : getArray(skin, "joints")) {
+                uint64_t index = 0;
+                dieAssert(joint.get(index) == simdjson::SUCCESS && index < asset.nodes.size(),
+                    "Invalid joint index");
+                s.joints.push_back(index);
+            }
+            if (const auto ibm = getIndex(skin, "inverseBindMatrices")) {
+                dieAssert(getAccessor(*ibm).count == s.joints.size(),
+                    "There must be an inverse bind matrix for every joint");
+                s.inverseBindMatrices = getPackedData(*ibm, ComponentType::F32, 16);
+            }
+        }
+    }
+
+    void loadAnimations(GltfAsset& asset)
+    {
+        for (const auto& animation : getArray(doc_, "animations")) {
+            GltfAsset::Animation& a = asset.animations.emplace_back();
+            a.name = getString(animation, "name");
+            const auto samplers = getArray(animation, "samplers");
+            for (const auto& channel : getArray(animation, "channels")) {
+                const auto target = getField(channel, "target");
+                dieAssert(target.has_value(), "Channel has no target");
+                const auto node = getIndex(*target, "node");
+                // Channels without a node are for extensions
+                if (!node) {
+                    continue;
+                }
+                dieAssert(*node < asset.nodes.size(), "Invalid channel node");
+                const auto path = getString(*target, "path");
+                size_t components = 0;
+                Sampler::Type samplerType = Sampler::Type::Vec3;
+                if (path == "translation" || path == "scale") {
+                    components = 3;
+                } else if (path == "rotation") {
+                    components = 4;
+                    samplerType = Sampler::Type::Quat;
+                } else {
+                    // Morph target weights
+                    fmt::print(stderr, "Ignoring animation channel '{}' in '{}'\n", path, path_);
+                    continue;
+                }
+
+                const auto samplerIdx = getUint(channel, "sampler");
+                dieAssert(samplerIdx < samplers.size(), "Invalid sampler index");
+                const auto& sampler = samplers[samplerIdx];
+                const auto interp = getString(sampler, "interpolation", "LINEAR");
+                dieAssert(interp == "LINEAR" || interp == "STEP",
+                    "Interpolation '{}' is not supported", interp);
+                a.channels.push_back(GltfAsset::Channel {
+                    .node = *node,
+                    .path = std::string(path),
+                    .samplerType = samplerType,
+                    .interpolation = interp == "STEP" ? Interpolation::Step : Interpolation::Linear,
+                    .times = getPackedData(getUint(sampler, "input"), ComponentType::F32, 1),
+                    .values = getFloatData(getUint(sampler, "output"), components),
+                });
+            }
+        }
+    }
+
+    std::string path_;
+    std::string dir_;
+    BufferView::Ptr binChunk_;
+    element doc_;
+    std::vector<BufferViewInfo> bufferViews_;
+    std::vector<Accessor> accessors_;
+    std::vector<std::pair<size_t, std::future<bool>>> decodes_;
+    // Index accessor and the vertex count of its primitive, see validateIndices
+    std::vector<std::pair<uint64_t, size_t>> indexChecks_;
+};
+
+element parseJson(simdjson::dom::parser& parser, std::span<const uint8_t> json,
+    const std::string& path)
+{
+    element doc;
+    const auto error = parser.parse(json.data(), json.size()).get(doc);
+    dieAssert(error == simdjson::SUCCESS, "Could not parse '{}': {}", path,
+        simdjson::error_message(error));
+    return doc;
+}
+
+uint32_t readU32(std::span<const uint8_t> data, size_t offset)
+{
+    uint32_t value = 0;
+    std::memcpy(&value, data.data() + offset, sizeof(value));
+    return value;
+}
+
+// A .glb is a 12 byte header followed by a JSON chunk and an optional BIN chunk. The whole file
+// is mapped and the bufferViews (and embedded images) point into the mapping, so the binary
+// data is never copied before it is uploaded or decoded.
+GltfAsset::Ptr loadGlb(const std::string& path)
+{
+    constexpr uint32_t magic = 0x46546C67; // "glTF"
+    constexpr uint32_t jsonChunk = 0x4E4F534A;
+    constexpr uint32_t binChunk = 0x004E4942;
+
+    const auto file = Buffer::map(path);
+    dieAssert(file != nullptr, "Could not open '{}'", path);
+    const auto data = file->data();
+    dieAssert(data.size() >= 20 && readU32(data, 0) == magic, "'{}' is not a .glb file", path);
+    dieAssert(readU32(data, 4) == 2, "'{}' is not glTF 2.0", path);
+    const auto length = std::min<size_t>(readU32(data, 8), data.size());
+
+    std::span<const uint8_t> json;
+    BufferView::Ptr bin;
+    size_t offset = 12;
+    while (offset + 8 <= length) {
+        const auto chunkLength = readU32(data, offset);
+        const auto chunkType = readU32(data, offset + 4);
+        offset += 8;
+        dieAssert(offset + chunkLength <= length, "Chunk exceeds the file in '{}'", path);
+        if (chunkType == jsonChunk && json.empty()) {
+            json = data.subspan(offset, chunkLength);
+        } else if (chunkType == binChunk && !bin) {
+            bin = BufferView::create(file, offset, chunkLength);
+        }
+        // Other chunks are for extensions and must be ignored
+        offset += (chunkLength + 3) & ~size_t(3);
+    }
+    dieAssert(!json.empty(), "'{}' has no JSON chunk", path);
+
+    simdjson::dom::parser parser;
+    return Loader(path, std::move(bin)).load(parseJson(parser, json, path));
+}
+
+GltfAsset::Ptr loadGltf(const std::string& path)
+{
+    const auto json = readFile<std::vector<uint8_t>>(path);
+    simdjson::dom::parser parser;
+    return Loader(path).load(parseJson(parser, json, path));
+}
+}
+
+GltfAsset::Ptr GltfAsset::load(
+    const std::string& path, bool useCache, bool optimize, const LodSettings& lodSettings)
+{
+    const auto cachePath = getSceneCachePath(path);
+    if (useCache) {
+        auto asset = loadSceneCache(cachePath);
+        // A cache with the wrong optimization settings is just rewritten
+        if (asset && asset->meshOptimization.has_value() == optimize
+            && (!optimize || asset->lodSettings == lodSettings)) {
+            asset->createGpuObjects();
+            return asset;
+        }
+    }
+
+    auto asset = path.ends_with(".glb") ? loadGlb(path) : loadGltf(path);
+    if (optimize) {
+        asset->meshOptimization.emplace();
+        asset->lodSettings = lodSettings;
+        for (auto& mesh : asset->meshes) {
+            for (auto& prim : mesh.primitives) {
+                optimizePrimitive(prim, *asset->meshOptimization);
+                generateLods(prim, lodSettings, *asset->meshOptimization);
+            }
+        }
+    }
+    if (useCache && !writeSceneCache(cachePath, *asset)) {
+        fmt::print(stderr, "Could not write scene cache '{}'\n", cachePath);
+    }
+    asset->createGpuObjects();
+    return asset;
+}
+
+void GltfAsset::createGpuObjects()
+{
+    // All textures are layers of texture arrays (one per texture size), so primitives with
+    // different materials can be drawn without switching textures (see assets/array.frag)
+    TextureArrayBuilder textureArrays;
+    std::vector<size_t> imageLayers;
+    for (const auto& image : images) {
+        imageLayers.push_back(
+            image.data ? textureArrays.add(image.data) : textureArrays.add(image.path));
+    }
+    const auto layers = textureArrays.build();
+    textures.clear();
+    for (const auto image : textureImages) {
+        textures.push_back(layers[imageLayers[image]]);
+    }
+
+    // getShared only shares data that comes from a file, this also catches data URIs
+    std::map<std::pair<const BufferView*, BufferTarget>, GraphicsBuffer::Ptr> graphicsBuffers;
+    const auto getGraphicsBuffer = [&graphicsBuffers](BufferTarget target, BufferView::Ptr data) {
+        auto& buffer = graphicsBuffers[{ data.get(), target }];
+        if (!buffer) {
+            buffer = GraphicsBuffer::getShared(target, BufferUsage::Static, data);
+        }
+        return buffer;
+    };
+
+    for (auto& mesh : meshes) {
+        for (auto& prim : mesh.primitives) {
+            prim.geometry = Geometry::create(glw::DrawMode::Triangles);
+            for (const auto& vertexBuffer : prim.vertexBuffers) {
+                prim.geometry->addVertexBuffer(vertexBuffer.format,
+                    getGraphicsBuffer(BufferTarget::Attributes, vertexBuffer.data));
+            }
+            prim.geometry->setIndexBuffer(prim.indexType,
+                getGraphicsBuffer(BufferTarget::Indices, prim.indexData), prim.indexOffset,
+                prim.indexCount);
+            if (prim.bounds) {
+                prim.geometry->setBounds(*prim.bounds);
+            }
+            if (prim.vertexTransform) {
+                prim.geometry->setVertexTransform(*prim.vertexTransform);
+            }
+            if (!prim.lods.empty()) {
+                prim.geometry->setLods(prim.lods);
+            }
+        }
+    }
+}
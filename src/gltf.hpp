@@ -0,0 +1,148 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "animation.hpp"
+#include "buffer.hpp"
+#include "graphics.hpp"
+
+// What the optimization in meshoptimize.hpp did to all primitives of an asset
+struct MeshOptimizationStats {
+    size_t primitives = 0;
+    size_t skipped = 0; // primitives that could not be optimized (e.g. indices out of range)
+    size_t triangles = 0;
+    size_t verticesBefore = 0;
+    size_t verticesAfter = 0;
+    // Vertex shader invocations with a simulated 16 entry FIFO cache
+    size_t vertexShaderInvocationsBefore = 0;
+    size_t vertexShaderInvocationsAfter = 0;
+    size_t vertexBytesBefore = 0;
+    size_t vertexBytesAfter = 0;
+    size_t indexBytesBefore = 0;
+    size_t indexBytesAfter = 0;
+    // Of the levels of detail generated by generateLods (meshsimplify.hpp), in addition to the
+    // full meshes
+    size_t lods = 0;
+    size_t lodTriangles = 0;
+    size_t lodIndexBytes = 0;
+};
+
+// The chain of levels of detail generated for every primitive (see meshsimplify.hpp)
+struct LodSettings {
+    size_t levels = 3; // at most, in addition to the full mesh. 0 disables them.
+    float ratio = 0.5f; // of the triangles of a level, relative to the previous level
+    // The largest error (relative to the diagonal of the bounds, see Geometry::Lod) a level may
+    // have
+    float maxError = 0.05f;
+
+    bool operator==(const LodSettings&) const = default;
+};
+
+// A glTF 2.0 file with everything that has to be created from it: buffers are read, textures are
+// decoded (in the background, see TextureArrayBuilder) and the geometry is set up. Only the
+// scene structure is left for Lua (see gltf.lua). Indices into the arrays are 0-based.
+// The descriptions the GPU objects are created from are kept, so the asset can be written to
+// the scene cache (see scenecache.hpp).
+struct GltfAsset {
+    using Ptr = std::shared_ptr<GltfAsset>;
+
+    // Either a file or encoded image data (embedded in a buffer or a data URI)
+    struct Image {
+        std::string path;
+        BufferView::Ptr data;
+    };
+
+    // The indices are into `textures`
+    struct Material {
+        std::string name;
+        std::optional<size_t> albedo;
+        glm::vec4 color = glm::vec4(1.0f);
+        std::optional<size_t> metallicRoughness;
+        float metallicFactor = 1.0f;
+        float roughnessFactor = 1.0f;
+        std::optional<size_t> normal;
+        std::optional<size_t> occlusion;
+    };
+
+    struct VertexBuffer {
+        BufferView::Ptr data;
+        VertexFormat format;
+    };
+
+    struct Primitive {
+        std::vector<VertexBuffer> vertexBuffers;
+        BufferView::Ptr indexData;
+        glw::AttributeType indexType;
+        size_t indexOffset; // in bytes
+        size_t indexCount;
+        std::optional<Aabb> bounds;
+        std::optional<glm::mat4> vertexTransform; // see Geometry::setVertexTransform
+        std::vector<Geometry::Lod> lods; // offsets into indexData, see Geometry::setLods
+        size_t material;
+        Geometry::Ptr geometry; // see createGpuObjects
+    };
+
+    struct Mesh {
+        std::string name;
+        std::vector<Primitive> primitives;
+    };
+
+    struct Node {
+        std::string name;
+        std::optional<size_t> mesh;
+        std::optional<size_t> skin;
+        std::vector<size_t> children;
+        std::optional<glm::vec3> translation;
+        std::optional<glm::quat> rotation;
+        std::optional<glm::vec3> scale;
+    };
+
+    struct Skin {
+        std::vector<size_t> joints;
+        BufferView::Ptr inverseBindMatrices; // nullptr means identity
+    };
+
+    struct Channel {
+        size_t node;
+        std::string path;
+        Sampler::Type samplerType;
+        Interpolation interpolation;
+        BufferView::Ptr times;
+        BufferView::Ptr values;
+    };
+
+    struct Animation {
+        std::string name;
+        std::vector<Channel> channels;
+    };
+
+    std::vector<Image> images;
+    std::vector<size_t> textureImages; // image index for every texture
+    std::vector<Texture::Ptr> textures; // see createGpuObjects
+    std::vector<Material> materials;
+    std::vector<Mesh> meshes;
+    std::vector<Node> nodes;
+    std::vector<size_t> scene; // root nodes
+    std::vector<Skin> skins;
+    std::vector<Animation> animations;
+    // Every file the asset was read from (including images), for the scene cache
+    std::vector<std::string> files;
+    std::optional<MeshOptimizationStats> meshOptimization; // if the meshes were optimized
+    LodSettings lodSettings; // only used if the meshes were optimized
+
+    // .gltf or .glb (by extension). Dies if the file is invalid or uses features that are not
+    // supported. If `useCache` is true, an up to date scene cache is loaded instead of the
+    // file and a missing or stale one is written. If `optimize` is true, the meshes are
+    // optimized with optimizePrimitive and levels of detail are generated with generateLods.
+    [[nodiscard]] static Ptr load(const std::string& path, bool useCache = true,
+        bool optimize = true, const LodSettings& lodSettings = {});
+
+    // Creates `textures` and the geometry of every primitive from the descriptions
+    void createGpuObjects();
+};
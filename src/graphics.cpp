@@ -1,279 +1,2097 @@
 #include "graphics.hpp"
 
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+
+#include <cmrc/cmrc.hpp>
+CMRC_DECLARE(glslSource);
 
 #include "die.hpp"
+#include "image.hpp"
+#include "mappedfile.hpp"
+#include "threadpool.hpp"
+#include "util.hpp"
+#include "wtex.hpp"
 
 // Windows is so fucking stupid
 #undef near
 #undef far
 
-Texture::Ptr Texture::create(Buffer::Ptr buffer)
+GlTexture::GlTexture(GLenum target)
+    : target_(target)
 {
-    return std::shared_ptr<Texture>(
-        new Texture(std::static_pointer_cast<BufferBase>(std::move(buffer))));
+    glGenTextures(1, &texture_);
 }
 
-Texture::Ptr Texture::create(BufferView::Ptr buffer)
+GlTexture::~GlTexture()
 {
-    return std::shared_ptr<Texture>(
-        new Texture(std::static_pointer_cast<BufferBase>(std::move(buffer))));
+    if (texture_) {
+        glDeleteTextures(1, &texture_);
+    }
 }
 
-Texture::Ptr Texture::createPixel(const glm::vec4& color, size_t width, size_t height)
+GlTexture::GlTexture(GlTexture&& other)
+    : target_(other.target_)
+    , texture_(std::exchange(other.texture_, 0))
+{
+}
+
+GlTexture& GlTexture::operator=(GlTexture&& other)
+{
+    if (texture_) {
+        glDeleteTextures(1, &texture_);
+    }
+    target_ = other.target_;
+    texture_ = std::exchange(other.texture_, 0);
+    return *this;
+}
+
+GLenum GlTexture::getTarget() const
 {
-    return std::shared_ptr<Texture>(new Texture(glwx::makeTexture2D(color, width, height)));
+    return target_;
 }
 
-const glw::Texture& Texture::getGlTexture() const
+GLuint GlTexture::getTexture() const
 {
     return texture_;
 }
 
-Texture::Texture(BufferBase::Ptr buffer)
-    : buffer_(std::move(buffer))
+TextureArray::Ptr TextureArray::create(size_t width, size_t height, size_t layers, bool mipmaps)
+{
+    return std::shared_ptr<TextureArray>(new TextureArray(width, height, layers, mipmaps));
+}
+
+TextureArray::TextureArray(size_t width, size_t height, size_t layers, bool mipmaps)
+    // Shares the ids with Texture, because both are bound through the same state cache
+    : id_(nextId<Texture>())
+    , width_(width)
+    , height_(height)
+    , layers_(layers)
+    , mipmaps_(mipmaps)
+    , texture_(GL_TEXTURE_2D_ARRAY)
 {
-    auto texture = glwx::makeTexture2D(buffer_->data().data(), buffer_->data().size());
-    if (!texture) {
-        throw DieException(fmt::format("Could not load texture '{}'", buffer_->name()));
+    size_t levels = 1;
+    if (mipmaps_) {
+        while ((std::max(width_, height_) >> levels) > 0) {
+            levels++;
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_.getTexture());
+    size_t bytes = 0;
+    for (size_t level = 0; level < levels; ++level) {
+        const auto w = std::max<size_t>(width_ >> level, 1);
+        const auto h = std::max<size_t>(height_ >> level, 1);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, static_cast<GLint>(level), GL_RGBA8,
+            static_cast<GLsizei>(w), static_cast<GLsizei>(h), static_cast<GLsizei>(layers_), 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        bytes += w * h * layers_ * 4;
     }
-    texture_ = std::move(*texture);
+    gpuMemory_.set(static_cast<int64_t>(bytes));
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(levels - 1));
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+        mipmaps_ ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, mipmaps_ ? GL_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    StateCache::instance().invalidateTextures();
 }
 
-Texture::Texture(std::string path)
-    : Texture(Buffer::create(std::move(path)))
+void TextureArray::setLayer(size_t layer, const uint8_t* pixels)
+{
+    assert(layer < layers_);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_.getTexture());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, static_cast<GLint>(layer),
+        static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), 1, GL_RGBA, GL_UNSIGNED_BYTE,
+        pixels);
+    StateCache::instance().invalidateTextures();
+}
+
+void TextureArray::generateMipmaps()
+{
+    if (mipmaps_) {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture_.getTexture());
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        StateCache::instance().invalidateTextures();
+    }
+}
+
+size_t TextureArray::getWidth() const
+{
+    return width_;
+}
+
+size_t TextureArray::getHeight() const
+{
+    return height_;
+}
+
+size_t TextureArray::getLayerCount() const
+{
+    return layers_;
+}
+
+GLuint TextureArray::getGlTexture() const
 {
+    return texture_.getTexture();
 }
 
-Texture::Texture(glw::Texture texture)
-    : texture_(std::move(texture))
+uint32_t TextureArray::getId() const
 {
+    return id_;
 }
 
+// A texture that is decoded on the thread pool and then uploaded in slices
+struct TextureLoad {
+    BufferBase::Ptr buffer;
+    GLuint texture;
+    std::future<std::optional<std::vector<Image>>> decoded;
+    std::vector<Image> mips;
+    size_t baseLevel = 0; // Only the levels from here on are uploaded, the streamer does the rest
+    size_t level = 0;
+    size_t row = 0;
+    bool cancelled = false; // The texture was destroyed before it was uploaded
+    bool done = false;
+    bool fullResolution = false; // Upload all levels, because the texture will not be streamed
+    std::function<void(std::vector<Image>, size_t)> onDone; // Gets the mips and the base level
+};
+
+// All levels of a streamed texture on the CPU side, so they can be uploaded again. With
+// Residency::Reload the data is released when it's not needed and read again later.
+struct TextureSource {
+    TextureFormat format = TextureFormat::Rgba8;
+    std::vector<WtexLevel> levels; // The spans are empty while the data is released
+    std::vector<size_t> levelBytes;
+    std::optional<MappedFile> file; // Cooked textures point into the mapping
+    std::vector<Image> images; // Decoded textures point into these
+    TrackedMemory memory { MemoryCategory::DecodedTextures };
+    std::future<std::optional<std::vector<Image>>> reload;
+
+    bool isLoaded() const
+    {
+        return file || !images.empty();
+    }
+
+    void setImages(std::vector<Image> mips)
+    {
+        images = std::move(mips);
+        levels.clear();
+        levelBytes.clear();
+        for (const auto& image : images) {
+            levels.push_back(WtexLevel { image.width, image.height, image.pixels });
+            levelBytes.push_back(image.pixels.size());
+        }
+        memory.set(static_cast<int64_t>(getBytes(0)));
+    }
+
+    void setFile(MappedFile mapping, Wtex wtex)
+    {
+        format = wtex.format;
+        levels = std::move(wtex.levels);
+        levelBytes.clear();
+        for (const auto& level : levels) {
+            levelBytes.push_back(level.data.size());
+        }
+        file = std::move(mapping);
+    }
+
+    void release()
+    {
+        file.reset();
+        images.clear();
+        images.shrink_to_fit();
+        for (auto& level : levels) {
+            level.data = {};
+        }
+        memory.set(0);
+    }
+
+    // Of all levels from `level` on
+    size_t getBytes(size_t level) const
+    {
+        size_t bytes = 0;
+        for (size_t l = level; l < levelBytes.size(); ++l) {
+            bytes += levelBytes[l];
+        }
+        return bytes;
+    }
+};
+
 namespace {
-struct Line {
-    std::string_view line;
-    size_t afterNewline;
+struct TextureUploader {
+    std::vector<std::shared_ptr<TextureLoad>> loads;
+    GLuint pbo = 0;
+    size_t pboSize = 0;
 };
 
-Line getLine(std::string_view str, size_t cursor)
+TextureUploader& getTextureUploader()
 {
-    const auto nl = std::min(str.size(), str.find_first_of("\n\r", cursor));
-    const auto line = str.substr(cursor, nl - cursor);
-    auto afterNewline = nl;
-    if (afterNewline < str.size() && str[afterNewline] == '\n')
-        afterNewline++;
-    if (afterNewline < str.size() && str[afterNewline] == '\r')
-        afterNewline++;
-    return Line { line, afterNewline };
+    static TextureUploader uploader;
+    return uploader;
 }
 
-std::string_view trim(std::string_view str)
+// For 2D textures bound to GL_TEXTURE_2D. The levels below `baseLevel` are not defined (yet).
+void setTextureParameters(size_t baseLevel, size_t levels)
 {
-    const auto start = str.find_first_not_of(" \t\r\n");
-    if (start == std::string_view::npos) {
-        return {};
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, static_cast<GLint>(baseLevel));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(levels - 1));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+}
+
+void allocateTextureStorage(TextureLoad& load)
+{
+    glBindTexture(GL_TEXTURE_2D, load.texture);
+    for (size_t level = load.baseLevel; level < load.mips.size(); ++level) {
+        const auto& mip = load.mips[level];
+        glTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(level), GL_RGBA8,
+            static_cast<GLsizei>(mip.width), static_cast<GLsizei>(mip.height), 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, nullptr);
     }
-    const auto end = str.find_last_not_of(" \t\r\n");
-    return str.substr(start, end - start + 1);
+    setTextureParameters(load.baseLevel, load.mips.size());
 }
 
-std::string getDirectory(std::string_view path)
+// Textures are first uploaded only up to this size, so they show up quickly
+constexpr size_t initialStreamingSize = 128;
+
+template <typename Level>
+size_t getInitialLevel(const std::vector<Level>& levels)
 {
-    const auto lastSep = path.rfind('/');
-    if (lastSep == std::string_view::npos) {
-        return "./";
+    size_t level = 0;
+    while (level + 1 < levels.size()
+        && std::max(levels[level].width, levels[level].height) > initialStreamingSize) {
+        level++;
     }
-    return std::string(path.substr(0, lastSep + 1));
+    return level;
 }
 
-std::optional<std::string> resolveIncludes(std::string_view src, const std::string& filePath)
+bool hasExtension(std::string_view name)
 {
-    std::string output;
-    output.reserve(src.size());
-    size_t cursor = 0;
-    size_t start = 0;
-    size_t lineNumber = 1;
-    while (cursor < src.size()) {
-        cursor = src.find_first_not_of(" \t", cursor);
-        if (cursor >= src.size())
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+        const auto ext = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+        if (ext && name == ext) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The S3TC enums are not part of core GL
+constexpr GLenum compressedRgbS3tcDxt1 = 0x83F0; // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+constexpr GLenum compressedRgbaS3tcDxt5 = 0x83F3; // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+
+GLenum getGlInternalFormat(TextureFormat format)
+{
+    switch (format) {
+    case TextureFormat::Bc1:
+        return compressedRgbS3tcDxt1;
+    case TextureFormat::Bc3:
+        return compressedRgbaS3tcDxt5;
+    case TextureFormat::Bc5:
+        return GL_COMPRESSED_RG_RGTC2;
+    default:
+        return GL_RGBA8;
+    }
+}
+
+bool isTextureFormatSupported(TextureFormat format)
+{
+    // RGTC (BC4/BC5) is core since 3.0
+    static const auto s3tc = hasExtension("GL_EXT_texture_compression_s3tc");
+    return s3tc || (format != TextureFormat::Bc1 && format != TextureFormat::Bc3);
+}
+
+void uploadTextureLevel(TextureFormat format, size_t level, const WtexLevel& data)
+{
+    const auto width = static_cast<GLsizei>(data.width);
+    const auto height = static_cast<GLsizei>(data.height);
+    if (format == TextureFormat::Rgba8) {
+        glTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(level), GL_RGBA8, width, height, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, data.data.data());
+    } else {
+        glCompressedTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(level),
+            getGlInternalFormat(format), width, height, 0, static_cast<GLsizei>(data.data.size()),
+            data.data.data());
+    }
+}
+
+bool isCookedUpToDate(const std::string& sourcePath, const std::string& cookedPath)
+{
+    std::error_code ec;
+    const auto cookedTime = std::filesystem::last_write_time(cookedPath, ec);
+    if (ec) {
+        return false;
+    }
+    const auto sourceTime = std::filesystem::last_write_time(sourcePath, ec);
+    // If only the cooked texture is shipped, it's always up to date
+    return ec || cookedTime >= sourceTime;
+}
+
+const Texture& getPlaceholderTexture()
+{
+    static const auto placeholder = Texture::createPixel(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
+    return *placeholder;
+}
+}
+
+size_t updateTextureUploads(size_t maxBytes)
+{
+    auto& uploader = getTextureUploader();
+
+    struct Slice {
+        TextureLoad* load;
+        size_t level;
+        size_t row;
+        size_t rows;
+        size_t offset; // in the PBO
+    };
+    std::vector<Slice> slices;
+    size_t total = 0;
+    for (const auto& load : uploader.loads) {
+        if (total >= maxBytes) {
             break;
-        const auto [line, afterNewline] = getLine(src, cursor);
-        if (line.size() > 0 && line[0] == '#') {
-            const auto trimmed = trim(line.substr(1));
-            const auto directiveEnd = trimmed.find_first_not_of("include");
-            const auto directive = trimmed.substr(0, directiveEnd);
-            if (directive == "include") {
-                const auto arg = trim(trimmed.substr(directiveEnd));
-                std::string path;
-                if (arg.size() > 1 && arg[0] == '"' && arg[arg.size() - 1] == '"') {
-                    // relative include
-                    path = getDirectory(filePath);
-                    path.append(arg.substr(1, arg.size() - 2));
-                } else if (arg.size() > 1 && arg[0] == '<' && arg[arg.size() - 1] == '>') {
-                    // absolute include
-                    path = arg.substr(1, arg.size() - 2);
-                } else {
-                    fmt::print(
-                        stderr, "Invalid argument '{}' for #include in line {}", arg, lineNumber);
-                    return std::nullopt;
-                }
-                const auto included = glwx::readFile(path);
-                if (!included) {
-                    fmt::print(stderr, "Could not load included shader: {}", path);
-                    return std::nullopt;
-                }
-                output.append(src.substr(start, cursor - start));
-                output.append("#line 1\n");
-                output.append(*included);
-                output.append("\n#line ");
-                output.append(std::to_string(lineNumber + 1));
-                output.append("\n");
-                start = afterNewline;
+        }
+        if (load->cancelled) {
+            continue;
+        }
+        if (load->mips.empty()) {
+            using namespace std::chrono_literals;
+            if (load->decoded.wait_for(0s) != std::future_status::ready) {
+                continue;
+            }
+            auto mips = load->decoded.get();
+            if (!mips) {
+                die("Could not load texture '{}'", load->buffer->name());
+            }
+            load->mips = std::move(*mips);
+            load->baseLevel = load->fullResolution ? 0 : getInitialLevel(load->mips);
+            load->level = load->baseLevel;
+            allocateTextureStorage(*load);
+        }
+        // Plan everything first, so the PBO can be mapped once
+        auto level = load->level, row = load->row;
+        while (level < load->mips.size() && total < maxBytes) {
+            const auto& mip = load->mips[level];
+            const auto rowSize = mip.width * 4;
+            // At least one row, so large textures can not get stuck
+            const auto rows
+                = std::clamp<size_t>((maxBytes - total) / rowSize, 1, mip.height - row);
+            slices.push_back(Slice { load.get(), level, row, rows, total });
+            total += rows * rowSize;
+            row += rows;
+            if (row == mip.height) {
+                level++;
+                row = 0;
             }
         }
-        cursor = afterNewline;
-        lineNumber++;
     }
-    output.append(src.substr(start));
-    return output;
+
+    if (!slices.empty()) {
+        if (!uploader.pbo) {
+            glGenBuffers(1, &uploader.pbo);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploader.pbo);
+        // Orphaning every time means we never wait for the previous upload to finish
+        uploader.pboSize = std::max(uploader.pboSize, total);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, uploader.pboSize, nullptr, GL_STREAM_DRAW);
+        auto ptr = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        for (const auto& slice : slices) {
+            const auto& mip = slice.load->mips[slice.level];
+            const auto rowSize = mip.width * 4;
+            std::memcpy(ptr + slice.offset, mip.pixels.data() + slice.row * rowSize,
+                slice.rows * rowSize);
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (const auto& slice : slices) {
+            const auto& mip = slice.load->mips[slice.level];
+            glBindTexture(GL_TEXTURE_2D, slice.load->texture);
+            glTexSubImage2D(GL_TEXTURE_2D, static_cast<GLint>(slice.level), 0,
+                static_cast<GLint>(slice.row), static_cast<GLsizei>(mip.width),
+                static_cast<GLsizei>(slice.rows), GL_RGBA, GL_UNSIGNED_BYTE,
+                reinterpret_cast<const void*>(slice.offset));
+            slice.load->level = slice.level;
+            slice.load->row = slice.row + slice.rows;
+            if (slice.load->row == mip.height) {
+                slice.load->level++;
+                slice.load->row = 0;
+            }
+        }
+        // Otherwise other texture uploads would read from the PBO
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        StateCache::instance().invalidateTextures();
+    }
+
+    for (const auto& load : uploader.loads) {
+        if (!load->cancelled && !load->mips.empty() && load->level == load->mips.size()) {
+            load->done = true;
+            load->onDone(std::move(load->mips), load->baseLevel);
+        }
+    }
+    std::erase_if(uploader.loads,
+        [](const std::shared_ptr<TextureLoad>& load) { return load->done || load->cancelled; });
+    return total;
 }
+
+void finishTextureUploads()
+{
+    for (const auto& load : getTextureUploader().loads) {
+        if (!load->cancelled && load->mips.empty()) {
+            load->decoded.wait();
+        }
+    }
+    updateTextureUploads(std::numeric_limits<size_t>::max());
 }
 
-Shader::Ptr Shader::create(Buffer::Ptr vert, Buffer::Ptr frag)
+size_t getPendingTextureUploads()
 {
-    return std::shared_ptr<Shader>(new Shader(std::static_pointer_cast<BufferBase>(std::move(vert)),
-        std::static_pointer_cast<BufferBase>(std::move(frag))));
+    return getTextureUploader().loads.size();
+}
+
+Texture::Ptr Texture::create(Buffer::Ptr buffer)
+{
+    return std::shared_ptr<Texture>(
+        new Texture(std::static_pointer_cast<BufferBase>(std::move(buffer))));
+}
+
+Texture::Ptr Texture::create(BufferView::Ptr buffer)
+{
+    return std::shared_ptr<Texture>(
+        new Texture(std::static_pointer_cast<BufferBase>(std::move(buffer))));
+}
+
+Texture::Ptr Texture::createPixel(const glm::vec4& color, size_t width, size_t height)
+{
+    std::array<uint8_t, 4> pixel;
+    for (size_t i = 0; i < 4; ++i) {
+        pixel[i] = static_cast<uint8_t>(std::clamp(color[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    std::vector<uint8_t> pixels(width * height * 4);
+    for (size_t i = 0; i < width * height; ++i) {
+        std::memcpy(pixels.data() + i * 4, pixel.data(), 4);
+    }
+
+    GlTexture texture(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, texture.getTexture());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, static_cast<GLsizei>(width),
+        static_cast<GLsizei>(height), 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    StateCache::instance().invalidateTextures();
+    return std::shared_ptr<Texture>(new Texture(std::move(texture)));
+}
+
+Texture::Ptr Texture::createLayer(TextureArray::Ptr array, size_t layer)
+{
+    return std::shared_ptr<Texture>(new Texture(std::move(array), layer));
+}
+
+Texture::Ptr Texture::createPixelLayer(const glm::vec4& color)
+{
+    static constexpr size_t poolSize = 256;
+    static TextureArray::Ptr pool;
+    static size_t poolUsed = 0;
+    // Colors are quantized to RGBA8 anyway, so textures with the same color can be shared
+    static std::unordered_map<uint32_t, Texture::Ptr> layers;
+
+    std::array<uint8_t, 4> pixel;
+    for (size_t i = 0; i < 4; ++i) {
+        pixel[i] = static_cast<uint8_t>(std::clamp(color[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    uint32_t key = 0;
+    std::memcpy(&key, pixel.data(), sizeof(key));
+    if (const auto it = layers.find(key); it != layers.end()) {
+        return it->second;
+    }
+
+    if (!pool || poolUsed == poolSize) {
+        pool = TextureArray::create(1, 1, poolSize, false);
+        poolUsed = 0;
+    }
+    pool->setLayer(poolUsed, pixel.data());
+    auto texture = createLayer(pool, poolUsed++);
+    layers.emplace(key, texture);
+    return texture;
+}
+
+Texture::~Texture()
+{
+    if (load_) {
+        load_->cancelled = true;
+    }
+    if (source_) {
+        TextureStreamer::instance().remove(this);
+    }
+}
+
+uint32_t Texture::getId() const
+{
+    return id_;
+}
+
+bool Texture::isResident() const
+{
+    return !load_ || load_->done;
+}
+
+bool Texture::isLayer() const
+{
+    return array_ != nullptr;
+}
+
+size_t Texture::getLayer() const
+{
+    return layer_;
+}
+
+TextureBinding Texture::getBinding(size_t unit) const
+{
+    if (array_) {
+        return TextureBinding {
+            unit, array_->getId(), GL_TEXTURE_2D_ARRAY, array_->getGlTexture()
+        };
+    }
+    if (!isResident()) {
+        return getPlaceholderTexture().getBinding(unit);
+    }
+    return TextureBinding { unit, id_, GL_TEXTURE_2D, texture_.getTexture() };
+}
+
+bool Texture::isStreamed() const
+{
+    return source_ != nullptr;
+}
+
+size_t Texture::getLevelCount() const
+{
+    return source_ ? source_->levels.size() : 1;
+}
+
+size_t Texture::getResidentLevel() const
+{
+    return residentLevel_;
+}
+
+size_t Texture::getTargetLevel() const
+{
+    return targetLevel_;
+}
+
+size_t Texture::getResidentBytes() const
+{
+    return source_ ? source_->getBytes(residentLevel_) : 0;
+}
+
+void Texture::reportUsage(float screenSize)
+{
+    usage_ = std::max(usage_, screenSize);
+}
+
+void Texture::setResidency(Residency residency)
+{
+    residency_ = residency;
+    if (load_ && !load_->done) {
+        load_->fullResolution = residency_ == Residency::DropAfterUpload;
+    }
+    // Streamed textures are raised to full resolution first (see TextureStreamer::update)
+    if (!source_ && residency_ != Residency::Keep) {
+        buffer_.reset();
+    }
+}
+
+Residency Texture::getResidency() const
+{
+    return residency_;
+}
+
+Texture::Texture(BufferBase::Ptr buffer)
+    : id_(nextId<Texture>())
+    , buffer_(std::move(buffer))
+    , fileRange_(buffer_->getFileRange())
+{
+    startLoad();
+}
+
+Texture::Texture(std::string path)
+    : id_(nextId<Texture>())
+{
+    const auto cookedPath = getCookedPath(path);
+    if (isCookedUpToDate(path, cookedPath) && loadCooked(cookedPath)) {
+        return;
+    }
+    buffer_ = Buffer::create(std::move(path));
+    fileRange_ = buffer_->getFileRange();
+    startLoad();
+}
+
+void Texture::startLoad()
+{
+    texture_ = GlTexture(GL_TEXTURE_2D);
+    load_ = std::make_shared<TextureLoad>();
+    load_->buffer = buffer_;
+    load_->texture = texture_.getTexture();
+    load_->decoded
+        = getThreadPool().submit([buffer = buffer_]() -> std::optional<std::vector<Image>> {
+              auto image = Image::decode(buffer->data());
+              if (!image) {
+                  return std::nullopt;
+              }
+              return buildMipChain(std::move(*image));
+          });
+    // Only called if the texture is still alive
+    load_->onDone = [this](std::vector<Image> mips, size_t baseLevel) {
+        auto source = std::make_unique<TextureSource>();
+        source->setImages(std::move(mips));
+        // The encoded data is only needed to decode it again and it can be read from the file
+        if (residency_ == Residency::DropAfterUpload
+            || (residency_ == Residency::Reload && fileRange_)) {
+            buffer_.reset();
+        }
+        if (baseLevel == 0 && residency_ == Residency::DropAfterUpload) {
+            gpuMemory_.set(static_cast<int64_t>(source->getBytes(0)));
+        } else {
+            startStreaming(std::move(source), baseLevel);
+        }
+    };
+    getTextureUploader().loads.push_back(load_);
+}
+
+bool Texture::loadCooked(const std::string& path)
+{
+    auto source = std::make_unique<TextureSource>();
+    if (!mapCooked(path, *source)) {
+        return false;
+    }
+    if (!isTextureFormatSupported(source->format)) {
+        return false;
+    }
+
+    // Uploaded straight from the mapping, without any copies or decoding on our side. The
+    // mapping is kept until the streamer does not need it anymore (see Residency).
+    cookedPath_ = path;
+    const auto levelCount = source->levels.size();
+    const auto initialLevel = getInitialLevel(source->levels);
+    texture_ = GlTexture(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, texture_.getTexture());
+    setTextureParameters(levelCount - 1, levelCount);
+    // Nothing is resident yet
+    startStreaming(std::move(source), levelCount);
+    setResidentLevel(initialLevel);
+    targetLevel_ = initialLevel;
+    return true;
+}
+
+bool Texture::mapCooked(const std::string& path, TextureSource& source)
+{
+    auto file = MappedFile::open(path);
+    if (!file) {
+        return false;
+    }
+    auto wtex = parseWtex(file->data());
+    if (!wtex || wtex->levels.empty()) {
+        fmt::print(stderr, "Invalid cooked texture '{}'\n", path);
+        return false;
+    }
+    source.setFile(std::move(*file), std::move(*wtex));
+    return true;
+}
+
+void Texture::startStreaming(std::unique_ptr<TextureSource> source, size_t residentLevel)
+{
+    source_ = std::move(source);
+    residentLevel_ = residentLevel;
+    targetLevel_ = residentLevel;
+    gpuMemory_.set(static_cast<int64_t>(source_->getBytes(residentLevel_)));
+    TextureStreamer::instance().add(this);
+}
+
+void Texture::stopStreaming()
+{
+    TextureStreamer::instance().remove(this);
+    source_.reset();
+    buffer_.reset();
+}
+
+bool Texture::acquireSource()
+{
+    if (source_->isLoaded()) {
+        return true;
+    }
+    if (!cookedPath_.empty()) {
+        // Mapping is cheap enough to do it right away
+        return mapCooked(cookedPath_, *source_);
+    }
+    if (!source_->reload.valid()) {
+        assert(fileRange_);
+        source_->reload = getThreadPool().submit(
+            [range = *fileRange_]() -> std::optional<std::vector<Image>> {
+                const auto buffer = Buffer::create(range);
+                auto image = Image::decode(buffer->data());
+                if (!image) {
+                    return std::nullopt;
+                }
+                return buildMipChain(std::move(*image));
+            });
+        return false;
+    }
+    using namespace std::chrono_literals;
+    if (source_->reload.wait_for(0s) != std::future_status::ready) {
+        return false;
+    }
+    auto mips = source_->reload.get();
+    if (!mips) {
+        die("Could not reload texture '{}'", fileRange_->path);
+    }
+    source_->setImages(std::move(*mips));
+    return true;
+}
+
+void Texture::releaseSource()
+{
+    const auto reloadable = fileRange_ || !cookedPath_.empty();
+    if (residency_ == Residency::Reload && reloadable && source_->isLoaded()) {
+        source_->release();
+    }
+}
+
+void Texture::setResidentLevel(size_t level)
+{
+    assert(source_ && level < source_->levels.size());
+    glBindTexture(GL_TEXTURE_2D, texture_.getTexture());
+    if (level < residentLevel_) {
+        assert(source_->isLoaded());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (size_t l = level; l < residentLevel_; ++l) {
+            uploadTextureLevel(source_->format, l, source_->levels[l]);
+        }
+    }
+    // Levels below the base level are ignored for sampling and completeness, so they can be
+    // redefined as empty, which releases their memory.
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, static_cast<GLint>(level));
+    for (size_t l = residentLevel_; l < level; ++l) {
+        glTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(l), GL_RGBA8, 0, 0, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, nullptr);
+    }
+    StateCache::instance().invalidateTextures();
+    residentLevel_ = level;
+    gpuMemory_.set(static_cast<int64_t>(source_->getBytes(residentLevel_)));
+}
+
+Texture::Texture(GlTexture texture)
+    : id_(nextId<Texture>())
+    , texture_(std::move(texture))
+{
+}
+
+Texture::Texture(TextureArray::Ptr array, size_t layer)
+    : id_(nextId<Texture>())
+    , array_(std::move(array))
+    , layer_(layer)
+{
+    assert(layer_ < array_->getLayerCount());
+}
+
+TextureStreamer& TextureStreamer::instance()
+{
+    static TextureStreamer streamer;
+    return streamer;
+}
+
+void TextureStreamer::setBudget(size_t bytes)
+{
+    budget_ = bytes;
+}
+
+size_t TextureStreamer::getBudget() const
+{
+    return budget_;
+}
+
+void TextureStreamer::setLodBias(float bias)
+{
+    lodBias_ = bias;
+}
+
+void TextureStreamer::add(Texture* texture)
+{
+    textures_.push_back(texture);
+}
+
+void TextureStreamer::remove(Texture* texture)
+{
+    std::erase(textures_, texture);
+}
+
+size_t TextureStreamer::computeTargetLevel(const Texture& texture, float viewportHeight) const
+{
+    const auto maxLevel = texture.getLevelCount() - 1;
+    const auto pixels = texture.usage_ * viewportHeight;
+    if (pixels <= 0.0f) {
+        return maxLevel;
+    }
+    // Assumes the texture is mapped once onto one unit of the model, so one texel per pixel
+    // is needed at most. Everything else would need the UV derivatives of every triangle.
+    const auto& base = texture.source_->levels[0];
+    const auto size = static_cast<float>(std::max(base.width, base.height));
+    const auto level = std::floor(std::log2(size / pixels) + lodBias_);
+    return static_cast<size_t>(std::clamp(level, 0.0f, static_cast<float>(maxLevel)));
+}
+
+void TextureStreamer::update(size_t maxBytes)
+{
+    frame_++;
+    stats_ = TextureStreamingStats {};
+    stats_.budget = budget_;
+    stats_.textures = textures_.size();
+
+    std::array<GLint, 4> viewport = {};
+    glGetIntegerv(GL_VIEWPORT, viewport.data());
+    const auto viewportHeight = static_cast<float>(viewport[3]);
+
+    size_t residentBytes = 0;
+    for (auto texture : textures_) {
+        if (texture->usage_ > 0.0f) {
+            texture->lastUsedFrame_ = frame_;
+            texture->targetLevel_ = computeTargetLevel(*texture, viewportHeight);
+        } else {
+            // Unused textures keep what they have until the budget is exceeded
+            texture->targetLevel_ = texture->residentLevel_;
+        }
+        if (texture->residency_ == Residency::DropAfterUpload) {
+            // It can't be uploaded again, so it needs everything
+            texture->targetLevel_ = 0;
+        }
+        texture->usage_ = 0.0f;
+        residentBytes += texture->getResidentBytes();
+    }
+
+    // Raising a texture uploads only the new levels, they share maxBytes with the other uploads.
+    // One texture may exceed it, so large textures can not get stuck. Dropping levels only moves
+    // the base level of the texture, so it is free and does not need the data.
+    const auto canUpload = [&](size_t bytes) {
+        return stats_.uploadedBytes + bytes <= maxBytes
+            || (stats_.uploadedBytes == 0 && maxBytes > 0);
+    };
+    const auto canDrop = [&](const Texture* texture) {
+        return texture->residentLevel_ + 1 < texture->getLevelCount();
+    };
+
+    auto drop = [&](Texture* texture) {
+        const auto before = texture->getResidentBytes();
+        texture->setResidentLevel(texture->residentLevel_ + 1);
+        residentBytes = residentBytes - before + texture->getResidentBytes();
+        stats_.dropped++;
+    };
+
+    // First make room for the textures that want to be raised by dropping levels that are not
+    // needed right now, then, if still over budget, drop the ones that are. If maxBytes is used
+    // up, the rest is dropped in the next frames.
+    std::vector<Texture*> candidates;
+    for (auto texture : textures_) {
+        if (texture->residentLevel_ + 1 < texture->getLevelCount()
+            && texture->residency_ != Residency::DropAfterUpload) {
+            candidates.push_back(texture);
+        }
+    }
+    // Least recently used first, then the ones with the most resolution they don't need
+    const auto surplus = [](const Texture* texture) {
+        return static_cast<ptrdiff_t>(texture->targetLevel_)
+            - static_cast<ptrdiff_t>(texture->residentLevel_);
+    };
+    std::sort(candidates.begin(), candidates.end(), [&](const Texture* a, const Texture* b) {
+        if (a->lastUsedFrame_ != b->lastUsedFrame_) {
+            return a->lastUsedFrame_ < b->lastUsedFrame_;
+        }
+        return surplus(a) > surplus(b);
+    });
+
+    size_t wanted = 0;
+    for (const auto texture : textures_) {
+        if (texture->targetLevel_ < texture->residentLevel_) {
+            wanted += texture->source_->getBytes(texture->targetLevel_)
+                - texture->getResidentBytes();
+        }
+    }
+    for (auto texture : candidates) {
+        // Textures used this frame only lose the resolution they don't need
+        const auto minLevel = texture->lastUsedFrame_ == frame_ ? texture->targetLevel_
+                                                                : texture->getLevelCount() - 1;
+        while (residentBytes + wanted > budget_ && texture->residentLevel_ < minLevel
+            && canDrop(texture)) {
+            drop(texture);
+        }
+    }
+    for (auto texture : candidates) {
+        while (residentBytes > budget_ && canDrop(texture)) {
+            drop(texture);
+        }
+    }
+
+    // Largest deficit first
+    std::vector<Texture*> raise;
+    for (auto texture : textures_) {
+        if (texture->targetLevel_ < texture->residentLevel_) {
+            raise.push_back(texture);
+        }
+    }
+    std::sort(raise.begin(), raise.end(), [](const Texture* a, const Texture* b) {
+        return a->residentLevel_ - a->targetLevel_ > b->residentLevel_ - b->targetLevel_;
+    });
+    for (auto texture : raise) {
+        // Go straight to the target if possible, otherwise one level at a time
+        auto level = texture->targetLevel_;
+        const auto fits = [&](size_t l) {
+            const auto bytes = texture->source_->getBytes(l);
+            const auto resident = residentBytes - texture->getResidentBytes() + bytes;
+            return resident <= budget_ && canUpload(bytes - texture->getResidentBytes());
+        };
+        while (level + 1 < texture->residentLevel_ && !fits(level)) {
+            level++;
+        }
+        if (!fits(level) || !texture->acquireSource()) {
+            continue;
+        }
+        const auto before = texture->getResidentBytes();
+        texture->setResidentLevel(level);
+        residentBytes = residentBytes - before + texture->getResidentBytes();
+        stats_.uploadedBytes += texture->getResidentBytes() - before;
+        stats_.raised++;
+    }
+
+    std::vector<Texture*> finished;
+    for (const auto texture : textures_) {
+        if (texture->targetLevel_ < texture->residentLevel_) {
+            stats_.pending++;
+        } else if (texture->residency_ == Residency::DropAfterUpload) {
+            finished.push_back(texture);
+        } else if (texture->lastUsedFrame_ == frame_
+            || frame_ - texture->lastUsedFrame_ > releaseDelayFrames) {
+            // Textures that were just loaded have not been drawn yet, so their target is unknown
+            texture->releaseSource();
+        }
+    }
+    for (const auto texture : finished) {
+        texture->stopStreaming();
+    }
+    stats_.residentBytes = residentBytes;
+}
+
+const TextureStreamingStats& TextureStreamer::getStats() const
+{
+    return stats_;
+}
+
+size_t TextureArrayBuilder::add(Buffer::Ptr buffer)
+{
+    buffers_.push_back(std::move(buffer));
+    return buffers_.size() - 1;
+}
+
+size_t TextureArrayBuilder::add(BufferView::Ptr buffer)
+{
+    buffers_.push_back(std::move(buffer));
+    return buffers_.size() - 1;
+}
+
+size_t TextureArrayBuilder::add(std::string path)
+{
+    return add(Buffer::create(std::move(path)));
+}
+
+std::vector<Texture::Ptr> TextureArrayBuilder::build()
+{
+    std::vector<std::future<std::optional<Image>>> decoded;
+    for (const auto& buffer : buffers_) {
+        decoded.push_back(
+            getThreadPool().submit([buffer]() { return Image::decode(buffer->data()); }));
+    }
+
+    std::vector<Image> images;
+    images.reserve(buffers_.size());
+    // Sorted, so the arrays are created in a deterministic order
+    std::map<std::pair<size_t, size_t>, std::vector<size_t>> sizes;
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        auto image = decoded[i].get();
+        if (!image) {
+            throw DieException(fmt::format("Could not load texture '{}'", buffers_[i]->name()));
+        }
+        sizes[{ image->width, image->height }].push_back(images.size());
+        images.push_back(std::move(*image));
+    }
+
+    std::vector<Texture::Ptr> textures(images.size());
+    for (const auto& [size, indices] : sizes) {
+        auto array = TextureArray::create(size.first, size.second, indices.size(), true);
+        for (size_t layer = 0; layer < indices.size(); ++layer) {
+            array->setLayer(layer, images[indices[layer]].pixels.data());
+            textures[indices[layer]] = Texture::createLayer(array, layer);
+        }
+        array->generateMipmaps();
+    }
+    buffers_.clear();
+    return textures;
+}
+
+namespace {
+struct Line {
+    std::string_view line;
+    size_t afterNewline;
+};
+
+Line getLine(std::string_view str, size_t cursor)
+{
+    const auto nl = std::min(str.size(), str.find_first_of("\n\r", cursor));
+    const auto line = str.substr(cursor, nl - cursor);
+    auto afterNewline = nl;
+    if (afterNewline < str.size() && str[afterNewline] == '\n')
+        afterNewline++;
+    if (afterNewline < str.size() && str[afterNewline] == '\r')
+        afterNewline++;
+    return Line { line, afterNewline };
+}
+
+std::string_view trim(std::string_view str)
+{
+    const auto start = str.find_first_not_of(" \t\r\n");
+    if (start == std::string_view::npos) {
+        return {};
+    }
+    const auto end = str.find_last_not_of(" \t\r\n");
+    return str.substr(start, end - start + 1);
+}
+
+std::string getDirectory(std::string_view path)
+{
+    const auto lastSep = path.rfind('/');
+    if (lastSep == std::string_view::npos) {
+        return "./";
+    }
+    return std::string(path.substr(0, lastSep + 1));
+}
+
+std::optional<std::string> readInclude(const std::string& path)
+{
+    // Built-in includes take precedence
+    static const auto resFs = cmrc::glslSource::get_filesystem();
+    if (resFs.is_file(path)) {
+        const auto file = resFs.open(path);
+        return std::string(file.begin(), file.end());
+    }
+    return glwx::readFile(path);
+}
+
+std::optional<std::string> resolveIncludes(std::string_view src, const std::string& filePath)
+{
+    std::string output;
+    output.reserve(src.size());
+    size_t cursor = 0;
+    size_t start = 0;
+    size_t lineNumber = 1;
+    while (cursor < src.size()) {
+        cursor = src.find_first_not_of(" \t", cursor);
+        if (cursor >= src.size())
+            break;
+        const auto [line, afterNewline] = getLine(src, cursor);
+        if (line.size() > 0 && line[0] == '#') {
+            const auto trimmed = trim(line.substr(1));
+            const auto directiveEnd = trimmed.find_first_not_of("include");
+            const auto directive = trimmed.substr(0, directiveEnd);
+            if (directive == "include") {
+                const auto arg = trim(trimmed.substr(directiveEnd));
+                std::string path;
+                bool absolute = false;
+                if (arg.size() > 1 && arg[0] == '"' && arg[arg.size() - 1] == '"') {
+                    // relative include
+                    path = getDirectory(filePath);
+                    path.append(arg.substr(1, arg.size() - 2));
+                } else if (arg.size() > 1 && arg[0] == '<' && arg[arg.size() - 1] == '>') {
+                    // absolute include
+                    path = arg.substr(1, arg.size() - 2);
+                    absolute = true;
+                } else {
+                    fmt::print(
+                        stderr, "Invalid argument '{}' for #include in line {}", arg, lineNumber);
+                    return std::nullopt;
+                }
+                const auto included = absolute ? readInclude(path) : glwx::readFile(path);
+                if (!included) {
+                    fmt::print(stderr, "Could not load included shader: {}", path);
+                    return std::nullopt;
+                }
+                output.append(src.substr(start, cursor - start));
+                output.append("#line 1\n");
+                output.append(*included);
+                output.append("\n#line ");
+                output.append(std::to_string(lineNumber + 1));
+                output.append("\n");
+                start = afterNewline;
+            }
+        }
+        cursor = afterNewline;
+        lineNumber++;
+    }
+    output.append(src.substr(start));
+    return output;
+}
+
+// Binding points of the built-in blocks in womf.glsl
+constexpr GLuint frameUniformBinding = 0;
+constexpr GLuint objectUniformBinding = 1;
+constexpr GLuint objectStorageBinding = 0; // WOMF_MULTI_DRAW
+
+// Returns whether the program reads its object uniforms from the storage block (multi-draw)
+bool bindBuiltinBlocks(const glw::ShaderProgram& prog)
+{
+    const auto bindBlock = [&prog](const char* name, GLuint binding) {
+        const auto index = glGetUniformBlockIndex(prog.getProgram(), name);
+        if (index != GL_INVALID_INDEX) {
+            glUniformBlockBinding(prog.getProgram(), index, binding);
+        }
+    };
+    bindBlock("WomfFrame", frameUniformBinding);
+    bindBlock("WomfObject", objectUniformBinding);
+
+    if (!isMultiDrawSupported()) {
+        return false;
+    }
+    const auto index
+        = glGetProgramResourceIndex(prog.getProgram(), GL_SHADER_STORAGE_BLOCK, "WomfObjects");
+    if (index == GL_INVALID_INDEX) {
+        return false;
+    }
+    glShaderStorageBlockBinding(prog.getProgram(), index, objectStorageBinding);
+    return true;
+}
+}
+
+Shader::Ptr Shader::create(Buffer::Ptr vert, Buffer::Ptr frag)
+{
+    return std::shared_ptr<Shader>(new Shader(std::static_pointer_cast<BufferBase>(std::move(vert)),
+        std::static_pointer_cast<BufferBase>(std::move(frag))));
+}
+
+Shader::Ptr Shader::create(Buffer::Ptr combined)
+{
+    return std::shared_ptr<Shader>(
+        new Shader(std::static_pointer_cast<BufferBase>(std::move(combined))));
+}
+
+const glw::ShaderProgram& Shader::getProgram() const
+{
+    return prog_;
+}
+
+const UniformLayout& Shader::getUniformLayout() const
+{
+    return uniformLayout_;
+}
+
+uint32_t Shader::getId() const
+{
+    return id_;
+}
+
+bool Shader::isMultiDraw() const
+{
+    return multiDraw_;
+}
+
+void Shader::initialize(std::string_view vert, std::string_view vertPath, std::string_view frag,
+    std::string_view fragPath)
+{
+    auto vertFull = resolveIncludes(vert, std::string(vertPath));
+    if (!vertFull) {
+        throw DieException(fmt::format("Could not resolve includes for shader: {}", vertPath));
+    }
+
+    auto fragFull = resolveIncludes(frag, std::string(fragPath));
+    if (!fragFull) {
+        throw DieException(fmt::format("Could not resolve includes for shader: {}", fragPath));
+    }
+
+    auto prog = glwx::makeShaderProgram(*vertFull, *fragFull);
+    if (!prog) {
+        throw DieException(
+            fmt::format("Could not create shader '{}' (vert) / '{}' (frag)", vertPath, fragPath));
+    }
+    prog_ = std::move(*prog);
+
+    multiDraw_ = bindBuiltinBlocks(prog_);
+    uniformLayout_ = UniformLayout::compile(prog_);
+    // Compiling the layout bound the program
+    StateCache::instance().invalidateProgram();
+}
+
+Shader::Shader(BufferBase::Ptr vert, BufferBase::Ptr frag)
+    : id_(nextId<Shader>())
+{
+    const std::string_view vertSv(
+        reinterpret_cast<const char*>(vert->data().data()), vert->data().size());
+
+    const std::string_view fragSv(
+        reinterpret_cast<const char*>(frag->data().data()), frag->data().size());
+
+    initialize(vertSv, vert->path(), fragSv, frag->path());
+}
+
+Shader::Shader(BufferBase::Ptr combined)
+    : id_(nextId<Shader>())
+{
+    const std::string_view sv(
+        reinterpret_cast<const char*>(combined->data().data()), combined->data().size());
+    std::string vert = "#define VERTEX_SHADER\n" + std::string(sv);
+    std::string frag = "#define FRAGMENT_SHADER\n#define FROGMENT_SHADER\n" + std::string(sv);
+
+    initialize(vert, combined->path(), frag, combined->path());
+}
+
+Shader::Shader(std::string vertPath, std::string fragPath)
+    : Shader(Buffer::create(vertPath), Buffer::create(fragPath))
+{
+}
+
+Shader::Shader(std::string combined)
+    : Shader(Buffer::create(combined))
+{
+}
+
+GraphicsBuffer::Ptr GraphicsBuffer::create(
+    BufferTarget target, BufferUsage usage, Buffer::Ptr buffer)
+{
+    return std::shared_ptr<GraphicsBuffer>(
+        new GraphicsBuffer(target, usage, std::static_pointer_cast<BufferBase>(std::move(buffer))));
+}
+
+GraphicsBuffer::Ptr GraphicsBuffer::create(
+    BufferTarget target, BufferUsage usage, BufferView::Ptr buffer)
+{
+    return std::shared_ptr<GraphicsBuffer>(
+        new GraphicsBuffer(target, usage, std::static_pointer_cast<BufferBase>(std::move(buffer))));
+}
+
+GraphicsBuffer::Ptr GraphicsBuffer::create(
+    BufferTarget target, BufferUsage usage, std::string filename)
+{
+    return std::shared_ptr<GraphicsBuffer>(new GraphicsBuffer(target, usage, std::move(filename)));
+}
+
+namespace {
+GraphicsBuffer::Stats graphicsBufferStats;
+
+// Keyed by path, offset and size of the file range
+using FileRangeKey = std::tuple<std::string, size_t, size_t>;
+std::map<FileRangeKey, std::weak_ptr<GraphicsBuffer>>& getSharedGraphicsBuffers()
+{
+    static std::map<FileRangeKey, std::weak_ptr<GraphicsBuffer>> buffers;
+    return buffers;
+}
+}
+
+GraphicsBuffer::Ptr GraphicsBuffer::getShared(
+    BufferTarget target, BufferUsage usage, Buffer::Ptr buffer)
+{
+    return getShared(target, usage, std::static_pointer_cast<BufferBase>(std::move(buffer)));
+}
+
+GraphicsBuffer::Ptr GraphicsBuffer::getShared(
+    BufferTarget target, BufferUsage usage, BufferView::Ptr buffer)
+{
+    return getShared(target, usage, std::static_pointer_cast<BufferBase>(std::move(buffer)));
+}
+
+GraphicsBuffer::Ptr GraphicsBuffer::getShared(
+    BufferTarget target, BufferUsage usage, BufferBase::Ptr buffer)
+{
+    const auto range = buffer->getFileRange();
+    if (!range) {
+        return std::shared_ptr<GraphicsBuffer>(
+            new GraphicsBuffer(target, usage, std::move(buffer)));
+    }
+    // The target and usage are only used for the upload, so they don't have to match
+    auto& weak = getSharedGraphicsBuffers()[{ range->path, range->offset, range->size }];
+    if (auto shared = weak.lock()) {
+        graphicsBufferStats.shared++;
+        return shared;
+    }
+    auto created
+        = std::shared_ptr<GraphicsBuffer>(new GraphicsBuffer(target, usage, std::move(buffer)));
+    weak = created;
+    return created;
+}
+
+const GraphicsBuffer::Stats& GraphicsBuffer::getStats()
+{
+    return graphicsBufferStats;
+}
+
+GraphicsBuffer::~GraphicsBuffer()
+{
+    graphicsBufferStats.buffers--;
+    if (fileRange_) {
+        auto& shared = getSharedGraphicsBuffers();
+        const auto it = shared.find({ fileRange_->path, fileRange_->offset, fileRange_->size });
+        if (it != shared.end() && it->second.expired()) {
+            shared.erase(it);
+        }
+    }
+}
+
+glw::Buffer& GraphicsBuffer::getGlBuffer()
+{
+    return gfxBuffer_;
+}
+
+size_t GraphicsBuffer::getSize() const
+{
+    return size_;
+}
+
+uint32_t GraphicsBuffer::getId() const
+{
+    return id_;
+}
+
+void GraphicsBuffer::setResidency(Residency residency)
+{
+    dieAssert(residency != Residency::Keep || buffer_ || fileRange_,
+        "Can not keep the data of buffer {}, it has been dropped and does not come from a file",
+        id_);
+    residency_ = residency;
+    if (residency_ == Residency::Keep && !buffer_) {
+        buffer_ = Buffer::create(*fileRange_);
+    } else if (residency_ == Residency::DropAfterUpload
+        || (residency_ == Residency::Reload && fileRange_)) {
+        buffer_.reset();
+    }
+}
+
+Residency GraphicsBuffer::getResidency() const
+{
+    return residency_;
+}
+
+void GraphicsBuffer::reupload()
+{
+    auto buffer = buffer_;
+    if (!buffer && fileRange_ && residency_ == Residency::Reload) {
+        buffer = Buffer::create(*fileRange_);
+    }
+    dieAssert(buffer != nullptr, "Can not upload buffer {} again, its data has been dropped", id_);
+    upload(*buffer);
+}
+
+void GraphicsBuffer::upload(const BufferBase& buffer)
+{
+    gfxBuffer_.data(static_cast<glw::Buffer::Target>(target_),
+        static_cast<glw::Buffer::UsageHint>(usage_), buffer.data().data(), buffer.data().size());
+    graphicsBufferStats.uploads++;
+    graphicsBufferStats.uploadedBytes += buffer.data().size();
+}
+
+GraphicsBuffer::GraphicsBuffer(BufferTarget target, BufferUsage usage, BufferBase::Ptr buffer)
+    : id_(nextId<GraphicsBuffer>())
+    , target_(target)
+    , usage_(usage)
+    , buffer_(std::move(buffer))
+    , size_(buffer_->size())
+    , fileRange_(buffer_->getFileRange())
+    , gpuMemory_(MemoryCategory::GpuBuffers, static_cast<int64_t>(size_))
+{
+    graphicsBufferStats.buffers++;
+    upload(*buffer_);
+    setResidency(residency_);
+}
+
+GraphicsBuffer::GraphicsBuffer(BufferTarget target, BufferUsage usage, std::string filename)
+    : GraphicsBuffer(target, usage, Buffer::create(std::move(filename)))
+{
+}
+
+size_t getAttributeTypeSize(glw::AttributeType type)
+{
+    switch (type) {
+    case glw::AttributeType::I8:
+    case glw::AttributeType::U8:
+        return 1;
+    case glw::AttributeType::I16:
+    case glw::AttributeType::U16:
+    case glw::AttributeType::F16:
+        return 2;
+    case glw::AttributeType::I32:
+    case glw::AttributeType::U32:
+    case glw::AttributeType::F32:
+        return 4;
+    case glw::AttributeType::F64:
+        return 8;
+    default:
+        assert(false && "Invalid attribute type");
+        return 0;
+    }
+}
+
+VertexFormat& VertexFormat::add(
+    size_t location, size_t components, glw::AttributeType type, bool normalized)
+{
+    return add(location, components, type, normalized, stride_);
+}
+
+VertexFormat& VertexFormat::add(size_t location, size_t components, glw::AttributeType type,
+    bool normalized, size_t offset)
+{
+    while (components > 0) {
+        const auto num = std::min<size_t>(components, 4);
+        attributes_.push_back(Attribute { location, num, type, normalized, offset });
+        // Keep attributes 4-byte aligned
+        offset += type == packedI10Type ? 4 : (num * getAttributeTypeSize(type) + 3) / 4 * 4;
+        if (!explicitStride_) {
+            stride_ = std::max(stride_, offset);
+        }
+        components -= num;
+        location++;
+    }
+    return *this;
+}
+
+VertexFormat& VertexFormat::setStride(size_t stride)
+{
+    stride_ = stride;
+    explicitStride_ = true;
+    return *this;
+}
+
+const std::vector<VertexFormat::Attribute>& VertexFormat::getAttributes() const
+{
+    return attributes_;
+}
+
+size_t VertexFormat::getStride() const
+{
+    return stride_;
+}
+
+void VertexFormat::set(size_t baseOffset) const
+{
+    for (const auto& attr : attributes_) {
+        const auto loc = static_cast<GLuint>(attr.location);
+        glEnableVertexAttribArray(loc);
+        glVertexAttribPointer(loc, static_cast<GLint>(attr.components),
+            static_cast<GLenum>(attr.type), attr.normalized ? GL_TRUE : GL_FALSE,
+            static_cast<GLsizei>(stride_),
+            reinterpret_cast<const void*>(baseOffset + attr.offset));
+        glVertexAttribDivisor(loc, attr.location >= firstInstanceAttributeLocation ? 1 : 0);
+    }
+}
+
+StreamBuffer& StreamBuffer::instance()
+{
+    // Enough for the uniforms of a few thousand draws, it grows if necessary
+    static StreamBuffer buffer(4 * 1024 * 1024);
+    return buffer;
+}
+
+StreamBuffer::StreamBuffer(size_t capacity)
+    : persistent_(hasExtension("GL_ARB_buffer_storage"))
+    , capacity_(capacity)
+{
+    createBuffer();
+    stats_ = Stats { persistent_, capacity_ };
+}
+
+StreamBuffer::~StreamBuffer()
+{
+    for (auto& fence : fences_) {
+        if (fence) {
+            glDeleteSync(fence);
+        }
+    }
+    for (const auto& [buffer, fence] : retired_) {
+        if (fence) {
+            glDeleteSync(fence);
+        }
+        glDeleteBuffers(1, &buffer);
+    }
+    glDeleteBuffers(1, &buffer_);
+}
+
+void StreamBuffer::createBuffer()
+{
+    // GL_COPY_WRITE_BUFFER, so no bindings that are used for drawing are touched
+    glGenBuffers(1, &buffer_);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+    if (persistent_) {
+        const auto size = static_cast<GLsizeiptr>(capacity_ * framesInFlight);
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+        mapping_ = static_cast<uint8_t*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags));
+    } else {
+        glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(capacity_), nullptr,
+            GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    gpuMemory_.set(static_cast<int64_t>(persistent_ ? capacity_ * framesInFlight : capacity_));
+}
+
+StreamBuffer::Allocation StreamBuffer::allocate(size_t size, size_t alignment)
+{
+    auto offset = (cursor_ + alignment - 1) / alignment * alignment;
+    maxAlignment_ = std::max(maxAlignment_, alignment);
+    // The regions of the persistent buffer start at multiples of the capacity, so it has to be
+    // aligned for all allocations (e.g. GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT for glBindBufferRange)
+    const auto misaligned = persistent_ && capacity_ % maxAlignment_ != 0;
+    if (offset + size > capacity_ || misaligned) {
+        const auto capacity = std::max(capacity_ * 2, offset + size);
+        capacity_ = (capacity + maxAlignment_ - 1) / maxAlignment_ * maxAlignment_;
+        stats_.grows++;
+        stats_.capacity = capacity_;
+        if (persistent_) {
+            // Allocations from this frame still point into the old buffer, so it has to live
+            // until the GPU is done with it (see endFrame)
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            retired_.emplace_back(buffer_, nullptr);
+            for (auto& fence : fences_) {
+                if (fence) {
+                    glDeleteSync(fence);
+                    fence = nullptr;
+                }
+            }
+            createBuffer();
+            region_ = 0;
+            offset = 0;
+        }
+        // Without persistent mapping the buffer is just orphaned with the new size in flush()
+        gpuMemory_.set(static_cast<int64_t>(persistent_ ? capacity_ * framesInFlight : capacity_));
+    }
+    cursor_ = offset + size;
+    stats_.used = std::max(stats_.used, cursor_);
+    if (persistent_) {
+        const auto base = region_ * capacity_;
+        return Allocation { buffer_, base + offset, size, mapping_ + base + offset };
+    }
+    staging_.resize(cursor_);
+    return Allocation { buffer_, offset, size, staging_.data() + offset };
+}
+
+void StreamBuffer::flush()
+{
+    // Coherent mappings need nothing
+    if (persistent_ || cursor_ == flushed_) {
+        return;
+    }
+    // Orphaning means we never wait for the GPU to finish reading the previous data. The
+    // previous data is gone from our point of view, so everything is uploaded again.
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+    glBufferData(
+        GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(capacity_), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, 0, static_cast<GLsizeiptr>(cursor_), staging_.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    flushed_ = cursor_;
+}
+
+void StreamBuffer::waitForRegion(size_t region)
+{
+    auto& fence = fences_[region];
+    if (!fence) {
+        return;
+    }
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        stats_.waits++;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000)
+            == GL_TIMEOUT_EXPIRED) {
+        }
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void StreamBuffer::endFrame()
+{
+    if (persistent_) {
+        fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    for (auto& [buffer, fence] : retired_) {
+        if (!fence) {
+            fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+    std::erase_if(retired_, [](const std::pair<GLuint, GLsync>& retired) {
+        if (glClientWaitSync(retired.second, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            return false;
+        }
+        glDeleteSync(retired.second);
+        glDeleteBuffers(1, &retired.first);
+        return true;
+    });
+
+    lastFrameStats_ = stats_;
+    stats_ = Stats { persistent_, capacity_ };
+    cursor_ = 0;
+    flushed_ = 0;
+    staging_.clear();
+    if (persistent_) {
+        region_ = (region_ + 1) % framesInFlight;
+        waitForRegion(region_);
+    }
+}
+
+const StreamBuffer::Stats& StreamBuffer::getStats() const
+{
+    return lastFrameStats_;
+}
+
+namespace {
+float lodThreshold = 0.5f / 1080.0f;
+// How much better another level has to be than the previous one (see Geometry::selectLod)
+constexpr float lodHysteresis = 0.2f;
+}
+
+Geometry::Ptr Geometry::create(glw::DrawMode mode)
+{
+    return std::shared_ptr<Geometry>(new Geometry(mode));
+}
+
+Geometry::~Geometry()
+{
+    if (pool_) {
+        pool_->free(baseVertex_, vertexCount_, firstIndex_, indexCount_);
+    }
+}
+
+void Geometry::draw(GraphicsBuffer* instanceBuffer, size_t instanceCount, size_t lod)
+{
+    StateCache::instance().countDraw();
+    if (pool_) {
+        dieAssert(!instanceBuffer, "Geometry from a GeometryPool can not be drawn instanced");
+        pool_->bind();
+        const auto indices = reinterpret_cast<const void*>(firstIndex_ * pool_->indexSize_);
+        glDrawElementsBaseVertex(static_cast<GLenum>(mode_), static_cast<GLsizei>(indexCount_),
+            indexType_, indices, static_cast<GLint>(baseVertex_));
+        return;
+    }
+
+    dieAssert(!vertexBuffers_.empty() || streamedVertices_, "Geometry has no vertex buffer");
+    StateCache::instance().bindVertexArray(id_, vertexArray_);
+    if (instanceBuffer && instanceBuffer->getId() != instanceBufferId_) {
+        dieAssert(instanceFormat_.has_value(), "Geometry has no instance format");
+        instanceBuffer->getGlBuffer().bind(glw::Buffer::Target::Array);
+        instanceFormat_->set();
+        instanceBufferId_ = instanceBuffer->getId();
+    }
+
+    const auto mode = static_cast<GLenum>(mode_);
+    if (indexType_) {
+        dieAssert(lod <= lods_.size(), "Invalid level of detail {}", lod);
+        const auto count = static_cast<GLsizei>(lod ? lods_[lod - 1].indexCount : indexCount_);
+        const auto indices
+            = reinterpret_cast<const void*>(lod ? lods_[lod - 1].indexOffset : indexOffset_);
+        if (instanceBuffer) {
+            glDrawElementsInstanced(
+                mode, count, indexType_, indices, static_cast<GLsizei>(instanceCount));
+        } else {
+            glDrawElements(mode, count, indexType_, indices);
+        }
+    } else {
+        const auto count = static_cast<GLsizei>(vertexCount_);
+        if (instanceBuffer) {
+            glDrawArraysInstanced(mode, 0, count, static_cast<GLsizei>(instanceCount));
+        } else {
+            glDrawArrays(mode, 0, count);
+        }
+    }
+}
+
+void Geometry::setLods(std::vector<Lod> lods)
+{
+    dieAssert(!pool_, "Geometry from a GeometryPool can not have levels of detail");
+    dieAssert(indexBuffer_, "Levels of detail need an index buffer");
+    const auto typeSize = getAttributeTypeSize(static_cast<glw::AttributeType>(indexType_));
+    for (const auto& lod : lods) {
+        dieAssert(lod.indexOffset % typeSize == 0
+                && lod.indexOffset + lod.indexCount * typeSize <= indexBuffer_->getSize(),
+            "Level of detail is outside of the index buffer");
+    }
+    lods_ = std::move(lods);
+}
+
+size_t Geometry::getLodCount() const
+{
+    return lods_.size() + 1;
+}
+
+size_t Geometry::selectLod(float screenSize, std::optional<size_t> previous) const
+{
+    // The errors grow with the level, so the first level that is too coarse ends the search.
+    // Levels up to the previous one only have to stay below the raised threshold, the ones
+    // after it have to be below the lowered one.
+    size_t level = 0;
+    for (size_t l = 1; l <= lods_.size(); ++l) {
+        const auto threshold = !previous ? lodThreshold
+            : l <= *previous             ? lodThreshold * (1.0f + lodHysteresis)
+                                         : lodThreshold * (1.0f - lodHysteresis);
+        if (lods_[l - 1].error * screenSize > threshold) {
+            break;
+        }
+        level = l;
+    }
+    return level;
+}
+
+void Geometry::setBounds(const Aabb& bounds)
+{
+    bounds_ = bounds;
+}
+
+const std::optional<Aabb>& Geometry::getBounds() const
+{
+    return bounds_;
+}
+
+void Geometry::setVertexTransform(const glm::mat4& transform)
+{
+    vertexTransform_ = transform;
+}
+
+const std::optional<glm::mat4>& Geometry::getVertexTransform() const
+{
+    return vertexTransform_;
+}
+
+uint32_t Geometry::getId() const
+{
+    return id_;
+}
+
+glw::DrawMode Geometry::getMode() const
+{
+    return mode_;
+}
+
+uint32_t Geometry::getVertexArrayId() const
+{
+    return pool_ ? pool_->getId() : id_;
+}
+
+GeometryPool* Geometry::getPool() const
+{
+    return pool_.get();
+}
+
+size_t Geometry::getBaseVertex() const
+{
+    return baseVertex_;
 }
 
-Shader::Ptr Shader::create(Buffer::Ptr combined)
+size_t Geometry::getFirstIndex() const
 {
-    return std::shared_ptr<Shader>(
-        new Shader(std::static_pointer_cast<BufferBase>(std::move(combined))));
+    return firstIndex_;
 }
 
-const glw::ShaderProgram& Shader::getProgram() const
+size_t Geometry::getIndexCount() const
 {
-    return prog_;
+    return indexCount_;
 }
 
-void Shader::initialize(std::string_view vert, std::string_view vertPath, std::string_view frag,
-    std::string_view fragPath)
-{
-    auto vertFull = resolveIncludes(vert, std::string(vertPath));
-    if (!vertFull) {
-        throw DieException(fmt::format("Could not resolve includes for shader: {}", vertPath));
-    }
+Geometry::Geometry(glw::DrawMode mode)
+    : id_(nextId<Geometry>())
+    , mode_(mode)
+{
+}
+
+void Geometry::addVertexBuffer(const VertexFormat& fmt, GraphicsBuffer::Ptr buffer, size_t offset,
+    std::optional<size_t> count)
+{
+    dieAssert(!pool_, "Geometry from a GeometryPool can not be modified");
+    dieAssert(offset <= buffer->getSize(), "Vertex offset is outside of the buffer");
+    const auto available = (buffer->getSize() - offset) / fmt.getStride();
+    // The last vertex may be shorter than the stride (e.g. in a glTF bufferView)
+    dieAssert(!count || *count <= available + 1, "Vertex count exceeds the buffer");
+    vertexArray_.bind();
+    buffer->getGlBuffer().bind(glw::Buffer::Target::Array);
+    fmt.set(offset);
+    vertexArray_.unbind();
+    StateCache::instance().invalidateVertexArray();
+    const auto vertexCount = count.value_or(available);
+    const auto first = vertexBuffers_.empty() && !streamedVertices_;
+    vertexCount_ = first ? vertexCount : std::min(vertexCount_, vertexCount);
+    vertexBuffers_.push_back(std::move(buffer));
+}
 
-    auto fragFull = resolveIncludes(frag, std::string(fragPath));
-    if (!fragFull) {
-        throw DieException(fmt::format("Could not resolve includes for shader: {}", fragPath));
-    }
+void Geometry::setIndexBuffer(glw::AttributeType idxType, GraphicsBuffer::Ptr buffer,
+    size_t offset, std::optional<size_t> count)
+{
+    dieAssert(!pool_, "Geometry from a GeometryPool can not be modified");
+    // The element array binding is part of the vertex array state
+    vertexArray_.bind();
+    buffer->getGlBuffer().bind(glw::Buffer::Target::ElementArray);
+    vertexArray_.unbind();
+    StateCache::instance().invalidateVertexArray();
+    const auto typeSize = getAttributeTypeSize(idxType);
+    dieAssert(offset % typeSize == 0, "Index offset is not aligned to the index size");
+    dieAssert(offset <= buffer->getSize(), "Index offset is outside of the buffer");
+    const auto available = (buffer->getSize() - offset) / typeSize;
+    dieAssert(!count || *count <= available, "Index count exceeds the buffer");
+    indexType_ = static_cast<GLenum>(idxType);
+    indexCount_ = count.value_or(available);
+    indexOffset_ = offset;
+    indexBuffer_ = std::move(buffer);
+    lods_.clear();
+}
 
-    auto prog = glwx::makeShaderProgram(vert, frag);
-    if (!prog) {
-        throw DieException(
-            fmt::format("Could not create shader '{}' (vert) / '{}' (frag)", vertPath, fragPath));
-    }
-    prog_ = std::move(*prog);
+void Geometry::streamVertices(const VertexFormat& fmt, std::span<const uint8_t> data)
+{
+    dieAssert(!pool_, "Geometry from a GeometryPool can not be modified");
+    const auto alloc = StreamBuffer::instance().allocate(data.size(), 16);
+    std::memcpy(alloc.data, data.data(), data.size());
+    vertexArray_.bind();
+    glBindBuffer(GL_ARRAY_BUFFER, alloc.buffer);
+    fmt.set(alloc.offset);
+    vertexArray_.unbind();
+    StateCache::instance().invalidateVertexArray();
+    vertexCount_ = data.size() / fmt.getStride();
+    streamedVertices_ = true;
 }
 
-Shader::Shader(BufferBase::Ptr vert, BufferBase::Ptr frag)
+void Geometry::streamIndices(glw::AttributeType idxType, std::span<const uint8_t> data)
 {
-    const std::string_view vertSv(
-        reinterpret_cast<const char*>(vert->data().data()), vert->data().size());
+    dieAssert(!pool_, "Geometry from a GeometryPool can not be modified");
+    const auto alloc = StreamBuffer::instance().allocate(data.size(), 4);
+    std::memcpy(alloc.data, data.data(), data.size());
+    vertexArray_.bind();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, alloc.buffer);
+    vertexArray_.unbind();
+    StateCache::instance().invalidateVertexArray();
+    indexBuffer_.reset();
+    indexType_ = static_cast<GLenum>(idxType);
+    indexCount_ = data.size() / getAttributeTypeSize(idxType);
+    indexOffset_ = alloc.offset;
+    lods_.clear();
+}
 
-    const std::string_view fragSv(
-        reinterpret_cast<const char*>(frag->data().data()), frag->data().size());
+void Geometry::setInstanceFormat(const VertexFormat& fmt)
+{
+    dieAssert(!pool_, "Geometry from a GeometryPool can not be modified");
+    instanceFormat_ = fmt;
+    instanceBufferId_ = 0;
+}
 
-    initialize(vertSv, vert->path(), fragSv, frag->path());
+namespace {
+// Per-instance attribute of the vertex arrays of all pools, which holds 0, 1, 2, ... The draws in a
+// multi-draw get their index in the batch as base instance, so the shader can read it from this.
+constexpr GLuint drawIndexAttributeLocation = 15;
+
+GLuint getDrawIndexBuffer()
+{
+    static const auto buffer = []() {
+        std::vector<uint32_t> indices(GeometryPool::maxMultiDrawCount);
+        std::iota(indices.begin(), indices.end(), 0u);
+        GLuint buffer = 0;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(indices.size() * 4),
+            indices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return buffer;
+    }();
+    return buffer;
+}
 }
 
-Shader::Shader(BufferBase::Ptr combined)
+GeometryPool::Ptr GeometryPool::create(const VertexFormat& fmt, glw::AttributeType indexType,
+    size_t vertexCapacity, size_t indexCapacity)
 {
-    const std::string_view sv(
-        reinterpret_cast<const char*>(combined->data().data()), combined->data().size());
-    std::string vert = "#define VERTEX_SHADER\n" + std::string(sv);
-    std::string frag = "#define FRAGMENT_SHADER\n#define FROGMENT_SHADER\n" + std::string(sv);
-
-    initialize(vert, combined->path(), frag, combined->path());
+    return std::shared_ptr<GeometryPool>(
+        new GeometryPool(fmt, indexType, vertexCapacity, indexCapacity));
 }
 
-Shader::Shader(std::string vertPath, std::string fragPath)
-    : Shader(Buffer::create(vertPath), Buffer::create(fragPath))
+GeometryPool::GeometryPool(const VertexFormat& fmt, glw::AttributeType indexType,
+    size_t vertexCapacity, size_t indexCapacity)
+    : id_(nextId<Geometry>())
+    , format_(fmt)
+    , indexType_(static_cast<GLenum>(indexType))
+    , indexSize_(getAttributeTypeSize(indexType))
 {
+    dieAssert(indexType == glw::AttributeType::U8 || indexType == glw::AttributeType::U16
+            || indexType == glw::AttributeType::U32,
+        "Invalid index type for GeometryPool");
+    dieAssert(format_.getStride() > 0, "Empty vertex format for GeometryPool");
+    reserve(std::max<size_t>(vertexCapacity, 1), std::max<size_t>(indexCapacity, 1));
 }
 
-Shader::Shader(std::string combined)
-    : Shader(Buffer::create(combined))
+GeometryPool::~GeometryPool()
 {
+    glDeleteBuffers(1, &vertexBuffer_);
+    glDeleteBuffers(1, &indexBuffer_);
 }
 
-GraphicsBuffer::Ptr GraphicsBuffer::create(
-    BufferTarget target, BufferUsage usage, Buffer::Ptr buffer)
+Geometry::Ptr GeometryPool::add(
+    glw::DrawMode mode, std::span<const uint8_t> vertices, std::span<const uint8_t> indices)
 {
-    return std::shared_ptr<GraphicsBuffer>(
-        new GraphicsBuffer(target, usage, std::static_pointer_cast<BufferBase>(std::move(buffer))));
+    const auto stride = format_.getStride();
+    dieAssert(vertices.size() % stride == 0, "Vertex data is not a multiple of the vertex size");
+    dieAssert(indices.size() % indexSize_ == 0, "Index data is not a multiple of the index size");
+    const auto vertexCount = vertices.size() / stride;
+    const auto indexCount = indices.size() / indexSize_;
+    dieAssert(vertexCount > 0 && indexCount > 0, "Pooled geometry needs vertices and indices");
+
+    reserve(vertexCount, indexCount);
+    const auto baseVertex = vertices_.allocate(vertexCount);
+    const auto firstIndex = indices_.allocate(indexCount);
+    assert(baseVertex && firstIndex);
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer_);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(*baseVertex * stride),
+        static_cast<GLsizeiptr>(vertices.size()), vertices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, indexBuffer_);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(*firstIndex * indexSize_),
+        static_cast<GLsizeiptr>(indices.size()), indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    auto geometry = std::shared_ptr<Geometry>(new Geometry(mode));
+    geometry->pool_ = shared_from_this();
+    geometry->baseVertex_ = *baseVertex;
+    geometry->vertexCount_ = vertexCount;
+    geometry->firstIndex_ = *firstIndex;
+    geometry->indexType_ = indexType_;
+    geometry->indexCount_ = indexCount;
+    geometries_++;
+    return geometry;
 }
 
-GraphicsBuffer::Ptr GraphicsBuffer::create(
-    BufferTarget target, BufferUsage usage, BufferView::Ptr buffer)
+void GeometryPool::multiDraw(
+    glw::DrawMode mode, GLuint indirectBuffer, size_t offset, size_t count)
 {
-    return std::shared_ptr<GraphicsBuffer>(
-        new GraphicsBuffer(target, usage, std::static_pointer_cast<BufferBase>(std::move(buffer))));
+    StateCache::instance().countMultiDraw(count);
+    bind();
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+    glMultiDrawElementsIndirect(static_cast<GLenum>(mode), indexType_,
+        reinterpret_cast<const void*>(offset), static_cast<GLsizei>(count), 0);
 }
 
-GraphicsBuffer::Ptr GraphicsBuffer::create(
-    BufferTarget target, BufferUsage usage, std::string filename)
+uint32_t GeometryPool::getId() const
 {
-    return std::shared_ptr<GraphicsBuffer>(new GraphicsBuffer(target, usage, std::move(filename)));
+    return id_;
 }
 
-glw::Buffer& GraphicsBuffer::getGlBuffer()
+const VertexFormat& GeometryPool::getVertexFormat() const
 {
-    return gfxBuffer_;
+    return format_;
 }
 
-GraphicsBuffer::GraphicsBuffer(BufferTarget target, BufferUsage usage, BufferBase::Ptr buffer)
-    : target_(target)
-    , usage_(usage)
-    , buffer_(std::move(buffer))
+GLenum GeometryPool::getIndexType() const
 {
-    gfxBuffer_.data(static_cast<glw::Buffer::Target>(target_),
-        static_cast<glw::Buffer::UsageHint>(usage_), buffer_->data().data(),
-        buffer_->data().size());
+    return indexType_;
 }
 
-GraphicsBuffer::GraphicsBuffer(BufferTarget target, BufferUsage usage, std::string filename)
-    : GraphicsBuffer(target, usage, Buffer::create(std::move(filename)))
+GeometryPool::Stats GeometryPool::getStats() const
 {
+    return Stats {
+        geometries_,
+        vertices_.getCapacity(),
+        vertices_.getUsed(),
+        indices_.getCapacity(),
+        indices_.getUsed(),
+        grows_,
+    };
 }
 
-Geometry::Ptr Geometry::create(glw::DrawMode mode)
+void GeometryPool::bind()
 {
-    return std::shared_ptr<Geometry>(new Geometry(mode));
+    StateCache::instance().bindVertexArray(id_, vertexArray_);
 }
 
-void Geometry::draw()
+void GeometryPool::setupVertexArray()
 {
-    primitive_.draw();
+    vertexArray_.bind();
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer_);
+    format_.set();
+    glBindBuffer(GL_ARRAY_BUFFER, getDrawIndexBuffer());
+    glEnableVertexAttribArray(drawIndexAttributeLocation);
+    glVertexAttribIPointer(drawIndexAttributeLocation, 1, GL_UNSIGNED_INT, 0, nullptr);
+    glVertexAttribDivisor(drawIndexAttributeLocation, 1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer_);
+    vertexArray_.unbind();
+    StateCache::instance().invalidateVertexArray();
 }
 
-Geometry::Geometry(glw::DrawMode mode)
-    : primitive_(mode)
+GLuint GeometryPool::resizeBuffer(GLuint buffer, size_t oldSize, size_t newSize)
 {
+    GLuint resized = 0;
+    glGenBuffers(1, &resized);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, resized);
+    glBufferData(
+        GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(newSize), nullptr, GL_STATIC_DRAW);
+    if (buffer) {
+        // Stays on the GPU. Queued draws that still use the old buffer keep it alive.
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(
+            GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, static_cast<GLsizeiptr>(oldSize));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &buffer);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return resized;
 }
 
-void Geometry::addVertexBuffer(const glw::VertexFormat& fmt, GraphicsBuffer::Ptr buffer)
+void GeometryPool::reserve(size_t vertexCount, size_t indexCount)
 {
-    primitive_.addVertexBuffer(buffer->getGlBuffer(), fmt);
-    vertexBuffers_.push_back(std::move(buffer));
+    const auto newCapacity = [](const RangeAllocator& alloc, size_t count) {
+        // Doubling keeps the number of copies low when many meshes are added
+        return std::max(alloc.getCapacity() * 2, alloc.getCapacity() + count);
+    };
+    const auto stride = format_.getStride();
+    const auto initial = vertexBuffer_ == 0;
+    bool resized = false;
+    if (vertices_.getLargestFree() < vertexCount) {
+        const auto capacity = newCapacity(vertices_, vertexCount);
+        vertexBuffer_
+            = resizeBuffer(vertexBuffer_, vertices_.getCapacity() * stride, capacity * stride);
+        vertices_.grow(capacity);
+        resized = true;
+    }
+    if (indices_.getLargestFree() < indexCount) {
+        const auto capacity = newCapacity(indices_, indexCount);
+        indexBuffer_ = resizeBuffer(
+            indexBuffer_, indices_.getCapacity() * indexSize_, capacity * indexSize_);
+        indices_.grow(capacity);
+        resized = true;
+    }
+    if (!resized) {
+        return;
+    }
+    if (!initial) {
+        grows_++;
+    }
+    setupVertexArray();
+    gpuMemory_.set(static_cast<int64_t>(
+        vertices_.getCapacity() * stride + indices_.getCapacity() * indexSize_));
 }
 
-void Geometry::setIndexBuffer(glw::AttributeType idxType, GraphicsBuffer::Ptr buffer)
+void GeometryPool::free(size_t baseVertex, size_t vertexCount, size_t firstIndex, size_t indexCount)
 {
-    primitive_.setIndexBuffer(buffer->getGlBuffer(), static_cast<glw::IndexType>(idxType));
-    indexBuffer_ = std::move(buffer);
+    vertices_.free(baseVertex, vertexCount);
+    indices_.free(firstIndex, indexCount);
+    geometries_--;
 }
 
 std::tuple<float, float, float> Transform::unpack(const glm::vec3& v)
@@ -286,6 +2104,12 @@ std::tuple<float, float, float, float> Transform::unpack(const glm::quat& q)
     return { q.x, q.y, q.z, q.w };
 }
 
+Mat4 Transform::unpack(const glm::mat4& m)
+{
+    return Mat4 { m[0][0], m[0][1], m[0][2], m[0][3], m[1][0], m[1][1], m[1][2], m[1][3], m[2][0],
+        m[2][1], m[2][2], m[2][3], m[3][0], m[3][1], m[3][2], m[3][3] };
+}
+
 std::tuple<float, float, float> Transform::getPosition() const
 {
     return unpack(glwx::Transform::getPosition());
@@ -368,9 +2192,7 @@ void Transform::lookAt(float x, float y, float z, float upX, float upY, float up
 
 Mat4 Transform::getMatrix() const
 {
-    auto m = glwx::Transform::getMatrix();
-    return Mat4 { m[0][0], m[0][1], m[0][2], m[0][3], m[1][0], m[1][1], m[1][2], m[1][3], m[2][0],
-        m[2][1], m[2][2], m[2][3], m[3][0], m[3][1], m[3][2], m[3][3] };
+    return unpack(glwx::Transform::getMatrix());
 }
 
 size_t getAttributeLocation(const std::string& name)
@@ -384,6 +2206,11 @@ size_t getAttributeLocation(const std::string& name)
         { "color0", 5 },
         { "joints0", 6 },
         { "weights0", 7 },
+        // Per-instance attributes (>= firstInstanceAttributeLocation)
+        { "instanceModel", 8 }, // mat4, takes 8 - 11
+        { "instanceColor", 12 },
+        { "instanceData0", 13 },
+        { "instanceData1", 14 },
     };
     const auto it = locs.find(name);
     assert(it != locs.end());
@@ -392,12 +2219,16 @@ size_t getAttributeLocation(const std::string& name)
 
 void clearColor(float r, float g, float b, float a)
 {
+    flush();
+    StateCache::instance().prepareClear();
     glClearColor(r, g, b, a);
     glClear(GL_COLOR_BUFFER_BIT);
 }
 
 void clearColorDepth(float r, float g, float b, float a, float depth)
 {
+    flush();
+    StateCache::instance().prepareClear();
     glClearColor(r, g, b, a);
     glClearDepth(depth);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -419,6 +2250,8 @@ glm::mat4 invViewProjectionMatrix;
 glm::mat4 modelViewProjectionMatrix;
 glm::mat4 invModelViewProjectionMatrix;
 
+bool frameUniformsDirty = true;
+
 void updateMV()
 {
     modelViewMatrix = viewMatrix * modelMatrix;
@@ -462,6 +2295,7 @@ void setViewMatrix(const glm::mat4& mat)
 {
     viewMatrix = mat;
     invViewMatrix = glm::inverse(mat); // useless double inversion
+    frameUniformsDirty = true;
     updateMV();
     updateVP();
     updateMVP();
@@ -482,6 +2316,7 @@ void setProjectionMatrix(const glm::mat4& mat)
 {
     projectionMatrix = mat;
     invProjectionMatrix = glm::inverse(projectionMatrix);
+    frameUniformsDirty = true;
     updateVP();
     updateMVP();
 }
@@ -497,85 +2332,684 @@ void setProjectionMatrix(float fovy, float aspect, float near, float far)
     setProjectionMatrix(glm::perspective(fovy, aspect, near, far));
 }
 
-int bind(const glw::Texture* texture)
+const glm::mat4& getModelMatrix()
+{
+    return modelMatrix;
+}
+
+const glm::mat4& getViewProjectionMatrix()
 {
-    static GLint numTextureUnits = 0;
-    if (numTextureUnits == 0) {
-        glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &numTextureUnits);
-        dieAssert(numTextureUnits > 0, "Maximum number of texture units is 0");
+    return viewProjectionMatrix;
+}
+
+UniformLayout UniformLayout::compile(const glw::ShaderProgram& prog)
+{
+    static const auto maxTextureUnits = []() {
+        GLint units = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+        dieAssert(units > 0, "Maximum number of texture units is 0");
+        return std::min(static_cast<size_t>(units), StateCache::maxTextureUnits);
+    }();
+
+    UniformLayout layout;
+    glUseProgram(prog.getProgram());
+    for (const auto& [name, info] : prog.getUniformInfo()) {
+        const auto location = glGetUniformLocation(prog.getProgram(), name.c_str());
+        // Members of uniform blocks (like the built-in ones) have no location
+        if (location < 0) {
+            continue;
+        }
+        const auto arraySize = static_cast<size_t>(info.size);
+        if (isSamplerType(info.type)) {
+            const auto unit = layout.numTextureUnits;
+            layout.numTextureUnits += arraySize;
+            dieAssert(layout.numTextureUnits <= maxTextureUnits,
+                "Too many samplers in shader (maximum is {})", maxTextureUnits);
+            std::array<GLint, StateCache::maxTextureUnits> units;
+            for (size_t i = 0; i < arraySize; ++i) {
+                units[i] = static_cast<GLint>(unit + i);
+            }
+            glUniform1iv(location, static_cast<GLsizei>(arraySize), units.data());
+            layout.entries.push_back(Entry {
+                name, location, info.type, arraySize, 0, unit, std::nullopt, std::nullopt });
+            continue;
+        }
+        const auto typeSize = getTypeSize(info.type);
+        if (typeSize == 0) {
+            continue;
+        }
+        layout.entries.push_back(Entry { name, location, info.type, arraySize, layout.dataSize, 0,
+            std::nullopt, std::nullopt });
+        layout.dataSize += typeSize * arraySize;
     }
-    struct BoundTexture {
-        int unit = -1;
-        const glw::Texture* texture = nullptr;
-    };
-    // This is sorted by most-recently-used first
-    static auto boundTextures = [&]() {
-        std::vector<BoundTexture> bound(numTextureUnits);
-        for (int i = 0; i < numTextureUnits; ++i) {
-            bound[i].unit = i;
+
+    std::vector<Entry*> objectLayerEntries;
+    for (auto& entry : layout.entries) {
+        if (entry.type != sampler2DArrayType) {
+            continue;
         }
-        return bound;
-    }();
-    auto moveToFront = [&](size_t index) {
-        const auto it = boundTextures.begin() + index;
-        std::rotate(boundTextures.begin(), it, it + 1);
+        const auto layerName = entry.name + "Layer";
+        for (size_t i = 0; i < layout.entries.size(); ++i) {
+            const auto& other = layout.entries[i];
+            if (other.name == layerName && other.type == glw::UniformInfo::Type::Int
+                && other.arraySize >= entry.arraySize) {
+                entry.layerEntry = i;
+            }
+        }
+        if (!entry.layerEntry) {
+            objectLayerEntries.push_back(&entry);
+        }
+    }
+    // The uniforms are not enumerated in a defined order
+    std::sort(objectLayerEntries.begin(), objectLayerEntries.end(),
+        [](const Entry* a, const Entry* b) { return a->name < b->name; });
+    size_t objectLayers = 0;
+    for (auto entry : objectLayerEntries) {
+        dieAssert(objectLayers + entry->arraySize <= maxObjectLayers,
+            "Too many texture array samplers without a <name>Layer uniform (maximum is {})",
+            maxObjectLayers);
+        entry->objectLayer = objectLayers;
+        objectLayers += entry->arraySize;
+    }
+    return layout;
+}
+
+bool isSamplerType(glw::UniformInfo::Type type)
+{
+    return type == glw::UniformInfo::Type::Sampler2D || type == sampler2DArrayType;
+}
+
+size_t UniformLayout::getTypeSize(glw::UniformInfo::Type type)
+{
+    using Type = glw::UniformInfo::Type;
+    switch (type) {
+    case Type::Int:
+    case Type::Float:
+        return 4;
+    case Type::Vec2:
+        return sizeof(glm::vec2);
+    case Type::Vec3:
+        return sizeof(glm::vec3);
+    case Type::Vec4:
+        return sizeof(glm::vec4);
+    case Type::Mat2:
+        return sizeof(glm::mat2);
+    case Type::Mat3:
+        return sizeof(glm::mat3);
+    case Type::Mat4:
+        return sizeof(glm::mat4);
+    default:
+        return 0; // Not supported
+    }
+}
+
+UniformSet::UniformSet(const UniformLayout& layout)
+    : layout_(&layout)
+    , data_(layout.dataSize)
+{
+}
+
+void UniformSet::writeTexture(
+    const UniformLayout::Entry& entry, size_t element, Texture::Ptr texture)
+{
+    assert(isSamplerType(entry.type));
+    assert(element < entry.arraySize);
+    assert(texture->isLayer() == (entry.type == sampler2DArrayType));
+    textureBindings_.push_back(texture->getBinding(entry.textureUnit + element));
+    if (entry.layerEntry) {
+        const auto& layerEntry = layout_->entries[*entry.layerEntry];
+        write(layerEntry, element, static_cast<int32_t>(texture->getLayer()));
+    } else if (entry.objectLayer) {
+        objectLayers_[*entry.objectLayer + element] = static_cast<int32_t>(texture->getLayer());
+    }
+    textures_.push_back(std::move(texture));
+}
+
+const Texture* UniformSet::getFirstTexture() const
+{
+    return textures_.empty() ? nullptr : textures_.front().get();
+}
+
+const std::vector<Texture::Ptr>& UniformSet::getTextures() const
+{
+    return textures_;
+}
+
+const std::array<int32_t, UniformLayout::maxObjectLayers>& UniformSet::getObjectLayers() const
+{
+    return objectLayers_;
+}
+
+void UniformSet::add(const UniformLayout::Entry& entry, size_t count)
+{
+    assert(count <= entry.arraySize);
+    if (isSamplerType(entry.type)) {
+        // The units are fixed, only the layers have to be uploaded
+        if (entry.layerEntry) {
+            add(layout_->entries[*entry.layerEntry], count);
+        }
+        return;
+    }
+    bindings_.push_back(Binding { entry.location, entry.type, static_cast<uint32_t>(count),
+        static_cast<uint32_t>(entry.offset) });
+}
+
+void UniformSet::set() const
+{
+    StateCache::instance().bindTextures(textureBindings_);
+
+    using Type = glw::UniformInfo::Type;
+    for (const auto& binding : bindings_) {
+        const auto data = data_.data() + binding.offset;
+        const auto floats = reinterpret_cast<const GLfloat*>(data);
+        const auto count = static_cast<GLsizei>(binding.count);
+        switch (binding.type) {
+        case Type::Int:
+            glUniform1iv(binding.location, count, reinterpret_cast<const GLint*>(data));
+            break;
+        case Type::Float:
+            glUniform1fv(binding.location, count, floats);
+            break;
+        case Type::Vec2:
+            glUniform2fv(binding.location, count, floats);
+            break;
+        case Type::Vec3:
+            glUniform3fv(binding.location, count, floats);
+            break;
+        case Type::Vec4:
+            glUniform4fv(binding.location, count, floats);
+            break;
+        case Type::Mat2:
+            glUniformMatrix2fv(binding.location, count, GL_FALSE, floats);
+            break;
+        case Type::Mat3:
+            glUniformMatrix3fv(binding.location, count, GL_FALSE, floats);
+            break;
+        case Type::Mat4:
+            glUniformMatrix4fv(binding.location, count, GL_FALSE, floats);
+            break;
+        default:
+            assert(false && "Invalid uniform type");
+        }
+    }
+}
+
+bool UniformSet::isEquivalent(const UniformSet& other) const
+{
+    const auto sameTexture = [](const TextureBinding& a, const TextureBinding& b) {
+        return a.unit == b.unit && a.textureId == b.textureId;
     };
-    for (size_t i = 0; i < boundTextures.size(); ++i) {
-        if (boundTextures[i].texture == texture) {
-            moveToFront(i);
-            return boundTextures[0].unit;
-        } else if (!boundTextures[i].texture) {
-            moveToFront(i);
-            texture->bind(boundTextures[0].unit);
-            boundTextures[0].texture = texture;
-            return boundTextures[0].unit;
-        }
-    }
-    // Texture isn't already bound and there is no free texture unit
-    moveToFront(boundTextures.size() - 1); // Move last (least recently used) to front
-    texture->bind(boundTextures[0].unit);
-    boundTextures[0].texture = texture;
-    return boundTextures[0].unit;
-}
-
-void UniformSet::set(const glw::ShaderProgram& shader) const
-{
-    for (const auto& [name, value] : uniforms) {
-        std::visit(
-            [&](auto&& v) {
-                if constexpr (std::is_same_v<std::decay_t<decltype(v)>, const glw::Texture*>) {
-                    shader.setUniform(name, bind(v));
-                } else {
-                    shader.setUniform(name, v);
-                }
-            },
-            value);
+    return layout_ == other.layout_ && bindings_ == other.bindings_ && data_ == other.data_
+        && std::equal(textureBindings_.begin(), textureBindings_.end(),
+            other.textureBindings_.begin(), other.textureBindings_.end(), sameTexture);
+}
+
+namespace {
+// std140 layouts of the blocks in womf.glsl
+struct FrameUniforms {
+    glm::mat4 viewMatrix;
+    glm::mat4 invViewMatrix;
+    glm::mat4 projectionMatrix;
+    glm::mat4 invProjectionMatrix;
+    glm::mat4 viewProjectionMatrix;
+    glm::mat4 invViewProjectionMatrix;
+};
+static_assert(sizeof(FrameUniforms) == 6 * 64);
+
+struct ObjectUniforms {
+    glm::mat4 modelMatrix;
+    glm::mat4 invModelMatrix;
+    glm::vec4 normalMatrix[3]; // mat3 columns are padded to vec4 in std140
+    glm::mat4 modelViewMatrix;
+    glm::mat4 invModelViewMatrix;
+    glm::mat4 modelViewProjectionMatrix;
+    glm::mat4 invModelViewProjectionMatrix;
+    glm::mat4 vertexTransform;
+    glm::ivec4 textureLayers;
+};
+static_assert(sizeof(ObjectUniforms) == 7 * 64 + 4 * 16);
+static_assert(UniformLayout::maxObjectLayers == 4); // textureLayers is an ivec4
+// The std430 layout of WomfObjectData (WOMF_MULTI_DRAW) is the same, so this is also the stride
+// of the array
+
+// The layout is given by GL
+struct DrawElementsIndirectCommand {
+    uint32_t count;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t baseVertex;
+    uint32_t baseInstance;
+};
+
+struct DrawCommand {
+    uint64_t sortKey;
+    RenderState::Ptr renderState;
+    Shader::Ptr shader;
+    Geometry::Ptr geometry;
+    GraphicsBuffer::Ptr instanceBuffer;
+    size_t instanceCount;
+    UniformSet uniforms;
+    size_t frameIndex;
+    size_t objectIndex;
+    size_t boxIndex; // noBox if the draw is not culled
+    size_t lod;
+};
+
+constexpr auto noBox = std::numeric_limits<size_t>::max();
+
+// Commands [first, first + count) of the sorted order, drawn with a single multi-draw
+struct MultiDrawBatch {
+    size_t first;
+    size_t count;
+    GLuint commandBuffer;
+    size_t commandsOffset;
+    GLuint objectBuffer;
+    size_t objectsOffset;
+};
+
+// Draws are recorded here and only executed (sorted) in flush()
+struct DrawQueue {
+    std::vector<DrawCommand> commands;
+    std::vector<FrameUniforms> frames;
+    std::vector<ObjectUniforms> objects;
+    std::vector<size_t> order;
+    std::vector<MultiDrawBatch> batches;
+    // World space bounds of the draws that are culled, in submission order
+    CullBoxes boxes;
+    std::vector<size_t> boxFrames;
+    std::vector<uint8_t> boxVisible;
+};
+
+bool frustumCulling = true;
+OcclusionBuffer::Ptr occlusionBuffer;
+
+DrawQueue& getDrawQueue()
+{
+    static DrawQueue queue;
+    return queue;
+}
+
+// Positive floats compare like their bit patterns, so the upper 16 bits are a (logarithmic)
+// quantization of the depth that keeps the order.
+uint64_t quantizeDepth(float depth)
+{
+    depth = std::max(depth, 0.0f);
+    uint32_t bits = 0;
+    std::memcpy(&bits, &depth, sizeof(bits));
+    return bits >> 16;
+}
+
+}
+
+// [63:60] layer, [59:44] depth, [43:32] shader, [31:16] texture, [15:0] geometry
+uint64_t makeSortKey(uint32_t layer, float depth, const Shader& shader, const Texture* texture,
+    const Geometry& geometry, bool backToFront)
+{
+    assert(layer <= maxSortLayer);
+    const auto depthBits = backToFront ? 0xffff - quantizeDepth(depth) : quantizeDepth(depth);
+    return (layer & 0xfull) << 60 | depthBits << 44 | (shader.getId() & 0xfffull) << 32
+        | (texture ? texture->getBinding(0).textureId & 0xffffull : 0) << 16
+        | (geometry.getVertexArrayId() & 0xffffull);
+}
+
+namespace {
+
+template <typename T>
+void stage(uint8_t* dest, const std::vector<T>& items, size_t stride)
+{
+    for (size_t i = 0; i < items.size(); ++i) {
+        std::memcpy(dest + i * stride, &items[i], sizeof(T));
+    }
+}
+
+size_t getUniformBufferAlignment()
+{
+    static const auto alignment = []() {
+        GLint alignment = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        return static_cast<size_t>(std::max(alignment, 1));
+    }();
+    return alignment;
+}
+
+size_t getStorageBufferAlignment()
+{
+    static const auto alignment = []() {
+        GLint alignment = 0;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        return static_cast<size_t>(std::max(alignment, 1));
+    }();
+    return alignment;
+}
+
+bool canMerge(const DrawCommand& a, const DrawCommand& b)
+{
+    return a.shader == b.shader && a.renderState == b.renderState
+        && a.geometry->getPool() == b.geometry->getPool()
+        && a.geometry->getMode() == b.geometry->getMode() && a.frameIndex == b.frameIndex
+        && a.uniforms.isEquivalent(b.uniforms);
+}
+
+// Finds runs of mergeable multi-draw commands in the sorted order and writes their draw
+// commands and object uniforms into the StreamBuffer
+void prepareMultiDraws(DrawQueue& queue, StreamBuffer& streamBuffer)
+{
+    queue.batches.clear();
+    size_t i = 0;
+    while (i < queue.order.size()) {
+        const auto& first = queue.commands[queue.order[i]];
+        if (!first.shader->isMultiDraw()) {
+            i++;
+            continue;
+        }
+        size_t count = 1;
+        while (i + count < queue.order.size() && count < GeometryPool::maxMultiDrawCount
+            && canMerge(first, queue.commands[queue.order[i + count]])) {
+            count++;
+        }
+
+        const auto commands = streamBuffer.allocate(count * sizeof(DrawElementsIndirectCommand),
+            alignof(DrawElementsIndirectCommand));
+        for (size_t d = 0; d < count; ++d) {
+            const auto& geometry = *queue.commands[queue.order[i + d]].geometry;
+            const auto cmd = DrawElementsIndirectCommand {
+                static_cast<uint32_t>(geometry.getIndexCount()),
+                1,
+                static_cast<uint32_t>(geometry.getFirstIndex()),
+                static_cast<int32_t>(geometry.getBaseVertex()),
+                static_cast<uint32_t>(d), // see drawIndexAttributeLocation
+            };
+            std::memcpy(commands.data + d * sizeof(cmd), &cmd, sizeof(cmd));
+        }
+
+        const auto objects
+            = streamBuffer.allocate(count * sizeof(ObjectUniforms), getStorageBufferAlignment());
+        for (size_t d = 0; d < count; ++d) {
+            const auto& object = queue.objects[queue.commands[queue.order[i + d]].objectIndex];
+            std::memcpy(objects.data + d * sizeof(ObjectUniforms), &object, sizeof(object));
+        }
+
+        queue.batches.push_back(MultiDrawBatch {
+            i, count, commands.buffer, commands.offset, objects.buffer, objects.offset });
+        i += count;
+    }
+}
+}
+
+namespace {
+size_t enqueueDraw(Shader* shader, Geometry* geometry, GraphicsBuffer* instanceBuffer,
+    size_t instanceCount, UniformSet uniforms, const RenderState* renderState,
+    std::optional<uint64_t> sortKey, std::optional<size_t> previousLod,
+    const std::optional<Aabb>& instanceBounds)
+{
+    dieAssert(!shader->isMultiDraw() || (geometry->getPool() && !instanceBuffer),
+        "Multi-draw shaders can only draw geometry from a GeometryPool without instances");
+
+    auto& queue = getDrawQueue();
+    auto state = renderState ? std::const_pointer_cast<RenderState>(renderState->shared_from_this())
+                             : RenderState::getDefault();
+
+    if (frameUniformsDirty || queue.frames.empty()) {
+        queue.frames.push_back(FrameUniforms {
+            viewMatrix,
+            invViewMatrix,
+            projectionMatrix,
+            invProjectionMatrix,
+            viewProjectionMatrix,
+            invViewProjectionMatrix,
+        });
+        frameUniformsDirty = false;
+    }
+
+    const auto& layers = uniforms.getObjectLayers();
+    const auto textureLayers = glm::ivec4(layers[0], layers[1], layers[2], layers[3]);
+
+    // The instance matrices are applied between the model matrix and the vertex transform, so
+    // instanced draws leave it to the shader
+    const auto& vertexTransform = geometry->getVertexTransform();
+    if (vertexTransform && !instanceBuffer) {
+        const auto invVertexTransform = glm::inverse(*vertexTransform);
+        queue.objects.push_back(ObjectUniforms {
+            modelMatrix * *vertexTransform,
+            invVertexTransform * invModelMatrix,
+            { glm::vec4(normalMatrix[0], 0.0f), glm::vec4(normalMatrix[1], 0.0f),
+                glm::vec4(normalMatrix[2], 0.0f) },
+            modelViewMatrix * *vertexTransform,
+            invVertexTransform * invModelViewMatrix,
+            modelViewProjectionMatrix * *vertexTransform,
+            invVertexTransform * invModelViewProjectionMatrix,
+            glm::mat4(1.0f),
+            textureLayers,
+        });
+    } else {
+        queue.objects.push_back(ObjectUniforms {
+            modelMatrix,
+            invModelMatrix,
+            { glm::vec4(normalMatrix[0], 0.0f), glm::vec4(normalMatrix[1], 0.0f),
+                glm::vec4(normalMatrix[2], 0.0f) },
+            modelViewMatrix,
+            invModelViewMatrix,
+            modelViewProjectionMatrix,
+            invModelViewProjectionMatrix,
+            vertexTransform.value_or(glm::mat4(1.0f)),
+            textureLayers,
+        });
+    }
+
+    // View space looks down -z
+    const auto depth = -modelViewMatrix[3].z;
+    // The largest axis, so non-uniform scales don't lower the resolution
+    const auto scale = std::max({ glm::length(glm::vec3(modelMatrix[0])),
+        glm::length(glm::vec3(modelMatrix[1])), glm::length(glm::vec3(modelMatrix[2])) });
+    const auto perspective = projectionMatrix[2][3] != 0.0f;
+    // Of a model space unit, relative to the screen height
+    const auto unitScreenSize
+        = projectionMatrix[1][1] * 0.5f * scale / (perspective ? std::max(depth, 1e-3f) : 1.0f);
+    for (const auto& texture : uniforms.getTextures()) {
+        texture->reportUsage(unitScreenSize);
+    }
+
+    size_t lod = 0;
+    if (geometry->getLodCount() > 1 && geometry->getBounds() && !instanceBuffer) {
+        const auto& bounds = *geometry->getBounds();
+        lod = geometry->selectLod(glm::length(bounds.max - bounds.min) * unitScreenSize,
+            previousLod);
+    }
+
+    // Instanced draws are culled as a whole
+    const auto& bounds = instanceBuffer ? instanceBounds : geometry->getBounds();
+    auto boxIndex = noBox;
+    if (frustumCulling && bounds) {
+        boxIndex = queue.boxes.size();
+        queue.boxes.push(*bounds, modelMatrix);
+        queue.boxFrames.push_back(queue.frames.size() - 1);
+    }
+
+    if (!sortKey) {
+        sortKey = state->isTransparent()
+            ? makeSortKey(1, depth, *shader, uniforms.getFirstTexture(), *geometry, true)
+            : makeSortKey(0, depth, *shader, uniforms.getFirstTexture(), *geometry);
+    }
+
+    queue.commands.push_back(DrawCommand {
+        *sortKey,
+        std::move(state),
+        shader->shared_from_this(),
+        geometry->shared_from_this(),
+        instanceBuffer ? instanceBuffer->shared_from_this() : nullptr,
+        instanceCount,
+        std::move(uniforms),
+        queue.frames.size() - 1,
+        queue.objects.size() - 1,
+        boxIndex,
+        lod,
+    });
+    return lod;
+}
+}
+
+size_t draw(Shader* shader, Geometry* geometry, UniformSet uniforms,
+    const RenderState* renderState, std::optional<uint64_t> sortKey,
+    std::optional<size_t> previousLod)
+{
+    return enqueueDraw(shader, geometry, nullptr, 0, std::move(uniforms), renderState, sortKey,
+        previousLod, std::nullopt);
+}
+
+void drawInstanced(Shader* shader, Geometry* geometry, GraphicsBuffer* instanceBuffer,
+    size_t instanceCount, UniformSet uniforms, const RenderState* renderState,
+    std::optional<uint64_t> sortKey, std::optional<Aabb> bounds)
+{
+    enqueueDraw(shader, geometry, instanceBuffer, instanceCount, std::move(uniforms),
+        renderState, sortKey, std::nullopt, bounds);
+}
+
+namespace {
+// Tests the boxes of all draws at once, per run of draws with the same view and projection
+void cullDraws(DrawQueue& queue)
+{
+    const auto numBoxes = queue.boxes.size();
+    queue.boxVisible.resize(numBoxes);
+    size_t visible = 0;
+    size_t first = 0;
+    while (first < numBoxes) {
+        const auto frame = queue.boxFrames[first];
+        auto last = first + 1;
+        while (last < numBoxes && queue.boxFrames[last] == frame) {
+            last++;
+        }
+        const Frustum frustum(queue.frames[frame].viewProjectionMatrix);
+        visible += frustum.test(queue.boxes, first, last - first, queue.boxVisible.data() + first);
+        first = last;
+    }
+    const auto culled = numBoxes - visible;
+
+    size_t occluded = 0;
+    if (occlusionBuffer && occlusionBuffer->isRasterized()) {
+        // Draws from other views (e.g. shadow maps) can't be tested against it
+        const auto& viewProjection = occlusionBuffer->getViewProjection();
+        for (size_t b = 0; b < numBoxes; ++b) {
+            if (!queue.boxVisible[b]
+                || queue.frames[queue.boxFrames[b]].viewProjectionMatrix != viewProjection) {
+                continue;
+            }
+            const auto center = glm::vec3(
+                queue.boxes.centerX[b], queue.boxes.centerY[b], queue.boxes.centerZ[b]);
+            const auto extent = glm::vec3(
+                queue.boxes.extentX[b], queue.boxes.extentY[b], queue.boxes.extentZ[b]);
+            if (!occlusionBuffer->isVisible(center, extent)) {
+                queue.boxVisible[b] = 0;
+                occluded++;
+            }
+        }
     }
+    StateCache::instance().countCulling(visible - occluded, culled, occluded);
+}
 }
 
-void draw(Shader* shader, Geometry* geometry, const UniformSet& uniforms)
+void flush()
 {
-    const auto& prog = shader->getProgram();
-    prog.bind();
+    auto& queue = getDrawQueue();
+    if (queue.commands.empty()) {
+        return;
+    }
+
+    cullDraws(queue);
+    queue.order.clear();
+    for (size_t i = 0; i < queue.commands.size(); ++i) {
+        const auto box = queue.commands[i].boxIndex;
+        if (box == noBox || queue.boxVisible[box]) {
+            queue.order.push_back(i);
+        }
+    }
+
+    // Stable, so draws with the same key are executed in submission order
+    std::stable_sort(queue.order.begin(), queue.order.end(), [&queue](size_t a, size_t b) {
+        return queue.commands[a].sortKey < queue.commands[b].sortKey;
+    });
+
+    // Write the uniform blocks of all draws at once
+    auto& streamBuffer = StreamBuffer::instance();
+    const auto alignment = getUniformBufferAlignment();
+    const auto align
+        = [alignment](size_t v) { return (v + alignment - 1) / alignment * alignment; };
+    const auto frameStride = align(sizeof(FrameUniforms));
+    const auto objectStride = align(sizeof(ObjectUniforms));
+    const auto objectsStart = align(queue.frames.size() * frameStride);
+    const auto uniforms = streamBuffer.allocate(
+        objectsStart + queue.objects.size() * objectStride, alignment);
+    stage(uniforms.data, queue.frames, frameStride);
+    stage(uniforms.data + objectsStart, queue.objects, objectStride);
+    prepareMultiDraws(queue, streamBuffer);
+    // This includes vertices and indices written with Geometry::stream*
+    streamBuffer.flush();
+    const auto framesOffset = uniforms.offset;
+    const auto objectsOffset = framesOffset + objectsStart;
+    const auto uniformBuffer = uniforms.buffer;
+
+    auto& stateCache = StateCache::instance();
+    size_t currentFrame = std::numeric_limits<size_t>::max();
+    size_t nextBatch = 0;
+    size_t i = 0;
+    while (i < queue.order.size()) {
+        const auto& cmd = queue.commands[queue.order[i]];
+        stateCache.apply(*cmd.renderState);
+        stateCache.useProgram(cmd.shader->getId(), cmd.shader->getProgram());
+        if (cmd.frameIndex != currentFrame) {
+            glBindBufferRange(GL_UNIFORM_BUFFER, frameUniformBinding, uniformBuffer,
+                framesOffset + cmd.frameIndex * frameStride, sizeof(FrameUniforms));
+            currentFrame = cmd.frameIndex;
+        }
+        cmd.uniforms.set();
+        if (nextBatch < queue.batches.size() && queue.batches[nextBatch].first == i) {
+            const auto& batch = queue.batches[nextBatch++];
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, objectStorageBinding, batch.objectBuffer,
+                batch.objectsOffset, batch.count * sizeof(ObjectUniforms));
+            cmd.geometry->getPool()->multiDraw(
+                cmd.geometry->getMode(), batch.commandBuffer, batch.commandsOffset, batch.count);
+            i += batch.count;
+            continue;
+        }
+        glBindBufferRange(GL_UNIFORM_BUFFER, objectUniformBinding, uniformBuffer,
+            objectsOffset + cmd.objectIndex * objectStride, sizeof(ObjectUniforms));
+        cmd.geometry->draw(cmd.instanceBuffer.get(), cmd.instanceCount, cmd.lod);
+        i++;
+    }
+    // Unbind, so buffer uploads outside of flush() can not modify a vertex array by accident
+    stateCache.unbindVertexArray();
+
+    queue.commands.clear();
+    queue.frames.clear();
+    queue.objects.clear();
+    queue.boxes.clear();
+    queue.boxFrames.clear();
+}
 
-    prog.setUniform("modelMatrix", modelMatrix);
-    prog.setUniform("invModelMatrix", invModelMatrix);
-    prog.setUniform("normalMatrix", normalMatrix);
-    prog.setUniform("viewMatrix", viewMatrix);
-    prog.setUniform("invViewMatrix", invViewMatrix);
-    prog.setUniform("projectionMatrix", projectionMatrix);
-    prog.setUniform("invProjectionMatrix", invProjectionMatrix);
+void setFrustumCulling(bool enabled)
+{
+    frustumCulling = enabled;
+}
 
-    prog.setUniform("modelViewMatrix", modelViewMatrix);
-    prog.setUniform("invModelViewMatrix", invModelViewMatrix);
-    prog.setUniform("viewProjectionMatrix", viewProjectionMatrix);
-    prog.setUniform("invViewProjectionMatrix", invViewProjectionMatrix);
-    prog.setUniform("modelViewProjectionMatrix", modelViewProjectionMatrix);
-    prog.setUniform("invModelViewProjectionMatrix", invModelViewProjectionMatrix);
+void setOcclusionBuffer(OcclusionBuffer::Ptr buffer)
+{
+    occlusionBuffer = std::move(buffer);
+}
 
-    uniforms.set(prog);
+void setLodThreshold(float threshold)
+{
+    lodThreshold = threshold;
+}
 
-    geometry->draw();
+bool isMultiDrawSupported()
+{
+    // Multi-draw indirect with base instance and storage buffers
+    static const auto supported = []() {
+        GLint major = 0;
+        GLint minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        return major > 4 || (major == 4 && minor >= 3);
+    }();
+    return supported;
 }
 
-void flush() { }
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <cassert>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <span>
 #include <variant>
 
 #include "glw/enums.hpp"
@@ -14,6 +20,74 @@
 #include "glwx/utility.hpp"
 
 #include "buffer.hpp"
+#include "culling.hpp"
+#include "memory.hpp"
+#include "occlusion.hpp"
+#include "rangeallocator.hpp"
+#include "renderstate.hpp"
+
+// Owns a GL texture object
+class GlTexture {
+public:
+    GlTexture() = default;
+    explicit GlTexture(GLenum target);
+    ~GlTexture();
+
+    GlTexture(const GlTexture&) = delete;
+    GlTexture& operator=(const GlTexture&) = delete;
+    GlTexture(GlTexture&& other);
+    GlTexture& operator=(GlTexture&& other);
+
+    GLenum getTarget() const;
+    GLuint getTexture() const;
+
+private:
+    GLenum target_ = 0;
+    GLuint texture_ = 0;
+};
+
+// A GL_TEXTURE_2D_ARRAY. Its layers are referenced by Textures (see Texture::createLayer), so
+// textures of different materials can be bound at once and draws don't have to switch textures.
+class TextureArray : public std::enable_shared_from_this<TextureArray> {
+public:
+    using Ptr = std::shared_ptr<TextureArray>;
+
+    // RGBA8 with a full mipmap chain if `mipmaps` is true
+    [[nodiscard]] static Ptr create(size_t width, size_t height, size_t layers, bool mipmaps);
+
+    // `pixels` must be width * height RGBA8
+    void setLayer(size_t layer, const uint8_t* pixels);
+    // Call after all layers have been set
+    void generateMipmaps();
+
+    size_t getWidth() const;
+    size_t getHeight() const;
+    size_t getLayerCount() const;
+    GLuint getGlTexture() const;
+    uint32_t getId() const;
+
+private:
+    TextureArray(size_t width, size_t height, size_t layers, bool mipmaps);
+
+    uint32_t id_;
+    size_t width_;
+    size_t height_;
+    size_t layers_;
+    bool mipmaps_;
+    GlTexture texture_;
+    TrackedMemory gpuMemory_ { MemoryCategory::GpuTextures };
+};
+
+// What happens to the CPU side copy of the data of a resource once it is on the GPU
+enum class Residency {
+    Keep,
+    DropAfterUpload, // It can not be uploaded again
+    // It is read from its file again when needed. Data that does not come from a file is kept.
+    Reload,
+};
+
+struct TextureLoad;
+struct TextureSource;
 
 class Texture : public std::enable_shared_from_this<Texture> {
 public:
@@ -34,15 +108,189 @@ public:
     [[nodiscard]] static Ptr createPixel(
         const glm::vec4& color, size_t width = 1, size_t height = 1);
 
-    const glw::Texture& getGlTexture() const;
+    [[nodiscard]] static Ptr createLayer(TextureArray::Ptr array, size_t layer);
+
+    // Solid color layers share a pool of 1x1 texture arrays
+    [[nodiscard]] static Ptr createPixelLayer(const glm::vec4& color);
+
+    ~Texture();
+
+    uint32_t getId() const;
+
+    // Textures created from files or buffers are decoded on the thread pool and uploaded in
+    // slices (see updateTextureUploads). Until then a placeholder is bound instead.
+    bool isResident() const;
+
+    bool isLayer() const;
+    size_t getLayer() const;
+
+    // For layers this binds the array and the id is the one of the array
+    TextureBinding getBinding(size_t unit) const;
+
+    // Textures with a mip chain (decoded or cooked) are streamed by the TextureStreamer. Only the
+    // levels from the resident level on are on the GPU. Level 0 is the full resolution.
+    // Layers are not streamed, the levels of an array are shared by all of its layers.
+    bool isStreamed() const;
+    size_t getLevelCount() const;
+    size_t getResidentLevel() const;
+    size_t getTargetLevel() const;
+    size_t getResidentBytes() const;
+
+    // Called by the draw path for every draw using this texture. `screenSize` is the projected
+    // size of one unit of the model as a fraction of the viewport height.
+    void reportUsage(float screenSize);
+
+    // The default is Reload: the encoded data is dropped after decoding and the decoded levels
+    // are dropped once the texture has reached its target level. They are read from the file
+    // again if the streamer needs them. DropAfterUpload stops streaming and uploads all levels.
+    void setResidency(Residency residency);
+    Residency getResidency() const;
 
 private:
+    friend class TextureStreamer;
+
     Texture(BufferBase::Ptr buffer);
+    // Uses the cooked texture (see womf-cook), if it exists and is newer than the source
     Texture(std::string path);
-    Texture(glw::Texture texture);
+    Texture(GlTexture texture);
+    Texture(TextureArray::Ptr array, size_t layer);
 
+    uint32_t id_;
     BufferBase::Ptr buffer_;
-    glw::Texture texture_;
+    GlTexture texture_;
+    std::shared_ptr<TextureLoad> load_;
+    TextureArray::Ptr array_;
+    size_t layer_ = 0;
+    Residency residency_ = Residency::Reload;
+    // Where the data can be read from again
+    std::optional<FileRange> fileRange_;
+    std::string cookedPath_;
+    std::unique_ptr<TextureSource> source_;
+    size_t residentLevel_ = 0;
+    size_t targetLevel_ = 0;
+    float usage_ = 0.0f; // maximum screenSize since the last streamer update
+    size_t lastUsedFrame_ = 0;
+    TrackedMemory gpuMemory_ { MemoryCategory::GpuTextures };
+
+    void startLoad();
+    bool loadCooked(const std::string& path);
+    static bool mapCooked(const std::string& path, TextureSource& source);
+    void startStreaming(std::unique_ptr<TextureSource> source, size_t residentLevel);
+    void stopStreaming();
+    // Returns false if the data has to be read and decoded first, which happens in the background
+    bool acquireSource();
+    // Drops the data if it can be read again
+    void releaseSource();
+    // Uploads the levels that become resident (the source must be acquired for that) or
+    // releases the ones that are dropped and moves the base level of the texture to `level`
+    void setResidentLevel(size_t level);
+};
+
+struct TextureStreamingStats {
+    size_t budget = 0;
+    size_t residentBytes = 0;
+    size_t textures = 0;
+    size_t pending = 0; // below their target resolution
+    size_t raised = 0;
+    size_t dropped = 0;
+    size_t uploadedBytes = 0;
+};
+
+// Keeps the streamed textures within a GPU memory budget. The draw path reports how large each
+// texture is on screen, from which the level that is actually needed (the target) is derived.
+// Textures are raised towards their target as long as the budget allows and if it is exceeded,
+// levels are dropped, starting with the textures that were not used recently.
+class TextureStreamer {
+public:
+    static TextureStreamer& instance();
+
+    void setBudget(size_t bytes);
+    size_t getBudget() const;
+    // Added to the target level, positive values favor lower resolutions
+    void setLodBias(float bias);
+
+    // Raising levels uploads at most `maxBytes` (at least one texture, so large textures can not
+    // get stuck, unless `maxBytes` is 0). Dropping levels does not upload anything.
+    void update(size_t maxBytes);
+    // Of the last update
+    const TextureStreamingStats& getStats() const;
+
+private:
+    friend class Texture;
+
+    TextureStreamer() = default;
+
+    void add(Texture* texture);
+    void remove(Texture* texture);
+    size_t computeTargetLevel(const Texture& texture, float viewportHeight) const;
+
+    // Data of textures that were not used for this long is released (see Residency::Reload)
+    static constexpr size_t releaseDelayFrames = 120;
+
+    std::vector<Texture*> textures_;
+    size_t budget_ = 256 * 1024 * 1024;
+    float lodBias_ = 0.0f;
+    size_t frame_ = 0;
+    TextureStreamingStats stats_;
+};
+
+// Packs textures into texture arrays. Textures with the same size end up in the same array.
+// Differently sized textures are not scaled, so ideally all textures of a model have the same size.
+class TextureArrayBuilder {
+public:
+    // Returns the index of the texture in the result of build()
+    size_t add(Buffer::Ptr buffer);
+    size_t add(BufferView::Ptr buffer);
+    size_t add(std::string path);
+
+    // Decodes all textures and returns a layer for each of them in the order they were added
+    std::vector<Texture::Ptr> build();
+
+private:
+    std::vector<BufferBase::Ptr> buffers_;
+};
+
+// Uploads the decoded textures through a pixel buffer object, at most `maxBytes` per call (at
+// least one row). Returns the number of bytes uploaded.
+size_t updateTextureUploads(size_t maxBytes);
+// Waits for all pending textures to be decoded and uploads them
+void finishTextureUploads();
+size_t getPendingTextureUploads();
+
+// glw::UniformInfo::Type does not have this, but it is just the GL enum
+constexpr auto sampler2DArrayType = static_cast<glw::UniformInfo::Type>(GL_SAMPLER_2D_ARRAY);
+
+bool isSamplerType(glw::UniformInfo::Type type);
+
+// Resolved once when a shader is created, so drawing does not have to look up uniforms by name
+struct UniformLayout {
+    struct Entry {
+        std::string name;
+        GLint location;
+        glw::UniformInfo::Type type;
+        size_t arraySize;
+        size_t offset; // into the data of a UniformSet
+        size_t textureUnit; // of the first element, only for samplers
+        // For texture array samplers, the index of the int uniform "<name>Layer" (if present),
+        // which is set automatically to the layer of the textures
+        std::optional<size_t> layerEntry;
+        // For texture array samplers without one, the component of textureLayers (see womf.glsl)
+        // the layer of the first element is written to, which is per draw object data
+        std::optional<size_t> objectLayer;
+    };
+
+    // The layers of array samplers without a "<name>Layer" uniform are assigned to the
+    // components of textureLayers in the order of their names
+    static constexpr size_t maxObjectLayers = 4;
+
+    // Every sampler gets a fixed texture unit, which is set here once, so drawing only has to bind
+    // the textures. This binds the program.
+    static UniformLayout compile(const glw::ShaderProgram& prog);
+    static size_t getTypeSize(glw::UniformInfo::Type type);
+
+    std::vector<Entry> entries;
+    size_t dataSize = 0;
+    size_t numTextureUnits = 0;
 };
 
 class Shader : public std::enable_shared_from_this<Shader> {
@@ -59,6 +307,11 @@ public:
     }
 
     const glw::ShaderProgram& getProgram() const;
+    const UniformLayout& getUniformLayout() const;
+    uint32_t getId() const;
+    // Reads the object uniforms per draw from an array (WOMF_MULTI_DRAW in womf.glsl), so it
+    // can only draw geometry from a GeometryPool, but those draws can be merged.
+    bool isMultiDraw() const;
 
 private:
     void initialize(std::string_view vert, std::string_view vertPath, std::string_view frag,
@@ -70,7 +323,10 @@ private:
     Shader(std::string vertPath, std::string fragPath);
     Shader(std::string combined);
 
+    uint32_t id_;
     glw::ShaderProgram prog_;
+    UniformLayout uniformLayout_;
+    bool multiDraw_ = false;
 };
 
 template <typename Enum>
@@ -94,41 +350,339 @@ class GraphicsBuffer : public std::enable_shared_from_this<GraphicsBuffer> {
 public:
     using Ptr = std::shared_ptr<GraphicsBuffer>;
 
+    struct Stats {
+        size_t buffers = 0; // currently alive
+        size_t uploads = 0;
+        size_t uploadedBytes = 0;
+        size_t shared = 0; // getShared calls that returned an existing buffer
+    };
+
     [[nodiscard]] static Ptr create(BufferTarget target, BufferUsage usage, Buffer::Ptr buffer);
     [[nodiscard]] static Ptr create(BufferTarget target, BufferUsage usage, BufferView::Ptr buffer);
     [[nodiscard]] static Ptr create(BufferTarget target, BufferUsage usage, std::string filename);
 
+    // Returns the buffer that is alive for the same file range (see BufferBase::getFileRange) if
+    // there is one, so data that is referenced from many places (like glTF bufferViews) is only
+    // uploaded once. Data that does not come from a file is not shared.
+    [[nodiscard]] static Ptr getShared(BufferTarget target, BufferUsage usage, Buffer::Ptr buffer);
+    [[nodiscard]] static Ptr getShared(
+        BufferTarget target, BufferUsage usage, BufferView::Ptr buffer);
+
+    // Totals since startup, except `buffers`
+    static const Stats& getStats();
+
+    ~GraphicsBuffer();
+
+    GraphicsBuffer(const GraphicsBuffer&) = delete;
+    GraphicsBuffer& operator=(const GraphicsBuffer&) = delete;
+
     glw::Buffer& getGlBuffer();
+    size_t getSize() const;
+    uint32_t getId() const;
+
+    // Nothing reads the data back, so the default is DropAfterUpload. Switching to Keep reads
+    // dropped data from its file again, which dies if the data did not come from a file.
+    void setResidency(Residency residency);
+    Residency getResidency() const;
+    // Uploads the data again, e.g. after the context was lost. Not possible with DropAfterUpload.
+    void reupload();
 
 private:
     GraphicsBuffer(BufferTarget target, BufferUsage usage, BufferBase::Ptr buffer);
     GraphicsBuffer(BufferTarget target, BufferUsage usage, std::string filename);
 
+    static Ptr getShared(BufferTarget target, BufferUsage usage, BufferBase::Ptr buffer);
+    void upload(const BufferBase& buffer);
+
+    uint32_t id_;
     BufferTarget target_;
     BufferUsage usage_;
     BufferBase::Ptr buffer_;
+    size_t size_;
+    std::optional<FileRange> fileRange_;
+    Residency residency_ = Residency::DropAfterUpload;
     glw::Buffer gfxBuffer_;
+    TrackedMemory gpuMemory_;
+};
+
+// Attributes at locations >= firstInstanceAttributeLocation advance per instance instead of per
+// vertex (see getAttributeLocation).
+constexpr size_t firstInstanceAttributeLocation = 8;
+
+class VertexFormat {
+public:
+    struct Attribute {
+        size_t location;
+        size_t components;
+        glw::AttributeType type;
+        bool normalized;
+        size_t offset;
+    };
+
+    // More than 4 components (i.e. matrices) are split into columns of 4 at consecutive locations
+    VertexFormat& add(
+        size_t location, size_t components, glw::AttributeType type, bool normalized = false);
+    // At an explicit offset in the vertex, e.g. for interleaved buffers or attributes that are not
+    // at the start of the buffer
+    VertexFormat& add(size_t location, size_t components, glw::AttributeType type, bool normalized,
+        size_t offset);
+    // Overrides the stride that is computed from the attributes
+    VertexFormat& setStride(size_t stride);
+
+    const std::vector<Attribute>& getAttributes() const;
+    size_t getStride() const;
+
+    // Sets (and enables) the attribute pointers for the buffer bound to GL_ARRAY_BUFFER.
+    // The vertices start at `baseOffset` in that buffer.
+    void set(size_t baseOffset = 0) const;
+
+private:
+    std::vector<Attribute> attributes_;
+    size_t stride_ = 0;
+    bool explicitStride_ = false;
+};
+
+size_t getAttributeTypeSize(glw::AttributeType type);
+
+// Not in glw::AttributeType either. Always 4 components (xyz 10 bits, w 2 bits) in 4 bytes, used
+// for normalized normals and tangents (see meshoptimize.hpp).
+constexpr auto packedI10Type = static_cast<glw::AttributeType>(GL_INT_2_10_10_10_REV);
+
+// Transient per-frame data (vertices, indices, uniforms) is written into one large buffer, so
+// there are no stalls and no buffers have to be created every frame. If buffer storage is
+// available, the buffer is mapped persistently and split into a region per frame in flight,
+// each protected by a fence. Otherwise the data is collected on the CPU and uploaded into an
+// orphaned buffer in flush().
+class StreamBuffer {
+public:
+    struct Allocation {
+        GLuint buffer;
+        size_t offset;
+        size_t size;
+        // Only valid until the next call to allocate
+        uint8_t* data;
+    };
+
+    struct Stats {
+        bool persistent = false;
+        size_t capacity = 0; // of one frame
+        size_t used = 0;
+        size_t waits = 0; // for the GPU to finish reading a region
+        size_t grows = 0;
+    };
+
+    static StreamBuffer& instance();
+
+    // The allocation is only valid until the end of the frame
+    Allocation allocate(size_t size, size_t alignment);
+    // Has to be called before the GPU reads data that was written since the last call
+    void flush();
+    // Starts the next frame
+    void endFrame();
+    // Of the last frame
+    const Stats& getStats() const;
+
+private:
+    static constexpr size_t framesInFlight = 3;
+
+    StreamBuffer(size_t capacity);
+    ~StreamBuffer();
+
+    void createBuffer();
+    void waitForRegion(size_t region);
+
+    bool persistent_;
+    size_t capacity_; // per region
+    // Of all allocations so far, the capacity is a multiple of it
+    size_t maxAlignment_ = 1;
+    GLuint buffer_ = 0;
+    uint8_t* mapping_ = nullptr;
+    size_t region_ = 0;
+    size_t cursor_ = 0;
+    std::array<GLsync, framesInFlight> fences_ = {};
+    // Buffers that were replaced by a bigger one, until the GPU is done with them
+    std::vector<std::pair<GLuint, GLsync>> retired_;
+    std::vector<uint8_t> staging_; // without persistent mapping
+    size_t flushed_ = 0;
+    TrackedMemory gpuMemory_ { MemoryCategory::GpuBuffers };
+    Stats stats_;
+    Stats lastFrameStats_;
 };
 
+class GeometryPool;
+
 class Geometry : public std::enable_shared_from_this<Geometry> {
 public:
     using Ptr = std::shared_ptr<Geometry>;
 
-    [[nodiscard]] static Ptr create(glw::DrawMode mode);
-
-    void addVertexBuffer(const glw::VertexFormat& fmt, GraphicsBuffer::Ptr buffer);
+    // A coarser version of the geometry that uses the same vertices
+    struct Lod {
+        size_t indexOffset; // in bytes, into the index buffer
+        size_t indexCount;
+        // How far the simplified surface is from the full one, relative to the diagonal of the
+        // bounds. This is the root mean square distance of the moved vertices from the
+        // triangles that were merged into them (area weighted), so single points may be further.
+        float error;
+    };
 
-    // This takes an AttributeType, so I only have to bind a single enum to Lua
-    void setIndexBuffer(glw::AttributeType idxType, GraphicsBuffer::Ptr buffer);
+    [[nodiscard]] static Ptr create(glw::DrawMode mode);
 
-    void draw();
+    ~Geometry();
+
+    // The vertices start at `offset` bytes in the buffer, so many geometries can share a buffer.
+    // Without a count, all vertices up to the end of the buffer are used.
+    void addVertexBuffer(const VertexFormat& fmt, GraphicsBuffer::Ptr buffer, size_t offset = 0,
+        std::optional<size_t> count = std::nullopt);
+
+    // This takes an AttributeType, so I only have to bind a single enum to Lua.
+    // The indices start at `offset` bytes and by default go until the end of the buffer.
+    void setIndexBuffer(glw::AttributeType idxType, GraphicsBuffer::Ptr buffer, size_t offset = 0,
+        std::optional<size_t> count = std::nullopt);
+
+    // The format of the instance buffers passed to draw
+    void setInstanceFormat(const VertexFormat& fmt);
+
+    // Copies the data into the StreamBuffer, so it's only valid for the current frame and has to
+    // be set again every frame the geometry is drawn (e.g. for particles or debug geometry).
+    // Draws are queued, so this may only be called once per frame for a geometry.
+    void streamVertices(const VertexFormat& fmt, std::span<const uint8_t> data);
+    void streamIndices(glw::AttributeType idxType, std::span<const uint8_t> data);
+
+    // `lod` is the level of detail, 0 is the full geometry (see setLods)
+    void draw(GraphicsBuffer* instanceBuffer = nullptr, size_t instanceCount = 0, size_t lod = 0);
+
+    // Levels 1 and up, from fine to coarse. Level 0 is the range passed to setIndexBuffer, the
+    // others are ranges of the same index buffer. Setting the index buffer removes them.
+    void setLods(std::vector<Lod> lods);
+    // Including level 0
+    size_t getLodCount() const;
+    // The coarsest level whose error, projected to the screen, is below the threshold (see
+    // setLodThreshold). `screenSize` is the size of the diagonal of the bounds, relative to the
+    // screen height. If the level used for the previous frame is passed, it is kept until
+    // another level is better by a margin, so the level does not flicker back and forth at the
+    // threshold.
+    size_t selectLod(float screenSize, std::optional<size_t> previous = std::nullopt) const;
+
+    // In model space. Draws of geometry with bounds are frustum culled (instanced draws use the
+    // bounds passed to drawInstanced instead). Bounds of skinned geometry have to be updated when
+    // the pose changes.
+    void setBounds(const Aabb& bounds);
+    const std::optional<Aabb>& getBounds() const;
+
+    // Applied to the vertices before the model matrix, e.g. to dequantize positions. The normal
+    // matrix and the bounds are not affected, so it may only translate and scale uniformly.
+    // Instanced draws leave it out of the object matrices, their shaders have to apply the
+    // vertexTransform uniform before the instance matrix (see womf.glsl). Positions read on the
+    // CPU (e.g. for OcclusionBuffer::addOccluder) have to be transformed as well.
+    void setVertexTransform(const glm::mat4& transform);
+    const std::optional<glm::mat4>& getVertexTransform() const;
+
+    uint32_t getId() const;
+    glw::DrawMode getMode() const;
+    // The id of the vertex array used for drawing, which is shared by all geometry of a pool
+    uint32_t getVertexArrayId() const;
+
+    // nullptr if the geometry is not from a GeometryPool
+    GeometryPool* getPool() const;
+    // Of the range in the pool, in vertices and indices
+    size_t getBaseVertex() const;
+    size_t getFirstIndex() const;
+    size_t getIndexCount() const;
 
 private:
+    friend class GeometryPool;
+
     Geometry(glw::DrawMode mode);
 
+    uint32_t id_;
+    glw::DrawMode mode_;
+    glw::VertexArray vertexArray_;
     std::vector<GraphicsBuffer::Ptr> vertexBuffers_;
+    size_t vertexCount_ = 0; // of the shortest vertex buffer
+    bool streamedVertices_ = false;
     GraphicsBuffer::Ptr indexBuffer_;
-    glwx::Primitive primitive_;
+    GLenum indexType_ = 0; // 0 if there are no indices
+    size_t indexCount_ = 0;
+    size_t indexOffset_ = 0; // in bytes
+    std::optional<VertexFormat> instanceFormat_;
+    uint32_t instanceBufferId_ = 0; // currently attached to the vertex array
+    std::shared_ptr<GeometryPool> pool_;
+    size_t baseVertex_ = 0;
+    size_t firstIndex_ = 0;
+    std::optional<Aabb> bounds_;
+    std::optional<glm::mat4> vertexTransform_;
+    std::vector<Lod> lods_;
+};
+
+// Static geometry of many meshes with the same vertex format and index type is suballocated from
+// a single vertex buffer and a single index buffer, so all of it can be drawn with the same
+// vertex array. Draws with a multi-draw shader (see Shader::isMultiDraw) that end up next to each
+// other after sorting and only differ in their object uniforms are merged into a single
+// glMultiDrawElementsIndirect in flush().
+class GeometryPool : public std::enable_shared_from_this<GeometryPool> {
+public:
+    using Ptr = std::shared_ptr<GeometryPool>;
+
+    struct Stats {
+        size_t geometries = 0;
+        // In vertices and indices
+        size_t vertexCapacity = 0;
+        size_t verticesUsed = 0;
+        size_t indexCapacity = 0;
+        size_t indicesUsed = 0;
+        size_t grows = 0;
+    };
+
+    // The most draws merged into a single multi-draw
+    static constexpr size_t maxMultiDrawCount = 4096;
+
+    // The vertex format describes a single interleaved buffer. The capacities are in vertices and
+    // indices and the buffers grow if they are exceeded.
+    [[nodiscard]] static Ptr create(const VertexFormat& fmt, glw::AttributeType indexType,
+        size_t vertexCapacity = 64 * 1024, size_t indexCapacity = 256 * 1024);
+
+    ~GeometryPool();
+
+    GeometryPool(const GeometryPool&) = delete;
+    GeometryPool& operator=(const GeometryPool&) = delete;
+
+    // The data is copied into the pool and the range is freed when the geometry is destroyed.
+    // The indices are relative to the first vertex of this geometry.
+    Geometry::Ptr add(
+        glw::DrawMode mode, std::span<const uint8_t> vertices, std::span<const uint8_t> indices);
+
+    // `count` commands (DrawElementsIndirectCommand) starting at `offset` in `indirectBuffer`
+    void multiDraw(glw::DrawMode mode, GLuint indirectBuffer, size_t offset, size_t count);
+
+    uint32_t getId() const;
+    const VertexFormat& getVertexFormat() const;
+    GLenum getIndexType() const;
+    Stats getStats() const;
+
+private:
+    friend class Geometry;
+
+    GeometryPool(const VertexFormat& fmt, glw::AttributeType indexType, size_t vertexCapacity,
+        size_t indexCapacity);
+
+    void bind();
+    void setupVertexArray();
+    GLuint resizeBuffer(GLuint buffer, size_t oldSize, size_t newSize);
+    void reserve(size_t vertexCount, size_t indexCount);
+    void free(size_t baseVertex, size_t vertexCount, size_t firstIndex, size_t indexCount);
+
+    uint32_t id_; // Shares the id space with Geometry, because it's bound like one
+    VertexFormat format_;
+    GLenum indexType_;
+    size_t indexSize_;
+    glw::VertexArray vertexArray_;
+    GLuint vertexBuffer_ = 0;
+    GLuint indexBuffer_ = 0;
+    RangeAllocator vertices_;
+    RangeAllocator indices_;
+    size_t geometries_ = 0;
+    size_t grows_ = 0;
+    TrackedMemory gpuMemory_ { MemoryCategory::GpuBuffers };
 };
 
 using Mat4 = std::tuple<float, float, float, float, float, float, float, float, float, float, float,
@@ -140,6 +694,7 @@ struct Transform : public glwx::Transform {
 
     static std::tuple<float, float, float> unpack(const glm::vec3& v);
     static std::tuple<float, float, float, float> unpack(const glm::quat& q);
+    static Mat4 unpack(const glm::mat4& m);
 
     std::tuple<float, float, float> getPosition() const;
     void setPosition(float x, float y, float z);
@@ -167,18 +722,54 @@ struct Transform : public glwx::Transform {
     Mat4 getMatrix() const;
 };
 
-using UniformValue = std::variant<int, float, glm::vec2, glm::vec3, glm::vec4, glm::mat2, glm::mat3,
-    glm::mat4, const glw::Texture*>;
-
-// TODO: Use Uniform Buffer Objects
+// The built-in matrices are passed with uniform buffer objects (see womf.glsl), these are the
+// remaining user uniforms. Values are written into a flat buffer laid out by the shader's
+// UniformLayout and uploaded with a single glUniform*v call per uniform.
 class UniformSet {
 public:
-    UniformValue& operator[](const std::string& name) { return uniforms[name]; }
+    // The layout must outlive the set
+    UniformSet(const UniformLayout& layout);
 
-    void set(const glw::ShaderProgram& shader) const;
+    template <typename T>
+    void write(const UniformLayout::Entry& entry, size_t element, const T& value)
+    {
+        assert(sizeof(T) == UniformLayout::getTypeSize(entry.type));
+        assert(element < entry.arraySize);
+        std::memcpy(data_.data() + entry.offset + element * sizeof(T), &value, sizeof(T));
+    }
+
+    // The texture is kept alive until the set is destroyed
+    void writeTexture(const UniformLayout::Entry& entry, size_t element, Texture::Ptr texture);
+    const Texture* getFirstTexture() const;
+    const std::vector<Texture::Ptr>& getTextures() const;
+    // Go into the object uniforms, so they don't prevent draws from being merged
+    const std::array<int32_t, UniformLayout::maxObjectLayers>& getObjectLayers() const;
+
+    // Marks the first `count` elements of the uniform for upload. Textures don't need this.
+    void add(const UniformLayout::Entry& entry, size_t count);
+
+    // Uploads the uniforms and binds the textures to the units of their samplers
+    void set() const;
+
+    // Whether set() would result in the same state, so the draws can be merged
+    bool isEquivalent(const UniformSet& other) const;
 
 private:
-    std::unordered_map<std::string, UniformValue> uniforms;
+    struct Binding {
+        GLint location;
+        glw::UniformInfo::Type type;
+        uint32_t count;
+        uint32_t offset;
+
+        bool operator==(const Binding& other) const = default;
+    };
+
+    const UniformLayout* layout_;
+    std::vector<Binding> bindings_;
+    std::vector<uint8_t> data_;
+    std::vector<TextureBinding> textureBindings_;
+    std::vector<Texture::Ptr> textures_;
+    std::array<int32_t, UniformLayout::maxObjectLayers> objectLayers_ {};
 };
 
 size_t getAttributeLocation(const std::string& name);
@@ -201,5 +792,47 @@ void setProjectionMatrix(float x0, float y0, float z0, float w0, float x1, float
     float w1, float x2, float y2, float z2, float w2, float x3, float y3, float z3, float w3);
 void setProjectionMatrix(float fovy, float aspect, float near, float far);
 
-void draw(Shader* shader, Geometry* geometry, const UniformSet& uniforms);
+const glm::mat4& getModelMatrix();
+const glm::mat4& getViewProjectionMatrix();
+
+// Draws are queued and executed in flush(), sorted by their sort key. If no sort key is given, one
+// is generated from the shader, the first texture, the geometry and the depth. Transparent draws
+// (see RenderState) are sorted back to front after all opaque draws.
+// If no render state is given, the default one is used.
+// Geometry with bounds and levels of detail is drawn with the level selected by
+// Geometry::selectLod, which is returned. Pass it back as `previousLod` the next frame to get
+// hysteresis (it has to be tracked per object, because geometry is shared).
+// The generated sort keys use layer 0 for opaque draws and layer 1 for transparent ones (back to
+// front). Within a layer, draws are sorted by depth, then by shader, texture and geometry.
+constexpr uint32_t maxSortLayer = 15;
+uint64_t makeSortKey(uint32_t layer, float depth, const Shader& shader, const Texture* texture,
+    const Geometry& geometry, bool backToFront = false);
+
+size_t draw(Shader* shader, Geometry* geometry, UniformSet uniforms,
+    const RenderState* renderState = nullptr, std::optional<uint64_t> sortKey = std::nullopt,
+    std::optional<size_t> previousLod = std::nullopt);
+// The per-instance attributes are read from instanceBuffer (see Geometry::setInstanceFormat).
+// The instances can be anywhere, so they are always drawn with the full geometry.
+// The instance data is only on the GPU, so instances are not culled individually. If `bounds`
+// (in model space, enclosing the geometry of all instances) is given, the whole draw is culled
+// with it.
+void drawInstanced(Shader* shader, Geometry* geometry, GraphicsBuffer* instanceBuffer,
+    size_t instanceCount, UniformSet uniforms, const RenderState* renderState = nullptr,
+    std::optional<uint64_t> sortKey = std::nullopt, std::optional<Aabb> bounds = std::nullopt);
 void flush();
+
+// Draws are culled in flush(), if the geometry has bounds. Enabled by default.
+void setFrustumCulling(bool enabled);
+// Draws that pass frustum culling are also tested against this buffer, if it has been rasterized
+// when flush() is called. Only draws with exactly the view projection matrix the buffer was
+// cleared with are tested, the others are never occluded. Pass nullptr to disable occlusion
+// culling.
+void setOcclusionBuffer(OcclusionBuffer::Ptr buffer);
+
+// The largest error of a level of detail on screen, relative to the screen height (see
+// Geometry::selectLod). The default is half a pixel at 1080p, because the error is a root mean
+// square and not the largest distance (see Geometry::Lod).
+void setLodThreshold(float threshold);
+
+// Whether the GL version supports multi-draw shaders (see Shader::isMultiDraw)
+bool isMultiDrawSupported();
@@ -0,0 +1,65 @@
+#include "image.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// glwx has its own copy of stb_image, so keep ours private to this translation unit
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+std::optional<Image> Image::decode(std::span<const uint8_t> data)
+{
+    int width = 0, height = 0, channels = 0;
+    const auto pixels = stbi_load_from_memory(
+        data.data(), static_cast<int>(data.size()), &width, &height, &channels, 4);
+    if (!pixels) {
+        return std::nullopt;
+    }
+    Image image;
+    image.width = static_cast<size_t>(width);
+    image.height = static_cast<size_t>(height);
+    image.pixels.resize(image.width * image.height * 4);
+    std::memcpy(image.pixels.data(), pixels, image.pixels.size());
+    stbi_image_free(pixels);
+    return image;
+}
+
+Image Image::downsample() const
+{
+    Image mip;
+    mip.width = std::max<size_t>(width / 2, 1);
+    mip.height = std::max<size_t>(height / 2, 1);
+    mip.pixels.resize(mip.width * mip.height * 4);
+    const auto rowSize = width * 4;
+    for (size_t y = 0; y < mip.height; ++y) {
+        const auto row0 = pixels.data() + std::min(y * 2, height - 1) * rowSize;
+        const auto row1 = pixels.data() + std::min(y * 2 + 1, height - 1) * rowSize;
+        auto dst = mip.pixels.data() + y * mip.width * 4;
+        if (width >= 2) {
+            // No branches and plain integer math in the inner loop, so this gets vectorized
+            const auto n = mip.width * 4;
+            for (size_t i = 0; i < n; ++i) {
+                const auto src = (i / 4) * 8 + i % 4;
+                const auto sum = static_cast<uint32_t>(row0[src]) + row0[src + 4] + row1[src]
+                    + row1[src + 4];
+                dst[i] = static_cast<uint8_t>((sum + 2) / 4);
+            }
+        } else {
+            for (size_t c = 0; c < 4; ++c) {
+                dst[c] = static_cast<uint8_t>((row0[c] + row1[c] + 1) / 2);
+            }
+        }
+    }
+    return mip;
+}
+
+std::vector<Image> buildMipChain(Image image)
+{
+    std::vector<Image> chain;
+    chain.push_back(std::move(image));
+    while (chain.back().width > 1 || chain.back().height > 1) {
+        chain.push_back(chain.back().downsample());
+    }
+    return chain;
+}
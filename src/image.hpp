@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Decoded image data, always RGBA8
+struct Image {
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint8_t> pixels;
+
+    // Decodes any format supported by stb_image
+    static std::optional<Image> decode(std::span<const uint8_t> data);
+
+    // 2x2 box filter. For odd sizes the last row or column is dropped, a size of 1 is kept and
+    // its pixels are averaged with themselves.
+    Image downsample() const;
+};
+
+// The image itself followed by all its mipmap levels down to 1x1
+std::vector<Image> buildMipChain(Image image);
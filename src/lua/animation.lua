@@ -45,6 +45,19 @@ function womf.Animation:addChannel(key, samplerType, interp, times, values)
     self.state[key] = self:sample(key, self.time)
 end
 
+-- The clone shares the channels (and their samplers), but has its own playback state, e.g. for
+-- every instance of a model. Don't add channels to either of them afterwards.
+function womf.Animation:clone()
+    local anim = womf.Animation()
+    anim.channels = self.channels
+    anim.duration = self.duration
+    anim.looping = self.looping
+    for key in pairs(self.channels) do
+        anim.state[key] = anim:sample(key, 0)
+    end
+    return anim
+end
+
 function womf.Animation:getState()
     return self.state
 end
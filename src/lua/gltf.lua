@@ -1,6 +1,6 @@
 local json = require "json"
 
-local pixelTexture = womf.pixelTexture(1, 1, 1, 1)
+local pixelTexture = womf.pixelTextureLayer(1, 1, 1, 1)
 
 local function walkNode(node, func)
     func(node)
@@ -15,90 +15,201 @@ local function walkScene(scene, func)
     end
 end
 
-local function getGlobalTransform(node, rootTrafo)
-    rootTrafo = rootTrafo or mat4()
-    local parentTrafo = node.parent and node.parent.fullTransform or rootTrafo
-    local nodeTrafo = mat4(node.transform:getMatrix())
-    node.fullTransform = parentTrafo * nodeTrafo
-    return node.fullTransform
+local identityTransform = womf.Transform()
+
+-- A model is everything that is loaded from the file and shared by all of its instances: meshes,
+-- materials, skins, animations and a template of the node transforms.
+local Model = {}
+Model.__index = Model
+
+-- An instance only has its own node transforms (a contiguous range in the scene graph of the
+-- model), the joint matrices of its skins and the playback state of its animations.
+local Instance = {}
+Instance.__index = Instance
+
+local SkinInstance = {}
+SkinInstance.__index = SkinInstance
+
+-- Animations are cloned when they are used first, because most instances only play a few
+local animationModels = setmetatable({}, {__mode = "k"})
+local InstanceAnimations = {}
+function InstanceAnimations.__index(animations, key)
+    local model = animationModels[animations]
+    local index = type(key) == "number" and key or model.animationIndices[key]
+    local template = index and model.animations[index]
+    if not template then
+        return nil
+    end
+    local anim = template:clone()
+    rawset(animations, index, anim)
+    if model.animationNames[index] then
+        rawset(animations, model.animationNames[index], anim)
+    end
+    return anim
 end
 
-local function drawScene(scene, shader, sceneTransform)
-    sceneTransform = sceneTransform and mat4(sceneTransform:getMatrix()) or mat4()
-    walkScene(scene, function(node)
-        if node.mesh then
-            womf.setModelMatrix(getGlobalTransform(node, sceneTransform):unpack())
-            for _, prim in ipairs(node.mesh.primitives) do
-                womf.draw(shader, prim.geometry, {
-                    jointMatrices = node.skin and node.skin.jointMatrices,
-                    texture = prim.material.albedo or pixelTexture,
-                    color = prim.material.color,
-                })
+function Model:walk(func)
+    walkScene(self, func)
+end
+
+function Model:instantiate()
+    -- Released when the instance is destroyed or collected
+    local nodes = self.graph:instantiateRange(0, self.nodeCount)
+    local instance = setmetatable({
+        model = self,
+        graph = self.graph,
+        nodes = nodes,
+        base = nodes:getFirst(),
+        skins = {},
+        animations = setmetatable({}, InstanceAnimations),
+        -- The level of detail of every primitive drawn last, in the order of Instance:draw
+        lods = {},
+    }, Instance)
+    instance.root = self.graph:getNode(instance.base)
+    animationModels[instance.animations] = self
+    for skinIdx, skin in ipairs(self.skins) do
+        instance.skins[skinIdx] = setmetatable({
+            instance = instance,
+            skin = skin,
+            jointMatrices = womf.MatrixPalette(skin.native:getJointCount()),
+        }, SkinInstance)
+        instance.skins[skinIdx]:update()
+    end
+    return instance
+end
+
+function Instance:walk(func)
+    walkScene(self.model, func)
+end
+
+-- A handle to the transform of the node in this instance (by index or name)
+function Instance:getNode(key)
+    local node = type(key) == "number" and self.model.nodes[key] or self.model.nodesByName[key]
+    return node and self.graph:getNode(self.base + node.id)
+end
+
+function Instance:draw(shader, sceneTransform)
+    -- Only changes the world matrices if the transform is different from the last draw
+    self.root:setTransform(sceneTransform or identityTransform)
+    local graph, base, lods = self.graph, self.base, self.lods
+    local drawIdx = 0
+    for _, node in ipairs(self.model.meshNodes) do
+        womf.setModelMatrix(graph, base + node.id)
+        local skin = node.skin and self.skins[node.skin]
+        for _, prim in ipairs(node.mesh.primitives) do
+            if skin and skin.bounds then
+                -- The geometry is shared by all instances, but the bounds are used when drawing
+                prim.geometry:setBounds(unpack(skin.bounds))
             end
+            drawIdx = drawIdx + 1
+            lods[drawIdx] = womf.draw(shader, prim.geometry, {
+                jointMatrices = skin and skin.jointMatrices,
+                -- The layer is passed in the object uniforms (textureLayers in womf.glsl)
+                albedo = prim.material.albedo or pixelTexture,
+                color = prim.material.color,
+            }, nil, nil, lods[drawIdx])
         end
-    end)
+    end
 end
 
-local function makeMat4(src)
-    local m = mat4()
-    for i = 1, 16 do
-        m[i] = src[i - 1]
+-- What this instance costs on its own, i.e. without the model data
+function Instance:getMemoryUsage()
+    local paletteBytes = 0
+    for _, skin in ipairs(self.skins) do
+        paletteBytes = paletteBytes + skin.jointMatrices:getSize() * 16 * 4
     end
-    return m
+    return {
+        nodes = self.model.nodeCount,
+        nodeBytes = self.model.nodeCount * self.graph:getStats().bytesPerNode,
+        paletteBytes = paletteBytes,
+    }
+end
+
+-- The nodes of the instance will be reused by the next instance of the model. This also happens
+-- when the instance is collected, but that may take a while.
+function Instance:destroy()
+    self.nodes:release()
+    self.graph = nil
 end
 
-local function updateSkin(skin)
-    local invGlobalTransform = mat4.invert(mat4(), getGlobalTransform(skin.rootNode))
-    for i, joint in ipairs(skin.joints) do
-        local parentTrafo = joint.node.parent and joint.node.parent.fullTransform or mat4()
-        joint.node.fullTransform = parentTrafo * mat4(joint.node.transform:getMatrix())
-        skin.jointMatrices[i] = {(invGlobalTransform * joint.node.fullTransform * joint.inverseBindMatrix):unpack()}
+function SkinInstance:update()
+    local minX, minY, minZ, maxX, maxY, maxZ = self.skin.native:update(self.instance.graph,
+        self.instance.base, self.jointMatrices)
+    local pad = self.skin.boundsPadding
+    if pad then
+        self.bounds = self.bounds or {}
+        local bounds = self.bounds
+        bounds[1], bounds[2], bounds[3] = minX - pad, minY - pad, minZ - pad
+        bounds[4], bounds[5], bounds[6] = maxX + pad, maxY + pad, maxZ + pad
     end
 end
 
-local function poseSkin(skin, pose)
+function SkinInstance:pose(pose)
+    local graph, base, channels = self.instance.graph, self.instance.base, self.skin.poseChannels
     for key, value in pairs(pose) do
-        local bone, component = key:match("([^/]+)/(.+)")
-        local trafo = skin.joints[bone].node.transform
-        if component == "translation" then
-            trafo:setPosition(value:unpack())
-        elseif component == "rotation" then
-            trafo:setOrientation(value:unpack())
+        local channel = channels[key]
+        if not channel then
+            local bone, component = key:match("([^/]+)/(.+)")
+            channel = {node = self.skin.jointNodes[bone], component = component}
+            channels[key] = channel
+        end
+        if channel.component == "translation" then
+            graph:setPosition(base + channel.node, value:unpack())
+        elseif channel.component == "rotation" then
+            graph:setOrientation(base + channel.node, value:unpack())
         end
     end
-    skin:update()
+    self:update()
 end
 
-function womf.loadGltf(filename)
+-- Reads the file with the Lua JSON parser. womf.readGltf is the native loader and returns the
+-- same tables (with 1-based indices), this is kept to compare against it (see
+-- examples/gltfbenchmark.lua).
+-- The GC only sees the small userdata of the file buffers, not how much memory they hold. Call
+-- collectgarbage() after loading if that memory should be freed right away.
+local function readGltf(filename)
+    assert(not filename:match("%.glb$"), ".glb files are only supported by the native loader")
     local data = json.decode(womf.readFile(filename))
     assert(#data.scenes == 1)
+    -- e.g. EXT_meshopt_compression
+    assert(not data.extensionsRequired,
+        "Required extensions are only supported by the native loader")
 
     local dir = filename:match("(.-/)[^/]+$") or "./"
 
     local ret = {}
 
-    ret.buffers = {}
+    -- Not part of the result, so the file contents can be freed once everything is uploaded
+    local buffers = {}
     for bufIdx, buffer in ipairs(data.buffers) do
         assert(buffer.uri)
-        ret.buffers[bufIdx] = womf.Buffer(dir .. buffer.uri)
+        buffers[bufIdx] = womf.Buffer(dir .. buffer.uri)
     end
 
-    ret.bufferViews = {}
+    local bufferViews = {}
     for bvIdx, bv in ipairs(data.bufferViews) do
-        ret.bufferViews[bvIdx] = womf.BufferView(ret.buffers[bv.buffer + 1], bv.byteOffset or 0, bv.byteLength)
+        bufferViews[bvIdx] = womf.BufferView(buffers[bv.buffer + 1], bv.byteOffset or 0, bv.byteLength)
     end
 
-    ret.textures = {}
-    for texIdx, texture in ipairs(data.textures or {}) do
-        local image = data.images[texture.source + 1]
+    -- All textures are layers of texture arrays (one per texture size), so primitives with
+    -- different materials can be drawn without switching textures (see assets/array.frag)
+    local textureArrays = womf.TextureArrayBuilder()
+    local imageLayers = {}
+    for imgIdx, image in ipairs(data.images or {}) do
         if image.uri then
-            ret.textures[texIdx] = womf.Texture(dir .. image.uri)
+            imageLayers[imgIdx] = textureArrays:add(dir .. image.uri)
         elseif image.bufferView then
-            ret.textures[texIdx] = womf.Texture(ret.bufferViews[image.bufferView + 1])
+            imageLayers[imgIdx] = textureArrays:add(bufferViews[image.bufferView + 1])
         else
             assert(image.uri or image.bufferView)
         end
     end
+    local layers = textureArrays:build()
+
+    ret.textures = {}
+    for texIdx, texture in ipairs(data.textures or {}) do
+        ret.textures[texIdx] = layers[imageLayers[texture.source + 1]]
+    end
 
     -- materials
     ret.materials = {}
@@ -148,7 +259,21 @@ function womf.loadGltf(filename)
         [5125] = womf.attrType.u32,
         [5126] = womf.attrType.f32,
     }
-    local indexBuffers = {}
+
+    local componentSizeMap = {
+        [5120] = 1,
+        [5121] = 1,
+        [5122] = 2,
+        [5123] = 2,
+        [5125] = 4,
+        [5126] = 4,
+    }
+
+    -- Every bufferView is uploaded once, no matter how many primitives use it (also across
+    -- loads of the same file). The accessors point into it with offset and stride.
+    local function getGraphicsBuffer(target, bvIdx)
+        return womf.GraphicsBuffer.getShared(target, womf.bufferUsage.static, bufferViews[bvIdx + 1])
+    end
 
     ret.meshes = {}
     for meshIdx, mesh in ipairs(data.meshes) do
@@ -162,131 +287,99 @@ function womf.loadGltf(filename)
             assert(prim.indices) -- indexed mesh
             assert(prim.material)
 
-            local referencedBufferViews = {}
-            for name, accessorIdx in ipairs(prim.attributes) do
-                table.insert(referencedBufferViews, data.accessors[accessorIdx + 1].bufferView)
-            end
-
+            -- Attributes in the same bufferView with the same stride are one vertex buffer binding
             local vertexFormats = {}
-            -- TODO: Use accessor.count to determine vertex count and set vertex range accordingly
             for attrName, accessorIdx in pairs(prim.attributes) do
                 local accessor = data.accessors[accessorIdx + 1]
-                local bufferView = ret.bufferViews[accessor.bufferView + 1]
-                if not vertexFormats[bufferView] then
-                    vertexFormats[bufferView] = {}
-                end
-                assert(not accessor.normalized)
-                assert(accessor.byteOffset == nil or accessor.byteOffset == 0)
                 local attrType = typeMap[accessor.componentType]
                 assert(attrType)
                 local count = componentMap[accessor.type]
                 assert(count)
-                table.insert(vertexFormats[bufferView], {attributeMap[attrName], attrType, count})
+                local bv = data.bufferViews[accessor.bufferView + 1]
+                local stride = bv.byteStride or count * componentSizeMap[accessor.componentType]
+                local key = accessor.bufferView .. "/" .. stride
+                if not vertexFormats[key] then
+                    vertexFormats[key] = { bufferView = accessor.bufferView, stride = stride,
+                        count = accessor.count }
+                end
+                -- Other accessors in the same bufferView may have more elements
+                vertexFormats[key].count = math.min(vertexFormats[key].count, accessor.count)
+                table.insert(vertexFormats[key], {
+                    attributeMap[attrName], attrType, count, accessor.normalized or false,
+                    accessor.byteOffset or 0,
+                })
             end
 
             local geometry = womf.Geometry(womf.drawMode.triangles)
 
-            for bufferView, vertexFormat in pairs(vertexFormats) do
-                local vfmt = womf.VertexFormat(vertexFormat)
-                local gbuf = womf.GraphicsBuffer(womf.bufferTarget.attributes, womf.bufferUsage.static, bufferView)
-                geometry:addVertexBuffer(vfmt, gbuf)
+            local position = prim.attributes.POSITION and data.accessors[prim.attributes.POSITION + 1]
+            if position and position.min and position.max then
+                geometry:setBounds(position.min[1], position.min[2], position.min[3],
+                    position.max[1], position.max[2], position.max[3])
+            end
+
+            for _, vertexFormat in pairs(vertexFormats) do
+                local gbuf = getGraphicsBuffer(womf.bufferTarget.attributes, vertexFormat.bufferView)
+                local count = vertexFormat.count
+                vertexFormat.bufferView = nil
+                vertexFormat.count = nil
+                geometry:addVertexBuffer(womf.VertexFormat(vertexFormat), gbuf, 0, count)
             end
 
             if prim.indices then
-                -- lets assume these are not reused
                 local accessor = data.accessors[prim.indices + 1]
-                local bufferView = ret.bufferViews[accessor.bufferView + 1]
-                if not indexBuffers[bufferView] then
-                    indexBuffers[bufferView] = womf.GraphicsBuffer(
-                        womf.bufferTarget.indices, womf.bufferUsage.static, bufferView)
-                end
                 local indexType = typeMap[accessor.componentType]
                 assert(indexType)
-                geometry:setIndexBuffer(indexType, indexBuffers[bufferView])
+                geometry:setIndexBuffer(indexType,
+                    getGraphicsBuffer(womf.bufferTarget.indices, accessor.bufferView),
+                    accessor.byteOffset or 0, accessor.count)
             end
 
             ret.meshes[meshIdx].primitives[primIdx] = {
                 geometry = geometry,
-                material = ret.materials[prim.material + 1],
+                material = prim.material + 1,
             }
         end
     end
 
-    ret.skins = {}
-    for skinIdx, skin in ipairs(data.skins or {}) do
-        ret.skins[skinIdx] = {
-            jointMatrices = {},
-            update = updateSkin,
-            pose = poseSkin,
-        }
-    end
-
     ret.nodes = {}
     for nodeIdx, node in ipairs(data.nodes) do
-        local trafo = womf.Transform()
-        if node.translation then
-            trafo:setPosition(unpack(node.translation))
-        end
-        if node.rotation then
-            trafo:setOrientation(unpack(node.rotation))
-        end
-        if node.scale then
-            trafo:setScale(unpack(node.scale))
+        local children = {}
+        for i, childIdx in ipairs(node.children or {}) do
+            children[i] = childIdx + 1
         end
-
         ret.nodes[nodeIdx] = {
             name = node.name,
-            transform = trafo,
-            mesh = node.mesh and ret.meshes[node.mesh + 1],
-            skin = (node.mesh and node.skin) and ret.skins[node.skin + 1],
-            children = {},
+            mesh = node.mesh and node.mesh + 1,
+            skin = node.skin and node.skin + 1,
+            children = children,
+            translation = node.translation,
+            rotation = node.rotation,
+            scale = node.scale,
         }
+    end
 
-        if node.mesh and node.skin then
-            ret.skins[node.skin + 1].rootNode = ret.nodes[nodeIdx]
-        end
+    ret.scene = {}
+    for i, nodeIdx in ipairs(data.scenes[1].nodes) do
+        ret.scene[i] = nodeIdx + 1
     end
 
+    ret.skins = {}
     for skinIdx, skin in ipairs(data.skins or {}) do
         local joints = {}
         for i, nodeIdx in ipairs(skin.joints) do
-            joints[i] = {
-                node = ret.nodes[nodeIdx + 1],
-                inverseBindMatrix = mat4(),
-            }
-            assert(joints[i].node.name)
-            joints[joints[i].node.name] = joints[i]
+            joints[i] = nodeIdx + 1
         end
-
         -- if not present inverse bind matrices are all identity matrices
+        local inverseBindMatrices = nil
         if skin.inverseBindMatrices then
             local accessor = data.accessors[skin.inverseBindMatrices + 1]
             assert(typeMap[accessor.componentType] == womf.attrType.f32)
             assert(accessor.type == "MAT4")
             assert(accessor.count == #skin.joints)
-
-            local bufferView = ret.bufferViews[accessor.bufferView + 1]
-            assert(bufferView:getSize() >= 16 * 4 * accessor.count)
-
-            local ptr = ffi.cast("float*", bufferView:getPointer())
-            for i = 1, #joints do
-                joints[i].inverseBindMatrix = makeMat4(ptr + (i - 1) * 16)
-            end
+            inverseBindMatrices = bufferViews[accessor.bufferView + 1]
         end
-
-        ret.skins[skinIdx].joints = joints
-    end
-
-    for nodeIdx, node in ipairs(data.nodes) do
-        for i, childIdx in ipairs(node.children or {}) do
-            local child = ret.nodes[childIdx + 1]
-            ret.nodes[nodeIdx].children[i] = child
-            child.parent = ret.nodes[nodeIdx]
-        end
-    end
-
-    for i, nodeIdx in ipairs(data.scenes[1].nodes) do
-        ret[i] = ret.nodes[nodeIdx + 1]
+        ret.skins[skinIdx] = { joints = joints, inverseBindMatrices = inverseBindMatrices }
     end
 
     local interpMap = {
@@ -308,30 +401,210 @@ function womf.loadGltf(filename)
 
     ret.animations = {}
     for animIdx, animation in ipairs(data.animations or {}) do
-        local anim = womf.Animation()
-
+        local channels = {}
         for _, channel in ipairs(animation.channels) do
-            local key = data.nodes[channel.target.node + 1].name .. "/" .. channel.target.path
             local sampler = animation.samplers[channel.sampler + 1]
             local timesAcc = data.accessors[sampler.input + 1]
             assert(typeMap[timesAcc.componentType] == womf.attrType.f32)
             assert(timesAcc.type == "SCALAR")
-            local timesBv = ret.bufferViews[timesAcc.bufferView + 1]
             local valuesAcc = data.accessors[sampler.output + 1]
             assert(typeMap[valuesAcc.componentType] == womf.attrType.f32)
             assert(valuesAcc.type == pathAccTypeMap[channel.target.path])
-            local valuesBv = ret.bufferViews[valuesAcc.bufferView + 1]
-            anim:addChannel(key, pathSamplerTypeMap[channel.target.path], interpMap[sampler.interpolation], timesBv, valuesBv)
+            table.insert(channels, {
+                node = channel.target.node + 1,
+                path = channel.target.path,
+                samplerType = pathSamplerTypeMap[channel.target.path],
+                interpolation = interpMap[sampler.interpolation],
+                times = bufferViews[timesAcc.bufferView + 1],
+                values = bufferViews[valuesAcc.bufferView + 1],
+            })
+        end
+        ret.animations[animIdx] = { name = animation.name, channels = channels }
+    end
+
+    return ret
+end
+
+-- Builds the model from the result of readGltf or womf.readGltf
+local function buildModel(asset)
+    local ret = setmetatable({}, Model)
+    ret.textures = asset.textures
+    ret.materials = asset.materials
+    -- Only with the native loader, see womf.readGltf
+    ret.meshOptimization = asset.meshOptimization
+
+    ret.meshes = {}
+    for meshIdx, mesh in ipairs(asset.meshes) do
+        ret.meshes[meshIdx] = { name = mesh.name, primitives = {} }
+        for primIdx, prim in ipairs(mesh.primitives) do
+            ret.meshes[meshIdx].primitives[primIdx] = {
+                geometry = prim.geometry,
+                material = asset.materials[prim.material],
+            }
+        end
+    end
+
+    -- The node transforms are a template in a native scene graph, which is copied for every
+    -- instance. The graph needs parents before their children and node 0 is the root of the
+    -- instance (for the transform passed to draw).
+    ret.graph = womf.SceneGraph()
+    local root = ret.graph:add()
+    local parents = {}
+    for nodeIdx, node in ipairs(asset.nodes) do
+        for _, childIdx in ipairs(node.children) do
+            parents[childIdx] = nodeIdx
+        end
+    end
+    local graphNodes = {}
+    local function addGraphNode(nodeIdx)
+        if not graphNodes[nodeIdx] then
+            local parent = parents[nodeIdx] and addGraphNode(parents[nodeIdx]) or root
+            graphNodes[nodeIdx] = ret.graph:add(parent)
+        end
+        return graphNodes[nodeIdx]
+    end
+
+    ret.nodes = {}
+    ret.nodesByName = {}
+    for nodeIdx, node in ipairs(asset.nodes) do
+        local trafo = addGraphNode(nodeIdx)
+        if node.translation then
+            trafo:setPosition(unpack(node.translation))
+        end
+        if node.rotation then
+            trafo:setOrientation(unpack(node.rotation))
+        end
+        if node.scale then
+            trafo:setScale(unpack(node.scale))
+        end
+
+        ret.nodes[nodeIdx] = {
+            name = node.name,
+            id = trafo:getId(),
+            mesh = node.mesh and ret.meshes[node.mesh],
+            skin = node.mesh and node.skin,
+            children = {},
+        }
+        if node.name then
+            ret.nodesByName[node.name] = ret.nodes[nodeIdx]
+        end
+    end
+    ret.nodeCount = ret.graph:getNodeCount()
+
+    for nodeIdx, node in ipairs(asset.nodes) do
+        for i, childIdx in ipairs(node.children) do
+            local child = ret.nodes[childIdx]
+            ret.nodes[nodeIdx].children[i] = child
+            child.parent = ret.nodes[nodeIdx]
+        end
+    end
+
+    for i, nodeIdx in ipairs(asset.scene) do
+        ret[i] = ret.nodes[nodeIdx]
+    end
+
+    -- Flat, so drawing an instance does not have to walk the hierarchy
+    ret.meshNodes = {}
+    walkScene(ret, function(node)
+        if node.mesh then
+            table.insert(ret.meshNodes, node)
+        end
+    end)
+
+    ret.skins = {}
+    for skinIdx, skin in ipairs(asset.skins) do
+        local rootNode = nil
+        for _, node in ipairs(ret.nodes) do
+            if node.skin == skinIdx then
+                rootNode = node
+            end
+        end
+
+        local jointIds = {}
+        local jointNodes = {}
+        for i, nodeIdx in ipairs(skin.joints) do
+            local node = ret.nodes[nodeIdx]
+            assert(node.name)
+            jointIds[i] = node.id
+            jointNodes[node.name] = node.id
+        end
+
+        ret.skins[skinIdx] = {
+            native = womf.Skin(rootNode and rootNode.id or 0, jointIds, skin.inverseBindMatrices),
+            jointNodes = jointNodes,
+            poseChannels = {},
+        }
+
+        -- A skinned mesh moves with its joints, so its bounds are estimated from the posed joint
+        -- positions (see SkinInstance:update), padded by how far the mesh extends beyond the
+        -- joints in the bind pose
+        if rootNode then
+            local native = ret.skins[skinIdx].native
+            local jMinX, jMinY, jMinZ, jMaxX, jMaxY, jMaxZ = native:getBindPoseBounds()
+            local pad = 0
+            for _, prim in ipairs(rootNode.mesh.primitives) do
+                local minX, minY, minZ, maxX, maxY, maxZ = prim.geometry:getBounds()
+                if not minX then
+                    pad = nil
+                    break
+                end
+                pad = math.max(pad, jMinX - minX, jMinY - minY, jMinZ - minZ, maxX - jMaxX,
+                    maxY - jMaxY, maxZ - jMaxZ)
+            end
+            ret.skins[skinIdx].boundsPadding = pad
+        end
+    end
+
+    ret.animations = {}
+    ret.animationIndices = {}
+    ret.animationNames = {}
+    for animIdx, animation in ipairs(asset.animations) do
+        local anim = womf.Animation()
+        for _, channel in ipairs(animation.channels) do
+            local key = asset.nodes[channel.node].name .. "/" .. channel.path
+            anim:addChannel(key, channel.samplerType, channel.interpolation, channel.times,
+                channel.values)
         end
 
         ret.animations[animIdx] = anim
         if animation.name then
             ret.animations[animation.name] = anim
+            ret.animationIndices[animation.name] = animIdx
+            ret.animationNames[animIdx] = animation.name
         end
     end
 
-    ret.walk = walkScene
-    ret.draw = drawScene
-
     return ret
 end
+
+-- loader is "cached" (default, the native loader with the scene cache), "optimized" (the same
+-- without the cache), "native" (without the cache and without mesh optimization, so it does the
+-- same work as the Lua loader) or "lua"
+local function loadModel(filename, loader)
+    if loader == "lua" then
+        return buildModel(readGltf(filename))
+    end
+    local native = loader == "native" or loader == "optimized"
+    return buildModel(womf.readGltf(filename, not native, loader ~= "native"))
+end
+
+-- Loading the same file again returns the same model, as long as it (or an instance) is alive
+local models = setmetatable({}, {__mode = "v"})
+
+function womf.loadGltfModel(filename, loader)
+    if not models[filename] then
+        models[filename] = loadModel(filename, loader)
+    end
+    return models[filename]
+end
+
+-- Always loads the file again, e.g. to measure loading times
+function womf.loadGltfModelUncached(filename, loader)
+    return loadModel(filename, loader)
+end
+
+-- An instance of the model in the file, e.g. scene:draw(shader, trafo) and
+-- scene.animations.Run:update(dt). Use loadGltfModel and instantiate for many copies.
+function womf.loadGltf(filename)
+    return womf.loadGltfModel(filename):instantiate()
+end
@@ -7,7 +7,11 @@ CMRC_DECLARE(luaSource);
 #include "animation.hpp"
 #include "buffer.hpp"
 #include "die.hpp"
+#include "gltf.hpp"
 #include "graphics.hpp"
+#include "memory.hpp"
+#include "prefetch.hpp"
+#include "scene.hpp"
 #include "sdlw.hpp"
 #include "util.hpp"
 
@@ -54,12 +58,21 @@ InputState& getMouseState(const std::string& button)
     return state[0]; // Just for the compiler
 }
 
+// Bytes of texture data uploaded per frame, so loading textures does not cause hitches
+size_t textureUploadBudget = 8 * 1024 * 1024;
+
 void bindSys(sol::state& lua, sol::table table, const sdlw::GlWindow& window)
 {
     table["getTime"] = &sdlw::getTime;
     table["present"] = [&window]() {
         flush();
         window.swap();
+        StateCache::instance().endFrame();
+        StreamBuffer::instance().endFrame();
+        // New textures first, the streamer gets what is left of the budget
+        const auto uploaded = updateTextureUploads(textureUploadBudget);
+        TextureStreamer::instance().update(
+            textureUploadBudget - std::min(uploaded, textureUploadBudget));
     };
     table["getWindowSize"] = [&window]() {
         const auto [w, h] = window.getSize();
@@ -186,71 +199,129 @@ void bindSys(sol::state& lua, sol::table table, const sdlw::GlWindow& window)
     table["getJoystick"] = &sdlw::getJoystick;
 }
 
-void readUniform(
-    UniformSet& uniformSet, const std::string& name, glw::UniformInfo::Type type, sol::object value)
+void readUniform(UniformSet& uniformSet, const UniformLayout::Entry& entry, size_t element,
+    sol::object value)
 {
-    switch (type) {
+    const auto& name = entry.name;
+    const auto readVec = [&](auto vec) {
+        constexpr auto N = decltype(vec)::length();
+        dieAssert(value.get_type() == sol::type::table, "Value for '{}' must be a 'table'", name);
+        auto table = value.as<sol::table>();
+        dieAssert(table.size() == static_cast<size_t>(N), "Value for '{}' must have {} elements",
+            name, N);
+        for (int i = 0; i < N; ++i) {
+            vec[i] = table[i + 1].template get<float>();
+        }
+        uniformSet.write(entry, element, vec);
+    };
+    const auto readMat = [&](auto mat) {
+        constexpr auto N = decltype(mat)::length();
+        dieAssert(value.get_type() == sol::type::table, "Value for '{}' must be a 'table'", name);
+        auto table = value.as<sol::table>();
+        dieAssert(table.size() == static_cast<size_t>(N * N),
+            "Value for '{}' must have {} elements", name, N * N);
+        for (int i = 0; i < N * N; ++i) {
+            mat[i / N][i % N] = table[i + 1].template get<float>();
+        }
+        uniformSet.write(entry, element, mat);
+    };
+
+    switch (entry.type) {
     case glw::UniformInfo::Type::Float:
         dieAssert(value.get_type() == sol::type::number, "Value for '{}' must be 'number'", name);
-        uniformSet[name] = value.as<float>();
+        uniformSet.write(entry, element, value.as<float>());
         break;
     case glw::UniformInfo::Type::Int:
         dieAssert(value.get_type() == sol::type::number, "Value for '{}' must be 'number'", name);
-        uniformSet[name] = value.as<int>();
+        uniformSet.write(entry, element, value.as<int>());
         break;
-    case glw::UniformInfo::Type::Vec4: {
-        dieAssert(value.get_type() == sol::type::table, "Value for '{}' must be a 'table'", name);
-        auto table = value.as<sol::table>();
-        dieAssert(table.size() == 4, "Value for '{}' must have 4 elements", name);
-        uniformSet[name] = glm::vec4(table[1], table[2], table[3], table[4]);
+    case glw::UniformInfo::Type::Vec2:
+        readVec(glm::vec2());
         break;
-    }
-    case glw::UniformInfo::Type::Mat4: {
-        dieAssert(value.get_type() == sol::type::table, "Value for '{}' must be a 'table'", name);
-        auto table = value.as<sol::table>();
-        dieAssert(table.size() == 16, "Value for '{}' must have 16 elements", name);
-        glm::mat4 mat;
-        for (size_t i = 1; i <= 16; ++i) {
-            mat[(i - 1) / 4][(i - 1) % 4] = table[i];
-        }
-        uniformSet[name] = mat;
+    case glw::UniformInfo::Type::Vec3:
+        readVec(glm::vec3());
+        break;
+    case glw::UniformInfo::Type::Vec4:
+        readVec(glm::vec4());
+        break;
+    case glw::UniformInfo::Type::Mat4:
+        readMat(glm::mat4());
         break;
-    }
     case glw::UniformInfo::Type::Sampler2D:
+    case sampler2DArrayType: {
         dieAssert(value.is<Texture>(), "Value for '{}' must be 'Texture'", name);
-        uniformSet[name] = &value.as<Texture>().getGlTexture();
+        auto texture = value.as<Texture::Ptr>();
+        const auto isArray = entry.type == sampler2DArrayType;
+        dieAssert(texture->isLayer() == isArray, "Value for '{}' must be a texture {}", name,
+            isArray ? "array layer (see TextureArrayBuilder)" : "that is not an array layer");
+        uniformSet.writeTexture(entry, element, std::move(texture));
         break;
+    }
     default:
-        die("Uniform of type '{}' not implemented yet", static_cast<GLenum>(type));
+        die("Uniform of type '{}' not implemented yet", static_cast<GLenum>(entry.type));
     }
 }
 
-UniformSet readUniforms(
-    const std::unordered_map<std::string, glw::UniformInfo>& uniformInfo, sol::table uniforms)
+UniformSet readUniforms(const UniformLayout& layout, sol::table uniforms)
 {
-    UniformSet uniformSet;
-    for (auto&& [name, value] : uniforms) {
-        const auto nameStr = name.as<std::string>();
-        const auto infoIt = uniformInfo.find(nameStr);
-        if (infoIt == uniformInfo.end()) {
+    UniformSet uniformSet(layout);
+    for (const auto& entry : layout.entries) {
+        const auto value = uniforms.get<sol::object>(entry.name);
+        if (value.get_type() == sol::type::lua_nil) {
             continue;
         }
-        if (infoIt->second.size > 1) {
+        if (entry.arraySize > 1 && entry.type == glw::UniformInfo::Type::Mat4
+            && value.is<MatrixPalette>()) {
+            const auto& matrices = value.as<const MatrixPalette&>().matrices;
+            const auto count = std::min(matrices.size(), entry.arraySize);
+            for (size_t i = 0; i < count; ++i) {
+                uniformSet.write(entry, i, matrices[i]);
+            }
+            uniformSet.add(entry, count);
+        } else if (entry.arraySize > 1) {
             dieAssert(value.get_type() == sol::type::table,
-                "Value for '{}' must be 'table' (array size {})", nameStr, infoIt->second.size);
+                "Value for '{}' must be 'table' (array size {})", entry.name, entry.arraySize);
             auto table = value.as<sol::table>();
-            for (size_t i = 1; i <= table.size(); ++i) {
-                const auto elemName = fmt::format("{}[{}]", nameStr, i - 1);
-                readUniform(uniformSet, elemName, infoIt->second.type, table[i]);
+            const auto count = std::min(table.size(), entry.arraySize);
+            for (size_t i = 0; i < count; ++i) {
+                readUniform(uniformSet, entry, i, table[i + 1]);
             }
+            uniformSet.add(entry, count);
         } else {
-            readUniform(uniformSet, nameStr, infoIt->second.type, value);
+            readUniform(uniformSet, entry, 0, value);
+            uniformSet.add(entry, 1);
         }
     }
     return uniformSet;
 }
 
-void bindGfx(sol::state&, sol::table table)
+// nil means the default render state
+const RenderState* getRenderState(sol::object obj)
+{
+    if (obj.get_type() == sol::type::lua_nil) {
+        return nullptr;
+    }
+    dieAssert(obj.is<RenderState>(), "Render state must be 'RenderState'");
+    return obj.as<RenderState*>();
+}
+
+// Lua numbers are doubles, so a whole 64 bit key would lose precision. Lua passes
+// {layer, depth} instead and the rest of the key is filled in like for generated keys.
+std::optional<uint64_t> readSortKey(sol::optional<sol::table> sortKey, const Shader& shader,
+    const Geometry& geometry, const UniformSet& uniforms, const RenderState* renderState)
+{
+    if (!sortKey) {
+        return std::nullopt;
+    }
+    const auto layer = sortKey->get<sol::optional<uint32_t>>(1);
+    const auto depth = sortKey->get<sol::optional<float>>(2);
+    dieAssert(layer && *layer <= maxSortLayer && depth,
+        "Sort key must be {{layer (0 to {}), depth}}", maxSortLayer);
+    return makeSortKey(*layer, *depth, shader, uniforms.getFirstTexture(), geometry,
+        renderState && renderState->isTransparent());
+}
+
+void bindGfx(sol::state& lua, sol::table table)
 {
     table["clear"] = sol::overload(clearColor, clearColorDepth);
     table["flush"] = &flush;
@@ -263,20 +334,176 @@ void bindGfx(sol::state&, sol::table table)
             float, float, float, float, float, float)>(&setViewMatrix));
     table["setModelMatrix"]
         = sol::overload(static_cast<void (*)(const Transform&)>(&setModelMatrix),
+            [](const SceneNode& node) { setModelMatrix(node.graph->getWorldMatrix(node.id)); },
+            [](SceneGraph& graph, SceneGraph::NodeId id) {
+                setModelMatrix(graph.getWorldMatrix(id));
+            },
             static_cast<void (*)(float, float, float, float, float, float, float, float, float,
                 float, float, float, float, float, float, float)>(&setModelMatrix));
 
-    // TODO: optional RenderState, optional sortKey
-    table["draw"] = [](Shader::Ptr shader, Geometry::Ptr geometry, sol::table uniforms) {
-        draw(shader.get(), geometry.get(),
-            readUniforms(shader->getProgram().getUniformInfo(), uniforms));
+    // draw(shader, geometry, uniforms, renderState, sortKey, previousLod)
+    // drawInstanced(shader, geometry, instanceBuffer, count, uniforms, renderState, sortKey,
+    //     bounds)
+    // bounds is {minX, minY, minZ, maxX, maxY, maxZ} around all instances in model space.
+    // sortKey is {layer, depth} (see makeSortKey), lower layers are drawn first.
+    // renderState (nil for the default state) comes before sortKey, which used to directly
+    // follow the uniforms. draw returns the level of detail, pass it back as previousLod the next
+    // frame.
+    table["draw"] = [](Shader::Ptr shader, Geometry::Ptr geometry, sol::table uniforms,
+                        sol::object renderState, sol::optional<sol::table> sortKey,
+                        sol::optional<size_t> previousLod) {
+        auto uniformSet = readUniforms(shader->getUniformLayout(), uniforms);
+        const auto state = getRenderState(renderState);
+        const auto key = readSortKey(sortKey, *shader, *geometry, uniformSet, state);
+        return draw(shader.get(), geometry.get(), std::move(uniformSet), state, key,
+            previousLod ? std::optional<size_t>(*previousLod) : std::nullopt);
+    };
+    table["drawInstanced"] = [](Shader::Ptr shader, Geometry::Ptr geometry,
+                                 GraphicsBuffer::Ptr instanceBuffer, size_t count,
+                                 sol::table uniforms, sol::object renderState,
+                                 sol::optional<sol::table> sortKey,
+                                 sol::optional<sol::table> bounds) {
+        std::optional<Aabb> box;
+        if (bounds) {
+            box = Aabb {
+                glm::vec3(bounds->get<float>(1), bounds->get<float>(2), bounds->get<float>(3)),
+                glm::vec3(bounds->get<float>(4), bounds->get<float>(5), bounds->get<float>(6)),
+            };
+        }
+        auto uniformSet = readUniforms(shader->getUniformLayout(), uniforms);
+        const auto state = getRenderState(renderState);
+        const auto key = readSortKey(sortKey, *shader, *geometry, uniformSet, state);
+        drawInstanced(shader.get(), geometry.get(), instanceBuffer.get(), count,
+            std::move(uniformSet), state, key, box);
+    };
+
+    // Counts of the last frame
+    table["getStateStats"] = []() {
+        const auto& stats = StateCache::instance().getFrameStats();
+        return std::tuple { stats.issued, stats.skipped };
+    };
+    // Totals since startup, except the number of buffers
+    table["getGraphicsBufferStats"] = [&lua]() {
+        const auto& stats = GraphicsBuffer::getStats();
+        return lua.create_table_with("buffers", stats.buffers, "uploads", stats.uploads,
+            "uploadedBytes", stats.uploadedBytes, "shared", stats.shared);
+    };
+    table["getDrawStats"] = [&lua]() {
+        const auto& stats = StateCache::instance().getFrameStats();
+        return lua.create_table_with("drawCalls", stats.drawCalls, "multiDrawCalls",
+            stats.multiDrawCalls, "multiDrawCommands", stats.multiDrawCommands, "visible",
+            stats.drawsVisible, "culled", stats.drawsCulled, "occluded", stats.drawsOccluded);
+    };
+    table["setFrustumCulling"] = &setFrustumCulling;
+    table["setLodThreshold"] = &setLodThreshold;
+    table["setOcclusionBuffer"] = [](sol::optional<OcclusionBuffer::Ptr> buffer) {
+        setOcclusionBuffer(buffer ? *buffer : nullptr);
+    };
+    table["setTextureUploadBudget"] = [](size_t bytes) { textureUploadBudget = bytes; };
+    // Textures are loaded in the background, e.g. a loading screen can wait for this to be 0
+    table["getPendingTextureUploads"] = &getPendingTextureUploads;
+    table["finishTextureUploads"] = &finishTextureUploads;
+    table["getTextureStats"] = []() {
+        const auto& stats = StateCache::instance().getFrameStats();
+        return std::tuple { stats.textureBinds, stats.textureBindsSkipped };
+    };
+    // GPU memory of streamed textures (see TextureStreamer)
+    table["setTextureBudget"]
+        = [](size_t bytes) { TextureStreamer::instance().setBudget(bytes); };
+    table["setTextureLodBias"]
+        = [](float bias) { TextureStreamer::instance().setLodBias(bias); };
+    table["getStreamBufferStats"] = [&lua]() {
+        const auto& stats = StreamBuffer::instance().getStats();
+        return lua.create_table_with("persistent", stats.persistent, "capacity", stats.capacity,
+            "used", stats.used, "waits", stats.waits, "grows", stats.grows);
+    };
+    // Bytes per subsystem (see MemoryCategory)
+    table["getMemoryReport"] = [&lua]() {
+        auto report = lua.create_table();
+        for (size_t i = 0; i < static_cast<size_t>(MemoryCategory::Count); ++i) {
+            const auto category = static_cast<MemoryCategory>(i);
+            report[std::string(getMemoryCategoryName(category))] = getMemoryUsage(category);
+        }
+        report["lua"] = lua.memory_used();
+        return report;
+    };
+    table["getTextureStreamingStats"] = [&lua]() {
+        const auto& stats = TextureStreamer::instance().getStats();
+        return lua.create_table_with("budget", stats.budget, "residentBytes",
+            stats.residentBytes, "textures", stats.textures, "pending", stats.pending, "raised",
+            stats.raised, "dropped", stats.dropped, "uploadedBytes", stats.uploadedBytes);
     };
 }
 
+// Creates a buffer from Lua values, e.g. womf.Buffer("vec3", {vec3(0, 1, 0), ...}).
+// Vector/matrix elements may be flat numbers, tables with x, y, z, w or array-like tables.
+Buffer::Ptr makeBuffer(const std::string& type, sol::table values)
+{
+    struct ElementType {
+        glw::AttributeType type;
+        size_t components;
+    };
+    static const std::unordered_map<std::string, ElementType> types {
+        { "f32", { glw::AttributeType::F32, 1 } },
+        { "vec2", { glw::AttributeType::F32, 2 } },
+        { "vec3", { glw::AttributeType::F32, 3 } },
+        { "vec4", { glw::AttributeType::F32, 4 } },
+        { "mat4", { glw::AttributeType::F32, 16 } },
+        { "u8", { glw::AttributeType::U8, 1 } },
+        { "u16", { glw::AttributeType::U16, 1 } },
+        { "u32", { glw::AttributeType::U32, 1 } },
+    };
+    const auto it = types.find(type);
+    if (it == types.end()) {
+        die("Invalid buffer type '{}'", type);
+    }
+    const auto elemType = it->second;
+
+    std::vector<uint8_t> data;
+    const auto push = [&](double value) {
+        const auto append = [&](auto v) {
+            const auto offset = data.size();
+            data.resize(offset + sizeof(v));
+            std::memcpy(data.data() + offset, &v, sizeof(v));
+        };
+        switch (elemType.type) {
+        case glw::AttributeType::U8:
+            append(static_cast<uint8_t>(value));
+            break;
+        case glw::AttributeType::U16:
+            append(static_cast<uint16_t>(value));
+            break;
+        case glw::AttributeType::U32:
+            append(static_cast<uint32_t>(value));
+            break;
+        default:
+            append(static_cast<float>(value));
+        }
+    };
+
+    static constexpr std::array<const char*, 4> fields = { "x", "y", "z", "w" };
+    for (size_t i = 1; i <= values.size(); ++i) {
+        const auto elem = values.get<sol::object>(i);
+        if (elem.get_type() == sol::type::number) {
+            push(elem.as<double>());
+        } else if (elem.get_type() == sol::type::table) {
+            const auto table = elem.as<sol::table>();
+            const auto named = elemType.components <= 4
+                && table.get<sol::object>("x").get_type() == sol::type::number;
+            for (size_t c = 0; c < elemType.components; ++c) {
+                push(named ? table.get<double>(fields[c]) : table.get<double>(c + 1));
+            }
+        } else {
+            die("Invalid value in buffer of type '{}' at index {}", type, i);
+        }
+    }
+    return Buffer::create(fmt::format("<{}[{}]>", type, values.size()), std::move(data));
+}
+
 auto bindBuffer(sol::state& lua)
 {
     auto buffer = lua.new_usertype<Buffer>("Buffer", sol::base_classes, sol::bases<BufferBase>(),
-        sol::call_constructor, sol::factories(&Buffer::create<std::string>));
+        sol::call_constructor, sol::factories(&Buffer::create<std::string>, &makeBuffer));
     buffer["getSize"] = &Buffer::size;
     return buffer;
 }
@@ -295,37 +522,80 @@ auto bindBufferView(sol::state& lua)
 
 auto bindTexture(sol::state& lua)
 {
-    return lua.new_usertype<Texture>("Texture", sol::call_constructor,
+    auto texture = lua.new_usertype<Texture>("Texture", sol::call_constructor,
         sol::factories(static_cast<Texture::Ptr (*)(Buffer::Ptr)>(&Texture::create),
             static_cast<Texture::Ptr (*)(BufferView::Ptr)>(&Texture::create),
             &Texture::create<std::string>));
+    texture["isResident"] = &Texture::isResident;
+    texture["isStreamed"] = &Texture::isStreamed;
+    texture["getLevelCount"] = &Texture::getLevelCount;
+    // 0 is the full resolution
+    texture["getResidentLevel"] = &Texture::getResidentLevel;
+    texture["getTargetLevel"] = &Texture::getTargetLevel;
+    texture["getResidentBytes"] = &Texture::getResidentBytes;
+    texture["setResidency"] = &Texture::setResidency;
+    texture["getResidency"] = &Texture::getResidency;
+    return texture;
+}
+
+auto bindTextureArrayBuilder(sol::state& lua)
+{
+    auto builder = lua.new_usertype<TextureArrayBuilder>("TextureArrayBuilder",
+        sol::call_constructor, sol::constructors<TextureArrayBuilder()>());
+    // Returns 1-based indices into the table returned by build
+    builder["add"] = sol::overload(
+        [](TextureArrayBuilder& builder, Buffer::Ptr buffer) { return builder.add(buffer) + 1; },
+        [](TextureArrayBuilder& builder, BufferView::Ptr buffer) {
+            return builder.add(buffer) + 1;
+        },
+        [](TextureArrayBuilder& builder, std::string path) { return builder.add(path) + 1; });
+    builder["build"]
+        = [](TextureArrayBuilder& builder) { return sol::as_table(builder.build()); };
+    return builder;
 }
 
 auto bindShader(sol::state& lua)
 {
-    return lua.new_usertype<Shader>("Shader", sol::call_constructor,
+    auto shader = lua.new_usertype<Shader>("Shader", sol::call_constructor,
         sol::factories(static_cast<Shader::Ptr (*)(Buffer::Ptr, Buffer::Ptr)>(&Shader::create),
             static_cast<Shader::Ptr (*)(Buffer::Ptr)>(&Shader::create),
             &Shader::create<std::string, std::string>, &Shader::create<std::string>));
+    shader["isMultiDraw"] = &Shader::isMultiDraw;
+    return shader;
 }
 
 auto bindGraphicsBuffer(sol::state& lua)
 {
-    return lua.new_usertype<GraphicsBuffer>("GraphicsBuffer", sol::call_constructor,
+    auto buffer = lua.new_usertype<GraphicsBuffer>("GraphicsBuffer", sol::call_constructor,
         sol::factories(static_cast<GraphicsBuffer::Ptr (*)(BufferTarget, BufferUsage, Buffer::Ptr)>(
                            &GraphicsBuffer::create),
             static_cast<GraphicsBuffer::Ptr (*)(BufferTarget, BufferUsage, BufferView::Ptr)>(
                 &GraphicsBuffer::create),
             static_cast<GraphicsBuffer::Ptr (*)(BufferTarget, BufferUsage, std::string)>(
                 &GraphicsBuffer::create)));
+    // Uploads each file range only once, e.g. GraphicsBuffer.getShared(target, usage, bufferView)
+    buffer["getShared"] = sol::overload(
+        static_cast<GraphicsBuffer::Ptr (*)(BufferTarget, BufferUsage, Buffer::Ptr)>(
+            &GraphicsBuffer::getShared),
+        static_cast<GraphicsBuffer::Ptr (*)(BufferTarget, BufferUsage, BufferView::Ptr)>(
+            &GraphicsBuffer::getShared));
+    buffer["getSize"] = &GraphicsBuffer::getSize;
+    buffer["setResidency"] = &GraphicsBuffer::setResidency;
+    buffer["getResidency"] = &GraphicsBuffer::getResidency;
+    buffer["reupload"] = &GraphicsBuffer::reupload;
+    return buffer;
 }
 
 auto bindVertexFormat(sol::state& lua)
 {
-    return lua.new_usertype<glw::VertexFormat>(
+    return lua.new_usertype<VertexFormat>(
         "VertexFormat", sol::call_constructor, sol::factories([](sol::table table) {
-            glw::VertexFormat fmt;
+            VertexFormat fmt;
             for (auto& elem : table) {
+                // Skip named fields like `stride`
+                if (elem.first.get_type() != sol::type::number) {
+                    continue;
+                }
                 const auto attr = elem.second.as<sol::table>();
                 const auto loc = [&]() {
                     if (attr.get<sol::object>(1).get_type() == sol::type::string) {
@@ -339,7 +609,15 @@ auto bindVertexFormat(sol::state& lua)
                 const auto type = attr.get<glw::AttributeType>(2);
                 const auto num = attr.get<uint32_t>(3);
                 const auto normalized = attr.get_or(4, false);
-                fmt.add(loc, num, type, normalized);
+                const auto offset = attr.get<sol::optional<size_t>>(5);
+                if (offset) {
+                    fmt.add(loc, num, type, normalized, *offset);
+                } else {
+                    fmt.add(loc, num, type, normalized);
+                }
+            }
+            if (const auto stride = table.get<sol::optional<size_t>>("stride")) {
+                fmt.setStride(*stride);
             }
             return fmt;
         }));
@@ -349,11 +627,156 @@ auto bindGeometry(sol::state& lua)
 {
     auto geometry = lua.new_usertype<Geometry>(
         "Geometry", sol::call_constructor, sol::factories(&Geometry::create));
-    geometry["addVertexBuffer"] = &Geometry::addVertexBuffer;
-    geometry["setIndexBuffer"] = &Geometry::setIndexBuffer;
+    geometry["addVertexBuffer"]
+        = [](Geometry& geometry, const VertexFormat& fmt, GraphicsBuffer::Ptr buffer,
+              sol::optional<size_t> offset, sol::optional<size_t> count) {
+              geometry.addVertexBuffer(fmt, std::move(buffer), offset.value_or(0),
+                  count ? std::optional<size_t>(*count) : std::nullopt);
+          };
+    geometry["setIndexBuffer"]
+        = [](Geometry& geometry, glw::AttributeType type, GraphicsBuffer::Ptr buffer,
+              sol::optional<size_t> offset, sol::optional<size_t> count) {
+              geometry.setIndexBuffer(type, std::move(buffer), offset.value_or(0),
+                  count ? std::optional<size_t>(*count) : std::nullopt);
+          };
+    geometry["setInstanceFormat"] = &Geometry::setInstanceFormat;
+    // Only valid for the current frame, e.g. geometry:streamVertices(vfmt, womf.Buffer(...))
+    geometry["streamVertices"] = sol::overload(
+        [](Geometry& geometry, const VertexFormat& fmt, Buffer::Ptr buffer) {
+            geometry.streamVertices(fmt, buffer->data());
+        },
+        [](Geometry& geometry, const VertexFormat& fmt, BufferView::Ptr buffer) {
+            geometry.streamVertices(fmt, buffer->data());
+        });
+    geometry["streamIndices"] = sol::overload(
+        [](Geometry& geometry, glw::AttributeType type, Buffer::Ptr buffer) {
+            geometry.streamIndices(type, buffer->data());
+        },
+        [](Geometry& geometry, glw::AttributeType type, BufferView::Ptr buffer) {
+            geometry.streamIndices(type, buffer->data());
+        });
+    geometry["setBounds"] = [](Geometry& geometry, float minX, float minY, float minZ, float maxX,
+                                float maxY, float maxZ) {
+        geometry.setBounds(Aabb { glm::vec3(minX, minY, minZ), glm::vec3(maxX, maxY, maxZ) });
+    };
+    // minX, minY, minZ, maxX, maxY, maxZ or nothing
+    geometry["getBounds"] = [](sol::this_state L, const Geometry& geometry) {
+        sol::variadic_results res;
+        if (const auto& bounds = geometry.getBounds()) {
+            for (const auto v : { bounds->min.x, bounds->min.y, bounds->min.z, bounds->max.x,
+                     bounds->max.y, bounds->max.z }) {
+                res.emplace_back(L, sol::in_place, v);
+            }
+        }
+        return res;
+    };
+    geometry["getLodCount"] = &Geometry::getLodCount;
+    geometry["getPool"] = [](const Geometry& geometry) {
+        auto pool = geometry.getPool();
+        return pool ? pool->shared_from_this() : nullptr;
+    };
     return geometry;
 }
 
+// e.g. womf.GeometryPool(vfmt, womf.attrType.u16) and pool:add(womf.drawMode.triangles, vertices,
+// indices), where vertices and indices are Buffers or BufferViews
+auto bindGeometryPool(sol::state& lua)
+{
+    auto pool = lua.new_usertype<GeometryPool>("GeometryPool", sol::call_constructor,
+        sol::factories(
+            [](const VertexFormat& fmt, glw::AttributeType indexType) {
+                return GeometryPool::create(fmt, indexType);
+            },
+            [](const VertexFormat& fmt, glw::AttributeType indexType, size_t vertexCapacity,
+                size_t indexCapacity) {
+                return GeometryPool::create(fmt, indexType, vertexCapacity, indexCapacity);
+            }));
+    pool["add"] = [](GeometryPool& pool, glw::DrawMode mode, sol::object vertices,
+                      sol::object indices) {
+        const auto data = [](const sol::object& obj) -> std::span<const uint8_t> {
+            if (obj.is<Buffer::Ptr>()) {
+                return obj.as<Buffer::Ptr>()->data();
+            }
+            if (obj.is<BufferView::Ptr>()) {
+                return obj.as<BufferView::Ptr>()->data();
+            }
+            die("Pooled geometry data must be a Buffer or a BufferView");
+            return {};
+        };
+        return pool.add(mode, data(vertices), data(indices));
+    };
+    pool["getStats"] = [&lua](const GeometryPool& pool) {
+        const auto stats = pool.getStats();
+        return lua.create_table_with("geometries", stats.geometries, "vertexCapacity",
+            stats.vertexCapacity, "verticesUsed", stats.verticesUsed, "indexCapacity",
+            stats.indexCapacity, "indicesUsed", stats.indicesUsed, "grows", stats.grows);
+    };
+    return pool;
+}
+
+// Occluders use the current model matrix and the buffer is cleared with the current view projection
+// matrix, e.g. occ:clear() after setting the camera, then occ:addOccluder(positions, indices,
+// womf.attrType.u16[, stride]) for every large occluder and occ:rasterize().
+auto bindOcclusionBuffer(sol::state& lua)
+{
+    auto occ = lua.new_usertype<OcclusionBuffer>("OcclusionBuffer", sol::call_constructor,
+        sol::factories([]() { return OcclusionBuffer::create(); },
+            [](size_t width, size_t height) { return OcclusionBuffer::create(width, height); }));
+    occ["clear"] = [](OcclusionBuffer& occ) { occ.clear(getViewProjectionMatrix()); };
+    occ["addOccluder"] = [](OcclusionBuffer& occ, BufferView::Ptr positions,
+                             BufferView::Ptr indices, glw::AttributeType indexType,
+                             sol::optional<size_t> stride) {
+        dieAssert(indexType == glw::AttributeType::U8 || indexType == glw::AttributeType::U16
+                || indexType == glw::AttributeType::U32,
+            "Occluder index type must be u8, u16 or u32");
+        occ.addOccluder(positions->data(), stride.value_or(sizeof(float) * 3), indices->data(),
+            getAttributeTypeSize(indexType), getModelMatrix());
+    };
+    occ["rasterize"] = &OcclusionBuffer::rasterize;
+    // Geometry without bounds is always visible
+    occ["isVisible"] = [](OcclusionBuffer& occ, const Geometry& geometry) {
+        const auto& bounds = geometry.getBounds();
+        return !bounds || occ.isVisible(*bounds, getModelMatrix());
+    };
+    occ["getSize"] = [](const OcclusionBuffer& occ) {
+        return std::tuple { occ.getWidth(), occ.getHeight() };
+    };
+    occ["getDepth"] = &OcclusionBuffer::getDepth;
+    occ["getStats"] = [&lua](const OcclusionBuffer& occ) {
+        const auto& stats = occ.getStats();
+        return lua.create_table_with("occluders", stats.occluders, "triangles", stats.triangles,
+            "tested", stats.tested, "occluded", stats.occluded);
+    };
+    return occ;
+}
+
+// e.g. womf.RenderState { blend = womf.blendMode.alpha, depthWrite = false }. Omitted fields
+// keep the defaults of RenderStateDesc.
+auto bindRenderState(sol::state& lua)
+{
+    return lua.new_usertype<RenderState>(
+        "RenderState", sol::call_constructor, sol::factories([](sol::table table) {
+            RenderStateDesc desc;
+            desc.depthTest = table.get_or("depthTest", desc.depthTest);
+            desc.depthFunc = table.get_or("depthFunc", desc.depthFunc);
+            desc.depthWrite = table.get_or("depthWrite", desc.depthWrite);
+            desc.blend = table.get_or("blend", desc.blend);
+            desc.cull = table.get_or("cull", desc.cull);
+            if (const auto mask = table.get<sol::optional<sol::table>>("colorMask")) {
+                dieAssert(mask->size() == 4, "colorMask must have 4 elements");
+                for (size_t i = 0; i < 4; ++i) {
+                    desc.colorMask[i] = mask->get<bool>(i + 1);
+                }
+            }
+            if (const auto offset = table.get<sol::optional<sol::table>>("polygonOffset")) {
+                dieAssert(offset->size() == 2, "polygonOffset must be {factor, units}");
+                desc.polygonOffsetFactor = offset->get<float>(1);
+                desc.polygonOffsetUnits = offset->get<float>(2);
+            }
+            return RenderState::create(desc);
+        }));
+}
+
 auto bindTransform(sol::state& lua)
 {
     auto trafo = lua.new_usertype<Transform>(
@@ -380,6 +803,136 @@ auto bindTransform(sol::state& lua)
     return trafo;
 }
 
+// e.g. local node = graph:add(parentNode) and node:setPosition(x, y, z). Nodes are handles into
+// the graph, which stores everything.
+auto bindSceneGraph(sol::state& lua)
+{
+    auto node = lua.new_usertype<SceneNode>("SceneNode", sol::no_constructor);
+    node["getId"] = [](const SceneNode& node) { return node.id; };
+    node["getParent"] = [](const SceneNode& node) -> sol::optional<SceneNode> {
+        const auto parent = node.graph->getParent(node.id);
+        if (parent == SceneGraph::noParent) {
+            return sol::nullopt;
+        }
+        return SceneNode { node.graph, parent };
+    };
+    node["getPosition"] = [](const SceneNode& node) {
+        return Transform::unpack(node.graph->getPosition(node.id));
+    };
+    node["setPosition"] = [](const SceneNode& node, float x, float y, float z) {
+        node.graph->setPosition(node.id, glm::vec3(x, y, z));
+    };
+    node["getOrientation"] = [](const SceneNode& node) {
+        return Transform::unpack(node.graph->getOrientation(node.id));
+    };
+    node["setOrientation"] = [](const SceneNode& node, float x, float y, float z, float w) {
+        node.graph->setOrientation(node.id, glm::quat(w, x, y, z));
+    };
+    node["getScale"] = [](const SceneNode& node) {
+        return Transform::unpack(node.graph->getScale(node.id));
+    };
+    node["setScale"] = [](const SceneNode& node, float x, float y, float z) {
+        node.graph->setScale(node.id, glm::vec3(x, y, z));
+    };
+    // Copies position, orientation and scale
+    node["setTransform"] = [](const SceneNode& node, const Transform& trafo) {
+        node.graph->setPosition(node.id, trafo.glwx::Transform::getPosition());
+        node.graph->setOrientation(node.id, trafo.glwx::Transform::getOrientation());
+        node.graph->setScale(node.id, trafo.glwx::Transform::getScale());
+    };
+    node["getWorldMatrix"] = [](const SceneNode& node) {
+        return Transform::unpack(node.graph->getWorldMatrix(node.id));
+    };
+
+    auto graph = lua.new_usertype<SceneGraph>(
+        "SceneGraph", sol::call_constructor, sol::factories(&SceneGraph::create));
+    graph["add"] = [](SceneGraph& graph, sol::optional<const SceneNode&> parent) {
+        dieAssert(!parent || parent->graph.get() == &graph, "Parent is from a different graph");
+        const auto id = graph.add(parent ? parent->id : SceneGraph::noParent);
+        return SceneNode { graph.shared_from_this(), id };
+    };
+    graph["getNode"] = [](SceneGraph& graph, SceneGraph::NodeId id) {
+        graph.checkNode(id);
+        return SceneNode { graph.shared_from_this(), id };
+    };
+    graph["getNodeCount"] = &SceneGraph::getNodeCount;
+    // Copies the nodes (see SceneGraph::instantiate), which are released when the result is
+    // collected or released. Raw ids are not released from Lua, so no range is freed twice.
+    graph["instantiateRange"] = [](SceneGraph& graph, SceneGraph::NodeId first, size_t count) {
+        return SceneNodeRange::create(graph.shared_from_this(), first, count);
+    };
+    // Same as the SceneNode methods, but without a handle, e.g. for animating many instances
+    graph["setPosition"] = [](SceneGraph& graph, SceneGraph::NodeId id, float x, float y, float z) {
+        graph.checkNode(id);
+        graph.setPosition(id, glm::vec3(x, y, z));
+    };
+    graph["setOrientation"]
+        = [](SceneGraph& graph, SceneGraph::NodeId id, float x, float y, float z, float w) {
+              graph.checkNode(id);
+              graph.setOrientation(id, glm::quat(w, x, y, z));
+          };
+    graph["setScale"] = [](SceneGraph& graph, SceneGraph::NodeId id, float x, float y, float z) {
+        graph.checkNode(id);
+        graph.setScale(id, glm::vec3(x, y, z));
+    };
+    graph["getWorldMatrix"] = [](SceneGraph& graph, SceneGraph::NodeId id) {
+        graph.checkNode(id);
+        return Transform::unpack(graph.getWorldMatrix(id));
+    };
+    graph["update"] = &SceneGraph::update;
+    graph["getStats"] = [&lua](const SceneGraph& graph) {
+        const auto& stats = graph.getStats();
+        return lua.create_table_with("nodes", stats.nodes, "freeNodes", stats.freeNodes,
+            "updates", stats.updates, "nodesUpdated", stats.nodesUpdated, "lastNodesUpdated",
+            stats.lastNodesUpdated, "bytesPerNode", SceneGraph::bytesPerNode);
+    };
+
+    auto range = lua.new_usertype<SceneNodeRange>("SceneNodeRange", sol::no_constructor);
+    range["getFirst"] = &SceneNodeRange::getFirst;
+    range["getCount"] = &SceneNodeRange::getCount;
+    range["release"] = &SceneNodeRange::release;
+    return graph;
+}
+
+// e.g. womf.Skin(rootNode, {jointNodes...}, inverseBindMatricesBufferView or nil), with node ids
+// relative to the first node of an instance
+auto bindSkin(sol::state& lua)
+{
+    auto skin = lua.new_usertype<Skin>("Skin", sol::call_constructor,
+        sol::factories([](SceneGraph::NodeId root, std::vector<SceneGraph::NodeId> joints,
+                           sol::optional<BufferView::Ptr> inverseBindMatrices) {
+            std::vector<glm::mat4> matrices;
+            if (inverseBindMatrices) {
+                const auto data = (*inverseBindMatrices)->data();
+                dieAssert(data.size() >= joints.size() * sizeof(glm::mat4),
+                    "Inverse bind matrices must have {} bytes", joints.size() * sizeof(glm::mat4));
+                matrices.resize(joints.size());
+                std::memcpy(matrices.data(), data.data(), joints.size() * sizeof(glm::mat4));
+            }
+            return Skin::create(root, std::move(joints), std::move(matrices));
+        }));
+    const auto unpackAabb = [](const Aabb& box) {
+        return std::tuple { box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z };
+    };
+    skin["getJointCount"] = &Skin::getJointCount;
+    // minX, minY, minZ, maxX, maxY, maxZ
+    skin["getBindPoseBounds"]
+        = [unpackAabb](const Skin& skin) { return unpackAabb(skin.getBindPoseBounds()); };
+    // Returns the bounds of the joints like getBindPoseBounds
+    skin["update"] = [unpackAabb](const Skin& skin, SceneGraph& graph, SceneGraph::NodeId base,
+                         MatrixPalette& palette) {
+        palette.matrices.resize(skin.getJointCount());
+        return unpackAabb(skin.update(graph, base, palette.matrices));
+    };
+
+    auto palette = lua.new_usertype<MatrixPalette>("MatrixPalette", sol::call_constructor,
+        sol::factories([](size_t count) {
+            return MatrixPalette { std::vector<glm::mat4>(count, glm::mat4(1.0f)) };
+        }));
+    palette["getSize"] = [](const MatrixPalette& palette) { return palette.matrices.size(); };
+    return skin;
+}
+
 auto bindSampler(sol::state& lua)
 {
     auto sampler = lua.new_usertype<Sampler>("Sampler", sol::call_constructor,
@@ -428,6 +981,125 @@ const void* BufferView_getPointer(const void* obj)
 }
 }
 
+// The same tables as readGltf in gltf.lua, with 1-based indices. Names that are missing in the
+// file are nil.
+sol::table gltfAssetToTable(sol::state& lua, const GltfAsset& asset)
+{
+    const auto setName = [](sol::table table, const std::string& name) {
+        if (!name.empty()) {
+            table["name"] = name;
+        }
+    };
+    const auto indexList = [&lua](const std::vector<size_t>& indices) {
+        auto list = lua.create_table(static_cast<int>(indices.size()));
+        for (size_t i = 0; i < indices.size(); ++i) {
+            list[i + 1] = indices[i] + 1;
+        }
+        return list;
+    };
+
+    auto textures = lua.create_table(static_cast<int>(asset.textures.size()));
+    for (size_t i = 0; i < asset.textures.size(); ++i) {
+        textures[i + 1] = asset.textures[i];
+    }
+
+    auto materials = lua.create_table(static_cast<int>(asset.materials.size()));
+    for (size_t i = 0; i < asset.materials.size(); ++i) {
+        const auto& mat = asset.materials[i];
+        const auto texture = [&asset](const std::optional<size_t>& index) {
+            return index ? asset.textures[*index] : nullptr;
+        };
+        auto material = lua.create_table_with("albedo", texture(mat.albedo), "color",
+            lua.create_table_with(1, mat.color.r, 2, mat.color.g, 3, mat.color.b, 4, mat.color.a),
+            "metallicRoughness", texture(mat.metallicRoughness), "metallicFactor",
+            mat.metallicFactor, "roughnessFactor", mat.roughnessFactor, "normal",
+            texture(mat.normal), "occlusion", texture(mat.occlusion));
+        setName(material, mat.name);
+        materials[i + 1] = material;
+    }
+
+    auto meshes = lua.create_table(static_cast<int>(asset.meshes.size()));
+    for (size_t i = 0; i < asset.meshes.size(); ++i) {
+        auto primitives = lua.create_table();
+        for (size_t p = 0; p < asset.meshes[i].primitives.size(); ++p) {
+            const auto& prim = asset.meshes[i].primitives[p];
+            primitives[p + 1]
+                = lua.create_table_with("geometry", prim.geometry, "material", prim.material + 1);
+        }
+        auto mesh = lua.create_table_with("primitives", primitives);
+        setName(mesh, asset.meshes[i].name);
+        meshes[i + 1] = mesh;
+    }
+
+    auto nodes = lua.create_table(static_cast<int>(asset.nodes.size()));
+    for (size_t i = 0; i < asset.nodes.size(); ++i) {
+        const auto& n = asset.nodes[i];
+        auto node = lua.create_table_with("children", indexList(n.children));
+        setName(node, n.name);
+        if (n.mesh) {
+            node["mesh"] = *n.mesh + 1;
+        }
+        if (n.skin) {
+            node["skin"] = *n.skin + 1;
+        }
+        if (n.translation) {
+            const auto& t = *n.translation;
+            node["translation"] = lua.create_table_with(1, t.x, 2, t.y, 3, t.z);
+        }
+        // x, y, z, w like in the file
+        if (n.rotation) {
+            const auto& r = *n.rotation;
+            node["rotation"] = lua.create_table_with(1, r.x, 2, r.y, 3, r.z, 4, r.w);
+        }
+        if (n.scale) {
+            const auto& s = *n.scale;
+            node["scale"] = lua.create_table_with(1, s.x, 2, s.y, 3, s.z);
+        }
+        nodes[i + 1] = node;
+    }
+
+    auto skins = lua.create_table(static_cast<int>(asset.skins.size()));
+    for (size_t i = 0; i < asset.skins.size(); ++i) {
+        const auto& skin = asset.skins[i];
+        skins[i + 1] = lua.create_table_with("joints", indexList(skin.joints),
+            "inverseBindMatrices", skin.inverseBindMatrices);
+    }
+
+    auto animations = lua.create_table(static_cast<int>(asset.animations.size()));
+    for (size_t i = 0; i < asset.animations.size(); ++i) {
+        auto channels = lua.create_table();
+        for (size_t c = 0; c < asset.animations[i].channels.size(); ++c) {
+            const auto& channel = asset.animations[i].channels[c];
+            channels[c + 1] = lua.create_table_with("node", channel.node + 1, "path", channel.path,
+                "samplerType", channel.samplerType, "interpolation", channel.interpolation,
+                "times", channel.times, "values", channel.values);
+        }
+        auto animation = lua.create_table_with("channels", channels);
+        setName(animation, asset.animations[i].name);
+        animations[i + 1] = animation;
+    }
+
+    auto ret = lua.create_table_with("textures", textures, "materials", materials, "meshes",
+        meshes, "nodes", nodes, "scene", indexList(asset.scene), "skins", skins, "animations",
+        animations);
+    if (const auto& stats = asset.meshOptimization) {
+        auto opt = lua.create_table_with("primitives", stats->primitives, "skipped",
+            stats->skipped, "triangles", stats->triangles, "verticesBefore",
+            stats->verticesBefore, "verticesAfter", stats->verticesAfter);
+        opt["vertexShaderInvocationsBefore"] = stats->vertexShaderInvocationsBefore;
+        opt["vertexShaderInvocationsAfter"] = stats->vertexShaderInvocationsAfter;
+        opt["vertexBytesBefore"] = stats->vertexBytesBefore;
+        opt["vertexBytesAfter"] = stats->vertexBytesAfter;
+        opt["indexBytesBefore"] = stats->indexBytesBefore;
+        opt["indexBytesAfter"] = stats->indexBytesAfter;
+        opt["lods"] = stats->lods;
+        opt["lodTriangles"] = stats->lodTriangles;
+        opt["lodIndexBytes"] = stats->lodIndexBytes;
+        ret["meshOptimization"] = opt;
+    }
+    return ret;
+}
+
 void bindTypes(sol::state& lua, sol::table table)
 {
     // For some reason I can't get shared_ptr<Buffer(View)> to convert to shared_ptr<BufferBase>
@@ -453,10 +1125,19 @@ void bindTypes(sol::state& lua, sol::table table)
 
     table["Shader"] = bindShader(lua);
 
+    lua.new_enum("Residency", "keep", Residency::Keep, "dropAfterUpload",
+        Residency::DropAfterUpload, "reload", Residency::Reload);
+    table["residency"] = lua["Residency"];
+    lua["Residency"] = sol::nil;
+
     table["Texture"] = bindTexture(lua);
     table["pixelTexture"] = [](float r, float g, float b, float a) {
         return Texture::createPixel(glm::vec4(r, g, b, a));
     };
+    table["pixelTextureLayer"] = [](float r, float g, float b, float a) {
+        return Texture::createPixelLayer(glm::vec4(r, g, b, a));
+    };
+    table["TextureArrayBuilder"] = bindTextureArrayBuilder(lua);
 
     lua.new_enum(
         "BufferTarget", "attributes", BufferTarget::Attributes, "indices", BufferTarget::Indices);
@@ -487,8 +1168,34 @@ void bindTypes(sol::state& lua, sol::table table)
     lua["DrawMode"] = sol::nil;
 
     table["Geometry"] = bindGeometry(lua);
+    table["GeometryPool"] = bindGeometryPool(lua);
+    table["isMultiDrawSupported"] = &isMultiDrawSupported;
+    table["OcclusionBuffer"] = bindOcclusionBuffer(lua);
+
+    lua.new_enum("DepthFunc", "never", DepthFunc::Never, "less", DepthFunc::Less, "equal",
+        DepthFunc::Equal, "lessEqual", DepthFunc::LessEqual, "greater", DepthFunc::Greater,
+        "notEqual", DepthFunc::NotEqual, "greaterEqual", DepthFunc::GreaterEqual, "always",
+        DepthFunc::Always);
+    table["depthFunc"] = lua["DepthFunc"];
+    lua["DepthFunc"] = sol::nil;
+
+    lua.new_enum("BlendMode", "none", BlendMode::None, "alpha", BlendMode::Alpha,
+        "premultipliedAlpha", BlendMode::PremultipliedAlpha, "additive", BlendMode::Additive);
+    table["blendMode"] = lua["BlendMode"];
+    lua["BlendMode"] = sol::nil;
+
+    lua.new_enum("CullMode", "none", CullMode::None, "back", CullMode::Back, "front",
+        CullMode::Front);
+    table["cullMode"] = lua["CullMode"];
+    lua["CullMode"] = sol::nil;
+
+    table["RenderState"] = bindRenderState(lua);
 
     table["Transform"] = bindTransform(lua);
+    table["SceneGraph"] = bindSceneGraph(lua);
+    table["Skin"] = bindSkin(lua);
+    table["MatrixPalette"] = lua["MatrixPalette"];
+    lua["MatrixPalette"] = sol::nil;
 
     lua.new_enum("InterpolationType", "step", Interpolation::Step, "linear", Interpolation::Linear);
     table["interp"] = lua["InterpolationType"];
@@ -500,6 +1207,22 @@ void bindTypes(sol::state& lua, sol::table table)
     lua["SamplerType"] = sol::nil;
 
     table["Sampler"] = bindSampler(lua);
+
+    // Native replacement for the JSON parsing in gltf.lua, see womf.loadGltfModel. The scene
+    // cache is used and the meshes are optimized unless useCache or optimize are false.
+    // lods is an optional table of LodSettings, e.g. { levels = 2, ratio = 0.25, maxError = 0.1 }
+    table["readGltf"] = [&lua](const std::string& path, sol::optional<bool> useCache,
+                            sol::optional<bool> optimize, sol::optional<sol::table> lods) {
+        LodSettings lodSettings;
+        if (lods) {
+            lodSettings.levels = lods->get_or("levels", lodSettings.levels);
+            lodSettings.ratio = lods->get_or("ratio", lodSettings.ratio);
+            lodSettings.maxError = lods->get_or("maxError", lodSettings.maxError);
+        }
+        return gltfAssetToTable(lua,
+            *GltfAsset::load(
+                path, useCache.value_or(true), optimize.value_or(true), lodSettings));
+    };
 }
 
 int solExceptionHandler(
@@ -554,6 +1277,8 @@ int main(int argc, char** argv)
     std::optional<std::string> title;
     std::optional<uint32_t> width;
     std::optional<uint32_t> height;
+    std::optional<std::string> prefetchManifest;
+    std::optional<float> prefetchRecordTime;
     try {
         auto config = lua.script_file("config.lua");
         assert(config.valid());
@@ -561,11 +1286,18 @@ int main(int argc, char** argv)
         title = table["title"].get<std::optional<std::string>>();
         width = table["width"].get<std::optional<uint32_t>>();
         height = table["height"].get<std::optional<uint32_t>>();
+        prefetchManifest = table["prefetchManifest"].get<std::optional<std::string>>();
+        prefetchRecordTime = table["prefetchRecordTime"].get<std::optional<float>>();
     } catch (const sol::error& exc) {
         fmt::print(stderr, "Error loading config.lua: {}\n", exc.what());
         return 1;
     }
 
+    // Start as early as possible, so the prefetch overlaps with SDL and GL initialization
+    if (prefetchManifest) {
+        startPrefetch(*prefetchManifest, prefetchRecordTime.value_or(5.0f));
+    }
+
     // SDL_LogSetAllPriority(SDL_LOG_PRIORITY_VERBOSE);
 
     sdlw::Sdl sdl(sdlw::SubSystem::Everything);
@@ -583,7 +1315,7 @@ int main(int argc, char** argv)
 
     gladLoadGLLoader((GLADloadproc)SDL_GL_GetProcAddress);
     glw::State::instance().setViewport(window->getSize().x, window->getSize().y);
-    glEnable(GL_DEPTH_TEST);
+    // Depth testing etc. are enabled by the default RenderState
 
     const auto resFs = cmrc::luaSource::get_filesystem();
     lua.add_package_loader(
@@ -595,6 +1327,17 @@ int main(int argc, char** argv)
             } else if (resFs.is_directory(path) && resFs.is_file(path + "/" + "init.lua")) {
                 return load(L, getCmrcFile(path + "/" + "init.lua"), moduleName);
             }
+            if (isRecordingFileReads()) {
+                // The default searchers load modules from disk without going through readFile
+                sol::state_view lua(L);
+                const sol::optional<std::string> file
+                    = lua["package"]["searchpath"](moduleName, lua["package"]["path"]);
+                std::error_code ec;
+                const auto size = file ? std::filesystem::file_size(*file, ec) : 0;
+                if (file && !ec) {
+                    recordFileRead(*file, 0, size);
+                }
+            }
             return sol::make_object(L, "Module not found");
         });
 
@@ -602,7 +1345,7 @@ int main(int argc, char** argv)
     bindSys(lua, lua["womf"], *window);
     bindGfx(lua, lua["womf"]);
     bindTypes(lua, lua["womf"]);
-    lua["womf"]["readFile"] = &readFile<std::string>;
+    lua["womf"]["readFile"] = [](const std::string& path) { return readFile<std::string>(path); };
 
     auto init = lua.script(getCmrcFile("init.lua"), "init");
     if (!init.valid()) {
@@ -610,6 +1353,14 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (isRecordingFileReads()) {
+        // A missing main.lua is reported by script_file below
+        std::error_code ec;
+        const auto size = std::filesystem::file_size("main.lua", ec);
+        if (!ec) {
+            recordFileRead("main.lua", 0, size);
+        }
+    }
     auto main = lua.script_file("main.lua");
     if (!main.valid()) {
         fmt::print(stderr, "Error: {}\n", main.get<sol::error>().what());
@@ -621,5 +1372,7 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    finishPrefetch();
+
     return 0;
 }
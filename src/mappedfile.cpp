@@ -0,0 +1,96 @@
+#include "mappedfile.hpp"
+
+#include <cstdio>
+#include <memory>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "prefetch.hpp"
+
+std::optional<MappedFile> MappedFile::open(const std::string& path)
+{
+    MappedFile file;
+#if !defined(_WIN32)
+    const auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return std::nullopt;
+    }
+    file.size_ = static_cast<size_t>(st.st_size);
+    if (file.size_ > 0) {
+        const auto ptr = ::mmap(nullptr, file.size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            ::close(fd);
+            return std::nullopt;
+        }
+        file.data_ = static_cast<const uint8_t*>(ptr);
+    }
+    // The mapping stays valid after closing the file
+    ::close(fd);
+#else
+    auto f = std::unique_ptr<FILE, decltype(&std::fclose)>(
+        std::fopen(path.c_str(), "rb"), &std::fclose);
+    if (!f) {
+        return std::nullopt;
+    }
+    std::fseek(f.get(), 0, SEEK_END);
+    file.fallback_.resize(std::ftell(f.get()));
+    std::fseek(f.get(), 0, SEEK_SET);
+    std::fread(file.fallback_.data(), 1, file.fallback_.size(), f.get());
+    file.data_ = file.fallback_.data();
+    file.size_ = file.fallback_.size();
+#endif
+    recordFileRead(path, 0, file.size_);
+    file.memory_.set(static_cast<int64_t>(file.size_));
+    return file;
+}
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+MappedFile::MappedFile(MappedFile&& other)
+    : data_(std::exchange(other.data_, nullptr))
+    , size_(std::exchange(other.size_, 0))
+    , fallback_(std::move(other.fallback_))
+    , memory_(std::move(other.memory_))
+{
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other)
+{
+    unmap();
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+    fallback_ = std::move(other.fallback_);
+    memory_ = std::move(other.memory_);
+    return *this;
+}
+
+std::span<const uint8_t> MappedFile::data() const
+{
+    return std::span<const uint8_t>(data_, size_);
+}
+
+void MappedFile::unmap()
+{
+#if !defined(_WIN32)
+    if (data_) {
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+    memory_.set(0);
+}
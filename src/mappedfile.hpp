@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+
+// A read-only memory mapping of a whole file. On platforms without mmap the file is just read.
+class MappedFile {
+public:
+    static std::optional<MappedFile> open(const std::string& path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+
+    std::span<const uint8_t> data() const;
+
+private:
+    MappedFile() = default;
+    void unmap();
+
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<uint8_t> fallback_;
+    TrackedMemory memory_ { MemoryCategory::MappedFiles };
+};
@@ -0,0 +1,77 @@
+#include "memory.hpp"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <utility>
+
+namespace {
+// Buffers might be created on worker threads
+std::array<std::atomic<int64_t>, static_cast<size_t>(MemoryCategory::Count)> usage;
+
+void track(MemoryCategory category, int64_t bytes)
+{
+    usage[static_cast<size_t>(category)] += bytes;
+}
+}
+
+std::string_view getMemoryCategoryName(MemoryCategory category)
+{
+    switch (category) {
+    case MemoryCategory::Buffers:
+        return "buffers";
+    case MemoryCategory::MappedFiles:
+        return "mappedFiles";
+    case MemoryCategory::DecodedTextures:
+        return "decodedTextures";
+    case MemoryCategory::GpuBuffers:
+        return "gpuBuffers";
+    case MemoryCategory::GpuTextures:
+        return "gpuTextures";
+    default:
+        assert(false && "Invalid memory category");
+        return "";
+    }
+}
+
+int64_t getMemoryUsage(MemoryCategory category)
+{
+    return usage[static_cast<size_t>(category)];
+}
+
+TrackedMemory::TrackedMemory(MemoryCategory category, int64_t bytes)
+    : category_(category)
+    , bytes_(bytes)
+{
+    track(category_, bytes_);
+}
+
+TrackedMemory::~TrackedMemory()
+{
+    track(category_, -bytes_);
+}
+
+TrackedMemory::TrackedMemory(TrackedMemory&& other)
+    : category_(other.category_)
+    , bytes_(std::exchange(other.bytes_, 0))
+{
+}
+
+TrackedMemory& TrackedMemory::operator=(TrackedMemory&& other)
+{
+    track(category_, -bytes_);
+    category_ = other.category_;
+    bytes_ = std::exchange(other.bytes_, 0);
+    return *this;
+}
+
+void TrackedMemory::set(int64_t bytes)
+{
+    track(category_, bytes - bytes_);
+    bytes_ = bytes;
+}
+
+int64_t TrackedMemory::get() const
+{
+    return bytes_;
+}
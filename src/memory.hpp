@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// Rough accounting of the large allocations, so it's visible where memory goes
+enum class MemoryCategory {
+    Buffers, // Buffer data read from files or created from Lua
+    MappedFiles, // Mostly clean pages that the OS can drop, but they count towards RSS
+    DecodedTextures, // Mip chains kept for streaming
+    GpuBuffers,
+    GpuTextures,
+    Count,
+};
+
+std::string_view getMemoryCategoryName(MemoryCategory category);
+// Current bytes in that category
+int64_t getMemoryUsage(MemoryCategory category);
+
+// Adds its size to a category for as long as it lives
+class TrackedMemory {
+public:
+    TrackedMemory(MemoryCategory category, int64_t bytes = 0);
+    ~TrackedMemory();
+
+    TrackedMemory(const TrackedMemory&) = delete;
+    TrackedMemory& operator=(const TrackedMemory&) = delete;
+    TrackedMemory(TrackedMemory&& other);
+    TrackedMemory& operator=(TrackedMemory&& other);
+
+    void set(int64_t bytes);
+    int64_t get() const;
+
+private:
+    MemoryCategory category_;
+    int64_t bytes_ = 0;
+};
@@ -0,0 +1,534 @@
+#include "meshoptdecode.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define WOMF_MESHOPT_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+// The low nibble of the header byte is the version
+constexpr uint8_t vertexHeader = 0xa0;
+constexpr uint8_t triangleHeader = 0xe0;
+constexpr uint8_t sequenceHeader = 0xd0;
+
+constexpr size_t vertexBlockSizeBytes = 8192;
+constexpr size_t vertexBlockMaxSize = 256;
+constexpr size_t byteGroupSize = 16;
+// No group is longer (16 bytes plus the header bytes that precede it), so with this much data
+// left a group can be decoded without bounds checks
+constexpr size_t byteGroupDecodeLimit = 24;
+// The last vertex of the first block's "previous" vertex, padded to at least this size
+constexpr size_t tailMinSize = 32;
+
+uint32_t unzigzag32(uint32_t v)
+{
+    return (0u - (v & 1)) ^ (v >> 1);
+}
+
+// A whole number of byte groups that fits into 8k
+size_t getVertexBlockSize(size_t stride)
+{
+    return std::min((vertexBlockSizeBytes / stride) & ~(byteGroupSize - 1), vertexBlockMaxSize);
+}
+
+// 16 values of 2 or 4 bits, the first one in the most significant bits. The largest value means
+// the actual byte follows after the packed values.
+template <int Bits>
+const uint8_t* decodePackedGroup(const uint8_t* data, uint8_t* dest)
+{
+    constexpr uint8_t sentinel = (1 << Bits) - 1;
+    const uint8_t* extra = data + byteGroupSize * Bits / 8;
+#ifdef WOMF_MESHOPT_SSE2
+    __m128i values;
+    if constexpr (Bits == 2) {
+        int32_t packed = 0;
+        std::memcpy(&packed, data, sizeof(packed));
+        const auto x = _mm_cvtsi32_si128(packed);
+        const auto mask = _mm_set1_epi8(3);
+        const auto a = _mm_and_si128(_mm_srli_epi16(x, 6), mask);
+        const auto b = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+        const auto c = _mm_and_si128(_mm_srli_epi16(x, 2), mask);
+        const auto d = _mm_and_si128(x, mask);
+        values = _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, b), _mm_unpacklo_epi8(c, d));
+    } else {
+        const auto x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(data));
+        const auto mask = _mm_set1_epi8(15);
+        values = _mm_unpacklo_epi8(
+            _mm_and_si128(_mm_srli_epi16(x, 4), mask), _mm_and_si128(x, mask));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), values);
+    // The encoder picks the bit count so there are few of these
+    auto sentinels = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(values, _mm_set1_epi8(static_cast<char>(sentinel)))));
+    while (sentinels) {
+        dest[std::countr_zero(sentinels)] = *extra++;
+        sentinels &= sentinels - 1;
+    }
+#else
+    constexpr size_t perByte = 8 / Bits;
+    for (size_t i = 0; i < byteGroupSize; ++i) {
+        const auto shift = 8 - Bits * (i % perByte + 1);
+        const auto value = static_cast<uint8_t>((data[i / perByte] >> shift) & sentinel);
+        dest[i] = value == sentinel ? *extra++ : value;
+    }
+#endif
+    return extra;
+}
+
+const uint8_t* decodeBytesGroup(const uint8_t* data, uint8_t* dest, int bitsLog2)
+{
+    switch (bitsLog2) {
+    case 0:
+        std::memset(dest, 0, byteGroupSize);
+        return data;
+    case 1:
+        return decodePackedGroup<2>(data, dest);
+    case 2:
+        return decodePackedGroup<4>(data, dest);
+    default:
+        std::memcpy(dest, data, byteGroupSize);
+        return data + byteGroupSize;
+    }
+}
+
+// `count` bytes (whole groups), preceded by the 2 bit sizes of all groups. Returns nullptr if
+// the data ends too early.
+const uint8_t* decodeBytes(const uint8_t* data, const uint8_t* end, uint8_t* dest, size_t count)
+{
+    const auto groups = count / byteGroupSize;
+    const auto header = data;
+    const auto headerSize = (groups + 3) / 4;
+    if (static_cast<size_t>(end - data) < headerSize) {
+        return nullptr;
+    }
+    data += headerSize;
+    for (size_t g = 0; g < groups; ++g) {
+        if (static_cast<size_t>(end - data) < byteGroupDecodeLimit) {
+            return nullptr;
+        }
+        const auto bitsLog2 = (header[g / 4] >> ((g % 4) * 2)) & 3;
+        data = decodeBytesGroup(data, dest + g * byteGroupSize, bitsLog2);
+    }
+    return data;
+}
+
+#ifdef WOMF_MESHOPT_SSE2
+__m128i unzigzag8(__m128i v)
+{
+    const auto sign = _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(v, _mm_set1_epi8(1)));
+    return _mm_xor_si128(sign, _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(127)));
+}
+#else
+uint8_t unzigzag8(uint8_t v)
+{
+    return static_cast<uint8_t>(-(v & 1) ^ (v >> 1));
+}
+#endif
+
+// The bytes of every vertex are stored one after the other, for all vertices of the block.
+// `last` is the vertex before the block, which the first one is coded against. It is updated to
+// the last vertex of the block.
+const uint8_t* decodeVertexBlock(const uint8_t* data, const uint8_t* end, uint8_t* dest,
+    size_t count, size_t stride, uint8_t* last)
+{
+    const auto alignedCount = (count + byteGroupSize - 1) & ~(byteGroupSize - 1);
+#ifdef WOMF_MESHOPT_SSE2
+    // Four bytes of every vertex at once (the stride is a multiple of 4). They are transposed,
+    // so every 32 bit lane is a vertex, and the deltas are summed up with two shifted adds.
+    alignas(16) uint8_t bytes[4][vertexBlockMaxSize];
+    alignas(16) uint8_t vertices[16];
+    for (size_t k = 0; k < stride; k += 4) {
+        for (auto& channel : bytes) {
+            data = decodeBytes(data, end, channel, alignedCount);
+            if (!data) {
+                return nullptr;
+            }
+        }
+        int32_t baseline = 0;
+        std::memcpy(&baseline, last + k, sizeof(baseline));
+        auto previous = _mm_set1_epi32(baseline);
+        for (size_t i = 0; i < count; i += byteGroupSize) {
+            __m128i channels[4];
+            for (size_t c = 0; c < 4; ++c) {
+                channels[c] = unzigzag8(
+                    _mm_load_si128(reinterpret_cast<const __m128i*>(bytes[c] + i)));
+            }
+            const auto lo01 = _mm_unpacklo_epi8(channels[0], channels[1]);
+            const auto hi01 = _mm_unpackhi_epi8(channels[0], channels[1]);
+            const auto lo23 = _mm_unpacklo_epi8(channels[2], channels[3]);
+            const auto hi23 = _mm_unpackhi_epi8(channels[2], channels[3]);
+            const __m128i quads[4] = {
+                _mm_unpacklo_epi16(lo01, lo23),
+                _mm_unpackhi_epi16(lo01, lo23),
+                _mm_unpacklo_epi16(hi01, hi23),
+                _mm_unpackhi_epi16(hi01, hi23),
+            };
+            for (size_t q = 0; q < 4 && i + q * 4 < count; ++q) {
+                auto v = quads[q];
+                v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi8(v, previous);
+                previous = _mm_shuffle_epi32(v, 0xff);
+                _mm_store_si128(reinterpret_cast<__m128i*>(vertices), v);
+                const auto first = i + q * 4;
+                for (size_t j = 0; j < 4 && first + j < count; ++j) {
+                    std::memcpy(dest + (first + j) * stride + k, vertices + j * 4, 4);
+                }
+            }
+        }
+    }
+#else
+    uint8_t bytes[vertexBlockMaxSize];
+    for (size_t k = 0; k < stride; ++k) {
+        data = decodeBytes(data, end, bytes, alignedCount);
+        if (!data) {
+            return nullptr;
+        }
+        auto previous = last[k];
+        for (size_t i = 0; i < count; ++i) {
+            previous = static_cast<uint8_t>(previous + unzigzag8(bytes[i]));
+            dest[i * stride + k] = previous;
+        }
+    }
+#endif
+    std::memcpy(last, dest + (count - 1) * stride, stride);
+    return data;
+}
+
+bool decodeVertices(uint8_t* dest, size_t count, size_t stride, std::span<const uint8_t> src)
+{
+    if (stride == 0 || stride > 256 || stride % 4 != 0) {
+        return false;
+    }
+    const auto tailSize = std::max(stride, tailMinSize);
+    if (src.size() < 1 + tailSize || (src[0] & 0xf0) != vertexHeader || (src[0] & 0x0f) != 0) {
+        return false;
+    }
+    const auto end = src.data() + src.size();
+    uint8_t last[256];
+    std::memcpy(last, end - stride, stride);
+
+    const auto blockSize = getVertexBlockSize(stride);
+    const uint8_t* data = src.data() + 1;
+    for (size_t offset = 0; offset < count; offset += blockSize) {
+        data = decodeVertexBlock(
+            data, end, dest + offset * stride, std::min(blockSize, count - offset), stride, last);
+        if (!data) {
+            return false;
+        }
+    }
+    return static_cast<size_t>(end - data) == tailSize;
+}
+
+// 7 bits per byte, the high bit means another byte follows
+uint32_t decodeVByte(const uint8_t*& data)
+{
+    const auto lead = *data++;
+    if (lead < 128) {
+        return lead;
+    }
+    uint32_t result = lead & 127;
+    uint32_t shift = 7;
+    for (int i = 0; i < 4; ++i) {
+        const auto group = *data++;
+        result |= static_cast<uint32_t>(group & 127) << shift;
+        shift += 7;
+        if (group < 128) {
+            break;
+        }
+    }
+    return result;
+}
+
+void writeIndex(uint8_t* dest, size_t indexSize, size_t i, uint32_t index)
+{
+    if (indexSize == 2) {
+        const auto value = static_cast<uint16_t>(index);
+        std::memcpy(dest + i * 2, &value, sizeof(value));
+    } else {
+        std::memcpy(dest + i * 4, &index, sizeof(index));
+    }
+}
+
+// Every triangle is a byte that says which of its vertices are new (the next index), come from
+// the vertex FIFO or are coded explicitly (as a delta to the last explicit one), and whether
+// one of its edges is in the edge FIFO. The decoder has to update the FIFOs exactly like the
+// encoder did.
+class TriangleDecoder {
+public:
+    bool decode(uint8_t* dest, size_t count, size_t indexSize, std::span<const uint8_t> src)
+    {
+        // The header, a code byte per triangle and the table of 16 common auxiliary codes
+        if (count % 3 != 0 || src.size() < 1 + count / 3 + 16
+            || (src[0] & 0xf0) != triangleHeader || (src[0] & 0x0f) > 1) {
+            return false;
+        }
+        // Version 1 codes +-1 deltas of explicit indices in the code byte
+        const uint32_t fifoCodeMax = (src[0] & 0x0f) >= 1 ? 13 : 15;
+
+        const uint8_t* code = src.data() + 1;
+        const uint8_t* data = code + count / 3;
+        const uint8_t* dataSafeEnd = src.data() + src.size() - 16;
+        const uint8_t* auxTable = dataSafeEnd;
+
+        for (size_t i = 0; i < count; i += 3) {
+            // A triangle reads at most 16 bytes of data, which the table after it covers
+            if (data > dataSafeEnd) {
+                return false;
+            }
+            const auto codeTri = *code++;
+            if (codeTri < 0xf0) {
+                const auto edge = codeTri >> 4;
+                const auto a = edges_[(edgeOffset_ - 1 - edge) & 15][0];
+                const auto b = edges_[(edgeOffset_ - 1 - edge) & 15][1];
+                const uint32_t fec = codeTri & 15;
+                uint32_t c = 0;
+                if (fec < fifoCodeMax) {
+                    c = fec == 0 ? next_++ : vertices_[(vertexOffset_ - 1 - fec) & 15];
+                    pushVertex(c, fec == 0);
+                } else {
+                    // 13 and 14 are -1 and +1
+                    c = last_ = fec != 15
+                        ? last_ + static_cast<uint32_t>(static_cast<int32_t>(fec - (fec ^ 3)))
+                        : decodeIndex(data);
+                    pushVertex(c);
+                }
+                writeTriangle(dest, indexSize, i, a, b, c);
+                pushEdge(c, b);
+                pushEdge(a, c);
+            } else if (codeTri < 0xfe) {
+                // All three vertices are new or from the vertex FIFO, the codes are in the table
+                const auto aux = auxTable[codeTri & 15];
+                const uint32_t feb = aux >> 4;
+                const uint32_t fec = aux & 15;
+                const auto a = next_++;
+                const auto b = feb == 0 ? next_++ : vertices_[(vertexOffset_ - feb) & 15];
+                const auto c = fec == 0 ? next_++ : vertices_[(vertexOffset_ - fec) & 15];
+                writeTriangle(dest, indexSize, i, a, b, c);
+                pushVertex(a);
+                pushVertex(b, feb == 0);
+                pushVertex(c, fec == 0);
+                pushEdge(b, a);
+                pushEdge(c, b);
+                pushEdge(a, c);
+            } else {
+                // Like the table, but with the auxiliary code in the data and explicit indices
+                const auto aux = *data++;
+                const uint32_t fea = codeTri == 0xfe ? 0 : 15;
+                const uint32_t feb = aux >> 4;
+                const uint32_t fec = aux & 15;
+                // A zero code that is not from the table restarts the new indices
+                if (aux == 0) {
+                    next_ = 0;
+                }
+                auto a = fea == 0 ? next_++ : 0;
+                auto b = feb == 0 ? next_++ : vertices_[(vertexOffset_ - feb) & 15];
+                auto c = fec == 0 ? next_++ : vertices_[(vertexOffset_ - fec) & 15];
+                if (fea == 15) {
+                    last_ = a = decodeIndex(data);
+                }
+                if (feb == 15) {
+                    last_ = b = decodeIndex(data);
+                }
+                if (fec == 15) {
+                    last_ = c = decodeIndex(data);
+                }
+                writeTriangle(dest, indexSize, i, a, b, c);
+                pushVertex(a);
+                pushVertex(b, feb == 0 || feb == 15);
+                pushVertex(c, fec == 0 || fec == 15);
+                pushEdge(b, a);
+                pushEdge(c, b);
+                pushEdge(a, c);
+            }
+        }
+        // All data up to the table has to be used
+        return data == dataSafeEnd;
+    }
+
+private:
+    uint32_t decodeIndex(const uint8_t*& data) const
+    {
+        return last_ + unzigzag32(decodeVByte(data));
+    }
+
+    static void writeTriangle(
+        uint8_t* dest, size_t indexSize, size_t i, uint32_t a, uint32_t b, uint32_t c)
+    {
+        writeIndex(dest, indexSize, i + 0, a);
+        writeIndex(dest, indexSize, i + 1, b);
+        writeIndex(dest, indexSize, i + 2, c);
+    }
+
+    void pushEdge(uint32_t a, uint32_t b)
+    {
+        edges_[edgeOffset_][0] = a;
+        edges_[edgeOffset_][1] = b;
+        edgeOffset_ = (edgeOffset_ + 1) & 15;
+    }
+
+    void pushVertex(uint32_t v, bool advance = true)
+    {
+        vertices_[vertexOffset_] = v;
+        vertexOffset_ = (vertexOffset_ + (advance ? 1 : 0)) & 15;
+    }
+
+    uint32_t edges_[16][2] = {};
+    uint32_t vertices_[16] = {};
+    size_t edgeOffset_ = 0;
+    size_t vertexOffset_ = 0;
+    uint32_t next_ = 0;
+    uint32_t last_ = 0;
+};
+
+// Every index is a delta to one of the last two indices (the low bit says which)
+bool decodeSequence(uint8_t* dest, size_t count, size_t indexSize, std::span<const uint8_t> src)
+{
+    // The header, at least a byte per index and a 4 byte tail
+    if (src.size() < 1 + count + 4 || (src[0] & 0xf0) != sequenceHeader
+        || (src[0] & 0x0f) > 1) {
+        return false;
+    }
+    const uint8_t* data = src.data() + 1;
+    const uint8_t* dataSafeEnd = src.data() + src.size() - 4;
+    uint32_t last[2] = { 0, 0 };
+    for (size_t i = 0; i < count; ++i) {
+        // An index reads at most 5 bytes, which the tail covers
+        if (data >= dataSafeEnd) {
+            return false;
+        }
+        const auto v = decodeVByte(data);
+        const auto baseline = v & 1;
+        last[baseline] += unzigzag32(v >> 1);
+        writeIndex(dest, indexSize, i, last[baseline]);
+    }
+    return data == dataSafeEnd;
+}
+
+int roundToInt(float v)
+{
+    return static_cast<int>(v + (v >= 0.0f ? 0.5f : -0.5f));
+}
+
+// x and y of the octahedral projection, z is 1 at the same scale
+template <typename T>
+void filterOctahedral(uint8_t* data, size_t count)
+{
+    const auto max = static_cast<float>((1 << (sizeof(T) * 8 - 1)) - 1);
+    for (size_t i = 0; i < count; ++i) {
+        T n[4];
+        std::memcpy(n, data + i * sizeof(n), sizeof(n));
+        auto x = static_cast<float>(n[0]);
+        auto y = static_cast<float>(n[1]);
+        const auto z = static_cast<float>(n[2]) - std::abs(x) - std::abs(y);
+        // The lower hemisphere is folded over the diagonals
+        const auto t = std::min(z, 0.0f);
+        x += x >= 0.0f ? t : -t;
+        y += y >= 0.0f ? t : -t;
+        const auto scale = max / std::sqrt(x * x + y * y + z * z);
+        n[0] = static_cast<T>(roundToInt(x * scale));
+        n[1] = static_cast<T>(roundToInt(y * scale));
+        n[2] = static_cast<T>(roundToInt(z * scale));
+        std::memcpy(data + i * sizeof(n), n, sizeof(n));
+    }
+}
+
+// Three components scaled by 1/sqrt(2) (the largest of the four is left out and reconstructed)
+// and the index of the missing one in the low bits of the fourth, whose high bits are the scale
+void filterQuaternion(uint8_t* data, size_t count)
+{
+    const auto scale = 1.0f / std::sqrt(2.0f);
+    for (size_t i = 0; i < count; ++i) {
+        int16_t q[4];
+        std::memcpy(q, data + i * sizeof(q), sizeof(q));
+        const auto s = scale / static_cast<float>(q[3] | 3);
+        const auto x = static_cast<float>(q[0]) * s;
+        const auto y = static_cast<float>(q[1]) * s;
+        const auto z = static_cast<float>(q[2]) * s;
+        const auto w = std::sqrt(std::max(1.0f - x * x - y * y - z * z, 0.0f));
+        const auto missing = q[3] & 3;
+        q[(missing + 1) & 3] = static_cast<int16_t>(roundToInt(x * 32767.0f));
+        q[(missing + 2) & 3] = static_cast<int16_t>(roundToInt(y * 32767.0f));
+        q[(missing + 3) & 3] = static_cast<int16_t>(roundToInt(z * 32767.0f));
+        q[missing] = static_cast<int16_t>(roundToInt(w * 32767.0f));
+        std::memcpy(data + i * sizeof(q), q, sizeof(q));
+    }
+}
+
+// A signed 24 bit mantissa and a signed 8 bit exponent, which become a float
+void filterExponential(uint8_t* data, size_t count)
+{
+    size_t i = 0;
+#ifdef WOMF_MESHOPT_SSE2
+    for (; i + 4 <= count; i += 4) {
+        const auto ptr = reinterpret_cast<__m128i*>(data + i * 4);
+        const auto v = _mm_loadu_si128(ptr);
+        const auto mantissa = _mm_srai_epi32(_mm_slli_epi32(v, 8), 8);
+        const auto exponent = _mm_srai_epi32(v, 24);
+        const auto scale = _mm_slli_epi32(_mm_add_epi32(exponent, _mm_set1_epi32(127)), 23);
+        const auto result = _mm_mul_ps(_mm_castsi128_ps(scale), _mm_cvtepi32_ps(mantissa));
+        _mm_storeu_si128(ptr, _mm_castps_si128(result));
+    }
+#endif
+    for (; i < count; ++i) {
+        uint32_t v = 0;
+        std::memcpy(&v, data + i * 4, sizeof(v));
+        const auto mantissa = static_cast<int32_t>(v << 8) >> 8;
+        const auto exponent = static_cast<int32_t>(v) >> 24;
+        // 2^exponent
+        const auto scale = std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+        const auto value = scale * static_cast<float>(mantissa);
+        std::memcpy(data + i * 4, &value, sizeof(value));
+    }
+}
+}
+
+bool decodeMeshopt(std::span<uint8_t> dest, size_t count, size_t stride, MeshoptMode mode,
+    MeshoptFilter filter, std::span<const uint8_t> data)
+{
+    if (stride == 0 || count > dest.size() / stride || dest.size() != count * stride) {
+        return false;
+    }
+    switch (mode) {
+    case MeshoptMode::Attributes:
+        if (!decodeVertices(dest.data(), count, stride, data)) {
+            return false;
+        }
+        break;
+    case MeshoptMode::Triangles:
+        return filter == MeshoptFilter::None && (stride == 2 || stride == 4)
+            && TriangleDecoder().decode(dest.data(), count, stride, data);
+    case MeshoptMode::Indices:
+        return filter == MeshoptFilter::None && (stride == 2 || stride == 4)
+            && decodeSequence(dest.data(), count, stride, data);
+    }
+
+    switch (filter) {
+    case MeshoptFilter::None:
+        return true;
+    case MeshoptFilter::Octahedral:
+        if (stride == 4) {
+            filterOctahedral<int8_t>(dest.data(), count);
+        } else if (stride == 8) {
+            filterOctahedral<int16_t>(dest.data(), count);
+        } else {
+            return false;
+        }
+        return true;
+    case MeshoptFilter::Quaternion:
+        if (stride != 8) {
+            return false;
+        }
+        filterQuaternion(dest.data(), count);
+        return true;
+    case MeshoptFilter::Exponential:
+        filterExponential(dest.data(), count * stride / 4);
+        return true;
+    }
+    return false;
+}
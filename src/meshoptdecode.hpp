@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Decoders for the buffer compression of EXT_meshopt_compression (the codecs of meshoptimizer):
+// - Attributes: the vertices are split into blocks, every byte of a vertex is delta coded
+//   against the same byte of the previous vertex and the deltas are stored in groups of 16 with
+//   0, 2, 4 or 8 bits each. With SSE2, the groups are unpacked and four bytes of every vertex are
+//   delta decoded at once.
+// - Triangles: the indices are coded with a FIFO of recent edges and one of recent vertices.
+// - Indices: the indices are delta coded against one of the two previous ones.
+// Filters are applied to decoded attributes: octahedral normals, quaternions with the largest
+// component left out and floats with a shared exponent.
+
+enum class MeshoptMode {
+    Attributes,
+    Triangles,
+    Indices,
+};
+
+enum class MeshoptFilter {
+    None,
+    Octahedral,
+    Quaternion,
+    Exponential,
+};
+
+// Decodes `count` elements of `stride` bytes into `dest`, which has to be count * stride bytes.
+// Returns false if the data or the parameters are invalid. It does not touch anything but the
+// arguments, so it can run on any thread.
+bool decodeMeshopt(std::span<uint8_t> dest, size_t count, size_t stride, MeshoptMode mode,
+    MeshoptFilter filter, std::span<const uint8_t> data);
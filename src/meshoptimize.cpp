@@ -0,0 +1,424 @@
+#include "meshoptimize.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
+namespace {
+// Of the cache the scoring is tuned for. Forsyth recommends 32, even for smaller caches.
+constexpr size_t scoringCacheSize = 32;
+// Of the cache that is simulated for the stats
+constexpr size_t fifoCacheSize = 16;
+constexpr auto noVertex = std::numeric_limits<uint32_t>::max();
+}
+
+std::vector<uint32_t> readIndices(const GltfAsset::Primitive& prim)
+{
+    const auto data = prim.indexData->data().subspan(prim.indexOffset);
+    std::vector<uint32_t> indices(prim.indexCount);
+    for (size_t i = 0; i < prim.indexCount; ++i) {
+        if (prim.indexType == glw::AttributeType::U8) {
+            indices[i] = data[i];
+        } else if (prim.indexType == glw::AttributeType::U16) {
+            uint16_t index;
+            std::memcpy(&index, data.data() + i * sizeof(index), sizeof(index));
+            indices[i] = index;
+        } else {
+            std::memcpy(&indices[i], data.data() + i * sizeof(uint32_t), sizeof(uint32_t));
+        }
+    }
+    return indices;
+}
+
+namespace {
+// A vertex is transformed again if it has been pushed out of the FIFO since it was last used
+size_t countVertexShaderInvocations(const std::vector<uint32_t>& indices, size_t vertexCount)
+{
+    std::vector<size_t> timestamps(vertexCount, 0); // when the vertex was put into the cache
+    size_t time = fifoCacheSize + 1;
+    size_t invocations = 0;
+    for (const auto index : indices) {
+        if (time - timestamps[index] > fifoCacheSize) {
+            timestamps[index] = time++;
+            invocations++;
+        }
+    }
+    return invocations;
+}
+
+float getVertexScore(int32_t cachePosition, uint32_t remainingTriangles)
+{
+    if (remainingTriangles == 0) {
+        return -1.0f;
+    }
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        // The vertices of the last triangle get a fixed score, so the next triangle does not
+        // just use the same edge again and again
+        score = cachePosition < 3 ? 0.75f
+                                  : std::pow(1.0f
+                                          - static_cast<float>(cachePosition - 3)
+                                              / static_cast<float>(scoringCacheSize - 3),
+                                      1.5f);
+    }
+    // Vertices with few triangles left are preferred, so they are done with
+    return score + 2.0f / std::sqrt(static_cast<float>(remainingTriangles));
+}
+}
+
+// Tom Forsyth, "Linear-Speed Vertex Cache Optimisation". Greedily emits the triangle with the
+// highest score, which is the sum of the scores of its vertices. Only the triangles of the
+// vertices in the (simulated) cache change their score after a triangle was emitted, so only
+// those are considered for the next one.
+std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount)
+{
+    const auto triangleCount = indices.size() / 3;
+
+    // The remaining triangles of every vertex are the first `remaining` in its range
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    for (const auto index : indices) {
+        offsets[index + 1]++;
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        offsets[v + 1] += offsets[v];
+    }
+    std::vector<uint32_t> remaining(vertexCount);
+    std::vector<uint32_t> adjacency(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        const auto v = indices[i];
+        adjacency[offsets[v] + remaining[v]++] = static_cast<uint32_t>(i / 3);
+    }
+
+    std::vector<float> vertexScores(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        vertexScores[v] = getVertexScore(-1, remaining[v]);
+    }
+    std::vector<float> triangleScores(triangleCount);
+    for (size_t t = 0; t < triangleCount; ++t) {
+        triangleScores[t] = vertexScores[indices[t * 3 + 0]] + vertexScores[indices[t * 3 + 1]]
+            + vertexScores[indices[t * 3 + 2]];
+    }
+    std::vector<uint8_t> emitted(triangleCount, 0);
+
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> newCache;
+    cache.reserve(scoringCacheSize + 3);
+    newCache.reserve(scoringCacheSize + 3);
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+
+    int64_t best = -1;
+    size_t cursor = 0; // for dead ends
+    for (size_t n = 0; n < triangleCount; ++n) {
+        if (best < 0) {
+            // No triangle in the cache left, continue with the next one that is not emitted yet
+            while (emitted[cursor]) {
+                cursor++;
+            }
+            best = static_cast<int64_t>(cursor);
+        }
+        const auto triangle = static_cast<uint32_t>(best);
+        emitted[triangle] = 1;
+
+        newCache.clear();
+        for (size_t k = 0; k < 3; ++k) {
+            const auto v = indices[triangle * 3 + k];
+            result.push_back(v);
+            if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) {
+                newCache.push_back(v);
+            }
+            const auto begin = adjacency.begin() + offsets[v];
+            const auto end = begin + remaining[v];
+            const auto it = std::find(begin, end, triangle);
+            if (it != end) {
+                std::iter_swap(it, end - 1);
+                remaining[v]--;
+            }
+        }
+        // Less than 3 for degenerate triangles
+        const auto triangleVertices = newCache.begin() + static_cast<ptrdiff_t>(newCache.size());
+        for (const auto v : cache) {
+            if (std::find(newCache.begin(), triangleVertices, v) == triangleVertices) {
+                newCache.push_back(v);
+            }
+        }
+
+        // Vertices past scoringCacheSize fell out of the cache
+        for (size_t i = 0; i < newCache.size(); ++i) {
+            const auto v = newCache[i];
+            const auto position = i < scoringCacheSize ? static_cast<int32_t>(i) : -1;
+            const auto score = getVertexScore(position, remaining[v]);
+            const auto delta = score - vertexScores[v];
+            vertexScores[v] = score;
+            for (size_t a = offsets[v]; a < offsets[v] + remaining[v]; ++a) {
+                triangleScores[adjacency[a]] += delta;
+            }
+        }
+        newCache.resize(std::min(newCache.size(), scoringCacheSize));
+        std::swap(cache, newCache);
+
+        best = -1;
+        float bestScore = -std::numeric_limits<float>::max();
+        for (const auto v : cache) {
+            for (size_t a = offsets[v]; a < offsets[v] + remaining[v]; ++a) {
+                const auto t = adjacency[a];
+                if (triangleScores[t] > bestScore) {
+                    bestScore = triangleScores[t];
+                    best = t;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+namespace {
+uint16_t toHalf(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const auto sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    const auto exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+    const auto mantissa = bits & 0x7fffff;
+    // Too small for a normal half. Denormals are not worth it for texture coordinates.
+    if (exponent <= 0) {
+        return sign;
+    }
+    // Only small values are converted (see canUseHalf), but just in case
+    if (exponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7c00);
+    }
+    auto half = static_cast<uint32_t>(sign) | (static_cast<uint32_t>(exponent) << 10)
+        | (mantissa >> 13);
+    // Round to nearest. A carry into the exponent is still correct.
+    if (mantissa & 0x1000) {
+        half++;
+    }
+    return static_cast<uint16_t>(half);
+}
+
+uint32_t packSnorm10(const glm::vec4& v)
+{
+    const auto pack = [](float value, float max, uint32_t mask) {
+        const auto i = static_cast<int32_t>(std::round(std::clamp(value, -1.0f, 1.0f) * max));
+        return static_cast<uint32_t>(i) & mask;
+    };
+    return pack(v.x, 511.0f, 0x3ff) | (pack(v.y, 511.0f, 0x3ff) << 10)
+        | (pack(v.z, 511.0f, 0x3ff) << 20) | (pack(v.w, 1.0f, 0x3) << 30);
+}
+
+enum class Encoding {
+    Copy,
+    Snorm16, // positions with a vertex transform
+    Packed10, // normals and tangents
+    Half, // texture coordinates
+};
+
+struct Attribute {
+    const uint8_t* data; // first vertex
+    size_t stride;
+    VertexFormat::Attribute input;
+    size_t inputSize;
+    Encoding encoding;
+    size_t outputOffset;
+};
+
+size_t getElementSize(const VertexFormat::Attribute& attr)
+{
+    return attr.type == packedI10Type ? 4 : attr.components * getAttributeTypeSize(attr.type);
+}
+
+glm::vec4 readFloats(const Attribute& attr, size_t vertex)
+{
+    glm::vec4 value(0.0f);
+    std::memcpy(&value, attr.data + vertex * attr.stride, attr.input.components * sizeof(float));
+    return value;
+}
+
+// Half floats have 10 bits of mantissa, which is about a texel of a 1k texture at 2.0
+bool canUseHalf(const Attribute& attr, size_t vertexCount)
+{
+    for (size_t v = 0; v < vertexCount; ++v) {
+        const auto uv = readFloats(attr, v);
+        if (std::abs(uv.x) > 2.0f || std::abs(uv.y) > 2.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+}
+
+void optimizePrimitive(GltfAsset::Primitive& prim, MeshOptimizationStats& stats)
+{
+    stats.primitives++;
+    auto indices = readIndices(prim);
+    if (indices.empty() || indices.size() % 3 != 0) {
+        stats.skipped++;
+        return;
+    }
+    const size_t vertexCount = *std::max_element(indices.begin(), indices.end()) + 1;
+
+    const auto positionLocation = getAttributeLocation("position");
+    const auto normalLocation = getAttributeLocation("normal");
+    const auto tangentLocation = getAttributeLocation("tangent");
+    const auto texcoord0Location = getAttributeLocation("texcoord0");
+    const auto texcoord1Location = getAttributeLocation("texcoord1");
+    const auto jointsLocation = getAttributeLocation("joints0");
+
+    std::vector<Attribute> attributes;
+    size_t bytesPerVertexBefore = 0;
+    bool skinned = false;
+    for (const auto& vertexBuffer : prim.vertexBuffers) {
+        const auto stride = vertexBuffer.format.getStride();
+        bytesPerVertexBefore += stride;
+        for (const auto& attr : vertexBuffer.format.getAttributes()) {
+            const auto size = getElementSize(attr);
+            // The accessors were only validated for their count, which may be less
+            if (attr.offset + (vertexCount - 1) * stride + size > vertexBuffer.data->size()) {
+                stats.skipped++;
+                return;
+            }
+            attributes.push_back(Attribute { vertexBuffer.data->data().data() + attr.offset,
+                stride, attr, size, Encoding::Copy, 0 });
+            skinned = skinned || attr.location == jointsLocation;
+        }
+    }
+
+    // Triangles first, then the vertices in the order the new triangles use them
+    indices = optimizeVertexCache(indices, vertexCount);
+    std::vector<uint32_t> remap(vertexCount, noVertex);
+    std::vector<uint32_t> order; // old index of every new vertex
+    for (auto& index : indices) {
+        if (remap[index] == noVertex) {
+            remap[index] = static_cast<uint32_t>(order.size());
+            order.push_back(index);
+        }
+        index = remap[index];
+    }
+
+    VertexFormat format;
+    size_t stride = 0;
+    for (auto& attr : attributes) {
+        const auto& in = attr.input;
+        const auto isFloat = in.type == glw::AttributeType::F32;
+        auto out = in;
+        if (isFloat && in.location == positionLocation && in.components == 3 && !skinned) {
+            attr.encoding = Encoding::Snorm16;
+            out.type = glw::AttributeType::I16;
+            out.normalized = true;
+        } else if (isFloat
+            && ((in.location == normalLocation && in.components == 3)
+                || (in.location == tangentLocation && in.components == 4))) {
+            attr.encoding = Encoding::Packed10;
+            out.components = 4;
+            out.type = packedI10Type;
+            out.normalized = true;
+        } else if (isFloat && (in.location == texcoord0Location || in.location == texcoord1Location)
+            && in.components == 2 && canUseHalf(attr, vertexCount)) {
+            attr.encoding = Encoding::Half;
+            out.type = glw::AttributeType::F16;
+        }
+        attr.outputOffset = stride;
+        out.offset = stride;
+        format.add(out.location, out.components, out.type, out.normalized, out.offset);
+        stride += (getElementSize(out) + 3) / 4 * 4;
+    }
+    format.setStride(stride);
+
+    // Uniform scale, so the normal matrix is not affected by the vertex transform
+    glm::vec3 center(0.0f);
+    float scale = 1.0f;
+    for (const auto& attr : attributes) {
+        if (attr.encoding != Encoding::Snorm16) {
+            continue;
+        }
+        glm::vec3 min(std::numeric_limits<float>::max());
+        glm::vec3 max(std::numeric_limits<float>::lowest());
+        for (const auto v : order) {
+            const auto pos = glm::vec3(readFloats(attr, v));
+            min = glm::min(min, pos);
+            max = glm::max(max, pos);
+        }
+        center = (min + max) * 0.5f;
+        const auto halfExtent = (max - min) * 0.5f;
+        scale = std::max({ halfExtent.x, halfExtent.y, halfExtent.z });
+        if (scale <= 0.0f) {
+            scale = 1.0f;
+        }
+        if (!prim.bounds) {
+            prim.bounds = Aabb { min, max };
+        }
+        glm::mat4 transform(scale);
+        transform[3] = glm::vec4(center, 1.0f);
+        prim.vertexTransform = transform;
+    }
+
+    std::vector<uint8_t> vertices(order.size() * stride, 0);
+    for (size_t n = 0; n < order.size(); ++n) {
+        const auto v = order[n];
+        for (const auto& attr : attributes) {
+            auto dst = vertices.data() + n * stride + attr.outputOffset;
+            switch (attr.encoding) {
+            case Encoding::Copy:
+                std::memcpy(dst, attr.data + v * attr.stride, attr.inputSize);
+                break;
+            case Encoding::Snorm16: {
+                const auto pos = (glm::vec3(readFloats(attr, v)) - center) / scale;
+                for (size_t c = 0; c < 3; ++c) {
+                    const auto q = static_cast<int16_t>(
+                        std::round(std::clamp(pos[static_cast<int>(c)], -1.0f, 1.0f) * 32767.0f));
+                    std::memcpy(dst + c * sizeof(q), &q, sizeof(q));
+                }
+                break;
+            }
+            case Encoding::Packed10: {
+                const auto packed = packSnorm10(readFloats(attr, v));
+                std::memcpy(dst, &packed, sizeof(packed));
+                break;
+            }
+            case Encoding::Half: {
+                const auto uv = readFloats(attr, v);
+                const uint16_t half[2] = { toHalf(uv.x), toHalf(uv.y) };
+                std::memcpy(dst, half, sizeof(half));
+                break;
+            }
+            }
+        }
+    }
+
+    // u8 indices are slow (or emulated) on most hardware, so they become u16 as well
+    const auto indexType
+        = order.size() <= 0x10000 ? glw::AttributeType::U16 : glw::AttributeType::U32;
+    const auto indexSize = getAttributeTypeSize(indexType);
+    std::vector<uint8_t> indexData(indices.size() * indexSize);
+    for (size_t i = 0; i < indices.size(); ++i) {
+        if (indexType == glw::AttributeType::U16) {
+            const auto index = static_cast<uint16_t>(indices[i]);
+            std::memcpy(indexData.data() + i * indexSize, &index, sizeof(index));
+        } else {
+            std::memcpy(indexData.data() + i * indexSize, &indices[i], sizeof(indices[i]));
+        }
+    }
+
+    stats.triangles += indices.size() / 3;
+    stats.verticesBefore += vertexCount;
+    stats.verticesAfter += order.size();
+    stats.vertexShaderInvocationsBefore
+        += countVertexShaderInvocations(readIndices(prim), vertexCount);
+    stats.vertexShaderInvocationsAfter += countVertexShaderInvocations(indices, order.size());
+    stats.vertexBytesBefore += vertexCount * bytesPerVertexBefore;
+    stats.vertexBytesAfter += vertices.size();
+    stats.indexBytesBefore += prim.indexCount * getAttributeTypeSize(prim.indexType);
+    stats.indexBytesAfter += indexData.size();
+
+    const auto vertexBuffer = Buffer::create("optimized vertices", std::move(vertices));
+    const auto indexBuffer = Buffer::create("optimized indices", std::move(indexData));
+    prim.vertexBuffers
+        = { GltfAsset::VertexBuffer { BufferView::create(vertexBuffer, 0, vertexBuffer->size()),
+            std::move(format) } };
+    prim.indexData = BufferView::create(indexBuffer, 0, indexBuffer->size());
+    prim.indexType = indexType;
+    prim.indexOffset = 0;
+}
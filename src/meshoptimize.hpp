@@ -0,0 +1,26 @@
+#pragma once
+
+#include "gltf.hpp"
+
+// Import-time optimization of glTF primitives:
+// - Triangles are reordered for the post-transform vertex cache (Forsyth's algorithm) and the
+//   vertices in the order they are first used, so fetches are mostly sequential.
+// - All attributes are interleaved into a single vertex buffer. Unreferenced vertices are dropped.
+// - Float positions become snorm16. The dequantization is a uniform scale and offset, which is
+//   set as the vertex transform of the geometry (so it ends up in the model matrix). Skinned
+//   primitives keep float positions, because the joint matrices are applied before the model
+//   matrix.
+// - Float normals and tangents become 2_10_10_10 snorm, float texture coordinates become half
+//   floats if they are small enough not to lose precision.
+// - Indices become u16 if there are few enough vertices.
+// Attributes that are not float are copied as they are.
+
+// Of the index range of the primitive, in any index type
+std::vector<uint32_t> readIndices(const GltfAsset::Primitive& primitive);
+
+// Reorders the triangles, the vertices stay the same
+std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount);
+
+// Replaces the vertex buffers and indices of the primitive and adds to the stats (see
+// GltfAsset::meshOptimization)
+void optimizePrimitive(GltfAsset::Primitive& primitive, MeshOptimizationStats& stats);
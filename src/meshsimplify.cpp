@@ -0,0 +1,581 @@
+#include "meshsimplify.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <tuple>
+
+#include "meshoptimize.hpp"
+
+namespace {
+// Border edges count more than the triangles, so the outline of the mesh keeps its shape
+constexpr double borderWeight = 10.0;
+// Of the summed differences of the joint weights of two vertices that may be collapsed
+constexpr float maxSkinDifference = 0.5f;
+// A level needs at most this many triangles of the previous level to be worth an index range
+constexpr double maxLevelRatio = 0.9;
+
+struct Quadric {
+    // The upper triangle of the symmetric 4x4 matrix
+    double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0;
+    double b2 = 0.0, bc = 0.0, bd = 0.0;
+    double c2 = 0.0, cd = 0.0;
+    double d2 = 0.0;
+    double weight = 0.0;
+
+    // Of the squared distance from the plane dot(n, p) + d = 0 (n is normalized)
+    static Quadric fromPlane(const glm::dvec3& n, double d, double weight)
+    {
+        Quadric q;
+        q.a2 = weight * n.x * n.x;
+        q.ab = weight * n.x * n.y;
+        q.ac = weight * n.x * n.z;
+        q.ad = weight * n.x * d;
+        q.b2 = weight * n.y * n.y;
+        q.bc = weight * n.y * n.z;
+        q.bd = weight * n.y * d;
+        q.c2 = weight * n.z * n.z;
+        q.cd = weight * n.z * d;
+        q.d2 = weight * d * d;
+        q.weight = weight;
+        return q;
+    }
+
+    Quadric& operator+=(const Quadric& o)
+    {
+        a2 += o.a2;
+        ab += o.ab;
+        ac += o.ac;
+        ad += o.ad;
+        b2 += o.b2;
+        bc += o.bc;
+        bd += o.bd;
+        c2 += o.c2;
+        cd += o.cd;
+        d2 += o.d2;
+        weight += o.weight;
+        return *this;
+    }
+
+    // The (weighted) root mean square distance of the point from the planes
+    double getError(const glm::dvec3& p) const
+    {
+        if (weight <= 0.0) {
+            return 0.0;
+        }
+        const auto squared = a2 * p.x * p.x + b2 * p.y * p.y + c2 * p.z * p.z
+            + 2.0 * (ab * p.x * p.y + ac * p.x * p.z + bc * p.y * p.z)
+            + 2.0 * (ad * p.x + bd * p.y + cd * p.z) + d2;
+        return std::sqrt(std::max(squared, 0.0) / weight);
+    }
+};
+
+Quadric operator+(Quadric a, const Quadric& b)
+{
+    a += b;
+    return a;
+}
+
+struct Skin {
+    glm::uvec4 joints;
+    glm::vec4 weights;
+};
+
+// The summed differences of the weights of all joints of either vertex
+float getSkinDifference(const Skin& a, const Skin& b)
+{
+    std::array<uint32_t, 8> joints;
+    std::array<float, 8> differences;
+    size_t count = 0;
+    const auto add = [&](uint32_t joint, float weight) {
+        for (size_t i = 0; i < count; ++i) {
+            if (joints[i] == joint) {
+                differences[i] += weight;
+                return;
+            }
+        }
+        joints[count] = joint;
+        differences[count++] = weight;
+    };
+    for (int i = 0; i < 4; ++i) {
+        add(a.joints[i], a.weights[i]);
+        add(b.joints[i], -b.weights[i]);
+    }
+    float sum = 0.0f;
+    for (size_t i = 0; i < count; ++i) {
+        sum += std::abs(differences[i]);
+    }
+    return sum;
+}
+
+enum class VertexKind : uint8_t {
+    Manifold, // moves onto any neighbour
+    Border, // only moves along the border
+    Locked, // seams and non-manifold edges
+};
+
+class Simplifier {
+public:
+    // The positions should be normalized, the errors are in the same units. Skins may be empty.
+    Simplifier(
+        std::vector<uint32_t> indices, std::vector<glm::dvec3> positions, std::vector<Skin> skins)
+        : indices_(std::move(indices))
+        , positions_(std::move(positions))
+        , skins_(std::move(skins))
+        , quadrics_(positions_.size())
+    {
+        weldPositions();
+        addQuadrics();
+    }
+
+    // Collapses edges until there are at most `targetIndexCount` indices left or the next
+    // collapse would exceed `maxError`. Returns the largest error of all collapses so far.
+    double simplify(size_t targetIndexCount, double maxError)
+    {
+        while (indices_.size() > targetIndexCount && collapseEdges(targetIndexCount, maxError)) {
+        }
+        return error_;
+    }
+
+    const std::vector<uint32_t>& getIndices() const
+    {
+        return indices_;
+    }
+
+private:
+    struct Collapse {
+        uint32_t from;
+        uint32_t to;
+        double error;
+    };
+
+    // Vertices with the same position get the same id, so edges match across seams. Vertices
+    // that share their position with another one are on a seam.
+    void weldPositions()
+    {
+        std::vector<uint8_t> used(positions_.size(), 0);
+        for (const auto index : indices_) {
+            used[index] = 1;
+        }
+        std::vector<uint32_t> order;
+        for (uint32_t v = 0; v < positions_.size(); ++v) {
+            if (used[v]) {
+                order.push_back(v);
+            }
+        }
+        const auto less = [this](uint32_t a, uint32_t b) {
+            const auto& pa = positions_[a];
+            const auto& pb = positions_[b];
+            return std::tie(pa.x, pa.y, pa.z) < std::tie(pb.x, pb.y, pb.z);
+        };
+        std::sort(order.begin(), order.end(), less);
+
+        weld_.resize(positions_.size());
+        std::iota(weld_.begin(), weld_.end(), 0u);
+        seam_.assign(positions_.size(), 0);
+        for (size_t i = 1; i < order.size(); ++i) {
+            if (positions_[order[i]] == positions_[order[i - 1]]) {
+                weld_[order[i]] = weld_[order[i - 1]];
+                seam_[order[i]] = 1;
+                seam_[order[i - 1]] = 1;
+            }
+        }
+    }
+
+    uint64_t getEdgeKey(uint32_t a, uint32_t b) const
+    {
+        const auto wa = weld_[a];
+        const auto wb = weld_[b];
+        return static_cast<uint64_t>(std::min(wa, wb)) << 32 | std::max(wa, wb);
+    }
+
+    // Of all triangles, sorted
+    std::vector<uint64_t> getEdges() const
+    {
+        std::vector<uint64_t> edges;
+        edges.reserve(indices_.size());
+        for (size_t t = 0; t < indices_.size(); t += 3) {
+            for (size_t k = 0; k < 3; ++k) {
+                edges.push_back(getEdgeKey(indices_[t + k], indices_[t + (k + 1) % 3]));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        return edges;
+    }
+
+    // The number of triangles that share the edge
+    size_t countEdge(const std::vector<uint64_t>& edges, uint32_t a, uint32_t b) const
+    {
+        const auto range = std::equal_range(edges.begin(), edges.end(), getEdgeKey(a, b));
+        return static_cast<size_t>(range.second - range.first);
+    }
+
+    glm::dvec3 getNormal(size_t triangle) const
+    {
+        const auto& p0 = positions_[indices_[triangle * 3 + 0]];
+        const auto& p1 = positions_[indices_[triangle * 3 + 1]];
+        const auto& p2 = positions_[indices_[triangle * 3 + 2]];
+        return glm::cross(p1 - p0, p2 - p0);
+    }
+
+    void addQuadrics()
+    {
+        for (size_t t = 0; t < indices_.size() / 3; ++t) {
+            const auto normal = getNormal(t);
+            const auto length = glm::length(normal);
+            if (length <= 0.0) {
+                continue;
+            }
+            const auto n = normal / length;
+            const auto q = Quadric::fromPlane(
+                n, -glm::dot(n, positions_[indices_[t * 3]]), length * 0.5);
+            for (size_t k = 0; k < 3; ++k) {
+                quadrics_[indices_[t * 3 + k]] += q;
+            }
+        }
+
+        // A plane through the border edge, perpendicular to its triangle
+        const auto edges = getEdges();
+        for (size_t t = 0; t < indices_.size() / 3; ++t) {
+            const auto normal = getNormal(t);
+            for (size_t k = 0; k < 3; ++k) {
+                const auto a = indices_[t * 3 + k];
+                const auto b = indices_[t * 3 + (k + 1) % 3];
+                if (countEdge(edges, a, b) != 1) {
+                    continue;
+                }
+                const auto edge = positions_[b] - positions_[a];
+                const auto perpendicular = glm::cross(edge, normal);
+                const auto length = glm::length(perpendicular);
+                if (length <= 0.0) {
+                    continue;
+                }
+                const auto n = perpendicular / length;
+                const auto q = Quadric::fromPlane(n, -glm::dot(n, positions_[a]),
+                    glm::dot(edge, edge) * borderWeight);
+                quadrics_[a] += q;
+                quadrics_[b] += q;
+            }
+        }
+    }
+
+    bool canCollapse(const std::vector<VertexKind>& kinds, const std::vector<uint64_t>& edges,
+        uint32_t from, uint32_t to) const
+    {
+        if (kinds[from] == VertexKind::Locked) {
+            return false;
+        }
+        if (kinds[from] == VertexKind::Border && countEdge(edges, from, to) != 1) {
+            return false;
+        }
+        return skins_.empty() || getSkinDifference(skins_[from], skins_[to]) <= maxSkinDifference;
+    }
+
+    // Whether moving `from` onto `to` turns one of the remaining triangles around
+    bool flips(std::span<const uint32_t> triangles, uint32_t from, uint32_t to) const
+    {
+        const auto& target = positions_[to];
+        for (const auto t : triangles) {
+            const auto corner = indices_.begin() + t * 3;
+            if (std::find(corner, corner + 3, to) != corner + 3) {
+                continue; // removed
+            }
+            const auto k = static_cast<size_t>(std::find(corner, corner + 3, from) - corner);
+            const auto& p1 = positions_[corner[(k + 1) % 3]];
+            const auto& p2 = positions_[corner[(k + 2) % 3]];
+            const auto before = glm::cross(p1 - positions_[from], p2 - positions_[from]);
+            const auto after = glm::cross(p1 - target, p2 - target);
+            const auto lengths = glm::length(before) * glm::length(after);
+            // Degenerate triangles can not flip, but should not be created either
+            if (glm::length(before) > 0.0 && glm::dot(before, after) <= 0.25 * lengths) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A single pass over all edges, cheapest first. Vertices around a collapse are not touched
+    // again in the same pass, so the adjacency stays valid. Returns false if nothing changed.
+    bool collapseEdges(size_t targetIndexCount, double maxError)
+    {
+        const auto vertexCount = positions_.size();
+        std::vector<uint32_t> offsets(vertexCount + 1, 0);
+        for (const auto index : indices_) {
+            offsets[index + 1]++;
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        std::vector<uint32_t> adjacency(indices_.size());
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices_.size(); ++i) {
+            adjacency[fill[indices_[i]]++] = static_cast<uint32_t>(i / 3);
+        }
+
+        const auto edges = getEdges();
+        std::vector<VertexKind> kinds(vertexCount, VertexKind::Manifold);
+        for (size_t v = 0; v < vertexCount; ++v) {
+            if (seam_[v]) {
+                kinds[v] = VertexKind::Locked;
+            }
+        }
+        for (size_t t = 0; t < indices_.size(); t += 3) {
+            for (size_t k = 0; k < 3; ++k) {
+                const auto a = indices_[t + k];
+                const auto b = indices_[t + (k + 1) % 3];
+                const auto count = countEdge(edges, a, b);
+                for (const auto v : { a, b }) {
+                    if (count > 2) {
+                        kinds[v] = VertexKind::Locked;
+                    } else if (count == 1 && kinds[v] == VertexKind::Manifold) {
+                        kinds[v] = VertexKind::Border;
+                    }
+                }
+            }
+        }
+
+        std::vector<Collapse> collapses;
+        for (size_t t = 0; t < indices_.size(); t += 3) {
+            for (size_t k = 0; k < 3; ++k) {
+                const auto a = indices_[t + k];
+                const auto b = indices_[t + (k + 1) % 3];
+                for (const auto& [from, to] : { std::pair { a, b }, std::pair { b, a } }) {
+                    if (canCollapse(kinds, edges, from, to)) {
+                        const auto quadric = quadrics_[from] + quadrics_[to];
+                        collapses.push_back(
+                            Collapse { from, to, quadric.getError(positions_[to]) });
+                    }
+                }
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(),
+            [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+        std::vector<uint8_t> touched(vertexCount, 0);
+        std::vector<uint32_t> remap(vertexCount);
+        std::iota(remap.begin(), remap.end(), 0u);
+        auto indexCount = indices_.size();
+        bool collapsed = false;
+        for (const auto& collapse : collapses) {
+            if (collapse.error > maxError || indexCount <= targetIndexCount) {
+                break;
+            }
+            if (touched[collapse.from] || touched[collapse.to]) {
+                continue;
+            }
+            const auto triangles = std::span<const uint32_t>(adjacency).subspan(
+                offsets[collapse.from], offsets[collapse.from + 1] - offsets[collapse.from]);
+            if (flips(triangles, collapse.from, collapse.to)) {
+                continue;
+            }
+            for (const auto t : triangles) {
+                const auto corner = indices_.begin() + t * 3;
+                for (size_t k = 0; k < 3; ++k) {
+                    touched[corner[k]] = 1;
+                }
+                if (std::find(corner, corner + 3, collapse.to) != corner + 3) {
+                    indexCount -= 3;
+                }
+            }
+            remap[collapse.from] = collapse.to;
+            quadrics_[collapse.to] += quadrics_[collapse.from];
+            error_ = std::max(error_, collapse.error);
+            collapsed = true;
+        }
+        if (!collapsed) {
+            return false;
+        }
+
+        size_t out = 0;
+        for (size_t t = 0; t < indices_.size(); t += 3) {
+            const auto a = remap[indices_[t + 0]];
+            const auto b = remap[indices_[t + 1]];
+            const auto c = remap[indices_[t + 2]];
+            if (a != b && b != c && a != c) {
+                indices_[out++] = a;
+                indices_[out++] = b;
+                indices_[out++] = c;
+            }
+        }
+        indices_.resize(out);
+        return true;
+    }
+
+    std::vector<uint32_t> indices_;
+    std::vector<glm::dvec3> positions_;
+    std::vector<Skin> skins_;
+    std::vector<Quadric> quadrics_;
+    std::vector<uint32_t> weld_;
+    std::vector<uint8_t> seam_;
+    double error_ = 0.0;
+};
+
+float readComponent(const uint8_t* data, glw::AttributeType type, bool normalized)
+{
+    const auto read = [data]<typename T>(T) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    };
+    switch (type) {
+    case glw::AttributeType::F32:
+        return read(float {});
+    case glw::AttributeType::U8:
+        return static_cast<float>(read(uint8_t {})) / (normalized ? 255.0f : 1.0f);
+    case glw::AttributeType::U16:
+        return static_cast<float>(read(uint16_t {})) / (normalized ? 65535.0f : 1.0f);
+    case glw::AttributeType::I8: {
+        const auto value = static_cast<float>(read(int8_t {}));
+        return normalized ? std::max(value / 127.0f, -1.0f) : value;
+    }
+    case glw::AttributeType::I16: {
+        const auto value = static_cast<float>(read(int16_t {}));
+        return normalized ? std::max(value / 32767.0f, -1.0f) : value;
+    }
+    default:
+        return 0.0f;
+    }
+}
+
+// Of the first `vertexCount` vertices. Empty if the primitive does not have the attribute or
+// it's in a format that is not supported.
+std::vector<glm::vec4> readAttribute(
+    const GltfAsset::Primitive& prim, size_t location, size_t vertexCount)
+{
+    for (const auto& vertexBuffer : prim.vertexBuffers) {
+        for (const auto& attr : vertexBuffer.format.getAttributes()) {
+            if (attr.location != location) {
+                continue;
+            }
+            const auto supported = attr.type == glw::AttributeType::F32
+                || attr.type == glw::AttributeType::U8 || attr.type == glw::AttributeType::U16
+                || attr.type == glw::AttributeType::I8 || attr.type == glw::AttributeType::I16;
+            const auto stride = vertexBuffer.format.getStride();
+            const auto typeSize = getAttributeTypeSize(attr.type);
+            const auto size = attr.components * typeSize;
+            if (!supported || attr.components > 4
+                || attr.offset + (vertexCount - 1) * stride + size > vertexBuffer.data->size()) {
+                return {};
+            }
+            std::vector<glm::vec4> values(vertexCount, glm::vec4(0.0f));
+            const auto data = vertexBuffer.data->data().data() + attr.offset;
+            for (size_t v = 0; v < vertexCount; ++v) {
+                for (size_t c = 0; c < attr.components; ++c) {
+                    const auto component = data + v * stride + c * typeSize;
+                    values[v][static_cast<int>(c)]
+                        = readComponent(component, attr.type, attr.normalized);
+                }
+            }
+            return values;
+        }
+    }
+    return {};
+}
+
+void writeIndex(uint8_t* dest, glw::AttributeType type, uint32_t index)
+{
+    if (type == glw::AttributeType::U8) {
+        *dest = static_cast<uint8_t>(index);
+    } else if (type == glw::AttributeType::U16) {
+        const auto value = static_cast<uint16_t>(index);
+        std::memcpy(dest, &value, sizeof(value));
+    } else {
+        std::memcpy(dest, &index, sizeof(index));
+    }
+}
+}
+
+void generateLods(
+    GltfAsset::Primitive& prim, const LodSettings& settings, MeshOptimizationStats& stats)
+{
+    if (settings.levels == 0) {
+        return;
+    }
+    const auto indices = readIndices(prim);
+    if (indices.empty() || indices.size() % 3 != 0) {
+        return;
+    }
+    const size_t vertexCount = *std::max_element(indices.begin(), indices.end()) + 1;
+
+    // Quantized positions (see optimizePrimitive) are scaled uniformly, so the relative errors
+    // are the same
+    const auto rawPositions = readAttribute(prim, getAttributeLocation("position"), vertexCount);
+    if (rawPositions.empty()) {
+        return;
+    }
+    glm::dvec3 min(std::numeric_limits<double>::max());
+    glm::dvec3 max(std::numeric_limits<double>::lowest());
+    for (const auto index : indices) {
+        min = glm::min(min, glm::dvec3(rawPositions[index]));
+        max = glm::max(max, glm::dvec3(rawPositions[index]));
+    }
+    const auto diagonal = glm::length(max - min);
+    if (diagonal <= 0.0) {
+        return;
+    }
+    std::vector<glm::dvec3> positions(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        positions[v] = (glm::dvec3(rawPositions[v]) - min) / diagonal;
+    }
+
+    std::vector<Skin> skins;
+    const auto joints = readAttribute(prim, getAttributeLocation("joints0"), vertexCount);
+    const auto weights = readAttribute(prim, getAttributeLocation("weights0"), vertexCount);
+    if (!joints.empty() && !weights.empty()) {
+        skins.resize(vertexCount);
+        for (size_t v = 0; v < vertexCount; ++v) {
+            skins[v] = Skin { glm::uvec4(joints[v]), weights[v] };
+        }
+    }
+
+    Simplifier simplifier(indices, std::move(positions), std::move(skins));
+    std::vector<std::vector<uint32_t>> levels;
+    std::vector<float> errors;
+    auto previous = indices.size();
+    for (size_t level = 0; level < settings.levels; ++level) {
+        const auto target
+            = static_cast<size_t>(static_cast<float>(previous / 3) * settings.ratio) * 3;
+        const auto error = simplifier.simplify(target, settings.maxError);
+        const auto& simplified = simplifier.getIndices();
+        if (simplified.empty()
+            || static_cast<double>(simplified.size())
+                > static_cast<double>(previous) * maxLevelRatio) {
+            break;
+        }
+        levels.push_back(optimizeVertexCache(simplified, vertexCount));
+        errors.push_back(static_cast<float>(error));
+        previous = simplified.size();
+    }
+    if (levels.empty()) {
+        return;
+    }
+
+    // The full mesh first, then the levels
+    const auto indexSize = getAttributeTypeSize(prim.indexType);
+    size_t lodIndexCount = 0;
+    for (const auto& level : levels) {
+        lodIndexCount += level.size();
+    }
+    std::vector<uint8_t> data((prim.indexCount + lodIndexCount) * indexSize);
+    std::memcpy(data.data(), prim.indexData->data().data() + prim.indexOffset,
+        prim.indexCount * indexSize);
+    auto offset = prim.indexCount * indexSize;
+    prim.lods.clear();
+    for (size_t l = 0; l < levels.size(); ++l) {
+        prim.lods.push_back(Geometry::Lod { offset, levels[l].size(), errors[l] });
+        for (const auto index : levels[l]) {
+            writeIndex(data.data() + offset, prim.indexType, index);
+            offset += indexSize;
+        }
+    }
+
+    stats.lods += levels.size();
+    stats.lodTriangles += lodIndexCount / 3;
+    stats.lodIndexBytes += lodIndexCount * indexSize;
+
+    const auto buffer = Buffer::create("lod indices", std::move(data));
+    prim.indexData = BufferView::create(buffer, 0, buffer->size());
+    prim.indexOffset = 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "gltf.hpp"
+
+// Levels of detail for glTF primitives, generated at import:
+// - Every level is simplified from the previous one by collapsing edges (a vertex is moved onto
+//   a neighbour and its degenerate triangles are removed), cheapest first. The cost of a
+//   collapse is the quadric error metric (Garland and Heckbert), i.e. the root mean square
+//   distance of the new position from the planes of all triangles that were merged into the
+//   vertex, weighted by their area.
+// - No vertices are created, the levels are only new index ranges (see Geometry::setLods), so
+//   they all share the vertex buffer of the primitive.
+// - Vertices on a UV or normal seam (different vertices with the same position) never move, so
+//   the seams stay closed. Vertices on the border of the mesh only move along the border.
+// - Vertices are not collapsed into vertices with a different skin (joints and weights), so
+//   the levels deform like the full mesh.
+// The indices of every level are optimized for the vertex cache as well.
+
+// Appends the levels to the index data of the primitive and adds to the stats. Primitives
+// without float or snorm16 positions are left as they are.
+void generateLods(
+    GltfAsset::Primitive& primitive, const LodSettings& settings, MeshOptimizationStats& stats);
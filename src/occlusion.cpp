@@ -0,0 +1,405 @@
+#include "occlusion.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#include "threadpool.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WOMF_OCCLUSION_SSE2
+#endif
+
+namespace {
+// Vertices closer than this (in clip space w) are considered to cross the near plane
+constexpr float minW = 1e-5f;
+
+uint32_t readIndex(const uint8_t* data, size_t indexSize)
+{
+    switch (indexSize) {
+    case 1:
+        return *data;
+    case 2: {
+        uint16_t index = 0;
+        std::memcpy(&index, data, sizeof(index));
+        return index;
+    }
+    default: {
+        uint32_t index = 0;
+        std::memcpy(&index, data, sizeof(index));
+        return index;
+    }
+    }
+}
+}
+
+OcclusionBuffer::Ptr OcclusionBuffer::create(size_t width, size_t height)
+{
+    return std::shared_ptr<OcclusionBuffer>(new OcclusionBuffer(width, height));
+}
+
+OcclusionBuffer::OcclusionBuffer(size_t width, size_t height)
+    : tilesX_(std::max<size_t>((width + tileWidth - 1) / tileWidth, 1))
+    , tilesY_(std::max<size_t>((height + tileHeight - 1) / tileHeight, 1))
+{
+    width_ = tilesX_ * tileWidth;
+    height_ = tilesY_ * tileHeight;
+    depth_.resize(width_ * height_, 1.0f);
+    tileMaxDepth_.resize(tilesX_ * tilesY_, 1.0f);
+    bins_.resize(tilesX_ * tilesY_);
+}
+
+void OcclusionBuffer::clear(const glm::mat4& viewProjection)
+{
+    viewProjection_ = viewProjection;
+    std::fill(depth_.begin(), depth_.end(), 1.0f);
+    std::fill(tileMaxDepth_.begin(), tileMaxDepth_.end(), 1.0f);
+    triangles_.clear();
+    for (auto& bin : bins_) {
+        bin.clear();
+    }
+    rasterized_ = false;
+    stats_ = Stats {};
+}
+
+void OcclusionBuffer::addOccluder(std::span<const uint8_t> positions, size_t stride,
+    std::span<const uint8_t> indices, size_t indexSize, const glm::mat4& model)
+{
+    assert(indexSize == 1 || indexSize == 2 || indexSize == 4);
+    assert(stride >= sizeof(glm::vec3));
+    rasterized_ = false;
+    stats_.occluders++;
+
+    // Screen space with z in [0, 1] and w < minW for vertices that are too close
+    const auto mvp = viewProjection_ * model;
+    const auto vertexCount = positions.size() >= sizeof(glm::vec3)
+        ? (positions.size() - sizeof(glm::vec3)) / stride + 1
+        : 0;
+    std::vector<glm::vec4> screen(vertexCount);
+    for (size_t i = 0; i < vertexCount; ++i) {
+        glm::vec3 pos;
+        std::memcpy(&pos, positions.data() + i * stride, sizeof(pos));
+        const auto clip = mvp * glm::vec4(pos, 1.0f);
+        if (clip.w < minW) {
+            screen[i] = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+            continue;
+        }
+        const auto ndc = glm::vec3(clip) / clip.w;
+        screen[i] = glm::vec4((ndc.x * 0.5f + 0.5f) * static_cast<float>(width_),
+            (ndc.y * 0.5f + 0.5f) * static_cast<float>(height_), ndc.z * 0.5f + 0.5f, clip.w);
+    }
+
+    // The triangles that are rasterized, by their vertex indices
+    std::vector<std::array<uint32_t, 3>> triangles;
+    const auto triangleCount = indices.size() / indexSize / 3;
+    for (size_t t = 0; t < triangleCount; ++t) {
+        std::array<uint32_t, 3> triangle;
+        bool skip = false;
+        for (size_t i = 0; i < 3; ++i) {
+            const auto index = readIndex(indices.data() + (t * 3 + i) * indexSize, indexSize);
+            // Skipping occluders is always safe
+            if (index >= vertexCount || screen[index].w < minW || screen[index].z < 0.0f) {
+                skip = true;
+                break;
+            }
+            triangle[i] = index;
+        }
+        if (skip) {
+            continue;
+        }
+        // Degenerate triangles would make their edges look like inner edges
+        const auto& a = screen[triangle[0]];
+        const auto& b = screen[triangle[1]];
+        const auto& c = screen[triangle[2]];
+        if (std::abs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y)) >= 1e-6f) {
+            triangles.push_back(triangle);
+        }
+    }
+
+    // Edges that two of the triangles share are inside of the occluder, the others are its
+    // outline. Edges are identified by their vertex indices, so the triangles should share them.
+    const auto getEdge = [](uint32_t a, uint32_t b) {
+        return static_cast<uint64_t>(std::min(a, b)) << 32 | std::max(a, b);
+    };
+    std::vector<uint64_t> edges;
+    edges.reserve(triangles.size() * 3);
+    for (const auto& triangle : triangles) {
+        for (size_t i = 0; i < 3; ++i) {
+            edges.push_back(getEdge(triangle[i], triangle[(i + 1) % 3]));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    const auto isInnerEdge = [&edges](uint64_t edge) {
+        const auto [first, last] = std::equal_range(edges.begin(), edges.end(), edge);
+        return last - first == 2;
+    };
+
+    for (const auto& triangle : triangles) {
+        std::array<glm::vec4, 3> v;
+        for (size_t i = 0; i < 3; ++i) {
+            v[i] = screen[triangle[i]];
+        }
+
+        const auto minX = std::max(std::min({ v[0].x, v[1].x, v[2].x }), 0.0f);
+        const auto maxX = std::min(std::max({ v[0].x, v[1].x, v[2].x }), float(width_));
+        const auto minY = std::max(std::min({ v[0].y, v[1].y, v[2].y }), 0.0f);
+        const auto maxY = std::min(std::max({ v[0].y, v[1].y, v[2].y }), float(height_));
+        if (minX >= maxX || minY >= maxY) {
+            continue;
+        }
+
+        Triangle tri;
+        // Edge i is opposite of vertex i, so it's zero on that edge and the area at vertex i
+        for (size_t i = 0; i < 3; ++i) {
+            const auto& a = v[(i + 1) % 3];
+            const auto& b = v[(i + 2) % 3];
+            tri.edgeA[i] = a.y - b.y;
+            tri.edgeB[i] = b.x - a.x;
+            tri.edgeC[i] = a.x * b.y - b.x * a.y;
+        }
+        auto area = tri.edgeA[0] * v[0].x + tri.edgeB[0] * v[0].y + tri.edgeC[0];
+        if (std::abs(area) < 1e-6f) {
+            continue;
+        }
+        // Occluders are two-sided
+        if (area < 0.0f) {
+            for (size_t i = 0; i < 3; ++i) {
+                tri.edgeA[i] = -tri.edgeA[i];
+                tri.edgeB[i] = -tri.edgeB[i];
+                tri.edgeC[i] = -tri.edgeC[i];
+            }
+            area = -area;
+        }
+        // The normalized edge functions are the barycentric coordinates
+        tri.depthX = (v[0].z * tri.edgeA[0] + v[1].z * tri.edgeA[1] + v[2].z * tri.edgeA[2]) / area;
+        tri.depthY = (v[0].z * tri.edgeB[0] + v[1].z * tri.edgeB[1] + v[2].z * tri.edgeB[2]) / area;
+        tri.depth0 = (v[0].z * tri.edgeC[0] + v[1].z * tri.edgeC[1] + v[2].z * tri.edgeC[2]) / area;
+        // Pixels are tested at their center, where the farthest depth of the triangle over the
+        // pixel is written. Both are linear, so their extremes over a pixel are half a pixel in x
+        // and y away from the center. The outline is moved in by that, so only pixels that are
+        // completely covered are written. Inner edges are moved out by a fraction of a pixel
+        // instead, so pixel centers on them are covered despite rounding.
+        tri.depth0 += 0.5f * (std::abs(tri.depthX) + std::abs(tri.depthY));
+        for (size_t i = 0; i < 3; ++i) {
+            const auto pixelOffset = std::abs(tri.edgeA[i]) + std::abs(tri.edgeB[i]);
+            const auto inner = isInnerEdge(getEdge(triangle[(i + 1) % 3], triangle[(i + 2) % 3]));
+            tri.edgeC[i] += inner ? pixelOffset / 64.0f : -0.5f * pixelOffset;
+        }
+        tri.minY = minY;
+        tri.maxY = maxY;
+
+        const auto index = static_cast<uint32_t>(triangles_.size());
+        triangles_.push_back(tri);
+        stats_.triangles++;
+        const auto tileX0 = static_cast<size_t>(minX) / tileWidth;
+        const auto tileX1 = std::min(static_cast<size_t>(maxX) / tileWidth, tilesX_ - 1);
+        const auto tileY0 = static_cast<size_t>(minY) / tileHeight;
+        const auto tileY1 = std::min(static_cast<size_t>(maxY) / tileHeight, tilesY_ - 1);
+        for (size_t ty = tileY0; ty <= tileY1; ++ty) {
+            for (size_t tx = tileX0; tx <= tileX1; ++tx) {
+                bins_[ty * tilesX_ + tx].push_back(index);
+            }
+        }
+    }
+}
+
+void OcclusionBuffer::rasterizeTile(size_t tile)
+{
+    const auto tileX = tile % tilesX_ * tileWidth;
+    const auto tileY = tile / tilesX_ * tileHeight;
+    const auto depth = depth_.data() + tile * tileWidth * tileHeight;
+
+    for (const auto index : bins_[tile]) {
+        const auto& tri = triangles_[index];
+        const auto y0 = std::max(static_cast<size_t>(tri.minY), tileY);
+        const auto y1 = std::min(static_cast<size_t>(std::ceil(tri.maxY)), tileY + tileHeight);
+        for (auto y = y0; y < y1; ++y) {
+            const auto py = static_cast<float>(y) + 0.5f;
+            const auto row = depth + (y - tileY) * tileWidth;
+            const auto rowDepth = tri.depthY * py + tri.depth0;
+            std::array<float, 3> rowEdge;
+            for (size_t i = 0; i < 3; ++i) {
+                rowEdge[i] = tri.edgeB[i] * py + tri.edgeC[i];
+            }
+#ifdef WOMF_OCCLUSION_SSE2
+            // Four pixels at a time
+            static_assert(tileWidth % 4 == 0);
+            const auto zero = _mm_setzero_ps();
+            for (size_t x = 0; x < tileWidth; x += 4) {
+                const auto px = _mm_add_ps(_mm_set1_ps(static_cast<float>(tileX + x)),
+                    _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+                auto inside = _mm_cmpgt_ps(
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.edgeA[0]), px), _mm_set1_ps(rowEdge[0])),
+                    zero);
+                for (size_t i = 1; i < 3; ++i) {
+                    const auto edge = _mm_add_ps(
+                        _mm_mul_ps(_mm_set1_ps(tri.edgeA[i]), px), _mm_set1_ps(rowEdge[i]));
+                    inside = _mm_and_ps(inside, _mm_cmpgt_ps(edge, zero));
+                }
+                if (_mm_movemask_ps(inside) == 0) {
+                    continue;
+                }
+                const auto z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.depthX), px),
+                    _mm_set1_ps(rowDepth));
+                const auto current = _mm_loadu_ps(row + x);
+                const auto nearest = _mm_min_ps(current, z);
+                _mm_storeu_ps(row + x,
+                    _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+            }
+#else
+            for (size_t x = 0; x < tileWidth; ++x) {
+                const auto px = static_cast<float>(tileX + x) + 0.5f;
+                bool inside = true;
+                for (size_t i = 0; i < 3; ++i) {
+                    inside = inside && tri.edgeA[i] * px + rowEdge[i] > 0.0f;
+                }
+                if (inside) {
+                    row[x] = std::min(row[x], tri.depthX * px + rowDepth);
+                }
+            }
+#endif
+        }
+    }
+
+    tileMaxDepth_[tile] = *std::max_element(depth, depth + tileWidth * tileHeight);
+}
+
+void OcclusionBuffer::rasterize()
+{
+    // Tiles are handed out with a counter and the main thread works on them too. Workers that
+    // only start after all tiles are taken (e.g. because they were busy decoding textures) return
+    // immediately, so they are never waited for.
+    struct Progress {
+        std::atomic<size_t> next { 0 };
+        std::atomic<size_t> done { 0 };
+    };
+    auto progress = std::make_shared<Progress>();
+    const auto numTiles = tilesX_ * tilesY_;
+    const auto work = [this, progress, numTiles]() {
+        size_t tile = 0;
+        while ((tile = progress->next++) < numTiles) {
+            rasterizeTile(tile);
+            progress->done++;
+        }
+    };
+
+    auto& pool = getThreadPool();
+    const auto jobs = std::min(pool.getThreadCount(), numTiles - 1);
+    for (size_t i = 0; i < jobs; ++i) {
+        pool.submit(work);
+    }
+    work();
+    while (progress->done < numTiles) {
+        std::this_thread::yield();
+    }
+    rasterized_ = true;
+}
+
+const glm::mat4& OcclusionBuffer::getViewProjection() const
+{
+    return viewProjection_;
+}
+
+bool OcclusionBuffer::isRasterized() const
+{
+    return rasterized_;
+}
+
+bool OcclusionBuffer::isVisible(const glm::vec3& center, const glm::vec3& extent)
+{
+    if (!rasterized_) {
+        return true;
+    }
+    stats_.tested++;
+
+    auto minX = std::numeric_limits<float>::max();
+    auto minY = std::numeric_limits<float>::max();
+    auto maxX = std::numeric_limits<float>::lowest();
+    auto maxY = std::numeric_limits<float>::lowest();
+    auto minZ = std::numeric_limits<float>::max();
+    for (size_t i = 0; i < 8; ++i) {
+        const auto corner = center
+            + extent
+                * glm::vec3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f);
+        const auto clip = viewProjection_ * glm::vec4(corner, 1.0f);
+        if (clip.w < minW) {
+            return true;
+        }
+        const auto ndc = glm::vec3(clip) / clip.w;
+        minX = std::min(minX, (ndc.x * 0.5f + 0.5f) * static_cast<float>(width_));
+        maxX = std::max(maxX, (ndc.x * 0.5f + 0.5f) * static_cast<float>(width_));
+        minY = std::min(minY, (ndc.y * 0.5f + 0.5f) * static_cast<float>(height_));
+        maxY = std::max(maxY, (ndc.y * 0.5f + 0.5f) * static_cast<float>(height_));
+        minZ = std::min(minZ, ndc.z * 0.5f + 0.5f);
+    }
+    if (minZ < 0.0f) {
+        return true;
+    }
+
+    // Every pixel the box touches
+    const auto x0 = static_cast<size_t>(std::clamp(std::floor(minX), 0.0f, float(width_)));
+    const auto x1 = static_cast<size_t>(std::clamp(std::ceil(maxX), 0.0f, float(width_)));
+    const auto y0 = static_cast<size_t>(std::clamp(std::floor(minY), 0.0f, float(height_)));
+    const auto y1 = static_cast<size_t>(std::clamp(std::ceil(maxY), 0.0f, float(height_)));
+    if (x0 >= x1 || y0 >= y1) {
+        // Outside of the screen, which is up to frustum culling
+        return true;
+    }
+
+    for (auto ty = y0 / tileHeight; ty <= (y1 - 1) / tileHeight; ++ty) {
+        for (auto tx = x0 / tileWidth; tx <= (x1 - 1) / tileWidth; ++tx) {
+            const auto tile = ty * tilesX_ + tx;
+            // Behind everything in the tile
+            if (minZ > tileMaxDepth_[tile]) {
+                continue;
+            }
+            const auto depth = depth_.data() + tile * tileWidth * tileHeight;
+            const auto px0 = std::max(x0, tx * tileWidth) - tx * tileWidth;
+            const auto px1 = std::min(x1, (tx + 1) * tileWidth) - tx * tileWidth;
+            const auto py0 = std::max(y0, ty * tileHeight) - ty * tileHeight;
+            const auto py1 = std::min(y1, (ty + 1) * tileHeight) - ty * tileHeight;
+            for (auto y = py0; y < py1; ++y) {
+                for (auto x = px0; x < px1; ++x) {
+                    if (minZ <= depth[y * tileWidth + x]) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    stats_.occluded++;
+    return false;
+}
+
+bool OcclusionBuffer::isVisible(const Aabb& box, const glm::mat4& model)
+{
+    const auto [center, extent] = transformAabb(box, model);
+    return isVisible(center, extent);
+}
+
+size_t OcclusionBuffer::getWidth() const
+{
+    return width_;
+}
+
+size_t OcclusionBuffer::getHeight() const
+{
+    return height_;
+}
+
+float OcclusionBuffer::getDepth(size_t x, size_t y) const
+{
+    assert(x < width_ && y < height_);
+    const auto tile = y / tileHeight * tilesX_ + x / tileWidth;
+    return depth_[tile * tileWidth * tileHeight + y % tileHeight * tileWidth + x % tileWidth];
+}
+
+const OcclusionBuffer::Stats& OcclusionBuffer::getStats() const
+{
+    return stats_;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "culling.hpp"
+
+// A low resolution depth buffer on the CPU. Large occluders (walls, terrain, buildings) are
+// rasterized into it and bounding boxes are tested against it, so objects that are hidden behind
+// them are not drawn at all. Nothing here touches GL, so it also works without a window.
+// The buffer is split into tiles, which are rasterized in parallel on the thread pool. Every tile
+// also keeps its farthest depth, so most boxes can be accepted or rejected per tile.
+// Occluders are only ever under-estimated, so the test is conservative: triangles that cross the
+// near plane are skipped and only pixels that are completely inside of the outline of an occluder
+// are written, with the farthest depth of the triangle over the pixel. Edges shared by two
+// triangles (with the same vertex indices) are not part of the outline. Where those triangles are
+// not coplanar, the depth is that of the triangle at the pixel center.
+class OcclusionBuffer : public std::enable_shared_from_this<OcclusionBuffer> {
+public:
+    using Ptr = std::shared_ptr<OcclusionBuffer>;
+
+    struct Stats {
+        size_t occluders = 0;
+        size_t triangles = 0; // that were binned into tiles
+        size_t tested = 0;
+        size_t occluded = 0;
+    };
+
+    static constexpr size_t tileWidth = 16;
+    static constexpr size_t tileHeight = 16;
+
+    // The size is rounded up to whole tiles
+    [[nodiscard]] static Ptr create(size_t width = 256, size_t height = 128);
+
+    // Starts a new frame. This should be the view projection matrix that is used for drawing.
+    void clear(const glm::mat4& viewProjection);
+    // Of the last clear
+    const glm::mat4& getViewProjection() const;
+
+    // Positions are vec3 f32 `stride` bytes apart, indices are u8, u16 or u32 (`indexSize` bytes)
+    // and describe a triangle list. Quantized positions have to be dequantized with the vertex
+    // transform of their geometry first (see Geometry::setVertexTransform).
+    void addOccluder(std::span<const uint8_t> positions, size_t stride,
+        std::span<const uint8_t> indices, size_t indexSize, const glm::mat4& model);
+
+    // Has to be called after the occluders have been added and before testing
+    void rasterize();
+    bool isRasterized() const;
+
+    // The box is in world space. Returns true if any part of it might be visible.
+    bool isVisible(const glm::vec3& center, const glm::vec3& extent);
+    bool isVisible(const Aabb& box, const glm::mat4& model);
+
+    size_t getWidth() const;
+    size_t getHeight() const;
+    // Depth in [0, 1] of the pixel, 1 is the far plane
+    float getDepth(size_t x, size_t y) const;
+
+    // Since the last clear
+    const Stats& getStats() const;
+
+private:
+    // Edge functions (a * x + b * y + c, positive inside) and depth plane in screen space
+    struct Triangle {
+        float edgeA[3];
+        float edgeB[3];
+        float edgeC[3];
+        float depthX;
+        float depthY;
+        float depth0;
+        float minY;
+        float maxY;
+    };
+
+    OcclusionBuffer(size_t width, size_t height);
+
+    void rasterizeTile(size_t tile);
+
+    size_t width_;
+    size_t height_;
+    size_t tilesX_;
+    size_t tilesY_;
+    glm::mat4 viewProjection_ = glm::mat4(1.0f);
+    std::vector<float> depth_; // row-major, per tile
+    std::vector<float> tileMaxDepth_;
+    std::vector<Triangle> triangles_;
+    std::vector<std::vector<uint32_t>> bins_; // triangle indices per tile
+    bool rasterized_ = false;
+    Stats stats_;
+};
@@ -0,0 +1,189 @@
+#include "prefetch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+namespace {
+struct ManifestEntry {
+    std::string path;
+    size_t offset;
+    size_t size;
+
+    bool operator==(const ManifestEntry& other) const = default;
+};
+
+struct PrefetchState {
+    std::string manifestPath;
+    float recordDuration = 0.0f;
+    std::chrono::steady_clock::time_point start;
+    // Set on the main thread, but files are read (and recorded) on the thread pool too
+    std::atomic<bool> recording = false;
+    std::mutex mutex;
+    std::vector<ManifestEntry> recorded;
+    std::vector<ManifestEntry> manifest; // as it was read
+};
+
+PrefetchState& getState()
+{
+    static PrefetchState state;
+    return state;
+}
+
+std::vector<ManifestEntry> readManifest(const std::string& path)
+{
+    std::vector<ManifestEntry> entries;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        // <offset> <size> <path>, path last so it may contain spaces
+        std::istringstream ss(line);
+        ManifestEntry entry;
+        if (!(ss >> entry.offset >> entry.size)) {
+            continue;
+        }
+        ss >> std::ws;
+        std::getline(ss, entry.path);
+        if (!entry.path.empty()) {
+            entries.push_back(std::move(entry));
+        }
+    }
+    return entries;
+}
+
+void writeManifest(const std::string& path, const std::vector<ManifestEntry>& entries)
+{
+    auto file = std::unique_ptr<FILE, decltype(&std::fclose)>(
+        std::fopen(path.c_str(), "wb"), &std::fclose);
+    if (!file) {
+        fmt::print(stderr, "Could not write prefetch manifest '{}'\n", path);
+        return;
+    }
+    for (const auto& entry : entries) {
+        fmt::print(file.get(), "{} {} {}\n", entry.offset, entry.size, entry.path);
+    }
+}
+
+void prefetch(const ManifestEntry& entry)
+{
+#if defined(__linux__)
+    // WILLNEED starts asynchronous readahead, so this returns quickly and the kernel does the rest
+    const auto fd = ::open(entry.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    ::posix_fadvise(fd, static_cast<off_t>(entry.offset), static_cast<off_t>(entry.size),
+        POSIX_FADV_WILLNEED);
+    ::close(fd);
+#else
+    // Fall back to just reading the range into a scratch buffer to pull it into the cache
+    auto file = std::unique_ptr<FILE, decltype(&std::fclose)>(
+        std::fopen(entry.path.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        return;
+    }
+    std::fseek(file.get(), static_cast<long>(entry.offset), SEEK_SET);
+    std::vector<char> scratch(64 * 1024);
+    size_t remaining = entry.size;
+    while (remaining > 0) {
+        const auto n
+            = std::fread(scratch.data(), 1, std::min(remaining, scratch.size()), file.get());
+        if (n == 0) {
+            break;
+        }
+        remaining -= n;
+    }
+#endif
+}
+}
+
+void startPrefetch(std::string manifestPath, float recordDuration)
+{
+    auto& state = getState();
+    state.manifestPath = std::move(manifestPath);
+    state.recordDuration = recordDuration;
+    state.start = std::chrono::steady_clock::now();
+    state.recording = recordDuration > 0.0f;
+    if (state.recording) {
+        // die() exits without returning from main, but the recording is still useful
+        std::atexit(finishPrefetch);
+    }
+
+    state.manifest = readManifest(state.manifestPath);
+    const auto& entries = state.manifest;
+    if (entries.empty()) {
+        return;
+    }
+
+    // Interleave the entries across the threads, so each of them keeps (roughly) the recorded
+    // order and the files needed first are requested first.
+    const auto numThreads
+        = std::min<size_t>(entries.size(), std::clamp(std::thread::hardware_concurrency(), 1u, 4u));
+    for (size_t t = 0; t < numThreads; ++t) {
+        // Detached, so an early exit (e.g. die()) does not have to wait for them
+        std::thread([entries, t, numThreads]() {
+            for (size_t i = t; i < entries.size(); i += numThreads) {
+                prefetch(entries[i]);
+            }
+        }).detach();
+    }
+}
+
+bool isRecordingFileReads()
+{
+    auto& state = getState();
+    if (!state.recording) {
+        return false;
+    }
+    const auto elapsed
+        = std::chrono::duration<float>(std::chrono::steady_clock::now() - state.start);
+    return elapsed.count() < state.recordDuration;
+}
+
+void recordFileRead(const std::string& path, size_t offset, size_t size)
+{
+    if (!isRecordingFileReads()) {
+        return;
+    }
+    auto& state = getState();
+    std::lock_guard lock(state.mutex);
+    const auto it = std::find_if(state.recorded.begin(), state.recorded.end(),
+        [&](const ManifestEntry& entry) { return entry.path == path; });
+    if (it == state.recorded.end()) {
+        state.recorded.push_back(ManifestEntry { path, offset, size });
+        return;
+    }
+    // Keep a single range per file that covers everything read from it
+    const auto begin = std::min(it->offset, offset);
+    const auto end = std::max(it->offset + it->size, offset + size);
+    it->offset = begin;
+    it->size = end - begin;
+}
+
+void finishPrefetch()
+{
+    auto& state = getState();
+    // Called from main and at exit, only the first call writes. Most launches record the same
+    // reads, so the file is only rewritten if something changed.
+    if (state.recording.exchange(false)) {
+        std::lock_guard lock(state.mutex);
+        if (state.recorded != state.manifest) {
+            writeManifest(state.manifestPath, state.recorded);
+        }
+    }
+}
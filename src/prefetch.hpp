@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+// Every launch reads the same files in the same order. If a manifest is configured, the files
+// (and byte ranges) read during the first `recordDuration` seconds are recorded into it and on the
+// next launch they are prefetched into the page cache in the background, while the Lua scripts are
+// still running.
+void startPrefetch(std::string manifestPath, float recordDuration);
+
+void recordFileRead(const std::string& path, size_t offset, size_t size);
+bool isRecordingFileReads();
+
+// Writes the recorded manifest (if recording was enabled). This also happens at exit, e.g. after
+// die(), but not if the process crashes.
+void finishPrefetch();
@@ -0,0 +1,88 @@
+#include "rangeallocator.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+RangeAllocator::RangeAllocator(size_t capacity)
+{
+    grow(capacity);
+}
+
+std::optional<size_t> RangeAllocator::allocate(size_t size)
+{
+    if (size == 0) {
+        return std::nullopt;
+    }
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+        const auto [offset, freeSize] = *it;
+        if (freeSize < size) {
+            continue;
+        }
+        free_.erase(it);
+        if (freeSize > size) {
+            free_.emplace(offset + size, freeSize - size);
+        }
+        used_ += size;
+        return offset;
+    }
+    return std::nullopt;
+}
+
+void RangeAllocator::free(size_t offset, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    assert(used_ >= size);
+    used_ -= size;
+    insertFree(offset, size);
+}
+
+void RangeAllocator::grow(size_t capacity)
+{
+    if (capacity <= capacity_) {
+        return;
+    }
+    const auto offset = capacity_;
+    capacity_ = capacity;
+    insertFree(offset, capacity - offset);
+}
+
+size_t RangeAllocator::getCapacity() const
+{
+    return capacity_;
+}
+
+size_t RangeAllocator::getUsed() const
+{
+    return used_;
+}
+
+size_t RangeAllocator::getLargestFree() const
+{
+    size_t largest = 0;
+    for (const auto& [offset, size] : free_) {
+        largest = std::max(largest, size);
+    }
+    return largest;
+}
+
+void RangeAllocator::insertFree(size_t offset, size_t size)
+{
+    auto next = free_.lower_bound(offset);
+    assert(next == free_.end() || next->first >= offset + size);
+    if (next != free_.begin()) {
+        const auto prev = std::prev(next);
+        assert(prev->first + prev->second <= offset);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            free_.erase(prev);
+        }
+    }
+    if (next != free_.end() && offset + size == next->first) {
+        size += next->second;
+        free_.erase(next);
+    }
+    free_.emplace(offset, size);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <optional>
+
+// Hands out ranges of a linear resource (e.g. a buffer) with first fit. Freed ranges are merged
+// with their free neighbours, so the free list stays short. The units are up to the user.
+class RangeAllocator {
+public:
+    RangeAllocator(size_t capacity = 0);
+
+    // std::nullopt if there is no free range that is large enough
+    std::optional<size_t> allocate(size_t size);
+    void free(size_t offset, size_t size);
+
+    // Adds free space at the end
+    void grow(size_t capacity);
+
+    size_t getCapacity() const;
+    size_t getUsed() const;
+    // The size of the largest allocation that would currently succeed
+    size_t getLargestFree() const;
+
+private:
+    void insertFree(size_t offset, size_t size);
+
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+    std::map<size_t, size_t> free_; // offset -> size
+};
@@ -0,0 +1,210 @@
+#include "renderstate.hpp"
+
+#include <cassert>
+
+#include "util.hpp"
+
+RenderState::Ptr RenderState::create(const RenderStateDesc& desc)
+{
+    return std::shared_ptr<RenderState>(new RenderState(desc));
+}
+
+const RenderState::Ptr& RenderState::getDefault()
+{
+    static const auto state = create(RenderStateDesc {});
+    return state;
+}
+
+const RenderStateDesc& RenderState::getDesc() const
+{
+    return desc_;
+}
+
+uint32_t RenderState::getId() const
+{
+    return id_;
+}
+
+bool RenderState::isTransparent() const
+{
+    return desc_.blend != BlendMode::None;
+}
+
+RenderState::RenderState(const RenderStateDesc& desc)
+    : id_(nextId<RenderState>())
+    , desc_(desc)
+{
+}
+
+StateCache& StateCache::instance()
+{
+    static StateCache cache;
+    return cache;
+}
+
+template <typename T, typename Func>
+void StateCache::update(std::optional<T>& current, const T& value, Func&& func)
+{
+    if (current && *current == value) {
+        stats_.skipped++;
+        return;
+    }
+    func();
+    current = value;
+    stats_.issued++;
+}
+
+void StateCache::setEnabled(GLenum cap, std::optional<bool>& current, bool enabled)
+{
+    update(current, enabled, [cap, enabled]() {
+        if (enabled) {
+            glEnable(cap);
+        } else {
+            glDisable(cap);
+        }
+    });
+}
+
+void StateCache::apply(const RenderState& state)
+{
+    const auto& desc = state.getDesc();
+
+    setEnabled(GL_DEPTH_TEST, depthTest_, desc.depthTest);
+    if (desc.depthTest) {
+        update(depthFunc_, desc.depthFunc,
+            [&desc]() { glDepthFunc(static_cast<GLenum>(desc.depthFunc)); });
+    }
+    update(depthWrite_, desc.depthWrite,
+        [&desc]() { glDepthMask(desc.depthWrite ? GL_TRUE : GL_FALSE); });
+
+    setEnabled(GL_BLEND, blendEnabled_, desc.blend != BlendMode::None);
+    if (desc.blend != BlendMode::None) {
+        update(blendMode_, desc.blend, [&desc]() {
+            switch (desc.blend) {
+            case BlendMode::Alpha:
+                glBlendFuncSeparate(
+                    GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+                break;
+            case BlendMode::PremultipliedAlpha:
+                glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+                break;
+            case BlendMode::Additive:
+                glBlendFunc(GL_ONE, GL_ONE);
+                break;
+            default:
+                break;
+            }
+        });
+    }
+
+    setEnabled(GL_CULL_FACE, cullEnabled_, desc.cull != CullMode::None);
+    if (desc.cull != CullMode::None) {
+        update(cullMode_, desc.cull,
+            [&desc]() { glCullFace(desc.cull == CullMode::Back ? GL_BACK : GL_FRONT); });
+    }
+
+    update(colorMask_, desc.colorMask, [&desc]() {
+        const auto& m = desc.colorMask;
+        glColorMask(m[0], m[1], m[2], m[3]);
+    });
+
+    const auto offset = std::pair(desc.polygonOffsetFactor, desc.polygonOffsetUnits);
+    const auto offsetEnabled = offset.first != 0.0f || offset.second != 0.0f;
+    setEnabled(GL_POLYGON_OFFSET_FILL, polygonOffsetEnabled_, offsetEnabled);
+    if (offsetEnabled) {
+        update(polygonOffset_, offset,
+            [&offset]() { glPolygonOffset(offset.first, offset.second); });
+    }
+}
+
+void StateCache::prepareClear()
+{
+    update(depthWrite_, true, []() { glDepthMask(GL_TRUE); });
+    update(colorMask_, std::array<bool, 4> { true, true, true, true },
+        []() { glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE); });
+}
+
+void StateCache::useProgram(uint32_t shaderId, const glw::ShaderProgram& prog)
+{
+    update(program_, shaderId, [&prog]() { prog.bind(); });
+}
+
+void StateCache::bindVertexArray(uint32_t geometryId, glw::VertexArray& vertexArray)
+{
+    update(vertexArray_, geometryId, [&vertexArray]() { vertexArray.bind(); });
+}
+
+void StateCache::unbindVertexArray()
+{
+    // 0 is never used as an id
+    update(vertexArray_, 0u, []() { glBindVertexArray(0); });
+}
+
+void StateCache::bindTexture(const TextureBinding& binding)
+{
+    assert(binding.unit < textures_.size());
+    auto& current = textures_[binding.unit];
+    if (current == binding.textureId) {
+        stats_.textureBindsSkipped++;
+    } else {
+        stats_.textureBinds++;
+    }
+    update(current, binding.textureId, [&binding]() {
+        glActiveTexture(GL_TEXTURE0 + static_cast<GLenum>(binding.unit));
+        glBindTexture(binding.target, binding.texture);
+    });
+}
+
+void StateCache::bindTextures(std::span<const TextureBinding> textures)
+{
+    for (const auto& binding : textures) {
+        bindTexture(binding);
+    }
+}
+
+void StateCache::invalidateProgram()
+{
+    program_.reset();
+}
+
+void StateCache::invalidateVertexArray()
+{
+    vertexArray_.reset();
+}
+
+void StateCache::invalidateTextures()
+{
+    for (auto& texture : textures_) {
+        texture.reset();
+    }
+}
+
+void StateCache::countDraw()
+{
+    stats_.drawCalls++;
+}
+
+void StateCache::countMultiDraw(size_t commands)
+{
+    stats_.drawCalls++;
+    stats_.multiDrawCalls++;
+    stats_.multiDrawCommands += commands;
+}
+
+void StateCache::countCulling(size_t visible, size_t culled, size_t occluded)
+{
+    stats_.drawsVisible += visible;
+    stats_.drawsCulled += culled;
+    stats_.drawsOccluded += occluded;
+}
+
+void StateCache::endFrame()
+{
+    lastFrameStats_ = stats_;
+    stats_ = Stats {};
+}
+
+const StateCache::Stats& StateCache::getFrameStats() const
+{
+    return lastFrameStats_;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <optional>
+#include <span>
+
+#include "glw/state.hpp"
+#include "glw/texture.hpp"
+#include "glwx/primitive.hpp"
+#include "glwx/shader.hpp"
+
+enum class DepthFunc : GLenum {
+    Never = GL_NEVER,
+    Less = GL_LESS,
+    Equal = GL_EQUAL,
+    LessEqual = GL_LEQUAL,
+    Greater = GL_GREATER,
+    NotEqual = GL_NOTEQUAL,
+    GreaterEqual = GL_GEQUAL,
+    Always = GL_ALWAYS,
+};
+
+enum class BlendMode {
+    None,
+    Alpha,
+    PremultipliedAlpha,
+    Additive,
+};
+
+enum class CullMode {
+    None,
+    Back,
+    Front,
+};
+
+struct RenderStateDesc {
+    bool depthTest = true;
+    DepthFunc depthFunc = DepthFunc::Less;
+    bool depthWrite = true;
+    BlendMode blend = BlendMode::None;
+    CullMode cull = CullMode::None;
+    std::array<bool, 4> colorMask = { true, true, true, true };
+    float polygonOffsetFactor = 0.0f;
+    float polygonOffsetUnits = 0.0f;
+};
+
+// Immutable, so it can be shared between draws and compared by id
+class RenderState : public std::enable_shared_from_this<RenderState> {
+public:
+    using Ptr = std::shared_ptr<RenderState>;
+
+    [[nodiscard]] static Ptr create(const RenderStateDesc& desc);
+
+    static const Ptr& getDefault();
+
+    const RenderStateDesc& getDesc() const;
+    uint32_t getId() const;
+
+    // Blended draws are sorted back to front after all opaque draws
+    bool isTransparent() const;
+
+private:
+    RenderState(const RenderStateDesc& desc);
+
+    uint32_t id_;
+    RenderStateDesc desc_;
+};
+
+struct TextureBinding {
+    size_t unit;
+    uint32_t textureId;
+    GLenum target;
+    GLuint texture;
+};
+
+// Shadows the GL state, so only actual changes result in GL calls. Everything that draws should
+// go through this. Code that changes bindings behind its back (e.g. texture creation) has to
+// invalidate the affected state.
+class StateCache {
+public:
+    struct Stats {
+        size_t issued = 0;
+        size_t skipped = 0;
+        // Subset of the above
+        size_t textureBinds = 0;
+        size_t textureBindsSkipped = 0;
+        // Draw calls, a multi-draw counts once and its commands are counted separately
+        size_t drawCalls = 0;
+        size_t multiDrawCalls = 0;
+        size_t multiDrawCommands = 0;
+        // Queued draws with bounds that were tested against the view frustum and (if they were
+        // inside of it) against the occlusion buffer
+        size_t drawsVisible = 0;
+        size_t drawsCulled = 0;
+        size_t drawsOccluded = 0;
+    };
+
+    // Samplers have a fixed unit per shader, so this is the maximum number of samplers per shader
+    static constexpr size_t maxTextureUnits = 32;
+
+    static StateCache& instance();
+
+    void apply(const RenderState& state);
+
+    // Clearing is affected by the write masks
+    void prepareClear();
+
+    // The ids are used instead of the GL objects, because they are never reused
+    void useProgram(uint32_t shaderId, const glw::ShaderProgram& prog);
+    void bindVertexArray(uint32_t geometryId, glw::VertexArray& vertexArray);
+    void unbindVertexArray();
+    void bindTexture(const TextureBinding& binding);
+    // Consecutive draws usually share most of their textures, so most of these are skipped
+    void bindTextures(std::span<const TextureBinding> textures);
+
+    void invalidateProgram();
+    void invalidateVertexArray();
+    void invalidateTextures();
+
+    void countDraw();
+    void countMultiDraw(size_t commands);
+    void countCulling(size_t visible, size_t culled, size_t occluded);
+
+    // Moves the current counters to the last frame
+    void endFrame();
+    const Stats& getFrameStats() const;
+
+private:
+    StateCache() = default;
+
+    template <typename T, typename Func>
+    void update(std::optional<T>& current, const T& value, Func&& func);
+    void setEnabled(GLenum cap, std::optional<bool>& current, bool enabled);
+
+    std::optional<bool> depthTest_;
+    std::optional<DepthFunc> depthFunc_;
+    std::optional<bool> depthWrite_;
+    std::optional<bool> blendEnabled_;
+    std::optional<BlendMode> blendMode_;
+    std::optional<bool> cullEnabled_;
+    std::optional<CullMode> cullMode_;
+    std::optional<std::array<bool, 4>> colorMask_;
+    std::optional<bool> polygonOffsetEnabled_;
+    std::optional<std::pair<float, float>> polygonOffset_;
+
+    std::optional<uint32_t> program_;
+    std::optional<uint32_t> vertexArray_;
+    std::array<std::optional<uint32_t>, maxTextureUnits> textures_;
+
+    Stats stats_;
+    Stats lastFrameStats_;
+};
@@ -0,0 +1,291 @@
+#include "scene.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include "die.hpp"
+
+SceneGraph::Ptr SceneGraph::create()
+{
+    return std::shared_ptr<SceneGraph>(new SceneGraph());
+}
+
+SceneGraph::NodeId SceneGraph::add(NodeId parent)
+{
+    dieAssert(parent == noParent || parent < parent_.size(), "Invalid parent {}", parent);
+    const auto id = static_cast<NodeId>(parent_.size());
+    parent_.push_back(parent);
+    position_.emplace_back(0.0f);
+    orientation_.emplace_back(1.0f, 0.0f, 0.0f, 0.0f);
+    scale_.emplace_back(1.0f);
+    world_.emplace_back(1.0f);
+    dirty_.push_back(1);
+    changed_.push_back(0);
+    released_.push_back(0);
+    anyDirty_ = true;
+    stats_.nodes++;
+    return id;
+}
+
+size_t SceneGraph::getNodeCount() const
+{
+    return parent_.size();
+}
+
+SceneGraph::NodeId SceneGraph::getParent(NodeId node) const
+{
+    return parent_[node];
+}
+
+void SceneGraph::checkNode(NodeId node) const
+{
+    dieAssert(node < parent_.size(), "Invalid node id {}", node);
+}
+
+SceneGraph::NodeId SceneGraph::instantiate(NodeId first, size_t count)
+{
+    dieAssert(count > 0 && first < parent_.size() && count <= parent_.size() - first,
+        "Invalid node range [{}, {} + {})", first, first, count);
+    // Checked before anything is changed, the copies would get garbage parents
+    for (size_t i = first; i < first + count; ++i) {
+        const auto parent = parent_[i];
+        dieAssert(parent == noParent || (parent >= first && parent < i),
+            "Node {} has a parent outside of the range [{}, {} + {})", i, first, first, count);
+    }
+    NodeId base = 0;
+    auto& freeRanges = freeRanges_[count];
+    if (!freeRanges.empty()) {
+        base = freeRanges.back();
+        freeRanges.pop_back();
+        stats_.freeNodes -= count;
+    } else {
+        base = static_cast<NodeId>(parent_.size());
+        const auto size = parent_.size() + count;
+        parent_.resize(size);
+        position_.resize(size);
+        orientation_.resize(size);
+        scale_.resize(size);
+        world_.resize(size);
+        dirty_.resize(size);
+        changed_.resize(size);
+        released_.resize(size);
+        stats_.nodes += count;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const auto src = static_cast<NodeId>(first + i);
+        const auto dst = static_cast<NodeId>(base + i);
+        const auto parent = parent_[src];
+        parent_[dst] = parent == noParent ? noParent : base + (parent - first);
+        position_[dst] = position_[src];
+        orientation_[dst] = orientation_[src];
+        scale_[dst] = scale_[src];
+        dirty_[dst] = 1;
+        released_[dst] = 0;
+    }
+    anyDirty_ = true;
+    return base;
+}
+
+void SceneGraph::release(NodeId first, size_t count)
+{
+    dieAssert(count > 0 && first < parent_.size() && count <= parent_.size() - first,
+        "Invalid node range [{}, {} + {})", first, first, count);
+    // Otherwise the range would be handed out twice
+    const auto released = std::count(
+        released_.begin() + first, released_.begin() + first + static_cast<ptrdiff_t>(count), 1);
+    if (released == static_cast<ptrdiff_t>(count)) {
+        return;
+    }
+    dieAssert(released == 0, "Node range [{}, {} + {}) is partially released", first, first,
+        count);
+    // Only nodes that are dirty or have a changed parent are updated, so these cost nothing
+    for (size_t i = first; i < first + count; ++i) {
+        dirty_[i] = 0;
+        changed_[i] = 0;
+        released_[i] = 1;
+    }
+    freeRanges_[count].push_back(first);
+    stats_.freeNodes += count;
+}
+
+const glm::vec3& SceneGraph::getPosition(NodeId node) const
+{
+    return position_[node];
+}
+
+void SceneGraph::setPosition(NodeId node, const glm::vec3& position)
+{
+    // Animations often write the same value every frame
+    if (position_[node] != position) {
+        position_[node] = position;
+        markDirty(node);
+    }
+}
+
+const glm::quat& SceneGraph::getOrientation(NodeId node) const
+{
+    return orientation_[node];
+}
+
+void SceneGraph::setOrientation(NodeId node, const glm::quat& orientation)
+{
+    if (orientation_[node] != orientation) {
+        orientation_[node] = orientation;
+        markDirty(node);
+    }
+}
+
+const glm::vec3& SceneGraph::getScale(NodeId node) const
+{
+    return scale_[node];
+}
+
+void SceneGraph::setScale(NodeId node, const glm::vec3& scale)
+{
+    if (scale_[node] != scale) {
+        scale_[node] = scale;
+        markDirty(node);
+    }
+}
+
+void SceneGraph::markDirty(NodeId node)
+{
+    dirty_[node] = 1;
+    anyDirty_ = true;
+}
+
+void SceneGraph::update()
+{
+    if (!anyDirty_) {
+        return;
+    }
+
+    // Parents come first, so their changed_ flag is already up to date for this pass
+    size_t updated = 0;
+    for (size_t i = 0; i < parent_.size(); ++i) {
+        const auto parent = parent_[i];
+        const auto parentChanged = parent != noParent && changed_[parent];
+        changed_[i] = dirty_[i] || parentChanged;
+        if (!changed_[i]) {
+            continue;
+        }
+        auto local = glm::mat4_cast(orientation_[i]);
+        local[0] *= scale_[i].x;
+        local[1] *= scale_[i].y;
+        local[2] *= scale_[i].z;
+        local[3] = glm::vec4(position_[i], 1.0f);
+        world_[i] = parent != noParent ? world_[parent] * local : local;
+        dirty_[i] = 0;
+        updated++;
+    }
+    anyDirty_ = false;
+
+    stats_.updates++;
+    stats_.nodesUpdated += updated;
+    stats_.lastNodesUpdated = updated;
+}
+
+const glm::mat4& SceneGraph::getWorldMatrix(NodeId node)
+{
+    update();
+    return world_[node];
+}
+
+const SceneGraph::Stats& SceneGraph::getStats() const
+{
+    return stats_;
+}
+
+Skin::Ptr Skin::create(SceneGraph::NodeId root, std::vector<SceneGraph::NodeId> joints,
+    std::vector<glm::mat4> inverseBindMatrices)
+{
+    return std::shared_ptr<Skin>(
+        new Skin(root, std::move(joints), std::move(inverseBindMatrices)));
+}
+
+Skin::Skin(SceneGraph::NodeId root, std::vector<SceneGraph::NodeId> joints,
+    std::vector<glm::mat4> inverseBindMatrices)
+    : root_(root)
+    , joints_(std::move(joints))
+    , maxNode_(std::max(root, joints_.empty() ? root : *std::ranges::max_element(joints_)))
+    , inverseBindMatrices_(std::move(inverseBindMatrices))
+{
+    if (inverseBindMatrices_.empty()) {
+        inverseBindMatrices_.resize(joints_.size(), glm::mat4(1.0f));
+    }
+    assert(inverseBindMatrices_.size() == joints_.size());
+}
+
+size_t Skin::getJointCount() const
+{
+    return joints_.size();
+}
+
+Aabb Skin::getBindPoseBounds() const
+{
+    Aabb bounds { glm::vec3(std::numeric_limits<float>::max()),
+        glm::vec3(std::numeric_limits<float>::lowest()) };
+    for (const auto& inverseBindMatrix : inverseBindMatrices_) {
+        const auto position = glm::vec3(glm::inverse(inverseBindMatrix)[3]);
+        bounds.min = glm::min(bounds.min, position);
+        bounds.max = glm::max(bounds.max, position);
+    }
+    return bounds;
+}
+
+Aabb Skin::update(SceneGraph& graph, SceneGraph::NodeId base, std::span<glm::mat4> matrices) const
+{
+    assert(matrices.size() >= joints_.size());
+    dieAssert(static_cast<size_t>(base) + maxNode_ < graph.getNodeCount(),
+        "Skin nodes are not in the graph (base {}, largest relative node {})", base, maxNode_);
+    Aabb bounds { glm::vec3(std::numeric_limits<float>::max()),
+        glm::vec3(std::numeric_limits<float>::lowest()) };
+    const auto invRoot = glm::inverse(graph.getWorldMatrix(base + root_));
+    for (size_t i = 0; i < joints_.size(); ++i) {
+        const auto joint = invRoot * graph.getWorldMatrix(base + joints_[i]);
+        const auto position = glm::vec3(joint[3]);
+        bounds.min = glm::min(bounds.min, position);
+        bounds.max = glm::max(bounds.max, position);
+        matrices[i] = joint * inverseBindMatrices_[i];
+    }
+    return bounds;
+}
+
+SceneNodeRange::Ptr SceneNodeRange::create(
+    SceneGraph::Ptr graph, SceneGraph::NodeId first, size_t count)
+{
+    const auto base = graph->instantiate(first, count);
+    return std::shared_ptr<SceneNodeRange>(new SceneNodeRange(std::move(graph), base, count));
+}
+
+SceneNodeRange::SceneNodeRange(SceneGraph::Ptr graph, SceneGraph::NodeId first, size_t count)
+    : graph_(std::move(graph))
+    , first_(first)
+    , count_(count)
+{
+}
+
+SceneNodeRange::~SceneNodeRange()
+{
+    release();
+}
+
+SceneGraph::NodeId SceneNodeRange::getFirst() const
+{
+    return first_;
+}
+
+size_t SceneNodeRange::getCount() const
+{
+    return count_;
+}
+
+void SceneNodeRange::release()
+{
+    if (graph_) {
+        graph_->release(first_, count_);
+        graph_.reset();
+    }
+}
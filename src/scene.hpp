@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "culling.hpp"
+
+// A transform hierarchy. The nodes are stored in SoA layout and a parent is always added before
+// its children, so all world matrices can be updated in a single pass over the arrays.
+// Only nodes whose local transform changed (or that have an ancestor that changed) are
+// recomputed, so a static scene costs nothing per frame.
+class SceneGraph : public std::enable_shared_from_this<SceneGraph> {
+public:
+    using Ptr = std::shared_ptr<SceneGraph>;
+    using NodeId = uint32_t;
+
+    static constexpr NodeId noParent = std::numeric_limits<NodeId>::max();
+    // What a node costs in the graph
+    static constexpr size_t bytesPerNode = sizeof(NodeId) + 2 * sizeof(glm::vec3)
+        + sizeof(glm::quat) + sizeof(glm::mat4) + 3 * sizeof(uint8_t);
+
+    struct Stats {
+        size_t nodes = 0; // including free ones
+        size_t freeNodes = 0; // released and not reused yet
+        size_t updates = 0; // update passes that did something
+        size_t nodesUpdated = 0; // world matrices recomputed in total
+        size_t lastNodesUpdated = 0; // in the last update pass
+    };
+
+    [[nodiscard]] static Ptr create();
+
+    // The parent has to exist already
+    NodeId add(NodeId parent = noParent);
+    size_t getNodeCount() const;
+    NodeId getParent(NodeId node) const;
+
+    // Copies the nodes [first, first + count) (with their local transforms) and returns the id of
+    // the copy of `first`. Parents must be inside of the range or noParent, so this is usually
+    // a template of a whole model, which is copied for every instance of it.
+    // A range that has been released with the same count is reused, otherwise the copies are
+    // appended, so the nodes of an instance are always contiguous.
+    NodeId instantiate(NodeId first, size_t count);
+    // The nodes are not updated anymore and will be reused by instantiate. Nodes outside of the
+    // range must not have a parent inside of it. Releasing a range again does nothing.
+    void release(NodeId first, size_t count);
+    // Dies if the node does not exist
+    void checkNode(NodeId node) const;
+
+    const glm::vec3& getPosition(NodeId node) const;
+    void setPosition(NodeId node, const glm::vec3& position);
+    const glm::quat& getOrientation(NodeId node) const;
+    void setOrientation(NodeId node, const glm::quat& orientation);
+    const glm::vec3& getScale(NodeId node) const;
+    void setScale(NodeId node, const glm::vec3& scale);
+
+    // Recomputes the world matrices of the changed subtrees. This is called automatically by
+    // getWorldMatrix, but it may be called explicitly to control when the work happens.
+    void update();
+    const glm::mat4& getWorldMatrix(NodeId node);
+
+    const Stats& getStats() const;
+
+private:
+    SceneGraph() = default;
+
+    void markDirty(NodeId node);
+
+    std::vector<NodeId> parent_;
+    std::vector<glm::vec3> position_;
+    std::vector<glm::quat> orientation_;
+    std::vector<glm::vec3> scale_;
+    std::vector<glm::mat4> world_;
+    std::vector<uint8_t> dirty_; // local transform changed since the last update
+    std::vector<uint8_t> changed_; // world matrix was recomputed in the last update
+    std::vector<uint8_t> released_; // free for instantiate
+    bool anyDirty_ = false;
+    std::unordered_map<size_t, std::vector<NodeId>> freeRanges_; // first node by count
+    Stats stats_;
+};
+
+// The immutable part of a skin, shared by all instances of a model. The node ids are relative to
+// the first node of an instance (see SceneGraph::instantiate).
+class Skin {
+public:
+    using Ptr = std::shared_ptr<Skin>;
+
+    // If inverseBindMatrices is empty, they are all identity
+    [[nodiscard]] static Ptr create(SceneGraph::NodeId root, std::vector<SceneGraph::NodeId> joints,
+        std::vector<glm::mat4> inverseBindMatrices);
+
+    size_t getJointCount() const;
+
+    // The joint positions in the bind pose in the space of the skinned mesh
+    Aabb getBindPoseBounds() const;
+
+    // Writes the joint matrices of the instance, relative to the skinned mesh (`root`).
+    // Returns the bounds of the joint positions in the same space. Dies if a node of the skin is
+    // not in the graph.
+    Aabb update(SceneGraph& graph, SceneGraph::NodeId base, std::span<glm::mat4> matrices) const;
+
+private:
+    Skin(SceneGraph::NodeId root, std::vector<SceneGraph::NodeId> joints,
+        std::vector<glm::mat4> inverseBindMatrices);
+
+    SceneGraph::NodeId root_;
+    std::vector<SceneGraph::NodeId> joints_;
+    SceneGraph::NodeId maxNode_; // of root and joints
+    std::vector<glm::mat4> inverseBindMatrices_;
+};
+
+// The joint matrices of one skinned instance. This can be passed as a mat4 array uniform.
+struct MatrixPalette {
+    std::vector<glm::mat4> matrices;
+};
+
+// What Lua holds on to. It keeps the graph alive.
+struct SceneNode {
+    SceneGraph::Ptr graph;
+    SceneGraph::NodeId id;
+};
+
+// Owns the copy of a range of nodes (see SceneGraph::instantiate) and releases it when it is
+// destroyed, e.g. when Lua collects it. It keeps the graph alive.
+class SceneNodeRange {
+public:
+    using Ptr = std::shared_ptr<SceneNodeRange>;
+
+    [[nodiscard]] static Ptr create(
+        SceneGraph::Ptr graph, SceneGraph::NodeId first, size_t count);
+
+    ~SceneNodeRange();
+
+    SceneNodeRange(const SceneNodeRange&) = delete;
+    SceneNodeRange& operator=(const SceneNodeRange&) = delete;
+
+    SceneGraph::NodeId getFirst() const;
+    size_t getCount() const;
+
+    // Releases the nodes right away instead of when this is destroyed
+    void release();
+
+private:
+    SceneNodeRange(SceneGraph::Ptr graph, SceneGraph::NodeId first, size_t count);
+
+    SceneGraph::Ptr graph_;
+    SceneGraph::NodeId first_;
+    size_t count_;
+};
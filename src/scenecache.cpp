@@ -0,0 +1,689 @@
+#include "scenecache.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+
+#include "die.hpp"
+#include "mappedfile.hpp"
+
+namespace {
+constexpr std::array<char, 4> magic = { 'W', 'S', 'C', 'N' };
+// Bump this whenever the layout of the file or of GltfAsset changes
+constexpr uint32_t version = 3;
+constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+// Followed by the structure (see writeSceneCache), the blobs start at dataOffset
+struct Header {
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint64_t structureSize;
+    uint64_t dataOffset;
+};
+
+size_t align(size_t offset)
+{
+    return (offset + 15) / 16 * 16;
+}
+
+// FNV-1a on 8 byte words. This only has to notice that a file changed.
+uint64_t hashBytes(std::span<const uint8_t> data)
+{
+    constexpr uint64_t prime = 0x100000001b3;
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < data.size(); ++i) {
+        hash = (hash ^ data[i]) * prime;
+    }
+    return hash ^ data.size();
+}
+
+struct Dependency {
+    std::string path;
+    uint64_t size;
+    int64_t modified;
+    uint64_t hash;
+};
+
+std::optional<Dependency> getDependency(const std::string& path)
+{
+    std::error_code ec;
+    const auto modified = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    const auto file = MappedFile::open(path);
+    if (!file) {
+        return std::nullopt;
+    }
+    return Dependency { path, file->data().size(),
+        static_cast<int64_t>(modified.time_since_epoch().count()), hashBytes(file->data()) };
+}
+
+// 0 for types that are not vertex attribute types, so a corrupt cache doesn't reach the assert
+// in getAttributeTypeSize
+size_t getAttributeSize(glw::AttributeType type, size_t components)
+{
+    switch (type) {
+    case glw::AttributeType::I8:
+    case glw::AttributeType::U8:
+    case glw::AttributeType::I16:
+    case glw::AttributeType::U16:
+    case glw::AttributeType::F16:
+    case glw::AttributeType::I32:
+    case glw::AttributeType::U32:
+    case glw::AttributeType::F32:
+        return components * getAttributeTypeSize(type);
+    default:
+        return type == packedI10Type ? 4 : 0;
+    }
+}
+
+// Whether `count` elements starting at byte `offset` fit into `size` bytes, without overflowing
+// for the garbage values of a corrupt cache
+bool isRangeInside(uint64_t offset, uint64_t count, size_t elementSize, size_t size)
+{
+    return offset <= size && count <= (size - offset) / elementSize;
+}
+
+bool isUpToDate(const Dependency& dep)
+{
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(dep.path, ec);
+    // A missing file can't be checked, so it counts as changed
+    if (ec || size != dep.size) {
+        return false;
+    }
+    const auto modified = std::filesystem::last_write_time(dep.path, ec);
+    if (!ec && static_cast<int64_t>(modified.time_since_epoch().count()) == dep.modified) {
+        return true;
+    }
+    // Touched, but maybe not changed (e.g. a fresh checkout)
+    const auto current = getDependency(dep.path);
+    return current && current->hash == dep.hash;
+}
+
+class Writer {
+public:
+    template <typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+        data_.insert(data_.end(), bytes, bytes + sizeof(T));
+    }
+
+    void writeString(const std::string& str)
+    {
+        write(static_cast<uint32_t>(str.size()));
+        data_.insert(data_.end(), str.begin(), str.end());
+    }
+
+    void writeIndex(const std::optional<size_t>& index)
+    {
+        write(index ? static_cast<uint32_t>(*index) : none);
+    }
+
+    template <typename T>
+    void writeCount(const std::vector<T>& vec)
+    {
+        write(static_cast<uint32_t>(vec.size()));
+    }
+
+    // Blobs that are referenced multiple times (like the bufferViews of a glTF) are written once
+    void writeBlob(const BufferView::Ptr& blob)
+    {
+        if (!blob) {
+            write(none);
+            return;
+        }
+        const auto [it, inserted] = blobIndices_.try_emplace(blob.get(), blobs_.size());
+        if (inserted) {
+            blobs_.push_back(blob);
+        }
+        write(static_cast<uint32_t>(it->second));
+    }
+
+    const std::vector<uint8_t>& getData() const
+    {
+        return data_;
+    }
+
+    const std::vector<BufferView::Ptr>& getBlobs() const
+    {
+        return blobs_;
+    }
+
+private:
+    std::vector<uint8_t> data_;
+    std::vector<BufferView::Ptr> blobs_;
+    std::unordered_map<const BufferView*, size_t> blobIndices_;
+};
+
+// Reading past the end (or a blob that is not in the file) fails the whole read and returns
+// zeros from then on, so callers only have to check failed() in the end.
+class Reader {
+public:
+    Reader(std::span<const uint8_t> data)
+        : data_(data)
+    {
+    }
+
+    template <typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value {};
+        if (failed_ || pos_ + sizeof(T) > data_.size()) {
+            failed_ = true;
+            return value;
+        }
+        std::memcpy(&value, data_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return value;
+    }
+
+    std::string readString()
+    {
+        const auto size = read<uint32_t>();
+        if (failed_ || pos_ + size > data_.size()) {
+            failed_ = true;
+            return {};
+        }
+        std::string str(reinterpret_cast<const char*>(data_.data() + pos_), size);
+        pos_ += size;
+        return str;
+    }
+
+    // `limit` is the number of elements an index may refer to
+    std::optional<size_t> readIndex(size_t limit)
+    {
+        const auto index = read<uint32_t>();
+        if (index == none) {
+            return std::nullopt;
+        }
+        check(index < limit);
+        return index;
+    }
+
+    size_t readRequiredIndex(size_t limit)
+    {
+        const auto index = read<uint32_t>();
+        check(index < limit);
+        return index;
+    }
+
+    // Every element takes at least `minSize` bytes, so a broken count can't allocate gigabytes
+    size_t readCount(size_t minSize = 1)
+    {
+        const auto count = read<uint32_t>();
+        check(count * minSize <= data_.size() - std::min(pos_, data_.size()));
+        return failed_ ? 0 : count;
+    }
+
+    BufferView::Ptr readBlob(const std::vector<BufferView::Ptr>& blobs)
+    {
+        const auto index = readIndex(blobs.size());
+        return index && !failed_ ? blobs[*index] : nullptr;
+    }
+
+    void check(bool condition)
+    {
+        failed_ = failed_ || !condition;
+    }
+
+    bool failed() const
+    {
+        return failed_;
+    }
+
+private:
+    std::span<const uint8_t> data_;
+    size_t pos_ = 0;
+    bool failed_ = false;
+};
+
+void writeVec3(Writer& w, const glm::vec3& v)
+{
+    w.write(v.x);
+    w.write(v.y);
+    w.write(v.z);
+}
+
+glm::vec3 readVec3(Reader& r)
+{
+    const auto x = r.read<float>();
+    const auto y = r.read<float>();
+    const auto z = r.read<float>();
+    return glm::vec3(x, y, z);
+}
+
+void writeStructure(Writer& w, const GltfAsset& asset)
+{
+    w.writeCount(asset.images);
+    for (const auto& image : asset.images) {
+        w.writeString(image.path);
+        w.writeBlob(image.data);
+    }
+    w.writeCount(asset.textureImages);
+    for (const auto image : asset.textureImages) {
+        w.write(static_cast<uint32_t>(image));
+    }
+
+    w.writeCount(asset.materials);
+    for (const auto& mat : asset.materials) {
+        w.writeString(mat.name);
+        w.writeIndex(mat.albedo);
+        w.write(mat.color);
+        w.writeIndex(mat.metallicRoughness);
+        w.write(mat.metallicFactor);
+        w.write(mat.roughnessFactor);
+        w.writeIndex(mat.normal);
+        w.writeIndex(mat.occlusion);
+    }
+
+    w.writeCount(asset.meshes);
+    for (const auto& mesh : asset.meshes) {
+        w.writeString(mesh.name);
+        w.writeCount(mesh.primitives);
+        for (const auto& prim : mesh.primitives) {
+            w.writeCount(prim.vertexBuffers);
+            for (const auto& vertexBuffer : prim.vertexBuffers) {
+                w.writeBlob(vertexBuffer.data);
+                w.write(static_cast<uint32_t>(vertexBuffer.format.getStride()));
+                w.writeCount(vertexBuffer.format.getAttributes());
+                for (const auto& attr : vertexBuffer.format.getAttributes()) {
+                    w.write(static_cast<uint32_t>(attr.location));
+                    w.write(static_cast<uint32_t>(attr.components));
+                    w.write(static_cast<uint32_t>(attr.type));
+                    w.write(static_cast<uint8_t>(attr.normalized));
+                    w.write(static_cast<uint32_t>(attr.offset));
+                }
+            }
+            w.writeBlob(prim.indexData);
+            w.write(static_cast<uint32_t>(prim.indexType));
+            w.write(static_cast<uint64_t>(prim.indexOffset));
+            w.write(static_cast<uint64_t>(prim.indexCount));
+            w.write(static_cast<uint8_t>(prim.bounds.has_value()));
+            if (prim.bounds) {
+                writeVec3(w, prim.bounds->min);
+                writeVec3(w, prim.bounds->max);
+            }
+            w.write(static_cast<uint8_t>(prim.vertexTransform.has_value()));
+            if (prim.vertexTransform) {
+                w.write(*prim.vertexTransform);
+            }
+            w.writeCount(prim.lods);
+            for (const auto& lod : prim.lods) {
+                w.write(static_cast<uint64_t>(lod.indexOffset));
+                w.write(static_cast<uint64_t>(lod.indexCount));
+                w.write(lod.error);
+            }
+            w.write(static_cast<uint32_t>(prim.material));
+        }
+    }
+
+    w.writeCount(asset.nodes);
+    for (const auto& node : asset.nodes) {
+        w.writeString(node.name);
+        w.writeIndex(node.mesh);
+        w.writeIndex(node.skin);
+        w.writeCount(node.children);
+        for (const auto child : node.children) {
+            w.write(static_cast<uint32_t>(child));
+        }
+        w.write(static_cast<uint8_t>(node.translation.has_value()));
+        if (node.translation) {
+            writeVec3(w, *node.translation);
+        }
+        w.write(static_cast<uint8_t>(node.rotation.has_value()));
+        if (node.rotation) {
+            w.write(*node.rotation);
+        }
+        w.write(static_cast<uint8_t>(node.scale.has_value()));
+        if (node.scale) {
+            writeVec3(w, *node.scale);
+        }
+    }
+
+    w.writeCount(asset.scene);
+    for (const auto node : asset.scene) {
+        w.write(static_cast<uint32_t>(node));
+    }
+
+    w.writeCount(asset.skins);
+    for (const auto& skin : asset.skins) {
+        w.writeCount(skin.joints);
+        for (const auto joint : skin.joints) {
+            w.write(static_cast<uint32_t>(joint));
+        }
+        w.writeBlob(skin.inverseBindMatrices);
+    }
+
+    w.writeCount(asset.animations);
+    for (const auto& animation : asset.animations) {
+        w.writeString(animation.name);
+        w.writeCount(animation.channels);
+        for (const auto& channel : animation.channels) {
+            w.write(static_cast<uint32_t>(channel.node));
+            w.writeString(channel.path);
+            w.write(static_cast<uint32_t>(channel.samplerType));
+            w.write(static_cast<uint32_t>(channel.interpolation));
+            w.writeBlob(channel.times);
+            w.writeBlob(channel.values);
+        }
+    }
+
+    w.write(static_cast<uint8_t>(asset.meshOptimization.has_value()));
+    if (asset.meshOptimization) {
+        w.write(*asset.meshOptimization);
+        w.write(static_cast<uint64_t>(asset.lodSettings.levels));
+        w.write(asset.lodSettings.ratio);
+        w.write(asset.lodSettings.maxError);
+    }
+}
+
+// Counts come before the elements they are checked against, so every index can be checked
+// right away. The order of the arrays matters for that (e.g. nodes are read after meshes).
+void readStructure(Reader& r, GltfAsset& asset, const std::vector<BufferView::Ptr>& blobs)
+{
+    asset.images.resize(r.readCount());
+    for (auto& image : asset.images) {
+        image.path = r.readString();
+        image.data = r.readBlob(blobs);
+        r.check(!image.path.empty() || image.data);
+    }
+    asset.textureImages.resize(r.readCount(sizeof(uint32_t)));
+    for (auto& image : asset.textureImages) {
+        image = r.readRequiredIndex(asset.images.size());
+    }
+
+    const auto textureCount = asset.textureImages.size();
+    asset.materials.resize(r.readCount());
+    for (auto& mat : asset.materials) {
+        mat.name = r.readString();
+        mat.albedo = r.readIndex(textureCount);
+        mat.color = r.read<glm::vec4>();
+        mat.metallicRoughness = r.readIndex(textureCount);
+        mat.metallicFactor = r.read<float>();
+        mat.roughnessFactor = r.read<float>();
+        mat.normal = r.readIndex(textureCount);
+        mat.occlusion = r.readIndex(textureCount);
+    }
+
+    asset.meshes.resize(r.readCount());
+    for (auto& mesh : asset.meshes) {
+        mesh.name = r.readString();
+        mesh.primitives.resize(r.readCount());
+        for (auto& prim : mesh.primitives) {
+            prim.vertexBuffers.resize(r.readCount());
+            for (auto& vertexBuffer : prim.vertexBuffers) {
+                vertexBuffer.data = r.readBlob(blobs);
+                r.check(vertexBuffer.data != nullptr);
+                const auto stride = r.read<uint32_t>();
+                const auto attributeCount = r.readCount();
+                for (size_t i = 0; i < attributeCount; ++i) {
+                    const auto location = r.read<uint32_t>();
+                    const auto components = r.read<uint32_t>();
+                    const auto type = static_cast<glw::AttributeType>(r.read<uint32_t>());
+                    const auto normalized = r.read<uint8_t>() != 0;
+                    const auto offset = r.read<uint32_t>();
+                    const auto size = getAttributeSize(type, components);
+                    r.check(components >= 1 && components <= 4 && size > 0
+                        && offset + size <= stride);
+                    if (r.failed()) {
+                        return;
+                    }
+                    vertexBuffer.format.add(location, components, type, normalized, offset);
+                }
+                vertexBuffer.format.setStride(stride);
+            }
+            prim.indexData = r.readBlob(blobs);
+            prim.indexType = static_cast<glw::AttributeType>(r.read<uint32_t>());
+            prim.indexOffset = r.read<uint64_t>();
+            prim.indexCount = r.read<uint64_t>();
+            r.check(prim.indexData != nullptr
+                && (prim.indexType == glw::AttributeType::U8
+                    || prim.indexType == glw::AttributeType::U16
+                    || prim.indexType == glw::AttributeType::U32));
+            if (r.failed()) {
+                return;
+            }
+            r.check(isRangeInside(prim.indexOffset, prim.indexCount,
+                getAttributeTypeSize(prim.indexType), prim.indexData->size()));
+            if (r.read<uint8_t>()) {
+                const auto min = readVec3(r);
+                const auto max = readVec3(r);
+                prim.bounds = Aabb { min, max };
+            }
+            if (r.read<uint8_t>()) {
+                prim.vertexTransform = r.read<glm::mat4>();
+            }
+            prim.lods.resize(r.readCount(2 * sizeof(uint64_t) + sizeof(float)));
+            const auto indexSize = getAttributeTypeSize(prim.indexType);
+            for (auto& lod : prim.lods) {
+                lod.indexOffset = r.read<uint64_t>();
+                lod.indexCount = r.read<uint64_t>();
+                lod.error = r.read<float>();
+                r.check(lod.indexOffset % indexSize == 0
+                    && isRangeInside(
+                        lod.indexOffset, lod.indexCount, indexSize, prim.indexData->size()));
+            }
+            prim.material = r.readRequiredIndex(asset.materials.size());
+        }
+    }
+
+    // Children are checked after all nodes have been read
+    asset.nodes.resize(r.readCount());
+    for (auto& node : asset.nodes) {
+        node.name = r.readString();
+        node.mesh = r.readIndex(asset.meshes.size());
+        node.skin = r.readIndex(std::numeric_limits<uint32_t>::max());
+        node.children.resize(r.readCount(sizeof(uint32_t)));
+        for (auto& child : node.children) {
+            child = r.readRequiredIndex(asset.nodes.size());
+        }
+        if (r.read<uint8_t>()) {
+            node.translation = readVec3(r);
+        }
+        if (r.read<uint8_t>()) {
+            node.rotation = r.read<glm::quat>();
+        }
+        if (r.read<uint8_t>()) {
+            node.scale = readVec3(r);
+        }
+    }
+
+    asset.scene.resize(r.readCount(sizeof(uint32_t)));
+    for (auto& node : asset.scene) {
+        node = r.readRequiredIndex(asset.nodes.size());
+    }
+
+    asset.skins.resize(r.readCount());
+    for (auto& skin : asset.skins) {
+        skin.joints.resize(r.readCount(sizeof(uint32_t)));
+        for (auto& joint : skin.joints) {
+            joint = r.readRequiredIndex(asset.nodes.size());
+        }
+        skin.inverseBindMatrices = r.readBlob(blobs);
+        r.check(!skin.inverseBindMatrices
+            || skin.inverseBindMatrices->size() == skin.joints.size() * sizeof(glm::mat4));
+    }
+    for (const auto& node : asset.nodes) {
+        r.check(!node.skin || *node.skin < asset.skins.size());
+    }
+
+    asset.animations.resize(r.readCount());
+    for (auto& animation : asset.animations) {
+        animation.name = r.readString();
+        animation.channels.resize(r.readCount());
+        for (auto& channel : animation.channels) {
+            channel.node = r.readRequiredIndex(asset.nodes.size());
+            channel.path = r.readString();
+            channel.samplerType = static_cast<Sampler::Type>(r.read<uint32_t>());
+            channel.interpolation = static_cast<Interpolation>(r.read<uint32_t>());
+            channel.times = r.readBlob(blobs);
+            channel.values = r.readBlob(blobs);
+            r.check(channel.times && channel.values
+                && (channel.interpolation == Interpolation::Step
+                    || channel.interpolation == Interpolation::Linear)
+                && (channel.samplerType == Sampler::Type::Vec3
+                    || channel.samplerType == Sampler::Type::Quat));
+        }
+    }
+
+    if (r.read<uint8_t>()) {
+        asset.meshOptimization = r.read<MeshOptimizationStats>();
+        asset.lodSettings.levels = r.read<uint64_t>();
+        asset.lodSettings.ratio = r.read<float>();
+        asset.lodSettings.maxError = r.read<float>();
+    }
+}
+}
+
+GltfAsset::Ptr loadSceneCache(const std::string& path)
+{
+    const auto file = Buffer::map(path);
+    if (!file) {
+        return nullptr;
+    }
+    const auto data = file->data();
+    Header header;
+    if (data.size() < sizeof(header)) {
+        return nullptr;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    // Written by a different version, it will just be rewritten
+    if (header.magic != magic || header.version != version) {
+        return nullptr;
+    }
+    if (header.structureSize > data.size() - sizeof(Header) || header.dataOffset > data.size()) {
+        fmt::print(stderr, "Invalid scene cache '{}'\n", path);
+        return nullptr;
+    }
+    Reader r(data.subspan(sizeof(Header), header.structureSize));
+
+    std::vector<Dependency> deps(r.readCount());
+    for (auto& dep : deps) {
+        dep.path = r.readString();
+        dep.size = r.read<uint64_t>();
+        dep.modified = r.read<int64_t>();
+        dep.hash = r.read<uint64_t>();
+    }
+    if (r.failed()) {
+        fmt::print(stderr, "Invalid scene cache '{}'\n", path);
+        return nullptr;
+    }
+    for (const auto& dep : deps) {
+        if (!isUpToDate(dep)) {
+            return nullptr;
+        }
+    }
+
+    // The blobs are views into the mapping, so nothing is copied before it's uploaded
+    const auto dataSize = data.size() - header.dataOffset;
+    std::vector<BufferView::Ptr> blobs(r.readCount(2 * sizeof(uint64_t)));
+    for (auto& blob : blobs) {
+        const auto offset = r.read<uint64_t>();
+        const auto size = r.read<uint64_t>();
+        r.check(offset <= dataSize && size <= dataSize - offset);
+        if (r.failed()) {
+            break;
+        }
+        blob = BufferView::create(file, header.dataOffset + offset, size);
+    }
+
+    auto asset = std::make_shared<GltfAsset>();
+    readStructure(r, *asset, blobs);
+    if (r.failed()) {
+        fmt::print(stderr, "Invalid scene cache '{}'\n", path);
+        return nullptr;
+    }
+    for (const auto& dep : deps) {
+        asset->files.push_back(dep.path);
+    }
+    return asset;
+}
+
+bool writeSceneCache(const std::string& path, const GltfAsset& asset)
+{
+    Writer deps;
+    deps.writeCount(asset.files);
+    for (const auto& filename : asset.files) {
+        const auto dep = getDependency(filename);
+        if (!dep) {
+            return false;
+        }
+        deps.writeString(dep->path);
+        deps.write(dep->size);
+        deps.write(dep->modified);
+        deps.write(dep->hash);
+    }
+
+    Writer structure;
+    writeStructure(structure, asset);
+
+    // Aligned, so vertex data can be uploaded straight from the mapped file
+    Writer blobTable;
+    blobTable.writeCount(structure.getBlobs());
+    uint64_t offset = 0;
+    for (const auto& blob : structure.getBlobs()) {
+        blobTable.write(offset);
+        blobTable.write(static_cast<uint64_t>(blob->size()));
+        offset = align(offset + blob->size());
+    }
+
+    const auto structureSize
+        = deps.getData().size() + blobTable.getData().size() + structure.getData().size();
+    const Header header { magic, version, structureSize, align(sizeof(Header) + structureSize) };
+
+    // Written to a temporary file first, so a crash never leaves a broken cache behind
+    const auto tmpPath = path + ".tmp";
+    std::error_code ec;
+    {
+        auto file = std::unique_ptr<FILE, decltype(&std::fclose)>(
+            std::fopen(tmpPath.c_str(), "wb"), &std::fclose);
+        if (!file) {
+            return false;
+        }
+        std::fwrite(&header, sizeof(header), 1, file.get());
+        for (const auto* part : { &deps, &blobTable, &structure }) {
+            std::fwrite(part->getData().data(), 1, part->getData().size(), file.get());
+        }
+        for (const auto& blob : structure.getBlobs()) {
+            const auto pos = static_cast<size_t>(std::ftell(file.get()));
+            const std::array<uint8_t, 16> padding {};
+            std::fwrite(padding.data(), 1, align(pos) - pos, file.get());
+            std::fwrite(blob->data().data(), 1, blob->size(), file.get());
+        }
+        // fclose can fail as well, so it is done explicitly
+        const auto failed = std::ferror(file.get()) != 0;
+        if (std::fclose(file.release()) != 0 || failed) {
+            std::filesystem::remove(tmpPath, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec) {
+        std::error_code removeEc;
+        std::filesystem::remove(tmpPath, removeEc);
+        return false;
+    }
+    return true;
+}
+
+std::string getSceneCachePath(const std::string& sourcePath)
+{
+    return sourcePath + ".wscn";
+}
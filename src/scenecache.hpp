@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+#include "gltf.hpp"
+
+// A GltfAsset serialized into a single file (.wscn), which is mapped when it's loaded. There is
+// no JSON to parse and no accessors to validate: the vertex, index, skin and animation data is
+// used straight from the mapping and only the structure has to be checked.
+// The cache contains a content hash of every file the asset was read from, so it's stale as soon
+// as one of them changes (GltfAsset::load then rewrites it).
+
+// Returns nullptr if there is no cache or it is stale or invalid
+GltfAsset::Ptr loadSceneCache(const std::string& path);
+
+bool writeSceneCache(const std::string& path, const GltfAsset& asset);
+
+// Next to the source file, e.g. "model.gltf.wscn"
+std::string getSceneCachePath(const std::string& sourcePath);
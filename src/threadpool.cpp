@@ -0,0 +1,60 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t numThreads)
+{
+    for (size_t i = 0; i < numThreads; ++i) {
+        threads_.emplace_back([this]() { work(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::getThreadCount() const
+{
+    return threads_.size();
+}
+
+void ThreadPool::push(std::function<void()> job)
+{
+    {
+        std::lock_guard lock(mutex_);
+        jobs_.push(std::move(job));
+    }
+    cv_.notify_one();
+}
+
+void ThreadPool::work()
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+            // Finish the remaining jobs first, so nobody waits on a future forever
+            if (jobs_.empty()) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop();
+        }
+        job();
+    }
+}
+
+ThreadPool& getThreadPool()
+{
+    static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+    return pool;
+}
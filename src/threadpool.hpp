@@ -0,0 +1,46 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for CPU-heavy loading work (decoding, mipmap generation, etc.).
+// Jobs must not touch GL or Lua.
+class ThreadPool {
+public:
+    ThreadPool(size_t numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template <typename Func>
+    auto submit(Func&& func) -> std::future<std::invoke_result_t<Func>>
+    {
+        using Result = std::invoke_result_t<Func>;
+        // std::function needs to be copyable, std::packaged_task is not
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+        auto future = task->get_future();
+        push([task = std::move(task)]() { (*task)(); });
+        return future;
+    }
+
+    size_t getThreadCount() const;
+
+private:
+    void push(std::function<void()> job);
+    void work();
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::queue<std::function<void()>> jobs_;
+    bool stop_ = false;
+};
+
+// Leaves one core for the main thread
+ThreadPool& getThreadPool();
@@ -1,13 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <memory>
 #include <string>
 
 #include "die.hpp"
+#include "prefetch.hpp"
+
+// Ids are never reused, so they can be compared even if the object has been destroyed since
+template <typename T>
+uint32_t nextId()
+{
+    static uint32_t id = 0;
+    return ++id;
+}
 
 template <typename Output>
-Output readFile(const std::string& filename)
+Output readFile(const std::string& filename, size_t offset = 0, size_t size = -1)
 {
     auto file = std::unique_ptr<FILE, decltype(&std::fclose)>(
         std::fopen(filename.c_str(), "rb"), &std::fclose);
@@ -15,9 +26,12 @@ Output readFile(const std::string& filename)
         throw DieException(fmt::format("Could not open file '{}'", filename));
     }
     std::fseek(file.get(), 0, SEEK_END);
+    const auto fileSize = static_cast<size_t>(std::ftell(file.get()));
+    offset = std::min(offset, fileSize);
     Output data;
-    data.resize(std::ftell(file.get()));
-    std::fseek(file.get(), 0, SEEK_SET);
+    data.resize(std::min(size, fileSize - offset));
+    std::fseek(file.get(), static_cast<long>(offset), SEEK_SET);
     std::fread(data.data(), 1, data.size(), file.get());
+    recordFileRead(filename, offset, data.size());
     return data;
 }
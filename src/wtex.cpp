@@ -0,0 +1,113 @@
+#include "wtex.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include "bcn.hpp"
+
+namespace {
+constexpr std::array<char, 4> magic = { 'W', 'T', 'E', 'X' };
+constexpr uint32_t version = 1;
+// Larger than any GL implementation supports, but small enough that the sizes can't overflow
+constexpr uint32_t maxDimension = 65536;
+
+struct Header {
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t numLevels;
+};
+
+struct LevelHeader {
+    uint32_t width;
+    uint32_t height;
+    uint64_t offset; // from the start of the file
+    uint64_t size;
+};
+
+size_t align(size_t offset)
+{
+    return (offset + 15) / 16 * 16;
+}
+
+size_t getLevelSize(size_t width, size_t height, TextureFormat format)
+{
+    if (format == TextureFormat::Rgba8) {
+        return width * height * 4;
+    }
+    return getCompressedSize(width, height, format);
+}
+}
+
+std::optional<Wtex> parseWtex(std::span<const uint8_t> data)
+{
+    Header header;
+    if (data.size() < sizeof(header)) {
+        return std::nullopt;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != magic || header.version != version
+        || header.format > static_cast<uint32_t>(TextureFormat::Bc5)) {
+        return std::nullopt;
+    }
+    if (data.size() < sizeof(Header) + header.numLevels * sizeof(LevelHeader)) {
+        return std::nullopt;
+    }
+
+    Wtex wtex;
+    wtex.format = static_cast<TextureFormat>(header.format);
+    for (size_t i = 0; i < header.numLevels; ++i) {
+        LevelHeader level;
+        std::memcpy(&level, data.data() + sizeof(Header) + i * sizeof(LevelHeader), sizeof(level));
+        // The data is uploaded as it is, so it has to be exactly what the format needs
+        if (level.width == 0 || level.height == 0 || level.width > maxDimension
+            || level.height > maxDimension
+            || level.size != getLevelSize(level.width, level.height, wtex.format)
+            || level.offset > data.size() || level.size > data.size() - level.offset) {
+            return std::nullopt;
+        }
+        wtex.levels.push_back(WtexLevel {
+            level.width, level.height, data.subspan(level.offset, level.size) });
+    }
+    return wtex;
+}
+
+bool writeWtex(const std::string& path, const std::vector<Image>& mips, TextureFormat format)
+{
+    std::vector<std::vector<uint8_t>> levels;
+    for (const auto& mip : mips) {
+        levels.push_back(format == TextureFormat::Rgba8 ? mip.pixels : compressImage(mip, format));
+    }
+
+    auto file = std::unique_ptr<FILE, decltype(&std::fclose)>(
+        std::fopen(path.c_str(), "wb"), &std::fclose);
+    if (!file) {
+        return false;
+    }
+
+    const Header header { magic, version, static_cast<uint32_t>(format),
+        static_cast<uint32_t>(levels.size()) };
+    std::fwrite(&header, sizeof(header), 1, file.get());
+    // Aligned, so the levels can be uploaded straight from the mapped file
+    auto offset = align(sizeof(Header) + levels.size() * sizeof(LevelHeader));
+    for (size_t i = 0; i < levels.size(); ++i) {
+        const LevelHeader level { static_cast<uint32_t>(mips[i].width),
+            static_cast<uint32_t>(mips[i].height), offset, levels[i].size() };
+        std::fwrite(&level, sizeof(level), 1, file.get());
+        offset = align(offset + levels[i].size());
+    }
+    for (const auto& level : levels) {
+        const auto pos = static_cast<size_t>(std::ftell(file.get()));
+        const std::array<uint8_t, 16> padding {};
+        std::fwrite(padding.data(), 1, align(pos) - pos, file.get());
+        std::fwrite(level.data(), 1, level.size(), file.get());
+    }
+    return std::ferror(file.get()) == 0;
+}
+
+std::string getCookedPath(const std::string& sourcePath)
+{
+    return sourcePath + ".wtex";
+}
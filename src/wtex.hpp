@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+
+// Cooked, GPU-ready textures (.wtex), created by womf-cook. They contain the whole mip chain
+// in the format it is uploaded in, so loading them is just a memcpy to the GPU.
+enum class TextureFormat : uint32_t {
+    Rgba8 = 0,
+    Bc1 = 1, // RGB, no alpha
+    Bc3 = 2, // RGBA
+    Bc5 = 3, // RG, for normal maps
+};
+
+struct WtexLevel {
+    size_t width;
+    size_t height;
+    std::span<const uint8_t> data;
+};
+
+struct Wtex {
+    TextureFormat format;
+    std::vector<WtexLevel> levels;
+};
+
+// The spans point into `data`
+std::optional<Wtex> parseWtex(std::span<const uint8_t> data);
+
+// Compresses every level (if necessary) and writes the container
+bool writeWtex(const std::string& path, const std::vector<Image>& mips, TextureFormat format);
+
+// Next to the source file, e.g. "texture.png.wtex"
+std::string getCookedPath(const std::string& sourcePath);
@@ -0,0 +1,108 @@
+// CPU checks of OcclusionBuffer, no GL needed
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "occlusion.hpp"
+
+namespace {
+size_t failures = 0;
+
+void check(bool condition, const char* what)
+{
+    if (!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// 64x64 pixels, looking down -z with a 90 degree field of view
+OcclusionBuffer::Ptr createBuffer()
+{
+    auto buffer = OcclusionBuffer::create(64, 64);
+    buffer->clear(glm::perspective(glm::radians(90.0f), 1.0f, 0.1f, 100.0f));
+    return buffer;
+}
+
+// Two triangles
+void addQuad(OcclusionBuffer& buffer, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c,
+    const glm::vec3& d)
+{
+    const glm::vec3 positions[] = { a, b, c, d };
+    const uint16_t indices[] = { 0, 1, 2, 0, 2, 3 };
+    std::vector<uint8_t> positionData(sizeof(positions));
+    std::memcpy(positionData.data(), positions, sizeof(positions));
+    std::vector<uint8_t> indexData(sizeof(indices));
+    std::memcpy(indexData.data(), indices, sizeof(indices));
+    buffer.addOccluder(positionData, sizeof(glm::vec3), indexData, sizeof(uint16_t),
+        glm::mat4(1.0f));
+}
+
+void testFullyHidden()
+{
+    auto buffer = createBuffer();
+    // Covers the whole screen
+    addQuad(*buffer, glm::vec3(-10.0f, -10.0f, -5.0f), glm::vec3(10.0f, -10.0f, -5.0f),
+        glm::vec3(10.0f, 10.0f, -5.0f), glm::vec3(-10.0f, 10.0f, -5.0f));
+    buffer->rasterize();
+    check(!buffer->isVisible(glm::vec3(0.0f, 0.0f, -10.0f), glm::vec3(1.0f)),
+        "box behind a wall is hidden");
+    check(buffer->isVisible(glm::vec3(0.0f, 0.0f, -3.0f), glm::vec3(1.0f)),
+        "box in front of a wall is visible");
+    check(buffer->isVisible(glm::vec3(0.0f, 0.0f, -5.0f), glm::vec3(1.0f)),
+        "box intersecting a wall is visible");
+}
+
+void testPartiallyHidden()
+{
+    auto buffer = createBuffer();
+    // Covers the left half of the screen, the edge is at x = 32.64 in pixels, so pixel 32 is
+    // only partially covered
+    addQuad(*buffer, glm::vec3(-10.0f, -10.0f, -5.0f), glm::vec3(0.1f, -10.0f, -5.0f),
+        glm::vec3(0.1f, 10.0f, -5.0f), glm::vec3(-10.0f, 10.0f, -5.0f));
+    buffer->rasterize();
+    check(!buffer->isVisible(glm::vec3(-5.0f, 0.0f, -10.0f), glm::vec3(1.0f)),
+        "box behind the occluder is hidden");
+    check(buffer->isVisible(glm::vec3(0.5f, 0.0f, -10.0f), glm::vec3(1.0f)),
+        "box sticking out from behind the occluder is visible");
+    // x = 32.7 to 32.9 in pixels, right of the edge, but inside of the edge pixel
+    check(buffer->isVisible(glm::vec3(0.25f, 0.0f, -10.0f), glm::vec3(0.03f, 0.03f, 0.01f)),
+        "box next to the silhouette in a partially covered pixel is visible");
+}
+
+void testSlanted()
+{
+    auto buffer = createBuffer();
+    // z = -6 - 0.8 * x, from the left edge of the screen to about x = 0.55 in NDC
+    const auto z = [](float x) { return -6.0f - 0.8f * x; };
+    addQuad(*buffer, glm::vec3(-6.0f, -20.0f, z(-6.0f)), glm::vec3(6.0f, -20.0f, z(6.0f)),
+        glm::vec3(6.0f, 20.0f, z(6.0f)), glm::vec3(-6.0f, 20.0f, z(-6.0f)));
+    buffer->rasterize();
+    check(!buffer->isVisible(glm::vec3(1.0f, 0.0f, z(1.0f) - 2.0f), glm::vec3(0.3f)),
+        "box behind a slanted occluder is hidden");
+    // Small boxes that intersect the occluder, at all positions within the pixels
+    bool allVisible = true;
+    for (auto x = -0.5f; x < 3.0f; x += 0.01f) {
+        allVisible = allVisible
+            && buffer->isVisible(glm::vec3(x, 0.0f, z(x) - 0.04f), glm::vec3(0.05f));
+    }
+    check(allVisible, "boxes intersecting a slanted occluder are visible");
+}
+}
+
+int main()
+{
+    testFullyHidden();
+    testPartiallyHidden();
+    testSlanted();
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("All occlusion checks passed\n");
+    return 0;
+}